@@ -20,20 +20,27 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Transforms/Instrumentation.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
@@ -67,6 +74,25 @@ static cl::opt<bool>  ClInstrumentAtomics(
 static cl::opt<bool>  ClInstrumentMemIntrinsics(
     "tsan-instrument-memintrinsics", cl::init(true),
     cl::desc("Instrument memintrinsics (memset/memcpy/memmove)"), cl::Hidden);
+static cl::opt<bool>  ClUfoInlineAcc(
+    "ufo-inline-acc", cl::init(false),
+    cl::desc("Write UFO memory access events inline, call the runtime only "
+             "when the thread buffer is full (run with UFO_INLINE_ACC=1 "
+             "UFO_TL_CLOCK=1)"),
+    cl::Hidden);
+static cl::opt<bool>  ClUfoCoalesceLoops(
+    "ufo-coalesce-loops", cl::init(false),
+    cl::desc("Report the affine accesses of loops without calls as one range "
+             "access before the loop"), cl::Hidden);
+static cl::opt<unsigned>  ClUfoCoalesceMaxStride(
+    "ufo-coalesce-max-stride", cl::init(64),
+    cl::desc("Largest stride in bytes of coalesced accesses, the range also "
+             "covers the bytes between two accesses"), cl::Hidden);
+static cl::opt<bool>  ClUfoPruneNonHeap(
+    "ufo-prune-non-heap", cl::init(false),
+    cl::desc("Also omit accesses that may point to several objects (phi, "
+             "select) when each is a non-captured alloca or a constant "
+             "global"), cl::Hidden);
 
 STATISTIC(NumInstrumentedReads, "Number of instrumented reads");
 STATISTIC(NumInstrumentedWrites, "Number of instrumented writes");
@@ -79,10 +105,20 @@ STATISTIC(NumOmittedReadsFromConstantGlobals,
 "Number of reads from constant globals");
 STATISTIC(NumOmittedReadsFromVtable, "Number of vtable reads");
 STATISTIC(NumOmittedNonCaptured, "Number of accesses ignored due to capturing");
+STATISTIC(NumUfoInlineAccs, "Number of accesses with inlined UFO events");
+STATISTIC(NumUfoCoalescedAccs, "Number of loop accesses coalesced into ranges");
+STATISTIC(NumUfoPrunedNonHeap,
+"Number of accesses through a phi or select pruned by -ufo-prune-non-heap");
 
 static const char *const kTsanModuleCtorName = "tsan.module_ctor";
 static const char *const kTsanInitName = "__tsan_init";
 
+// UFO inline access ABI, see InlineBuf in rtl/ufo/tlbuffer.h
+static const char *const kUfoTlBufName = "__ufo_tl_buf";
+static const unsigned kUfoMemRead = 8;  // EventType::MemRead, MemWrite is 9
+static const unsigned kUfoAccEventLen = 19;  // sizeof(MemAccEvent)
+static const unsigned kUfoAccRoom = 27;  // INLINE_ACC_ROOM
+
 namespace {
 
 /// ThreadSanitizer: instrument the code in module to find races.
@@ -97,12 +133,19 @@ struct ThreadSanitizer : public FunctionPass {
 private:
   void initializeCallbacks(Module &M);
   bool instrumentLoadOrStore(Instruction *I, const DataLayout &DL);
+  bool instrumentUfoInlineAcc(Instruction *I, Value *Addr, int Idx,
+                              Value *OnAccessFunc, const DataLayout &DL);
   bool instrumentAtomic(Instruction *I, const DataLayout &DL);
   bool instrumentMemIntrinsic(Instruction *I);
+  bool coalesceLoopAccesses(SmallVectorImpl<Instruction *> &All,
+                            const DataLayout &DL);
+  bool coalesceLoopAccess(Instruction *I, Loop *L, ScalarEvolution &SE,
+                          SCEVExpander &Expander, const DataLayout &DL);
   void chooseInstructionsToInstrument(SmallVectorImpl<Instruction *> &Local,
                                       SmallVectorImpl<Instruction *> &All,
                                       const DataLayout &DL);
   bool addrPointsToConstantData(Value *Addr);
+  bool addrPointsToNonCapturedObjects(Value *Addr, const DataLayout &DL);
   int getMemoryAccessFuncIndex(Value *Addr, const DataLayout &DL);
   void InsertRuntimeIgnores(Function &F);
 
@@ -127,8 +170,13 @@ private:
   Function *TsanAtomicSignalFence;
   Function *TsanVptrUpdate;
   Function *TsanVptrLoad;
+  Function *TsanReadRange;
+  Function *TsanWriteRange;
   Function *MemmoveFn, *MemcpyFn, *MemsetFn;
   Function *TsanCtorFunction;
+  // -ufo-inline-acc: {buf, size, limit, last_off, clock} of this thread
+  StructType *UfoInlineBufTy;
+  GlobalVariable *UfoTlBuf;
 };
 }  // namespace
 
@@ -138,6 +186,9 @@ INITIALIZE_PASS_BEGIN(
 "ThreadSanitizer: detects data races.",
 false, false)
 INITIALIZE_PASS_DEPENDENCY(TargetLibraryInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(ScalarEvolutionWrapperPass)
 INITIALIZE_PASS_END(
     ThreadSanitizer, "tsan",
 "ThreadSanitizer: detects data races.",
@@ -147,6 +198,12 @@ StringRef ThreadSanitizer::getPassName() const { return "ThreadSanitizer"; }
 
 void ThreadSanitizer::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<TargetLibraryInfoWrapperPass>();
+  // only used by coalesceLoopAccesses()
+  if (ClUfoCoalesceLoops) {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+  }
 }
 
 FunctionPass *llvm::createThreadSanitizerPass() {
@@ -235,6 +292,12 @@ void ThreadSanitizer::initializeCallbacks(Module &M) {
                             IRB.getInt8PtrTy(), IRB.getInt8PtrTy(), nullptr));
   TsanVptrLoad = checkSanitizerInterfaceFunction(M.getOrInsertFunction(
       "__tsan_vptr_read", Attr, IRB.getVoidTy(), IRB.getInt8PtrTy(), nullptr));
+  TsanReadRange = checkSanitizerInterfaceFunction(M.getOrInsertFunction(
+      "__tsan_read_range", Attr, IRB.getVoidTy(), IRB.getInt8PtrTy(), IntptrTy,
+      nullptr));
+  TsanWriteRange = checkSanitizerInterfaceFunction(M.getOrInsertFunction(
+      "__tsan_write_range", Attr, IRB.getVoidTy(), IRB.getInt8PtrTy(), IntptrTy,
+      nullptr));
   TsanAtomicThreadFence = checkSanitizerInterfaceFunction(M.getOrInsertFunction(
       "__tsan_atomic_thread_fence", Attr, IRB.getVoidTy(), OrdTy, nullptr));
   TsanAtomicSignalFence = checkSanitizerInterfaceFunction(M.getOrInsertFunction(
@@ -249,6 +312,13 @@ void ThreadSanitizer::initializeCallbacks(Module &M) {
   MemsetFn = checkSanitizerInterfaceFunction(
       M.getOrInsertFunction("memset", Attr, IRB.getInt8PtrTy(), IRB.getInt8PtrTy(),
                             IRB.getInt32Ty(), IntptrTy, nullptr));
+
+  UfoInlineBufTy = StructType::get(IRB.getInt8PtrTy(), IRB.getInt32Ty(),
+                                   IRB.getInt32Ty(), IRB.getInt32Ty(),
+                                   IRB.getInt64Ty(), nullptr);
+  UfoTlBuf = cast<GlobalVariable>(
+      M.getOrInsertGlobal(kUfoTlBufName, UfoInlineBufTy->getPointerTo()));
+  UfoTlBuf->setThreadLocalMode(GlobalVariable::InitialExecTLSModel);
 }
 
 bool ThreadSanitizer::doInitialization(Module &M) {
@@ -322,10 +392,31 @@ bool ThreadSanitizer::addrPointsToConstantData(Value *Addr) {
   return false;
 }
 
+// -ufo-prune-non-heap: Addr may point to one of several objects, none of them
+// can be written by a different thread.
+bool ThreadSanitizer::addrPointsToNonCapturedObjects(Value *Addr,
+                                                     const DataLayout &DL) {
+  SmallVector<Value *, 4> Objs;
+  GetUnderlyingObjects(Addr, Objs, DL);
+  for (Value *Obj : Objs) {
+    if (isa<AllocaInst>(Obj)) {
+      if (PointerMayBeCaptured(Obj, true, true))
+        return false;
+    } else if (GlobalVariable *GV = dyn_cast<GlobalVariable>(Obj)) {
+      if (!GV->isConstant())
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Instrumenting some of the accesses may be proven redundant.
 // Currently handled:
 //  - read-before-write (within same BB, no calls between)
-//  - not captured variables
+//  - not captured variables (-ufo-prune-non-heap: also through a phi or
+//    select, see addrPointsToNonCapturedObjects)
 //
 // We do not handle some of the patterns that should not survive
 // after the classic compiler optimizations.
@@ -363,14 +454,19 @@ continue;
 Value *Addr = isa<StoreInst>(*I)
               ? cast<StoreInst>(I)->getPointerOperand()
               : cast<LoadInst>(I)->getPointerOperand();
-if (isa<AllocaInst>(GetUnderlyingObject(Addr, DL)) &&
-!PointerMayBeCaptured(Addr, true, true)) {
+Value *Obj = GetUnderlyingObject(Addr, DL);
+if (isa<AllocaInst>(Obj) && !PointerMayBeCaptured(Addr, true, true)) {
 // The variable is addressable but not captured, so it cannot be
 // referenced from a different thread and participate in a data race
 // (see llvm/Analysis/CaptureTracking.h for details).
 NumOmittedNonCaptured++;
 continue;
 }
+if (ClUfoPruneNonHeap && (isa<PHINode>(Obj) || isa<SelectInst>(Obj)) &&
+    addrPointsToNonCapturedObjects(Addr, DL)) {
+NumUfoPrunedNonHeap++;
+continue;
+}
 All.push_back(I);
 }
 Local.clear();
@@ -441,6 +537,8 @@ bool ThreadSanitizer::runOnFunction(Function &F) {
   // (e.g. variables that do not escape, etc).
 
   // Instrument memory accesses only if we want to report bugs in the function.
+  if (ClInstrumentMemoryAccesses && SanitizeFunction && ClUfoCoalesceLoops)
+    Res |= coalesceLoopAccesses(AllLoadsAndStores, DL);
   if (ClInstrumentMemoryAccesses && SanitizeFunction)
     for (auto Inst : AllLoadsAndStores) {
       Res |= instrumentLoadOrStore(Inst, DL);
@@ -526,7 +624,9 @@ bool ThreadSanitizer::instrumentLoadOrStore(Instruction *I,
   else
     OnAccessFunc = IsWrite ? TsanUnalignedWrite[Idx] : TsanUnalignedRead[Idx];
 
-  if (IsWrite) {
+  if (ClUfoInlineAcc && instrumentUfoInlineAcc(I, Addr, Idx, OnAccessFunc, DL)) {
+    NumUfoInlineAccs++;
+  } else if (IsWrite) {
 //    template<bool preserveNames = true, typename T = ConstantFolder,
 //        typename Inserter = IRBuilderDefaultInserter<preserveNames> >
     IRBuilder<ConstantFolder, IRBuilderAfterInserter<true>> insertAfter(I);
@@ -540,6 +640,173 @@ bool ThreadSanitizer::instrumentLoadOrStore(Instruction *I,
   return true;
 }
 
+static bool isUfoAccValueSupported(Type *Ty, unsigned BitSize,
+                                   const DataLayout &DL) {
+  if (Ty->isIntegerTy() || Ty->isPointerTy())
+    return true;
+  return (Ty->isFloatingPointTy() ||
+          (Ty->isVectorTy() && !Ty->getScalarType()->isPointerTy())) &&
+         DL.getTypeSizeInBits(Ty) == BitSize;
+}
+
+// the value read or written as an integer of BitSize bits,
+// see isUfoAccValueSupported()
+static Value *ufoAccValue(IRBuilder<> &IRB, Value *V, unsigned BitSize) {
+  Type *Ty = V->getType();
+  Type *IntTy = IRB.getIntNTy(BitSize);
+  if (Ty->isIntegerTy())
+    return IRB.CreateZExt(V, IntTy);
+  if (Ty->isPointerTy())
+    return IRB.CreatePtrToInt(V, IntTy);
+  return IRB.CreateBitCast(V, IntTy);
+}
+
+// unaligned store of V at Buf + Offset
+static void createUfoStore(IRBuilder<> &IRB, Value *V, Value *Buf,
+                           unsigned Offset) {
+  Value *P = IRB.CreateConstGEP1_32(Buf, Offset);
+  IRB.CreateAlignedStore(
+      V, IRB.CreatePointerCast(P, V->getType()->getPointerTo()), 1);
+}
+
+// After the access, write a raw MemAccEvent and the value to the thread
+// buffer (InlineBuf) if there is room, otherwise call the run-time library,
+// which flushes the buffer. Events are little endian, 48 bit fields are written
+// as 64 bit stores, their upper bytes are overwritten by the next field.
+// pc is the address of the function, the return address of the call otherwise.
+bool ThreadSanitizer::instrumentUfoInlineAcc(Instruction *I, Value *Addr,
+                                             int Idx, Value *OnAccessFunc,
+                                             const DataLayout &DL) {
+  bool IsWrite = isa<StoreInst>(*I);
+  Value *Val = IsWrite ? cast<StoreInst>(I)->getValueOperand() : I;
+  const unsigned ByteSize = 1U << Idx;
+  if (ByteSize > 8 || !isUfoAccValueSupported(Val->getType(), ByteSize * 8, DL))
+    return false;
+
+  Instruction *SplitBefore = I->getNextNode();
+  IRBuilder<> IRB(SplitBefore);
+  Value *Abi = IRB.CreateLoad(UfoTlBuf);
+  Value *SizePtr = IRB.CreateStructGEP(UfoInlineBufTy, Abi, 1);
+  Value *Buf = IRB.CreateLoad(IRB.CreateStructGEP(UfoInlineBufTy, Abi, 0));
+  Value *Size = IRB.CreateLoad(SizePtr);
+  Value *Limit = IRB.CreateLoad(IRB.CreateStructGEP(UfoInlineBufTy, Abi, 2));
+  Value *Fits = IRB.CreateICmpULT(IRB.CreateAdd(Size, IRB.getInt32(kUfoAccRoom)),
+                                  Limit);
+  TerminatorInst *ThenTerm, *ElseTerm;
+  SplitBlockAndInsertIfThenElse(
+      Fits, SplitBefore, &ThenTerm, &ElseTerm,
+      MDBuilder(I->getContext()).createBranchWeights(1000, 1));
+
+  IRBuilder<> Fast(ThenTerm);
+  // idx from the clock of this thread, no shared counter
+  Value *ClockPtr = Fast.CreateStructGEP(UfoInlineBufTy, Abi, 4);
+  Value *EvIdx = Fast.CreateAdd(Fast.CreateLoad(ClockPtr), Fast.getInt64(1));
+  Fast.CreateStore(EvIdx, ClockPtr);
+  Value *P = Fast.CreateInBoundsGEP(Fast.getInt8Ty(), Buf,
+                                    Fast.CreateZExt(Size, IntptrTy));
+  Fast.CreateStore(Fast.getInt8((kUfoMemRead + IsWrite) | (Idx << 6)), P);
+  createUfoStore(Fast, EvIdx, P, 1);
+  createUfoStore(Fast, Fast.CreatePtrToInt(Addr, Fast.getInt64Ty()), P, 7);
+  createUfoStore(Fast, Fast.CreatePtrToInt(I->getFunction(), Fast.getInt64Ty()),
+                 P, 13);
+  createUfoStore(Fast, ufoAccValue(Fast, Val, ByteSize * 8), P,
+                 kUfoAccEventLen);
+  Fast.CreateStore(Size, Fast.CreateStructGEP(UfoInlineBufTy, Abi, 3));
+  Fast.CreateStore(Fast.CreateAdd(Size, Fast.getInt32(kUfoAccEventLen + ByteSize)),
+                   SizePtr);
+
+  IRBuilder<> Slow(ElseTerm);
+  Slow.CreateCall(OnAccessFunc, Slow.CreatePointerCast(Addr, Slow.getInt8PtrTy()));
+  return true;
+}
+
+// Loops with one exit at the latch and without calls (free, locks, ...) nor
+// atomics, so that no event of this thread happens between the iterations.
+static bool isUfoCoalescableLoop(Loop *L) {
+  if (!L->getLoopPreheader() || !L->getLoopLatch() ||
+      L->getExitingBlock() != L->getLoopLatch())
+    return false;
+  for (BasicBlock *BB : L->blocks())
+    for (Instruction &Inst : *BB) {
+      if (isa<DbgInfoIntrinsic>(Inst))
+        continue;
+      if (IntrinsicInst *II = dyn_cast<IntrinsicInst>(&Inst))
+        if (II->getIntrinsicID() == Intrinsic::lifetime_start ||
+            II->getIntrinsicID() == Intrinsic::lifetime_end)
+          continue;
+      if (isa<CallInst>(Inst) || isa<InvokeInst>(Inst) || Inst.isAtomic())
+        return false;
+    }
+  return true;
+}
+
+// Accesses {Start,+,Stride} of their innermost loop, executed once per
+// iteration, are reported by one __tsan_read_range/__tsan_write_range in the
+// preheader, from the lowest to the highest address accessed. Removed from All.
+bool ThreadSanitizer::coalesceLoopAccesses(SmallVectorImpl<Instruction *> &All,
+                                           const DataLayout &DL) {
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  SCEVExpander Expander(SE, DL, "ufo");
+  DenseMap<Loop *, bool> Coalescable;
+  SmallVector<Instruction *, 8> Kept;
+  bool Res = false;
+  for (Instruction *I : All) {
+    Loop *L = LI.getLoopFor(I->getParent());
+    if (L && !Coalescable.count(L))
+      Coalescable[L] = isUfoCoalescableLoop(L);
+    if (L && Coalescable[L] && !isVtableAccess(I) &&
+        DT.dominates(I->getParent(), L->getLoopLatch()) &&
+        coalesceLoopAccess(I, L, SE, Expander, DL)) {
+      NumUfoCoalescedAccs++;
+      Res = true;
+    } else {
+      Kept.push_back(I);
+    }
+  }
+  All.swap(Kept);
+  return Res;
+}
+
+bool ThreadSanitizer::coalesceLoopAccess(Instruction *I, Loop *L,
+                                         ScalarEvolution &SE,
+                                         SCEVExpander &Expander,
+                                         const DataLayout &DL) {
+  bool IsWrite = isa<StoreInst>(*I);
+  Value *Addr = IsWrite
+                ? cast<StoreInst>(I)->getPointerOperand()
+                : cast<LoadInst>(I)->getPointerOperand();
+  const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Addr));
+  if (!AR || AR->getLoop() != L || !AR->isAffine())
+    return false;
+  const SCEVConstant *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+  const SCEV *BTC = SE.getBackedgeTakenCount(L);
+  if (!Step || isa<SCEVCouldNotCompute>(BTC))
+    return false;
+  const int64_t Stride = Step->getAPInt().getSExtValue();
+  const uint64_t AbsStride = Stride < 0 ? -(uint64_t)Stride : Stride;
+  if (AbsStride > ClUfoCoalesceMaxStride)
+    return false;
+  const SCEV *Start = AR->getStart();
+  if (!isSafeToExpand(Start, SE) || !isSafeToExpand(BTC, SE))
+    return false;
+
+  Type *OrigTy = cast<PointerType>(Addr->getType())->getElementType();
+  const uint64_t Size = DL.getTypeStoreSize(OrigTy);
+  const SCEV *Span = SE.getMulExpr(SE.getTruncateOrZeroExtend(BTC, IntptrTy),
+                                   SE.getConstant(IntptrTy, AbsStride));
+  const SCEV *Lo = Stride < 0 ? SE.getMinusSCEV(Start, Span) : Start;
+  const SCEV *Len = SE.getAddExpr(Span, SE.getConstant(IntptrTy, Size));
+
+  Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+  IRBuilder<> IRB(InsertPt);
+  Value *LoV = Expander.expandCodeFor(Lo, IRB.getInt8PtrTy(), InsertPt);
+  Value *LenV = Expander.expandCodeFor(Len, IntptrTy, InsertPt);
+  IRB.CreateCall(IsWrite ? TsanWriteRange : TsanReadRange, {LoV, LenV});
+  return true;
+}
+
 static ConstantInt *createOrdering(IRBuilder<> *IRB, AtomicOrdering ord) {
   uint32_t v = 0;
   switch (ord) {
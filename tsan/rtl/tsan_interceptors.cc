@@ -1051,9 +1051,6 @@ static int cond_wait(ThreadState *thr, uptr pc, ScopedInterceptor *si,
   MemoryAccessRange(thr, pc, (uptr)c, sizeof(uptr), false);
   MutexUnlock(thr, pc, (uptr)m);
   CondMutexUnlockCtx arg = {si, thr, pc, m};
-
-  bw::ufo::on_cond_wait(thr, pc, (u64)c, (u64)m);
-
   int res = 0;
   // This ensures that we handle mutex lock even in case of pthread_cancel.
   // See test/tsan/cond_cancel.cc.
@@ -1063,6 +1060,8 @@ static int cond_wait(ThreadState *thr, uptr pc, ScopedInterceptor *si,
     res = call_pthread_cancel_with_cleanup(
         fn, c, m, t, (void (*)(void *arg))cond_mutex_unlock, &arg);
   }
+  // woken up (or timed out), before the mutex is locked again
+  bw::ufo::on_cond_wait(thr, pc, (u64)c, (u64)m);
   if (res == errno_EOWNERDEAD) MutexRepair(thr, pc, (uptr)m);
   MutexLock(thr, pc, (uptr)m);
   return res;
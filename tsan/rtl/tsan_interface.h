@@ -34,6 +34,18 @@ SANITIZER_INTERFACE_ATTRIBUTE void __tsan_init();
 
 SANITIZER_INTERFACE_ATTRIBUTE void __ufo_ptr_prop(void* addr_src, void* addr_dest);
 SANITIZER_INTERFACE_ATTRIBUTE void __ufo_ptr_deref(void* addr_src);
+// UFO_RING: write the flight recorder of all threads, returns 1 if dumped
+SANITIZER_INTERFACE_ATTRIBUTE int __ufo_dump();
+// region of interest: trace between __ufo_enable() and __ufo_disable() (UFO_ROI=1 starts disabled)
+SANITIZER_INTERFACE_ATTRIBUTE void __ufo_enable();
+SANITIZER_INTERFACE_ATTRIBUTE void __ufo_disable();
+// memory accesses and calls of the calling thread
+SANITIZER_INTERFACE_ATTRIBUTE void __ufo_enable_thread();
+SANITIZER_INTERFACE_ATTRIBUTE void __ufo_disable_thread();
+// write the buffer of the calling thread, the other threads at their next sync event, returns 1 if flushed
+SANITIZER_INTERFACE_ATTRIBUTE int __ufo_flush();
+// write the next traces to dir_<pid>, returns 1 if rotated
+SANITIZER_INTERFACE_ATTRIBUTE int __ufo_rotate(const char *dir);
 
 SANITIZER_INTERFACE_ATTRIBUTE void __tsan_read1(void *addr);
 SANITIZER_INTERFACE_ATTRIBUTE void __tsan_read2(void *addr);
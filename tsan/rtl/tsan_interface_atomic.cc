@@ -25,6 +25,7 @@
 #include "tsan_flags.h"
 #include "tsan_interface.h"
 #include "tsan_rtl.h"
+#include "tsan/rtl/ufo/ufo_interface.h"
 
 using namespace __tsan;  // NOLINT
 
@@ -176,6 +177,32 @@ static int SizeLog() {
   // this leads to false negatives only in very obscure cases.
 }
 
+// UFO: the atomic event is recorded under the lock of the sync var (if any),
+// so that the events of one address are in the order of the operations.
+// The event is attributed to callpc, the caller of __tsan_atomic*, while tsan
+// keeps the pc of the runtime function for its own bookkeeping.
+template<typename T>
+static void UfoAtomic(ThreadState *thr, uptr callpc, const volatile T *a,
+    u8 op, morder mo) {
+  bw::ufo::on_atomic(thr, callpc, (uptr)a, SizeLog<T>(), op, (u8)mo);
+}
+
+// UFO_LITE: no sync var, a striped spin lock keeps the order of the events
+// of one address for non-relaxed operations. The 64 stripes are global: every
+// non-relaxed atomic of the process takes one, unrelated addresses hashed to
+// the same stripe contend. Relaxed operations take no lock.
+struct UfoAtomicStripe {
+  StaticSpinMutex mtx;
+  char pad[kCacheLineSize - sizeof(StaticSpinMutex)];
+};
+
+static const uptr kUfoAtomicStripes = 64;
+static UfoAtomicStripe ufo_atomic_stripes[kUfoAtomicStripes];
+
+static StaticSpinMutex *UfoAtomicMutex(const volatile void *a) {
+  return &ufo_atomic_stripes[((uptr)a >> 3) % kUfoAtomicStripes].mtx;
+}
+
 #if !SANITIZER_GO
 static atomic_uint8_t *to_atomic(const volatile a8 *a) {
   return reinterpret_cast<atomic_uint8_t *>(const_cast<a8 *>(a));
@@ -220,19 +247,28 @@ static a128 NoTsanAtomicLoad(const volatile a128 *a, morder mo) {
 #endif
 
 template<typename T>
-static T AtomicLoad(ThreadState *thr, uptr pc, const volatile T *a,
-    morder mo) {
+static T AtomicLoad(ThreadState *thr, uptr pc, uptr callpc,
+    const volatile T *a, morder mo) {
   CHECK(IsLoadOrder(mo));
   // This fast-path is critical for performance.
   // Assume the access is atomic.
   if (!IsAcquireOrder(mo)) {
     MemoryReadAtomic(thr, pc, (uptr)a, SizeLog<T>());
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpLoad, mo);
     return NoTsanAtomicLoad(a, mo);
   }
-  SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, (uptr)a, false);
-  AcquireImpl(thr, pc, &s->clock);
-  T v = NoTsanAtomicLoad(a, mo);
-  s->mtx.ReadUnlock();
+  T v;
+  if (bw::ufo::is_lite()) {
+    SpinMutexLock l(UfoAtomicMutex(a));
+    v = NoTsanAtomicLoad(a, mo);
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpLoad, mo);
+  } else {
+    SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, (uptr)a, false);
+    AcquireImpl(thr, pc, &s->clock);
+    v = NoTsanAtomicLoad(a, mo);
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpLoad, mo);
+    s->mtx.ReadUnlock();
+  }
   MemoryReadAtomic(thr, pc, (uptr)a, SizeLog<T>());
   return v;
 }
@@ -250,8 +286,8 @@ static void NoTsanAtomicStore(volatile a128 *a, a128 v, morder mo) {
 #endif
 
 template<typename T>
-static void AtomicStore(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
+static void AtomicStore(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
   CHECK(IsStoreOrder(mo));
   MemoryWriteAtomic(thr, pc, (uptr)a, SizeLog<T>());
   // This fast-path is critical for performance.
@@ -259,6 +295,13 @@ static void AtomicStore(ThreadState *thr, uptr pc, volatile T *a, T v,
   // Strictly saying even relaxed store cuts off release sequence,
   // so must reset the clock.
   if (!IsReleaseOrder(mo)) {
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpStore, mo);
+    NoTsanAtomicStore(a, v, mo);
+    return;
+  }
+  if (bw::ufo::is_lite()) {
+    SpinMutexLock l(UfoAtomicMutex(a));
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpStore, mo);
     NoTsanAtomicStore(a, v, mo);
     return;
   }
@@ -268,13 +311,21 @@ static void AtomicStore(ThreadState *thr, uptr pc, volatile T *a, T v,
   // Can't increment epoch w/o writing to the trace as well.
   TraceAddEvent(thr, thr->fast_state, EventTypeMop, 0);
   ReleaseStoreImpl(thr, pc, &s->clock);
+  UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpStore, mo);
   NoTsanAtomicStore(a, v, mo);
   s->mtx.Unlock();
 }
 
 template<typename T, T (*F)(volatile T *v, T op)>
-static T AtomicRMW(ThreadState *thr, uptr pc, volatile T *a, T v, morder mo) {
+static T AtomicRMW(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
   MemoryWriteAtomic(thr, pc, (uptr)a, SizeLog<T>());
+  if (mo != mo_relaxed && bw::ufo::is_lite()) {
+    SpinMutexLock l(UfoAtomicMutex(a));
+    v = F(a, v);
+    UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpRMW, mo);
+    return v;
+  }
   SyncVar *s = 0;
   if (mo != mo_relaxed) {
     s = ctx->metamap.GetOrCreateAndLock(thr, pc, (uptr)a, true);
@@ -289,6 +340,7 @@ static T AtomicRMW(ThreadState *thr, uptr pc, volatile T *a, T v, morder mo) {
       AcquireImpl(thr, pc, &s->clock);
   }
   v = F(a, v);
+  UfoAtomic(thr, callpc, a, bw::ufo::AtomicOpRMW, mo);
   if (s)
     s->mtx.Unlock();
   return v;
@@ -330,45 +382,45 @@ static T NoTsanAtomicFetchNand(volatile T *a, T v, morder mo) {
 }
 
 template<typename T>
-static T AtomicExchange(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_xchg>(thr, pc, a, v, mo);
+static T AtomicExchange(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_xchg>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchAdd(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_add>(thr, pc, a, v, mo);
+static T AtomicFetchAdd(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_add>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchSub(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_sub>(thr, pc, a, v, mo);
+static T AtomicFetchSub(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_sub>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchAnd(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_and>(thr, pc, a, v, mo);
+static T AtomicFetchAnd(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_and>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchOr(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_or>(thr, pc, a, v, mo);
+static T AtomicFetchOr(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_or>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchXor(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_xor>(thr, pc, a, v, mo);
+static T AtomicFetchXor(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_xor>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
-static T AtomicFetchNand(ThreadState *thr, uptr pc, volatile T *a, T v,
-    morder mo) {
-  return AtomicRMW<T, func_nand>(thr, pc, a, v, mo);
+static T AtomicFetchNand(ThreadState *thr, uptr pc, uptr callpc,
+    volatile T *a, T v, morder mo) {
+  return AtomicRMW<T, func_nand>(thr, pc, callpc, a, v, mo);
 }
 
 template<typename T>
@@ -395,10 +447,21 @@ static T NoTsanAtomicCAS(volatile T *a, T c, T v, morder mo, morder fmo) {
 }
 
 template<typename T>
-static bool AtomicCAS(ThreadState *thr, uptr pc,
+static bool AtomicCAS(ThreadState *thr, uptr pc, uptr callpc,
     volatile T *a, T *c, T v, morder mo, morder fmo) {
   (void)fmo;  // Unused because llvm does not pass it yet.
   MemoryWriteAtomic(thr, pc, (uptr)a, SizeLog<T>());
+  if (mo != mo_relaxed && bw::ufo::is_lite()) {
+    SpinMutexLock l(UfoAtomicMutex(a));
+    T cc = *c;
+    T pr = func_cas(a, cc, v);
+    UfoAtomic(thr, callpc, a,
+        pr == cc ? bw::ufo::AtomicOpCAS : bw::ufo::AtomicOpLoad, mo);
+    if (pr == cc)
+      return true;
+    *c = pr;
+    return false;
+  }
   SyncVar *s = 0;
   bool write_lock = mo != mo_acquire && mo != mo_consume;
   if (mo != mo_relaxed) {
@@ -415,6 +478,9 @@ static bool AtomicCAS(ThreadState *thr, uptr pc,
   }
   T cc = *c;
   T pr = func_cas(a, cc, v);
+  // a failed CAS only reads
+  UfoAtomic(thr, callpc, a,
+      pr == cc ? bw::ufo::AtomicOpCAS : bw::ufo::AtomicOpLoad, mo);
   if (s) {
     if (write_lock)
       s->mtx.Unlock();
@@ -428,9 +494,9 @@ static bool AtomicCAS(ThreadState *thr, uptr pc,
 }
 
 template<typename T>
-static T AtomicCAS(ThreadState *thr, uptr pc,
+static T AtomicCAS(ThreadState *thr, uptr pc, uptr callpc,
     volatile T *a, T c, T v, morder mo, morder fmo) {
-  AtomicCAS(thr, pc, a, &c, v, mo, fmo);
+  AtomicCAS(thr, pc, callpc, a, &c, v, mo, fmo);
   return c;
 }
 
@@ -439,9 +505,10 @@ static void NoTsanAtomicFence(morder mo) {
   __sync_synchronize();
 }
 
-static void AtomicFence(ThreadState *thr, uptr pc, morder mo) {
+static void AtomicFence(ThreadState *thr, uptr pc, uptr callpc, morder mo) {
   // FIXME(dvyukov): not implemented.
   __sync_synchronize();
+  bw::ufo::on_atomic(thr, callpc, 0, 0, bw::ufo::AtomicOpFence, (u8)mo);
 }
 #endif
 
@@ -450,6 +517,7 @@ static void AtomicFence(ThreadState *thr, uptr pc, morder mo) {
 
 // C/C++
 
+// UFO events of atomics are attributed to the caller (callpc), see UfoAtomic.
 #define SCOPED_ATOMIC(func, ...) \
     const uptr callpc = (uptr)__builtin_return_address(0); \
     uptr pc = StackTrace::GetCurrentPc(); \
@@ -459,7 +527,7 @@ static void AtomicFence(ThreadState *thr, uptr pc, morder mo) {
       return NoTsanAtomic##func(__VA_ARGS__); \
     AtomicStatInc(thr, sizeof(*a), mo, StatAtomic##func); \
     ScopedAtomic sa(thr, callpc, a, mo, __func__); \
-    return Atomic##func(thr, pc, __VA_ARGS__); \
+    return Atomic##func(thr, pc, callpc, __VA_ARGS__); \
 /**/
 
 class ScopedAtomic {
@@ -854,7 +922,7 @@ void __tsan_atomic_signal_fence(morder mo) {
       NoTsanAtomic##func(__VA_ARGS__); \
     } else { \
       FuncEntry(thr, cpc); \
-      Atomic##func(thr, pc, __VA_ARGS__); \
+      Atomic##func(thr, pc, pc, __VA_ARGS__); \
       FuncExit(thr); \
     } \
 #define ATOMIC_RET(func, ret, ...) \
@@ -862,7 +930,7 @@ void __tsan_atomic_signal_fence(morder mo) {
       (ret) = NoTsanAtomic##func(__VA_ARGS__); \
     } else { \
       FuncEntry(thr, cpc); \
-      (ret) = Atomic##func(thr, pc, __VA_ARGS__); \
+      (ret) = Atomic##func(thr, pc, pc, __VA_ARGS__); \
       FuncExit(thr); \
     } \
 
@@ -872,7 +940,7 @@ void __tsan_atomic_signal_fence(morder mo) {
     if (thr->ignore_sync) { \
       NoTsanAtomic##func(__VA_ARGS__); \
     } else { \
-      Atomic##func(thr, pc, __VA_ARGS__); \
+      Atomic##func(thr, pc, pc, __VA_ARGS__); \
     } \
 /**/
 
@@ -880,7 +948,7 @@ void __tsan_atomic_signal_fence(morder mo) {
     if (thr->ignore_sync) { \
       (ret) = NoTsanAtomic##func(__VA_ARGS__); \
     } else { \
-      (ret) = Atomic##func(thr, pc, __VA_ARGS__); \
+      (ret) = Atomic##func(thr, pc, pc, __VA_ARGS__); \
     } \
 /**/
 
@@ -26,6 +26,27 @@ void __ufo_ptr_prop(void* addr_src, void* addr_dest) {
 void __ufo_ptr_deref(void* addr_ptr) {
   bw::ufo::on_ptr_deref(cur_thread(), CALLERPC, (uptr)addr_ptr);
 }
+int __ufo_dump() {
+  return bw::ufo::dump_ufo() ? 1 : 0;
+}
+void __ufo_enable() {
+  bw::ufo::enable_ufo(cur_thread(), true);
+}
+void __ufo_disable() {
+  bw::ufo::enable_ufo(cur_thread(), false);
+}
+void __ufo_enable_thread() {
+  bw::ufo::enable_ufo_thread(cur_thread(), true);
+}
+void __ufo_disable_thread() {
+  bw::ufo::enable_ufo_thread(cur_thread(), false);
+}
+int __ufo_flush() {
+  return bw::ufo::flush_ufo(cur_thread()) ? 1 : 0;
+}
+int __ufo_rotate(const char *dir) {
+  return bw::ufo::rotate_ufo(cur_thread(), dir) ? 1 : 0;
+}
 
 void __tsan_read1(void *addr) {
   MemoryRead(cur_thread(), CALLERPC, (uptr)addr, kSizeLog1);
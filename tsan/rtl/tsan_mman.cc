@@ -35,7 +35,9 @@ void __sanitizer_free_hook(void *ptr) {
 namespace __tsan {
 
 struct MapUnmapCallback {
-  void OnMap(uptr p, uptr size) const { }
+  void OnMap(uptr p, uptr size) const {
+    bw::ufo::on_heap_map(p, size);
+  }
   void OnUnmap(uptr p, uptr size) const {
     // We are about to unmap a chunk of user memory.
     // Mark the corresponding shadow memory as not needed.
@@ -157,7 +159,8 @@ void *user_alloc(ThreadState *thr, uptr pc, uptr sz, uptr align, bool signal) {
 
   bw::ufo::on_alloc(thr, pc, p, sz);
 
-  if (ctx && ctx->initialized)
+  // UFO_LITE: heap blocks are not in the meta map
+  if (ctx && ctx->initialized && !bw::ufo::is_lite())
     OnUserAlloc(thr, pc, (uptr)p, sz, true);
   if (signal)
     SignalUnsafeCall(thr, pc);
@@ -175,7 +178,7 @@ void *user_calloc(ThreadState *thr, uptr pc, uptr size, uptr n) {
 
 void user_free(ThreadState *thr, uptr pc, void *p, bool signal) {
   ScopedGlobalProcessor sgp;
-  if (ctx && ctx->initialized)
+  if (ctx && ctx->initialized && !bw::ufo::is_lite())
     OnUserFree(thr, pc, (uptr)p, true);
   allocator()->Deallocate(&thr->proc()->alloc_cache, p);
 
@@ -219,6 +222,13 @@ void *user_realloc(ThreadState *thr, uptr pc, void *p, uptr sz) {
 uptr user_alloc_usable_size(const void *p) {
   if (p == 0)
     return 0;
+  if (bw::ufo::is_lite()) {
+    // no block in the meta map, the size of the chunk (at least the requested size)
+    if (!allocator()->PointerIsMine(const_cast<void *>(p))
+        || allocator()->GetBlockBegin(p) != p)
+      return 0;  // Not a valid pointer.
+    return allocator()->GetActuallyAllocatedSize(const_cast<void *>(p));
+  }
   MBlock *b = ctx->metamap.GetBlock((uptr)p);
   if (!b)
     return 0;  // Not a valid pointer.
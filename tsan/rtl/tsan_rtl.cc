@@ -699,7 +699,9 @@ bool ContainsSameAccess(u64 *s, u64 a, u64 sync_epoch, bool is_write) {
 ALWAYS_INLINE USED
 void MemoryAccess(ThreadState *thr, uptr pc, uptr addr,
     int kAccessSizeLog, bool kAccessIsWrite, bool kIsAtomic) {
-
+  // atomics are traced as MemAtomic, see UfoAtomic in tsan_interface_atomic.cc
+  if (kIsAtomic)
+    return;
   bw::ufo::on_mem_acc(thr, pc, addr, kAccessSizeLog, kAccessIsWrite);
 }
 
@@ -74,6 +74,9 @@ void MutexCreate(ThreadState *thr, uptr pc, uptr addr,
     MemoryWrite(thr, pc, addr, kSizeLog1);
     thr->is_freeing = false;
   }
+  // UFO_LITE: no sync var
+  if (bw::ufo::is_lite())
+    return;
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
   s->is_rw = rw;
   s->is_recursive = recursive;
@@ -86,6 +89,11 @@ void MutexCreate(ThreadState *thr, uptr pc, uptr addr,
 void MutexDestroy(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: MutexDestroy %zx\n", thr->tid, addr);
   StatInc(thr, StatMutexDestroy);
+  if (bw::ufo::is_lite()) {
+    if (IsAppMem(addr))
+      MemoryWrite(thr, pc, addr, kSizeLog1);
+    return;
+  }
   SyncVar *s = ctx->metamap.GetIfExistsAndLock(addr, true);
   if (s == 0)
     return;
@@ -146,6 +154,12 @@ void MutexDestroy(ThreadState *thr, uptr pc, uptr addr) {
 void MutexLock(ThreadState *thr, uptr pc, uptr addr, int rec, bool try_lock) {
   DPrintf("#%d: MutexLock %zx rec=%d\n", thr->tid, addr, rec);
   CHECK_GT(rec, 0);
+  // UFO_LITE: the interceptor calls this after the lock is acquired,
+  // UFO orders the events itself, no sync var, clock, mutex set nor deadlock detection.
+  if (bw::ufo::is_lite()) {
+    bw::ufo::on_mtx_lock(thr, pc, addr);
+    return;
+  }
 //  if (IsAppMem(addr))
 //    MemoryReadAtomic(thr, pc, addr, kSizeLog1);
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
@@ -193,6 +207,11 @@ void MutexLock(ThreadState *thr, uptr pc, uptr addr, int rec, bool try_lock) {
 
 int MutexUnlock(ThreadState *thr, uptr pc, uptr addr, bool all) {
   DPrintf("#%d: MutexUnlock %zx all=%d\n", thr->tid, addr, all);
+  // UFO_LITE: called before the mutex is released, the recursion is not tracked
+  if (bw::ufo::is_lite()) {
+    bw::ufo::on_mtx_unlock(thr, pc, addr);
+    return 1;
+  }
 //  if (IsAppMem(addr))
 //    MemoryReadAtomic(thr, pc, addr, kSizeLog1);
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
@@ -240,6 +259,10 @@ int MutexUnlock(ThreadState *thr, uptr pc, uptr addr, bool all) {
 void MutexReadLock(ThreadState *thr, uptr pc, uptr addr, bool trylock) {
   DPrintf("#%d: MutexReadLock %zx\n", thr->tid, addr);
   StatInc(thr, StatMutexReadLock);
+  if (bw::ufo::is_lite()) {
+    bw::ufo::on_rd_lock(thr, pc, addr);
+    return;
+  }
 //  if (IsAppMem(addr))
 //    MemoryReadAtomic(thr, pc, addr, kSizeLog1);
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, false);
@@ -263,7 +286,7 @@ void MutexReadLock(ThreadState *thr, uptr pc, uptr addr, bool trylock) {
   }
   u64 mid = s->GetId();
 
-//  bw::ufo::on_rd_lock(thr, pc, s->addr);
+  bw::ufo::on_rd_lock(thr, pc, s->addr);
 
   s->mtx.ReadUnlock();
   // Can't touch s after this point.
@@ -278,6 +301,10 @@ void MutexReadLock(ThreadState *thr, uptr pc, uptr addr, bool trylock) {
 void MutexReadUnlock(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: MutexReadUnlock %zx\n", thr->tid, addr);
   StatInc(thr, StatMutexReadUnlock);
+  if (bw::ufo::is_lite()) {
+    bw::ufo::on_rd_unlock(thr, pc, addr);
+    return;
+  }
 //  if (IsAppMem(addr))
 //    MemoryReadAtomic(thr, pc, addr, kSizeLog1);
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
@@ -297,7 +324,7 @@ void MutexReadUnlock(ThreadState *thr, uptr pc, uptr addr) {
   }
   u64 mid = s->GetId();
 
-//  bw::ufo::on_rd_unlock(thr, pc, s->addr);
+  bw::ufo::on_rd_unlock(thr, pc, s->addr);
 
   s->mtx.Unlock();
   // Can't touch s after this point.
@@ -312,6 +339,11 @@ void MutexReadUnlock(ThreadState *thr, uptr pc, uptr addr) {
 
 void MutexReadOrWriteUnlock(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: MutexReadOrWriteUnlock %zx\n", thr->tid, addr);
+  // UFO_LITE: no owner in a sync var to tell a reader from the writer
+  if (bw::ufo::is_lite()) {
+    bw::ufo::on_rw_unlock(thr, pc, addr);
+    return;
+  }
 //  if (IsAppMem(addr))
 //    MemoryReadAtomic(thr, pc, addr, kSizeLog1);
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
@@ -348,7 +380,10 @@ void MutexReadOrWriteUnlock(ThreadState *thr, uptr pc, uptr addr) {
   }
   u64 mid = s->GetId();
 
-//  bw::ufo::on_rw_unlock(thr, pc, s->addr);
+  if (write)
+    bw::ufo::on_mtx_unlock(thr, pc, s->addr);
+  else
+    bw::ufo::on_rd_unlock(thr, pc, s->addr);
 
   s->mtx.Unlock();
   // Can't touch s after this point.
@@ -362,6 +397,8 @@ void MutexReadOrWriteUnlock(ThreadState *thr, uptr pc, uptr addr) {
 
 void MutexRepair(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: MutexRepair %zx\n", thr->tid, addr);
+  if (bw::ufo::is_lite())
+    return;
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
   s->owner_tid = SyncVar::kInvalidTid;
   s->recursion = 0;
@@ -370,6 +407,8 @@ void MutexRepair(ThreadState *thr, uptr pc, uptr addr) {
 
 void MutexInvalidAccess(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: MutexInvalidAccess %zx\n", thr->tid, addr);
+  if (bw::ufo::is_lite())
+    return;
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
   u64 mid = s->GetId();
   s->mtx.Unlock();
@@ -378,7 +417,7 @@ void MutexInvalidAccess(ThreadState *thr, uptr pc, uptr addr) {
 
 void Acquire(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: Acquire %zx\n", thr->tid, addr);
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   SyncVar *s = ctx->metamap.GetIfExistsAndLock(addr, false);
   if (!s)
@@ -398,7 +437,7 @@ static void UpdateClockCallback(ThreadContextBase *tctx_base, void *arg) {
 
 void AcquireGlobal(ThreadState *thr, uptr pc) {
   DPrintf("#%d: AcquireGlobal\n", thr->tid);
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   ThreadRegistryLock l(ctx->thread_registry);
   ctx->thread_registry->RunCallbackForEachThreadLocked(
@@ -407,7 +446,7 @@ void AcquireGlobal(ThreadState *thr, uptr pc) {
 
 void Release(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: Release %zx\n", thr->tid, addr);
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
   thr->fast_state.IncrementEpoch();
@@ -419,7 +458,7 @@ void Release(ThreadState *thr, uptr pc, uptr addr) {
 
 void ReleaseStore(ThreadState *thr, uptr pc, uptr addr) {
   DPrintf("#%d: ReleaseStore %zx\n", thr->tid, addr);
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   SyncVar *s = ctx->metamap.GetOrCreateAndLock(thr, pc, addr, true);
   thr->fast_state.IncrementEpoch();
@@ -441,7 +480,7 @@ static void UpdateSleepClockCallback(ThreadContextBase *tctx_base, void *arg) {
 
 void AfterSleep(ThreadState *thr, uptr pc) {
   DPrintf("#%d: AfterSleep %zx\n", thr->tid);
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   thr->last_sleep_stack_id = CurrentStackId(thr, pc);
   ThreadRegistryLock l(ctx->thread_registry);
@@ -451,7 +490,7 @@ void AfterSleep(ThreadState *thr, uptr pc) {
 #endif
 
 void AcquireImpl(ThreadState *thr, uptr pc, SyncClock *c) {
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   thr->clock.set(thr->fast_state.epoch());
   thr->clock.acquire(&thr->proc()->clock_cache, c);
@@ -459,7 +498,7 @@ void AcquireImpl(ThreadState *thr, uptr pc, SyncClock *c) {
 }
 
 void ReleaseImpl(ThreadState *thr, uptr pc, SyncClock *c) {
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   thr->clock.set(thr->fast_state.epoch());
   thr->fast_synch_epoch = thr->fast_state.epoch();
@@ -468,7 +507,7 @@ void ReleaseImpl(ThreadState *thr, uptr pc, SyncClock *c) {
 }
 
 void ReleaseStoreImpl(ThreadState *thr, uptr pc, SyncClock *c) {
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   thr->clock.set(thr->fast_state.epoch());
   thr->fast_synch_epoch = thr->fast_state.epoch();
@@ -477,7 +516,7 @@ void ReleaseStoreImpl(ThreadState *thr, uptr pc, SyncClock *c) {
 }
 
 void AcquireReleaseImpl(ThreadState *thr, uptr pc, SyncClock *c) {
-  if (thr->ignore_sync)
+  if (thr->ignore_sync || bw::ufo::is_lite())
     return;
   thr->clock.set(thr->fast_state.epoch());
   thr->fast_synch_epoch = thr->fast_state.epoch();
@@ -0,0 +1,73 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#ifndef UFO_COMPACT_CODEC_H
+#define UFO_COMPACT_CODEC_H
+
+// fields of EncodingCompact, see Encoding in ufo_interface.h.
+// no sanitizer dependency, also used by the tests of the offline reader (reader/)
+
+namespace bw {
+namespace ufo {
+namespace codec {
+
+typedef unsigned char byte;
+typedef unsigned long long word;
+
+inline __attribute__((always_inline))
+byte *put_varint(byte *p, word v) {
+  while (v >= 0x80) {
+    *p++ = (byte) (v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (byte) v;
+  return p;
+}
+
+inline __attribute__((always_inline))
+word zigzag(word cur, word pred) {
+  long long d = (long long) (cur - pred);
+  return (word) ((d << 1) ^ (d >> 63));
+}
+
+// fields are delta encoded against the previous event of the block, reset at the beginning of each block
+struct Predictors {
+  word idx;
+  word addr;
+  word pc;
+
+  void reset() {
+    idx = 0;
+    addr = 0;
+    pc = 0;
+  }
+
+  // idx never decreases in one thread, no zigzag
+  inline __attribute__((always_inline))
+  byte *put_idx(byte *p, word v) {
+    word d = v - idx;
+    idx = v;
+    return put_varint(p, d);
+  }
+
+  inline __attribute__((always_inline))
+  byte *put_addr(byte *p, word v) {
+    word d = zigzag(v, addr);
+    addr = v;
+    return put_varint(p, d);
+  }
+
+  inline __attribute__((always_inline))
+  byte *put_pc(byte *p, word v) {
+    word d = zigzag(v, pc);
+    pc = v;
+    return put_varint(p, d);
+  }
+};
+
+} // ns codec
+} // ns ufo
+} // ns bw
+
+#endif //UFO_COMPACT_CODEC_H
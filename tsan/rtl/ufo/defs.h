@@ -8,20 +8,19 @@
 // for test only, do not disable it
 #define BUF_EVENT_ON
 
-// sync file on flush(), should always on
-#define SYNC_AT_FLUSH
+// fsync after every flushed block by default (UFO_SYNC=-1), otherwise when the trace of a thread is closed
+//#define SYNC_AT_FLUSH
 
 
 // enable statistic
 #define STAT_ON
 
 
-const unsigned long long UFO_VERSION = 20161001;
+const unsigned long long UFO_VERSION = 20170425;
 
 typedef unsigned char Byte;
-typedef unsigned short TidType;
-
-const unsigned int MAX_THREAD = 8192;
+// UFO thread id, unique in one process, see thread_table.h
+typedef unsigned int TidType;
 
 #define PACKED_STRUCT(NAME)\
   struct __attribute__ ((__packed__)) NAME
@@ -56,6 +55,10 @@ const char * const ENV_USE_IO_Q = "UFO_ASYNC_IO"; // 0
 const char * const ENV_IO_Q_SIZE = "UFO_IO_Q";
 const int DEFAULT_IO_Q_SIZE = 4;
 
+// max number of compression/writer threads of the async io queue
+const char * const ENV_IO_WORKERS = "UFO_IO_WORKERS";
+const int DEFAULT_IO_WORKERS = 4;
+
 const char* const ENV_TRACE_FUNC = "UFO_CALL"; // 1
 
 const char * const ENV_NO_VALUE = "UFO_NO_VALUE";
@@ -64,17 +67,82 @@ const char* const ENV_PRINT_STAT = "UFO_STAT";
 
 const char* const ENV_PTR_PROP = "UFO_PTR_PROP"; // 0
 
+// order events with per-thread hybrid clocks instead of the global counter, see tlclock.h
+const char* const ENV_TL_CLOCK = "UFO_TL_CLOCK"; // 0
+
+// delta/varint encoding of frequent events, see ufo_interface.h
+const char* const ENV_COMPACT = "UFO_COMPACT"; // 0
+
+// with UFO_COMPACT, write pc as per-block dictionary ids
+const char* const ENV_PC_DICT = "UFO_PC_DICT"; // 1
+
+// trace writer backend, see io_writer.h. 0: buffered write(), 1: O_DIRECT
+const char* const ENV_WRITER = "UFO_WRITER"; // 0
+
+// fsync policy. -1: every flush, 0: never, 1: at thread end, N > 1: every N MB
+const char* const ENV_SYNC = "UFO_SYNC";
+
+// analyze blocks in the io workers (use-after-free matching) instead of writing trace files
+const char* const ENV_ONLINE = "UFO_ONLINE"; // 0
+
+// only trace accesses that may hit a heap chunk, see heap_map.h
+const char* const ENV_HEAP_ONLY = "UFO_HEAP_ONLY"; // 0
+
+// trace the first read and write of an address (per size) between two sync events of a thread
+const char* const ENV_DEDUP = "UFO_DEDUP"; // 0
+
+// trace atomic operations with memory_order_relaxed
+const char* const ENV_ATOMIC_RELAXED = "UFO_ATOMIC_RELAXED"; // 1
+
+// tsan skips its sync vars, vector clocks and heap block meta map, see lite_mode in ufo_interface.h
+const char* const ENV_LITE = "UFO_LITE"; // 0
+
+// flight recorder: per-thread ring of N MB, written only when dumped, see flight_recorder.h
+const char* const ENV_RING = "UFO_RING"; // 0
+// signal dumping the rings, 0: none
+const char* const ENV_RING_SIGNAL = "UFO_RING_SIGNAL";
+const int DEFAULT_RING_SIGNAL = 12; // SIGUSR2
+
+// region of interest: start with tracing disabled, until __ufo_enable()
+const char* const ENV_ROI = "UFO_ROI"; // 0
+
+// the program is built with -mllvm -ufo-inline-acc, see InlineBuf in tlbuffer.h
+const char* const ENV_INLINE_ACC = "UFO_INLINE_ACC"; // 0
+
+// burst sampling of memory accesses per pc, see sampler.h
+const char* const ENV_SAMPLE = "UFO_SAMPLE"; // 0
+const char* const ENV_SAMPLE_BURST = "UFO_SAMPLE_BURST";
+const int DEFAULT_SAMPLE_BURST = 10;
+const char* const ENV_SAMPLE_DECAY = "UFO_SAMPLE_DECAY";
+const int DEFAULT_SAMPLE_DECAY = 10;
+// lowest sampling rate of a hot pc: 1 / UFO_SAMPLE_MIN
+const char* const ENV_SAMPLE_MIN = "UFO_SAMPLE_MIN";
+const int DEFAULT_SAMPLE_MIN = 1000;
+#ifdef SYNC_AT_FLUSH
+const int DEFAULT_SYNC = -1;
+#else
+const int DEFAULT_SYNC = 1;
+#endif
+
 const unsigned int DIR_MAX_LEN = 255;
 
 const char* const NAME_MODULE_INFO = "/_module_info.txt";
 const char* const NAME_STAT_FILE = "/_statistics.txt";
 const char* const NAME_STAT_CSV = "/_statistics.csv";
+// UFO_STAT: memory governor summary and decisions
+const char* const NAME_MEM_STAT = "/_memory.txt";
+// UFO_RING, followed by the number of the dump
+const char* const NAME_DUMP_DIR = "/dump_";
+const char* const NAME_FATAL_DIR = "/dump_fatal";
 
 /**
- * dev stopped
- * memory threshold:
+ * memory threshold of all trace buffers (tl buffers, io queue, compression buffers), in MB:
  * if threshold 1 is exceeded, reduce current tl buffer size by 2;
- * if threshold 2 is exceeded, reduce current tl buffer size by 4.
+ * if threshold 2 (the budget) is exceeded, reduce current tl buffer size by 4.
+ * the size doubles again (up to UFO_TL_BUF) when usage drops below half of threshold 1.
+ * buffers are resized at flush, larger buffers are flushed early, see UFOContext::mem_acquired.
+ * one shrink at a time: the next waits until a buffer is resized to the current size.
+ * with UFO_STAT the decisions are written to NAME_MEM_STAT.
  */
 const char * const ENV_UFO_MEM_T1 = "UFO_MEM_T1";
 const char * const ENV_UFO_MEM_T2 = "UFO_MEM_T2";
@@ -82,6 +150,6 @@ const char * const ENV_UFO_MEM_T2 = "UFO_MEM_T2";
 const unsigned long DEFAULT_MEM_THRESHOLD_1 = 128ul * 80; // 10G
 const unsigned long DEFAULT_MEM_THRESHOLD_2 = 128ul * 120; // 15G
 
-const unsigned long MIN_BUF_SZ = 32 * 1024 * 1024;
+const unsigned long MIN_BUF_SZ = 1024 * 1024;
 
 #endif //UFO_DEFS_H
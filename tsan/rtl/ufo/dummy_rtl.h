@@ -28,6 +28,8 @@ void nop_cond_wait(__tsan::ThreadState* thr, uptr pc, u64 addr_cond, u64 addr_mt
 void nop_cond_signal(__tsan::ThreadState* thr, uptr pc, u64 addr_cond){}
 void nop_cond_broadcast(__tsan::ThreadState* thr, uptr pc, u64 addr_cond){}
 
+void nop_atomic(__tsan::ThreadState *thr, uptr pc, uptr addr, int size_log, u8 op, u8 mo) {}
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -0,0 +1,474 @@
+//
+// Created by xkommando on 4/26/17.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+#include "../../../sanitizer_common/sanitizer_posix.h"
+
+#include "../tsan_mman.h"
+#include "../tsan_rtl.h"
+
+#include "defs.h"
+#include "ufo_interface.h"
+#include "ufo.h"
+#include "io_writer.h"
+#include "flight_recorder.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::Printf;
+using __sanitizer::atomic_load_relaxed;
+using __sanitizer::atomic_store_relaxed;
+using __sanitizer::memory_order_relaxed;
+using __sanitizer::uptr;
+
+extern UFOContext *uctx;
+
+// watcher thread: how often the dump signal is checked
+static const int RING_POLL_MS = 100;
+static const int FATAL_SIGNALS[] = {SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL};
+static const u32 N_FATAL_SIGNALS = sizeof(FATAL_SIGNALS) / sizeof(int);
+// live chunks written by a fatal dump
+static const u64 FATAL_MAX_LIVE = 1 << 20;
+
+void LiveHeap::init() {
+  live_ = (LiveChunk **) __sanitizer::MmapOrDie((1 << LIVE_BITS) * sizeof(LiveChunk *), "UFO ring live chunks");
+  for (u32 i = 0; i < N_SHARDS; ++i) {
+    shards_[i].mtx.Init();
+    shards_[i].free = nullptr;
+    shards_[i].slabs = nullptr;
+  }
+  atomic_store_relaxed(&n_live_, 0);
+}
+
+void LiveHeap::destroy() {
+  for (u32 i = 0; i < N_SHARDS; ++i) {
+    while (shards_[i].slabs != nullptr) {
+      LiveChunk *next = shards_[i].slabs->next;
+      __tsan::internal_free(shards_[i].slabs);
+      shards_[i].slabs = next;
+    }
+  }
+  __sanitizer::UnmapOrDie(live_, (1 << LIVE_BITS) * sizeof(LiveChunk *));
+  live_ = nullptr;
+}
+
+LiveChunk *LiveHeap::new_live(Shard &sh) {
+  if (sh.free == nullptr) {
+    LiveChunk *slab = (LiveChunk *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, SLAB_SIZE * sizeof(LiveChunk));
+    slab->next = sh.slabs;
+    sh.slabs = slab;
+    for (u32 i = 1; i < SLAB_SIZE; ++i) {
+      slab[i].next = sh.free;
+      sh.free = slab + i;
+    }
+  }
+  LiveChunk *c = sh.free;
+  sh.free = c->next;
+  return c;
+}
+
+void LiveHeap::on_alloc(u32 uid, u64 idx, u64 addr, u64 pc, u32 size) {
+  u32 h = hash(addr);
+  Shard &sh = shards_[h & (N_SHARDS - 1)];
+  __sanitizer::SpinMutexLock l(&sh.mtx);
+  LiveChunk *c = nullptr;
+  for (LiveChunk *p = live_[h]; p != nullptr; p = p->next) {
+    if (p->addr == addr) {
+      c = p;
+      break;
+    }
+  }
+  if (c == nullptr) {
+    c = new_live(sh);
+    c->next = live_[h];
+    live_[h] = c;
+    __sanitizer::atomic_fetch_add(&n_live_, 1, memory_order_relaxed);
+  }
+  c->addr = addr;
+  c->alloc_idx = idx;
+  c->alloc_pc = pc;
+  c->size = size;
+  c->alloc_tid = uid;
+}
+
+void LiveHeap::on_dealloc(u64 addr) {
+  u32 h = hash(addr);
+  Shard &sh = shards_[h & (N_SHARDS - 1)];
+  __sanitizer::SpinMutexLock l(&sh.mtx);
+  for (LiveChunk **pp = live_ + h; *pp != nullptr; pp = &(*pp)->next) {
+    LiveChunk *c = *pp;
+    if (c->addr != addr)
+      continue;
+    *pp = c->next;
+    c->next = sh.free;
+    sh.free = c;
+    __sanitizer::atomic_fetch_sub(&n_live_, 1, memory_order_relaxed);
+    return;
+  }
+  // allocated before tracing
+}
+
+static bool _by_thread(const LiveChunk &a, const LiveChunk &b) {
+  return a.alloc_tid < b.alloc_tid || (a.alloc_tid == b.alloc_tid && a.alloc_idx < b.alloc_idx);
+}
+
+u64 LiveHeap::collect(LiveChunk *out, u64 max, bool wait) {
+  u64 n = 0;
+  for (u32 s = 0; s < N_SHARDS; ++s) {
+    if (wait) {
+      shards_[s].mtx.Lock();
+    } else if (!shards_[s].mtx.TryLock()) {
+      // held by a thread stopped in on_alloc/on_dealloc, maybe the faulting one
+      continue;
+    }
+    for (u32 h = s; h < (1u << LIVE_BITS) && n < max; h += N_SHARDS) {
+      for (LiveChunk *c = live_[h]; c != nullptr && n < max; c = c->next) {
+        out[n++] = *c;
+      }
+    }
+    shards_[s].mtx.Unlock();
+  }
+  __sanitizer::InternalSort(&out, n, _by_thread);
+  return n;
+}
+
+static Byte *_put_varint(Byte *p, u64 v) {
+  while (v >= 0x80) {
+    *p++ = (Byte) (v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (Byte) v;
+  return p;
+}
+
+static u64 _zigzag(u64 cur, u64 pred) {
+  s64 d = (s64) (cur - pred);
+  return (u64) ((d << 1) ^ (d >> 63));
+}
+
+// AllocEvents of allocs[0, n) in the encoding of the trace, one block, see TLBuffer::put_event(const AllocEvent &).
+// returns the length of the block
+static u64 _encode_allocs(const LiveChunk *allocs, u64 n, Byte *out, BlockSummary *sum) {
+  const bool compact = (uctx->encoding & EncodingCompact) != 0;
+  const bool pc_dict = (uctx->encoding & EncodingPcDict) != 0;
+  sum->reset();
+  u64 pred_idx = 0;
+  u64 pred_addr = 0;
+  u64 pred_pc = 0;
+  Byte *p = out;
+  for (u64 i = 0; i < n; ++i) {
+    AllocEvent e(allocs[i].alloc_idx, allocs[i].addr, allocs[i].alloc_pc, allocs[i].size);
+    if (!compact) {
+      __sanitizer::internal_memcpy(p, &e, sizeof(AllocEvent));
+      p += sizeof(AllocEvent);
+    } else {
+      if (pc_dict) {
+        // id 0 is bound again before every event
+        PcDefEvent def(0, e.pc);
+        __sanitizer::internal_memcpy(p, &def, sizeof(PcDefEvent));
+        p += sizeof(PcDefEvent);
+      }
+      *p++ = e.type_index;
+      p = _put_varint(p, e.idx - pred_idx);
+      p = _put_varint(p, _zigzag(e.addr, pred_addr));
+      if (pc_dict) {
+        p = _put_varint(p, 0);
+      } else {
+        p = _put_varint(p, _zigzag(e.pc, pred_pc));
+        pred_pc = e.pc;
+      }
+      pred_idx = e.idx;
+      pred_addr = e.addr;
+      u32 size = e.size;
+      __sanitizer::internal_memcpy(p, &size, 4);
+      p += 4;
+    }
+    if (e.idx < sum->min_idx)
+      sum->min_idx = e.idx;
+    if (e.idx > sum->max_idx)
+      sum->max_idx = e.idx;
+    if (e.addr < sum->min_addr)
+      sum->min_addr = e.addr;
+    if (e.addr + e.size > sum->max_addr)
+      sum->max_addr = e.addr + e.size;
+    sum->n_alloc++;
+  }
+  return (u64) (p - out);
+}
+
+static void _write_allocs(int fd, const LiveChunk *allocs, u64 n, Byte *out) {
+  for (u64 b = 0; b < n; b += DUMP_ALLOCS_PER_BLOCK) {
+    u64 end = b + DUMP_ALLOCS_PER_BLOCK < n ? b + DUMP_ALLOCS_PER_BLOCK : n;
+    BlockSummary sum;
+    u64 len = _encode_allocs(allocs + b, end - b, out, &sum);
+    write_file(fd, out, len, sum);
+  }
+}
+
+// the live chunks allocated before the ring (allocs are ordered by idx), their AllocEvents left it
+static u64 _before_ring(const RingSnapshot &snap, const LiveChunk *allocs, u64 n_allocs) {
+  u64 ring_start = ~0ull;
+  for (u32 i = 0; i < snap.n_segs; ++i) {
+    if (snap.sum[i].min_idx < ring_start)
+      ring_start = snap.sum[i].min_idx;
+  }
+  while (n_allocs > 0 && allocs[n_allocs - 1].alloc_idx >= ring_start)
+    n_allocs--;
+  return n_allocs;
+}
+
+void dump_thread(const char *dir, u32 uid, const TLBuffer *buf, const LiveChunk *allocs, u64 n_allocs,
+                 Byte *ring_copy, Byte *alloc_buf) {
+  RingSnapshot snap;
+  snap.n_segs = 0;
+  if (buf != nullptr)
+    buf->copy_ring(ring_copy, &snap);
+  n_allocs = _before_ring(snap, allocs, n_allocs);
+  if (snap.n_segs == 0 && n_allocs == 0)
+    return;
+
+  char path[DIR_MAX_LEN + 16];
+  __sanitizer::internal_snprintf(path, sizeof(path), "%s/%u", dir, uid);
+  int fd = trace_open(path);
+  if (fd < 0) {
+    Printf("UFO>>> could not open dump file '%s'\r\n", path);
+    return;
+  }
+  UFOHeader header(uid, uctx->time_started, uctx->use_compression, uctx->clock_mode, uctx->encoding,
+                   uctx->sample_burst, uctx->sample_decay, uctx->sample_max_period);
+  trace_write(fd, &header, sizeof(UFOHeader));
+  _write_allocs(fd, allocs, n_allocs, alloc_buf);
+  u64 off = 0;
+  for (u32 i = 0; i < snap.n_segs; ++i) {
+    write_file(fd, ring_copy + off, snap.size[i], snap.sum[i]);
+    off += snap.size[i];
+  }
+  trace_write_index(fd);
+  trace_close(fd);
+}
+
+/**
+ * fatal dump, run by a signal handler or Die(), maybe on a thread stopped in malloc or holding a runtime lock:
+ * nothing is allocated, no lock is waited for and no libc function is called.
+ * the dir and the staging memory are prepared in advance (prepare_fatal_dump),
+ * the trace files are written with internal_write, not compressed and without index.
+ */
+struct FatalStage {
+  char dir[DIR_MAX_LEN + 16];
+  Byte *ring_copy;
+  Byte *alloc_buf;
+  LiveChunk *live;
+};
+static FatalStage fatal_;
+static __sanitizer::atomic_uint32_t fatal_dumped_;
+
+static void _write_all(int fd, const void *data, u64 len) {
+  const Byte *p = (const Byte *) data;
+  while (len > 0) {
+    uptr res = __sanitizer::internal_write(fd, p, len);
+    if (__sanitizer::internal_iserror(res))
+      return;
+    p += res;
+    len -= res;
+  }
+}
+
+// a block as written by write_file() without compression
+static void _write_raw_block(int fd, const Byte *data, u64 len) {
+  if (uctx->encoding & EncodingCompact) {
+    u32 block_len = (u32) len;
+    _write_all(fd, &block_len, 4);
+  }
+  _write_all(fd, data, len);
+}
+
+static void _dump_thread_fatal(u32 uid, const TLBuffer *buf, const LiveChunk *allocs, u64 n_allocs) {
+  RingSnapshot snap;
+  snap.n_segs = 0;
+  if (buf != nullptr)
+    buf->copy_ring(fatal_.ring_copy, &snap);
+  n_allocs = _before_ring(snap, allocs, n_allocs);
+  if (snap.n_segs == 0 && n_allocs == 0)
+    return;
+
+  char path[DIR_MAX_LEN + 32];
+  __sanitizer::internal_snprintf(path, sizeof(path), "%s/%u", fatal_.dir, uid);
+  uptr fd = __sanitizer::internal_open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if (__sanitizer::internal_iserror(fd))
+    return;
+  UFOHeader header(uid, uctx->time_started, 0, uctx->clock_mode, uctx->encoding,
+                   uctx->sample_burst, uctx->sample_decay, uctx->sample_max_period);
+  _write_all((int) fd, &header, sizeof(UFOHeader));
+  for (u64 b = 0; b < n_allocs; b += DUMP_ALLOCS_PER_BLOCK) {
+    u64 end = b + DUMP_ALLOCS_PER_BLOCK < n_allocs ? b + DUMP_ALLOCS_PER_BLOCK : n_allocs;
+    BlockSummary sum;
+    u64 len = _encode_allocs(allocs + b, end - b, fatal_.alloc_buf, &sum);
+    _write_raw_block((int) fd, fatal_.alloc_buf, len);
+  }
+  u64 off = 0;
+  for (u32 i = 0; i < snap.n_segs; ++i) {
+    _write_raw_block((int) fd, fatal_.ring_copy + off, snap.size[i]);
+    off += snap.size[i];
+  }
+  __sanitizer::internal_close(fd);
+}
+
+void prepare_fatal_dump(const char *trace_dir) {
+  if (fatal_.ring_copy == nullptr) {
+    // pages are touched only by a dump
+    fatal_.ring_copy = (Byte *) __sanitizer::MmapOrDie(uctx->ring_size, "UFO fatal dump");
+    fatal_.alloc_buf = (Byte *) __sanitizer::MmapOrDie(DUMP_ALLOC_BUF, "UFO fatal dump");
+    fatal_.live = (LiveChunk *) __sanitizer::MmapOrDie(FATAL_MAX_LIVE * sizeof(LiveChunk), "UFO fatal dump");
+  }
+  __sanitizer::internal_snprintf(fatal_.dir, sizeof(fatal_.dir), "%s%s", trace_dir, NAME_FATAL_DIR);
+  // trace_dir was just emptied
+  if (0 != mkdir(fatal_.dir, 0700) && errno != EEXIST) {
+    Printf("UFO>>> could not create '%s', no dump on fatal errors\r\n", fatal_.dir);
+    fatal_.dir[0] = '\0';
+  }
+  atomic_store_relaxed(&fatal_dumped_, 0);
+}
+
+static void release_fatal_dump() {
+  if (fatal_.ring_copy == nullptr)
+    return;
+  __sanitizer::UnmapOrDie(fatal_.ring_copy, uctx->ring_size);
+  __sanitizer::UnmapOrDie(fatal_.alloc_buf, DUMP_ALLOC_BUF);
+  __sanitizer::UnmapOrDie(fatal_.live, FATAL_MAX_LIVE * sizeof(LiveChunk));
+  fatal_.ring_copy = nullptr;
+}
+
+void dump_fatal() {
+  if (uctx == nullptr || uctx->threads == nullptr || fatal_.ring_copy == nullptr || fatal_.dir[0] == '\0')
+    return;
+  // once, a fault in the dump is not dumped again
+  if (__sanitizer::atomic_exchange(&fatal_dumped_, 1, memory_order_relaxed))
+    return;
+  // the rings of ended threads are not freed meanwhile, unless a dump or a free is in progress
+  bool locked = uctx->ring_mtx.TryLock();
+  // nor the chunks of ended threads, see ThreadTable::end
+  bool slots_locked = uctx->threads->mtx_.TryLock();
+  // ordered by uid, shards locked by stopped threads are skipped
+  u64 n_live = uctx->live_heap->collect(fatal_.live, FATAL_MAX_LIVE, false);
+  const u32 n_uids = uctx->threads->n_uids();
+  u64 i = 0;
+  for (u32 uid = 0; uid < n_uids; ++uid) {
+    u64 end = i;
+    while (end < n_live && fatal_.live[end].alloc_tid == uid)
+      end++;
+    ThreadSlot *slot = uctx->threads->get(uid);
+    _dump_thread_fatal(uid, slot != nullptr ? &slot->buf : nullptr, fatal_.live + i, end - i);
+    i = end;
+  }
+  if (slots_locked)
+    uctx->threads->mtx_.Unlock();
+  if (locked)
+    uctx->ring_mtx.Unlock();
+  static const char msg[] = "UFO>>> flight recorder: fatal error, rings dumped to ";
+  _write_all(2, msg, sizeof(msg) - 1);
+  _write_all(2, fatal_.dir, __sanitizer::internal_strlen(fatal_.dir));
+  _write_all(2, "\r\n", 2);
+}
+
+static __sanitizer::atomic_uint32_t dump_requested_;
+static __sanitizer::atomic_uint32_t watching_;
+static pthread_t watcher_;
+static int dump_signal_;
+static struct sigaction old_fatal_[N_FATAL_SIGNALS];
+static struct sigaction old_dump_;
+
+// async: the dump is done by the watcher thread
+static void on_dump_signal(int signum, void *info, void *ctx) {
+  atomic_store_relaxed(&dump_requested_, 1);
+}
+
+// dump, then chain to the previous action of signum
+static void on_fatal_signal(int signum, void *info, void *ctx) {
+  dump_fatal();
+  struct sigaction *old = nullptr;
+  for (u32 i = 0; i < N_FATAL_SIGNALS; ++i) {
+    if (FATAL_SIGNALS[i] == signum)
+      old = old_fatal_ + i;
+  }
+  __sanitizer::internal_sigaction(signum, old, nullptr);
+  if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+    if (old->sa_flags & SA_SIGINFO)
+      old->sa_sigaction(signum, (siginfo_t *) info, ctx);
+    else
+      old->sa_handler(signum);
+    return;
+  }
+  // default action: a fault is raised again when the handler returns, a signal sent by kill() is not
+  syscall(SYS_kill, __sanitizer::internal_getpid(), signum);
+}
+
+static void on_die() {
+  dump_fatal();
+}
+
+static void _install(int signum, void (*handler)(int, void *, void *), int flags, struct sigaction *old) {
+  struct sigaction sigact;
+  __sanitizer::internal_memset(&sigact, 0, sizeof(sigact));
+  sigact.sa_sigaction = (void (*)(int, siginfo_t *, void *)) handler;
+  sigact.sa_flags = SA_SIGINFO | flags;
+  if (0 != __sanitizer::internal_sigaction(signum, &sigact, old)) {
+    Printf("UFO>>> could not handle signal %d\r\n", signum);
+  }
+}
+
+static void *watch_loop(void *p) {
+  while (atomic_load_relaxed(&watching_)) {
+    if (__sanitizer::atomic_exchange(&dump_requested_, 0, memory_order_relaxed))
+      uctx->dump_ring();
+    __sanitizer::SleepForMillis(RING_POLL_MS);
+  }
+  return nullptr;
+}
+
+static void start_watcher() {
+  atomic_store_relaxed(&dump_requested_, 0);
+  atomic_store_relaxed(&watching_, 1);
+  __sanitizer::real_pthread_create(&watcher_, NULL, watch_loop, NULL);
+}
+
+void start_recorder(int signum) {
+  for (u32 i = 0; i < N_FATAL_SIGNALS; ++i) {
+    _install(FATAL_SIGNALS[i], on_fatal_signal, SA_NODEFER | SA_ONSTACK, old_fatal_ + i);
+  }
+  __sanitizer::AddDieCallback(on_die);
+  dump_signal_ = signum;
+  if (signum > 0) {
+    _install(signum, on_dump_signal, SA_RESTART, &old_dump_);
+    start_watcher();
+  }
+}
+
+void stop_recorder() {
+  if (dump_signal_ > 0) {
+    atomic_store_relaxed(&watching_, 0);
+    __sanitizer::real_pthread_join((void *) watcher_, NULL);
+    __sanitizer::internal_sigaction(dump_signal_, &old_dump_, nullptr);
+  }
+  for (u32 i = 0; i < N_FATAL_SIGNALS; ++i) {
+    __sanitizer::internal_sigaction(FATAL_SIGNALS[i], old_fatal_ + i, nullptr);
+  }
+  __sanitizer::RemoveDieCallback(on_die);
+  release_fatal_dump();
+}
+
+void recorder_after_fork() {
+  if (dump_signal_ > 0)
+    start_watcher();
+}
+
+} // ns ufo
+} // ns bw
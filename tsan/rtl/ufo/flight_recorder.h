@@ -0,0 +1,114 @@
+//
+// Created by xkommando on 4/26/17.
+//
+
+#ifndef UFO_FLIGHT_RECORDER_H
+#define UFO_FLIGHT_RECORDER_H
+
+#include "../../../sanitizer_common/sanitizer_atomic.h"
+#include "../../../sanitizer_common/sanitizer_mutex.h"
+#include "../tsan_defs.h"
+#include "defs.h"
+#include "tlbuffer.h"
+#include "online_matcher.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u32;
+using __sanitizer::u64;
+
+/**
+ * UFO_RING, flight recorder.
+ * the tl buffer of a thread is a ring of RING_SEGMENTS segments, each segment is one block of whole events.
+ * a full segment is kept, not flushed, and the oldest one is overwritten: nothing is written in steady state,
+ * a thread keeps between 3/4 and all of the last UFO_RING MB of its events.
+ *
+ * the rings are dumped to <trace dir>/dump_<n>, one trace file per thread, on a trigger:
+ * __ufo_dump() or the UFO_RING_SIGNAL signal (handled by a watcher thread).
+ * on a fatal error (SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL or Die()) they are dumped to <trace dir>/dump_fatal
+ * by the handler itself, see dump_fatal(), then the previous handler of the signal is run.
+ * threads keep tracing during the dump, a segment overwritten while it is copied is dropped.
+ *
+ * the AllocEvent of a chunk leaves the ring long before the chunk is freed,
+ * so the allocations of live chunks are retained in a LiveHeap.
+ * a dump writes the live chunks allocated by a thread before its ring in the first blocks of its trace,
+ * the accesses of the window can be matched against their chunks.
+ * the ring of an ended thread is dropped, the live chunks it allocated are not.
+ */
+struct LiveHeap {
+  static const u32 LIVE_BITS = 20;
+  static const u32 SHARD_BITS = 6;
+  static const u32 N_SHARDS = 1 << SHARD_BITS;
+  static const u32 SLAB_SIZE = 4096;
+
+  // the buckets with (hash & (N_SHARDS - 1)) == shard
+  struct Shard {
+    __sanitizer::StaticSpinMutex mtx;
+    LiveChunk *free;
+    // slabs of LiveChunk, linked by their first node
+    LiveChunk *slabs;
+  };
+
+  LiveChunk **live_;
+  Shard shards_[N_SHARDS];
+  __sanitizer::atomic_uint64_t n_live_;
+
+  void init();
+
+  void destroy();
+
+  // a chunk still at addr (its free was not traced) is replaced
+  void on_alloc(u32 uid, u64 idx, u64 addr, u64 pc, u32 size);
+
+  void on_dealloc(u64 addr);
+
+  ALWAYS_INLINE
+  u64 n_live() const {
+    return __sanitizer::atomic_load_relaxed(&n_live_);
+  }
+
+  // copy at most max live chunks to out, ordered by uid (alloc_tid) then idx, returns the number copied.
+  // !wait: the shards locked by another thread are skipped
+  u64 collect(LiveChunk *out, u64 max, bool wait = true);
+
+private:
+  ALWAYS_INLINE
+  static u32 hash(u64 addr) {
+    return (u32) ((addr * 0x9E3779B97F4A7C15ull) >> (64 - LIVE_BITS));
+  }
+
+  // shard lock held
+  LiveChunk *new_live(Shard &sh);
+};
+
+// live chunks per block in a dump
+const u32 DUMP_ALLOCS_PER_BLOCK = 4096;
+const u32 DUMP_ALLOC_BUF = DUMP_ALLOCS_PER_BLOCK * (MAX_PC_DEF_LEN + MAX_COMPACT_LEN);
+
+/**
+ * write the trace of thread uid to dir/uid: the live chunks it allocated before its ring, then its ring.
+ * allocs: the live chunks allocated by uid, ordered by idx. buf is null if the thread ended.
+ * ring_copy: ring size, alloc_buf: DUMP_ALLOC_BUF bytes
+ */
+void dump_thread(const char *dir, u32 uid, const TLBuffer *buf, const LiveChunk *allocs, u64 n_allocs,
+                 Byte *ring_copy, Byte *alloc_buf);
+
+// install the handlers of the fatal signals and of signum (0: none), start the watcher thread
+void start_recorder(int signum);
+
+// create <trace_dir>/dump_fatal and map the staging memory of dump_fatal(), again after fork and rotation
+void prepare_fatal_dump(const char *trace_dir);
+
+// async signal safe: no allocation, no blocking lock, no libc. once per process
+void dump_fatal();
+
+void stop_recorder();
+
+// executed by the child process, the watcher thread is not forked
+void recorder_after_fork();
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_FLIGHT_RECORDER_H
@@ -0,0 +1,37 @@
+//
+// Created by xkommando on 4/11/17.
+//
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+#include "../../../sanitizer_common/sanitizer_mutex.h"
+
+#include "heap_map.h"
+
+namespace bw {
+namespace ufo {
+
+u64 *heap_bits;
+
+static __sanitizer::StaticSpinMutex heap_map_mtx;
+
+void heap_map_add(uptr p, uptr size) {
+  if (size == 0 || p - __tsan::HeapMemBeg() < __tsan::HeapMemEnd() - __tsan::HeapMemBeg())
+    return;
+  if (p >= HEAP_MAP_LIMIT)
+    return;
+  uptr end = p + size;
+  if (end > HEAP_MAP_LIMIT)
+    end = HEAP_MAP_LIMIT;
+
+  // may be called before UFO is initialized, by the allocator of any thread
+  __sanitizer::SpinMutexLock l(&heap_map_mtx);
+  if (heap_bits == nullptr) {
+    heap_bits = (u64 *) __sanitizer::MmapNoReserveOrDie(HEAP_MAP_WORDS * sizeof(u64), "UFO heap map");
+  }
+  for (uptr g = p >> HEAP_GRANULE_BITS; g <= (end - 1) >> HEAP_GRANULE_BITS; ++g) {
+    heap_bits[g >> 6] |= 1ull << (g & 63);
+  }
+}
+
+} // ns ufo
+} // ns bw
@@ -0,0 +1,56 @@
+//
+// Created by xkommando on 4/11/17.
+//
+
+#ifndef UFO_HEAP_MAP_H
+#define UFO_HEAP_MAP_H
+
+#include "../../../sanitizer_common/sanitizer_internal_defs.h"
+#include "../tsan_platform.h"
+#include "defs.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u64;
+using __sanitizer::uptr;
+
+// one bit per granule of the address space below HEAP_MAP_LIMIT
+const uptr HEAP_GRANULE_BITS = 20; // 1MB
+const uptr HEAP_MAP_LIMIT = 1ull << 47;
+const uptr HEAP_MAP_WORDS = (HEAP_MAP_LIMIT >> HEAP_GRANULE_BITS) / 64;
+
+/**
+ * UFO_HEAP_ONLY: memory that may hold a chunk of the TSan user allocator.
+ * chunks of the primary allocator are in [HeapMemBeg, HeapMemEnd).
+ * large chunks are mmaped anywhere, their granules are set by heap_map_add when mapped, never cleared:
+ * a freed chunk is still a use-after-free target. a granule can hold other data, never the opposite.
+ *
+ * the bitmap is reserved (16MB) at the first large chunk, pages are touched only for the granules used.
+ */
+extern u64 *heap_bits;
+
+// called by the tsan allocator for every mapping of user memory, see tsan_mman.cc
+void heap_map_add(uptr p, uptr size);
+
+ALWAYS_INLINE
+bool may_be_heap(uptr addr) {
+  if (addr - __tsan::HeapMemBeg() < __tsan::HeapMemEnd() - __tsan::HeapMemBeg())
+    return true;
+  u64 *bits = heap_bits;
+  if (bits == nullptr || addr >= HEAP_MAP_LIMIT)
+    return false;
+  uptr g = addr >> HEAP_GRANULE_BITS;
+  return (bits[g >> 6] >> (g & 63)) & 1;
+}
+
+// [addr, addr + size) meets the heap
+ALWAYS_INLINE
+bool may_be_heap_range(uptr addr, uptr size) {
+  return may_be_heap(addr) || (size > 0 && may_be_heap(addr + size - 1));
+}
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_HEAP_MAP_H
@@ -6,280 +6,182 @@
 #error "error: must be included by rtl_impl.h"
 #endif
 
-#ifdef STAT_ON
-
-#define __MC_STAT \
-if (is_write) {\
-    uctx->stat[tid].c_write[kAccessSizeLog]++;\
-  } else {\
-    uctx->stat[tid].c_read[kAccessSizeLog]++;\
-  }\
+/**
+ * configuration of the memory access handlers.
+ * every combination is instantiated, UFOContext::start_trace() installs the one of the current configuration,
+ * so that the hot path has no test on the configuration.
+ */
+enum AccFlag {
+  AccValue = 1, // record the value read or written, not UFO_NO_VALUE
+  AccNoStack = 2, // UFO_NO_STACK
+  AccHeapOnly = 4, // UFO_HEAP_ONLY
+  AccDedup = 8, // UFO_DEDUP, mem acc only
+  AccSample = 16, // UFO_SAMPLE
+  AccStat = 32, // UFO_STAT
+  AccThreadOff = 64 // a thread called __ufo_disable_thread(), see UFOContext::set_thread_enabled
+};
+const u32 N_ACC_CONFIG = 128;
+const u32 RANGE_ACC_FLAGS = AccNoStack | AccHeapOnly | AccSample | AccStat | AccThreadOff;
 
+#ifdef STAT_ON
+#define ACC_STAT(field) \
+  if (kFlags & AccStat) \
+    slot->stat.field++;
 #else
-
-#define __MC_STAT
-
+#define ACC_STAT(field)
 #endif
 
+template <u32 kFlags>
 __HOT_CODE
-void impl_mem_acc(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
-  if (is_write) {
-    DPrintf("UFO>>> #%d write %d bytes to %llu  val:%llu   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
-  } else {
-    DPrintf("UFO>>> #%d read %d bytes from %llu val:%llu   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
+void tpl_mem_acc(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
+  ThreadSlot *slot = uctx->threads->of(thr->tid);
+  if (UNLIKELY(slot == nullptr))
+    return;
+  TLBuffer &buf = slot->buf;
+  if (kFlags & AccThreadOff) {
+    if (buf.acc_off_)
+      return;
+  }
+  if (kFlags & AccNoStack) {
+    s64 ofs = addr - buf.stack_bottom;
+    if (0 < ofs && ofs < buf.stack_height) {
+      ACC_STAT(cs_acc)
+      DPrintf(" skipped stack\r\n");
+      return;
+    }
+    ofs = addr - buf.tls_bottom;
+    if (0 < ofs && ofs < buf.tls_height) {
+      ACC_STAT(cs_acc)
+      DPrintf(" skipped tls\r\n");
+      return;
+    }
+  }
+  if (kFlags & AccHeapOnly) {
+    if (!may_be_heap(addr)) {
+      ACC_STAT(cs_non_heap)
+      return;
+    }
+  }
+  // filtered accesses do not count in the bursts
+  if (kFlags & AccSample) {
+    if (!buf.sampler_.sample(pc)) {
+      buf.sum_.n_skipped++;
+      ACC_STAT(cs_sampled)
+      return;
+    }
+  }
+  if (kFlags & AccDedup) {
+    if (!buf.dedup_first(addr, kAccessSizeLog, is_write)) {
+      ACC_STAT(c_dedup_hit)
+      return;
+    }
+    ACC_STAT(c_dedup_miss)
   }
-  int tid = thr->tid;
-  __MC_STAT
 
   u8 type_idx = EventType::MemRead;
   if (is_write) {
-    type_idx = EventType::MemWrite;
-  }
-
-  u8 sz = static_cast<u8>(kAccessSizeLog);
-  type_idx |= sz << 6;
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
-
-#ifndef BUF_EVENT_ON
-  int fd = uctx->tlbufs[tid].trace_fd_;
-  MemAccEvent _e(type_idx, _idx, (u64)addr, (u64)pc);
-  internal_write(fd, &_e, sizeof(MemAccEvent));
-  const int acc_len = 1 << kAccessSizeLog;
-  internal_write(fd, addr, acc_len)
-#else
-  auto &buf = uctx->tlbufs[tid];
-  const int acc_len = 1 << kAccessSizeLog;
-//  if (UNLIKELY(buf.buf_ == nullptr)) {
-//    buf.open_buf();
-//    buf.open_file(tid);
-//  } else if (UNLIKELY(buf.size_ + sizeof(MemAccEvent) + acc_len >= buf.capacity_)) {
-//    buf.flush();
-//  }
-  buf.put_event(MemAccEvent(type_idx, _idx, (u64)addr, (u64)pc));
-  Byte *ptr = (Byte *) addr;
-  for (int i = 0; i < acc_len; ++i) {
-    *(buf.buf_ + buf.size_ + i) = *(ptr + i);
-  }
-  buf.size_ += acc_len;
-#endif
-}
-
-// no value
-__HOT_CODE
-void impl_mem_acc_nv(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
-  if (is_write) {
+    ACC_STAT(c_write[kAccessSizeLog])
     DPrintf("UFO>>> #%d write %d bytes to %llu  val:%llu   pc:%p\r\n",
             thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
-  } else {
-    DPrintf("UFO>>> #%d read %d bytes from %llu val:%llu   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
-  }
-
-  int tid = thr->tid;
-  __MC_STAT
-
-  u8 type_idx = EventType::MemRead;
-  if (is_write) {
     type_idx = EventType::MemWrite;
-  }
-
-  u8 sz = static_cast<u8>(kAccessSizeLog);
-  type_idx |= sz << 6;
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
-
-#ifndef BUF_EVENT_ON
-  int fd = uctx->tlbufs[tid].trace_fd_;
-  MemAccEvent _e(type_idx, _idx, (u64)addr, (u64)pc);
-  internal_write(fd, &_e, sizeof(MemAccEvent));
-  return;
-#else
-  auto &buf = uctx->tlbufs[tid];
-//  if (UNLIKELY(buf.buf_ == nullptr)) {
-//    buf.open_buf();
-//    buf.open_file(tid);
-//  } else if (UNLIKELY(buf.size_ + sizeof(MemAccEvent) >= buf.capacity_)) {
-//    buf.flush();
-//  }
-  buf.put_event(MemAccEvent(type_idx, _idx, (u64)addr, (u64)pc));
-  return;
-#endif
-}
-
-// skip stack acc
-__HOT_CODE
-void ns_mem_acc(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
-  int tid = thr->tid;
-  __MC_STAT
-  TLBuffer &buf = uctx->tlbufs[tid];
-  s64 ofs = addr - buf.stack_bottom;
-  if (0 < ofs && ofs < buf.stack_height) {
-    uctx->stat[tid].cs_acc++;
-    DPrintf(" skipped stack\r\n");
-    return;
-  }
-  ofs = addr - buf.tls_bottom;
-  if (0 < ofs && ofs < buf.tls_height) {
-    uctx->stat[tid].cs_acc++;
-    DPrintf(" skipped tls\r\n");
-    return;
-  }
-
-  if (is_write) {
-    DPrintf("UFO>>> #%d write %d bytes to %llu  val:%u   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
   } else {
-    DPrintf("UFO>>> #%d read %d bytes from %llu val:%u   pc:%p\r\n",
+    ACC_STAT(c_read[kAccessSizeLog])
+    DPrintf("UFO>>> #%d read %d bytes from %llu val:%llu   pc:%p\r\n",
             thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
   }
 
-  u8 type_idx = EventType::MemRead;
-  if (is_write) {
-    type_idx = EventType::MemWrite;
-  }
-
   u8 sz = static_cast<u8>(kAccessSizeLog);
   type_idx |= sz << 6;
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
+  u64 _idx = _next_idx(buf);
 
-#ifndef BUF_EVENT_ON
-  int fd = uctx->tlbufs[tid].trace_fd_;
-  MemAccEvent _e(type_idx, _idx, (u64)addr, (u64)pc);
-  internal_write(fd, &_e, sizeof(MemAccEvent));
-  const int acc_len = 1 << kAccessSizeLog;
-  internal_write(fd, addr, acc_len);
-#else
-  const int acc_len = 1 << kAccessSizeLog;
-//  if (UNLIKELY(buf.buf_ == nullptr)) {
-//    buf.open_buf();
-//    buf.open_file(tid);
-//  } else if (UNLIKELY(buf.size_ + sizeof(MemAccEvent) + acc_len >= buf.capacity_)) {
-//    buf.flush();
-//  }
   buf.put_event(MemAccEvent(type_idx, _idx, (u64)addr, (u64)pc));
-  Byte *ptr = (Byte *) addr;
-  for (int i = 0; i < acc_len; ++i) {
-    *(buf.buf_ + buf.size_ + i) = *(ptr + i);
+  if (kFlags & AccValue) {
+    // room for the value is reserved by put_event
+    const int acc_len = 1 << kAccessSizeLog;
+    Byte *ptr = (Byte *) addr;
+    for (int i = 0; i < acc_len; ++i) {
+      *(buf.buf_ + buf.size_ + i) = *(ptr + i);
+    }
+    buf.size_ += acc_len;
   }
-  buf.size_ += acc_len;
-#endif
 }
 
-
-// skip stack acc, no value
+template <u32 kFlags>
 __HOT_CODE
-void ns_mem_acc_nv(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
-
-  int tid = thr->tid;
-  __MC_STAT
-  TLBuffer &buf = uctx->tlbufs[tid];
-  s64 ofs = addr - buf.stack_bottom;
-  if (0 < ofs && ofs < buf.stack_height) {
-    uctx->stat[tid].cs_acc++;
-    DPrintf(" skipped stack\r\n");
-    return;
-  }
-  ofs = addr - buf.tls_bottom;
-  if (0 < ofs && ofs < buf.tls_height) {
-    uctx->stat[tid].cs_acc++;
-    DPrintf(" skipped tls\r\n");
+void tpl_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write) {
+  ThreadSlot *slot = uctx->threads->of(thr->tid);
+  if (UNLIKELY(slot == nullptr))
     return;
+  TLBuffer &buf = slot->buf;
+  if (kFlags & AccThreadOff) {
+    if (buf.acc_off_)
+      return;
+  }
+  if (kFlags & AccNoStack) {
+    if (buf.is_thrlocal(addr)) {
+      ACC_STAT(cs_range_acc)
+      return;
+    }
+  }
+  if (kFlags & AccHeapOnly) {
+    if (!may_be_heap_range(addr, size)) {
+      ACC_STAT(cs_non_heap)
+      return;
+    }
+  }
+  if (kFlags & AccSample) {
+    if (!buf.sampler_.sample(pc)) {
+      buf.sum_.n_skipped++;
+      ACC_STAT(cs_sampled)
+      return;
+    }
   }
 
+  u8 type_idx = EventType::MemRangeRead;
   if (is_write) {
-    DPrintf("UFO>>> #%d write %d bytes to %llu  val:%u   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
+    ACC_STAT(c_range_w)
+    DPrintf("UFO>>> #%d range write mem to %llu    len %d    pc:%p\r\n", thr->tid, addr, size, pc);
+    type_idx = EventType::MemRangeWrite;
   } else {
-    DPrintf("UFO>>> #%d read %d bytes from %llu val:%u   pc:%p\r\n",
-            thr->tid, (1 << kAccessSizeLog), addr, __read_addr(addr, kAccessSizeLog), pc);
-  }
-
-  u8 type_idx = EventType::MemRead;
-  if (is_write) {
-    type_idx = EventType::MemWrite;
+    ACC_STAT(c_range_r)
+    DPrintf("UFO>>> #%d range read mem from %llu    len %d    pc:%p\r\n", thr->tid, addr, size, pc);
   }
+  u64 _idx = _next_idx(buf);
 
-  u8 sz = static_cast<u8>(kAccessSizeLog);
-  type_idx |= sz << 6;
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
-
-#ifndef BUF_EVENT_ON
-  int fd = uctx->tlbufs[tid].trace_fd_;
-  MemAccEvent _e(type_idx, _idx, (u64)addr, (u64)pc);
-  internal_write(fd, &_e, sizeof(MemAccEvent));
-  return;
-#else
-//  if (UNLIKELY(buf.buf_ == nullptr)) {
-//    buf.open_buf();
-//    buf.open_file(tid);
-//  } else if (UNLIKELY(buf.size_ + sizeof(MemAccEvent) >= buf.capacity_)) {
-//    buf.flush();
-//  }
-  buf.put_event(MemAccEvent(type_idx, _idx, (u64)addr, (u64)pc));
-#endif
+  buf.put_event(MemRangeAccEvent(type_idx, _idx, (u64)addr, (u64)pc, (u32)size));
 }
 
+#undef ACC_STAT
 
-__HOT_CODE
-void impl_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write) {
-  int tid = thr->tid;
-  if (is_write) {
-    DPrintf("UFO>>> #%d range write mem to %llu    len %d    pc:%p  local?%d\r\n",
-            thr->tid, addr, size, pc, uctx->tlbufs[tid].is_thrlocal(addr));
-  } else {
-    DPrintf("UFO>>> #%d range read mem from %llu    len %d    pc:%p  local?%d\r\n",
-            thr->tid, addr, size, pc, uctx->tlbufs[tid].is_thrlocal(addr));
+// handlers of configurations [0, kFlags]
+template <u32 kFlags>
+struct AccHandlers {
+  static void fill(FPMemAcc *acc, FPMemRangeAcc *range) {
+    acc[kFlags] = &tpl_mem_acc<kFlags>;
+    range[kFlags] = &tpl_mem_range_acc<kFlags & RANGE_ACC_FLAGS>;
+    AccHandlers<kFlags - 1>::fill(acc, range);
   }
+};
 
-#ifdef STAT_ON
-  if (is_write) {
-    uctx->stat[tid].c_range_w++;
-    MC_STAT(thr, c_range_w)
-  } else {
-    uctx->stat[tid].c_range_r++;
+template <>
+struct AccHandlers<0> {
+  static void fill(FPMemAcc *acc, FPMemRangeAcc *range) {
+    acc[0] = &tpl_mem_acc<0>;
+    range[0] = &tpl_mem_range_acc<0>;
   }
-#endif
-
-  u8 type_idx = EventType::MemRangeRead;
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
+};
 
-  if (is_write) {
-    type_idx = EventType::MemRangeWrite;
-  }
-  uctx->tlbufs[tid].put_event(MemRangeAccEvent(type_idx, _idx, (u64)addr, (u64)pc, (u32)size));
+// flags: AccFlag
+static FPMemAcc select_mem_acc(u32 flags) {
+  FPMemAcc accs[N_ACC_CONFIG];
+  FPMemRangeAcc ranges[N_ACC_CONFIG];
+  AccHandlers<N_ACC_CONFIG - 1>::fill(accs, ranges);
+  return accs[flags];
 }
 
-// no stack
-__HOT_CODE
-void ns_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write) {
-
-  int tid = thr->tid;
-#ifdef STAT_ON
-  if (is_write) {
-    uctx->stat[tid].c_range_w++;
-    MC_STAT(thr, c_range_w)
-  } else {
-    uctx->stat[tid].c_range_r++;
-  }
-#endif
-
-  TLBuffer &buf = uctx->tlbufs[tid];
-  if(buf.is_thrlocal(addr))
-    return;
-
-  if (is_write) {
-    DPrintf("UFO>>> #%d range write mem to %llu    len %d    pc:%p\r\n", thr->tid, addr, size, pc);
-  } else {
-    DPrintf("UFO>>> #%d range read mem from %llu    len %d    pc:%p\r\n", thr->tid, addr, size, pc);
-  }
-
-  u8 type_idx = EventType::MemRangeRead;
-  if (is_write) {
-    type_idx = EventType::MemRangeWrite;
-  }
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
-
-  buf.put_event(MemRangeAccEvent(type_idx, _idx, (u64)addr, (u64)pc, (u32)size));
+static FPMemRangeAcc select_mem_range_acc(u32 flags) {
+  FPMemAcc accs[N_ACC_CONFIG];
+  FPMemRangeAcc ranges[N_ACC_CONFIG];
+  AccHandlers<N_ACC_CONFIG - 1>::fill(accs, ranges);
+  return ranges[flags];
 }
-
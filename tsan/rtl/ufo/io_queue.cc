@@ -3,108 +3,256 @@
 //
 
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
 #include "../../../sanitizer_common/sanitizer_atomic.h"
 #include "../../../sanitizer_common/sanitizer_common.h"
 #include "../../../sanitizer_common/sanitizer_posix.h"
 
-#include "../../../interception/interception.h"
 #include "../tsan_defs.h"
 #include "../tsan_mman.h"
+#include "../tsan_rtl.h"
 
 #include "defs.h"
 #include "ufo.h"
 #include "tlbuffer.h"
 #include "io_queue.h"
+#include "io_writer.h"
 #include "snappy/snappy.h"
 
-DECLARE_REAL(int, pthread_mutex_init, pthread_mutex_t*, const pthread_mutexattr_t*)
-DECLARE_REAL(int, pthread_mutex_lock, pthread_mutex_t*)
-DECLARE_REAL(int, pthread_mutex_unlock, pthread_mutex_t*)
-DECLARE_REAL(int, pthread_mutex_destroy, pthread_mutex_t*)
-
-DECLARE_REAL(int, pthread_cond_init, pthread_cond_t*, const pthread_condattr_t*)
-DECLARE_REAL(int, pthread_cond_wait, pthread_cond_t*, pthread_mutex_t*)
-DECLARE_REAL(int, pthread_cond_signal, pthread_cond_t*)
-DECLARE_REAL(int, pthread_cond_destroy, pthread_cond_t*)
-
 namespace bw {
 namespace ufo {
 
-using __sanitizer::internal_write;
 
 // defined in ufo_rtl.cc
 extern UFOContext *uctx;
 
-static char* g_zip_buf = nullptr;
-static size_t g_zipbuf_len = 0;
-static struct snappy_env g_snappy_env;
-
-// called by one thread (OutQueue::pt_worker_) at a time, COMPRESS_ON
-void _do_write(int fd, Byte* data, u64 len) {
+// called by the owner worker only, COMPRESS_ON
+void IOWorker::write(int fd, Byte* data, u64 len, const BlockSummary &sum) {
+  u64 off = trace_offset(fd);
   if (uctx->use_compression) {
     size_t outlen;
-    g_snappy_env.scratch = 0; // reuse env.hashtable
-    g_snappy_env.scratch_output = 0;
-    int err = snappy_compress(&g_snappy_env, (const char *) data, len, g_zip_buf, &outlen);
-    DPrintf("SNAPPY>>>#%d err:%d   %llu  ->  %llu\r\n", __tsan::cur_thread()->tid, err, len, outlen);
+    snappy_env_->scratch = 0; // reuse env.hashtable
+    snappy_env_->scratch_output = 0;
+    int err = snappy_compress(snappy_env_, (const char *) data, len, zip_buf_, &outlen);
+    DPrintf("SNAPPY>>>worker %u err:%d   %llu  ->  %llu\r\n", id_, err, len, outlen);
     if (err != 0) {
-      Printf("!!! #%d Error(%d) compress buffer, len:%d\r\n", __tsan::cur_thread()->tid, err, len);
+      Printf("!!! worker %u Error(%d) compress buffer, len:%d\r\n", id_, err, len);
       __sanitizer::Die();
     }
     u32 block_len = (u32) outlen;
-    internal_write(fd, &block_len, 4);
-    internal_write(fd, g_zip_buf, outlen);
+    trace_writev(fd, &block_len, 4, zip_buf_, outlen);
+  } else if (uctx->encoding & EncodingCompact) {
+    // compact blocks are decoded one by one, see Encoding
+    u32 block_len = (u32) len;
+    trace_writev(fd, &block_len, 4, data, len);
   } else {
-    internal_write(fd, data, len);
+    trace_write(fd, data, len);
   }
+  trace_block_done(fd, sum, off);
+}
 
-#ifdef SYNC_AT_FLUSH
-  fsync(fd);
-#endif
+
+void TaskRing::init(u32 min_cap) {
+  u32 cap = 1;
+  while (cap < min_cap)
+    cap <<= 1;
+  mask_ = cap - 1;
+  cells_ = (Cell *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, cap * sizeof(Cell));
+  for (u32 i = 0; i < cap; ++i) {
+    __sanitizer::atomic_store_relaxed(&cells_[i].seq_, i);
+    cells_[i].task_ = nullptr;
+  }
+  __sanitizer::atomic_store_relaxed(&enq_pos_, 0);
+  __sanitizer::atomic_store_relaxed(&deq_pos_, 0);
 }
 
+void TaskRing::release_mem() {
+  if (cells_ != nullptr)
+    __tsan::internal_free(cells_);
+  cells_ = nullptr;
+}
 
-void OutQueue::wait_non_full() {
-  REAL(pthread_cond_wait)(&cond_not_full_, &mutex_);
+bool TaskRing::push(WriteTask *task) {
+  Cell *cell;
+  u64 pos = __sanitizer::atomic_load_relaxed(&enq_pos_);
+  for (;;) {
+    cell = cells_ + (pos & mask_);
+    u64 seq = __sanitizer::atomic_load(&cell->seq_, __sanitizer::memory_order_acquire);
+    s64 dif = (s64) seq - (s64) pos;
+    if (dif == 0) {
+      if (__sanitizer::atomic_compare_exchange_weak(&enq_pos_, &pos, pos + 1,
+                                                    __sanitizer::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      return false; // full
+    } else {
+      pos = __sanitizer::atomic_load_relaxed(&enq_pos_);
+    }
+  }
+  cell->task_ = task;
+  __sanitizer::atomic_store(&cell->seq_, pos + 1, __sanitizer::memory_order_release);
+  return true;
 }
-void OutQueue::wait_non_empty() {
-  REAL(pthread_cond_wait)(&cond_not_empty_, &mutex_);
+
+bool TaskRing::pop(WriteTask **task) {
+  Cell *cell;
+  u64 pos = __sanitizer::atomic_load_relaxed(&deq_pos_);
+  for (;;) {
+    cell = cells_ + (pos & mask_);
+    u64 seq = __sanitizer::atomic_load(&cell->seq_, __sanitizer::memory_order_acquire);
+    s64 dif = (s64) seq - (s64) (pos + 1);
+    if (dif == 0) {
+      if (__sanitizer::atomic_compare_exchange_weak(&deq_pos_, &pos, pos + 1,
+                                                    __sanitizer::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      return false; // empty
+    } else {
+      pos = __sanitizer::atomic_load_relaxed(&deq_pos_);
+    }
+  }
+  *task = cell->task_;
+  __sanitizer::atomic_store(&cell->seq_, pos + mask_ + 1, __sanitizer::memory_order_release);
+  return true;
 }
 
-void OutQueue::notify_non_empty() {
-  REAL(pthread_cond_signal)(&cond_not_empty_);
+bool TaskRing::is_empty() const {
+  return __sanitizer::atomic_load(&deq_pos_, __sanitizer::memory_order_acquire)
+         == __sanitizer::atomic_load(&enq_pos_, __sanitizer::memory_order_acquire);
 }
 
-void OutQueue::notify_non_full() {
-  REAL(pthread_cond_signal)(&cond_not_full_);
+
+// <linux/futex.h> is broken on some linux distributions, see sanitizer_linux.cc
+static const int FUTEX_WAIT_PRIVATE_ = 128;
+static const int FUTEX_WAKE_PRIVATE_ = 129;
+
+void Parker::init() {
+  __sanitizer::atomic_store_relaxed(&seq_, 0);
+  __sanitizer::atomic_store_relaxed(&n_parked_, 0);
 }
-void OutQueue::lock() {
-  REAL(pthread_mutex_lock)(&mutex_);
+
+u32 Parker::prepare() {
+  __sanitizer::atomic_fetch_add(&n_parked_, 1, __sanitizer::memory_order_seq_cst);
+  return __sanitizer::atomic_load(&seq_, __sanitizer::memory_order_seq_cst);
 }
 
-void OutQueue::unlock() {
-  REAL(pthread_mutex_unlock)(&mutex_);
+void Parker::cancel() {
+  __sanitizer::atomic_fetch_sub(&n_parked_, 1, __sanitizer::memory_order_relaxed);
+}
+
+bool Parker::wait(u32 key, u32 timeout_ms) {
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  // a producer is an application thread
+  int saved_errno = errno;
+  syscall(SYS_futex, &seq_, FUTEX_WAIT_PRIVATE_, key, timeout_ms != 0 ? &ts : nullptr, nullptr, 0);
+  errno = saved_errno;
+  __sanitizer::atomic_fetch_sub(&n_parked_, 1, __sanitizer::memory_order_relaxed);
+  return __sanitizer::atomic_load(&seq_, __sanitizer::memory_order_acquire) != key;
+}
+
+void Parker::wake_all() {
+  // pairs with prepare(): either the waiter sees the condition, or this sees the waiter
+  __sanitizer::atomic_thread_fence(__sanitizer::memory_order_seq_cst);
+  if (__sanitizer::atomic_load_relaxed(&n_parked_) == 0)
+    return;
+  __sanitizer::atomic_fetch_add(&seq_, 1, __sanitizer::memory_order_release);
+  syscall(SYS_futex, &seq_, FUTEX_WAKE_PRIVATE_, 0x7fffffff, nullptr, nullptr, 0);
 }
 
 bool OutQueue::is_started() const {
   return __sanitizer::atomic_load_relaxed(&continue_);
 }
 
+void IOWorker::start(OutQueue *q, u32 id) {
+  this->q_ = q;
+  this->id_ = id;
+  todo_.init(q->length_);
+  park_.init();
+  snappy_env_ = nullptr;
+  zip_buf_ = nullptr;
+  zip_len_ = 0;
+  if (uctx->use_compression) {
+    snappy_env_ = (struct snappy_env *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(struct snappy_env));
+    snappy_init_env(snappy_env_);
+    zip_len_ = snappy_max_compressed_length(uctx->get_buf_size());
+    zip_buf_ = (char *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, zip_len_);
+    uctx->mem_acquired(zip_len_);
+  }
+  __sanitizer::real_pthread_create(&pt_, NULL, work_loop, this);
+}
 
-// for pthread
-static void* _work_loop(void*);
+// idle time of the last active worker before it is deactivated
+static const u32 IDLE_MS_SHRINK = 1000;
+
+//static
+void* IOWorker::work_loop(void* p) {
+  IOWorker *w = (IOWorker *) p;
+  OutQueue *q = w->q_;
+  for (;;) {
+    WriteTask *task;
+    if (w->todo_.pop(&task)) {
+      if (uctx->online) {
+        // an empty last block still tells the matcher the thread ended
+        if (task->size_ > 0 || task->last_)
+          uctx->matcher->analyze(task->owner_->uid_, task->data_, task->size_, task->last_);
+      } else if (task->size_ == 0) {
+        // nothing left in a finished trace
+      } else {
+        w->write(task->fd_, task->data_, task->size_, task->sum_);
+      }
+      if (task->last_ && task->fd_ >= 0) {
+        trace_write_index(task->fd_);
+        trace_close(task->fd_);
+      }
+      task->size_ = 0;
+      task->last_ = false;
+      __sanitizer::atomic_fetch_sub(&task->owner_->in_flight_, 1, __sanitizer::memory_order_release);
+      q->free_.push(task);
+      q->free_park_.wake_all();
+    } else if (q->is_started()) {
+      u32 key = w->park_.prepare();
+      // pushed or stopped since the pop
+      if (!w->todo_.is_empty() || !q->is_started()) {
+        w->park_.cancel();
+        continue;
+      }
+      // worker 0 is never deactivated, the others wait without timeout until they are the last active one
+      u32 timeout = (w->id_ > 0 && w->id_ + 1 == q->active_workers()) ? IDLE_MS_SHRINK : 0;
+      if (!w->park_.wait(key, timeout) && timeout != 0)
+        q->shrink(w->id_);
+    } else { // stopped and drained
+      return nullptr;
+    }
+  } // for
+}
 
-void OutQueue::start(int len) {
-  this->length_ = len;
+void IOWorker::release_mem() {
+  todo_.release_mem();
+  if (zip_buf_ != nullptr) {
+    __tsan::internal_free(zip_buf_);
+    uctx->mem_released(zip_len_);
+  }
+  zip_buf_ = nullptr;
+  if (snappy_env_ != nullptr) {
+    snappy_free_env(snappy_env_);
+    __tsan::internal_free(snappy_env_);
+  }
+  snappy_env_ = nullptr;
+}
 
-  REAL(pthread_mutex_init)(&mutex_, NULL);
-  REAL(pthread_cond_init)(&cond_not_full_, NULL);
-  REAL(pthread_cond_init)(&cond_not_empty_, NULL);
-  head_ = 0;
-  tail_ = 0;
-  task_count_ = 0;
+void OutQueue::start(int len, u32 n_workers) {
+  this->length_ = len;
+  if (n_workers < 1)
+    n_workers = 1;
+  this->n_workers_ = n_workers;
 
   taskq_ = (WriteTask*)__tsan::internal_alloc(__tsan::MBlockScopedBuf, len * sizeof(WriteTask));
+  free_.init(len);
+  free_park_.init();
 
   for (int i = 0; i < length_; ++i) {
     u32 sz = uctx->get_buf_size();
@@ -112,56 +260,100 @@ void OutQueue::start(int len) {
     taskq_[i].size_ = 0;
     taskq_[i].fd_ = -1;
     taskq_[i].cap_ = sz;
+    taskq_[i].owner_ = nullptr;
+    taskq_[i].last_ = false;
     taskq_[i].data_ = (Byte*)__tsan::internal_alloc(__tsan::MBlockScopedBuf, sz);
     uctx->mem_acquired(sz);
+    free_.push(taskq_ + i);
   }
 
-  if (uctx->use_compression) {
-    snappy_init_env(&g_snappy_env);
-    g_zipbuf_len = snappy_max_compressed_length(uctx->get_buf_size());
-    g_zip_buf = (char *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, g_zipbuf_len);
-    uctx->mem_acquired(g_zipbuf_len);
-  }
-
+  grow_mtx_.Init();
+  __sanitizer::atomic_store_relaxed(&n_active_, 1);
+  __sanitizer::atomic_store_relaxed(&next_worker_, 0);
+  __sanitizer::atomic_store_relaxed(&n_stall_, 0);
   __sanitizer::atomic_store_relaxed(&continue_, 1);
-  __sanitizer::real_pthread_create(&pt_worker_, NULL, _work_loop, this);
+
+  // the others are started by grow()
+  workers_ = (IOWorker *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, n_workers_ * sizeof(IOWorker));
+  workers_[0].start(this, 0);
+  this->n_started_ = 1;
 }
 
-void OutQueue::push(TLBuffer *buf) {
-  lock();
-  while (is_full()) {
-    wait_non_full();
-  }
-  WriteTask *task = taskq_ + tail_;
-  tail_ = (tail_ + 1) % length_;
-  task_count_++;
-  task->load_with(buf);// non-block
-  notify_non_empty();
-  unlock();
+u32 OutQueue::active_workers() const {
+  return __sanitizer::atomic_load_relaxed(&n_active_);
 }
 
+u64 OutQueue::stall_count() const {
+  return __sanitizer::atomic_load_relaxed(&n_stall_);
+}
 
-static void* _work_loop(void* p) {
-  OutQueue* q = (OutQueue*)p;
-  while (q->is_started()) {
-    q->lock();
-    while (q->is_empty()) {
-      if (q->is_started()) {
-        q->wait_non_empty();
-      } else { // thread should quit
-        q->unlock();
-        return nullptr;
-      }
+u32 OutQueue::pick_worker() {
+  // the worker is started before it is activated
+  u32 n = __sanitizer::atomic_load(&n_active_, __sanitizer::memory_order_acquire);
+  return __sanitizer::atomic_fetch_add(&next_worker_, 1, __sanitizer::memory_order_relaxed) % n;
+}
+
+// producer is faster than the writers, called by the producer of buf
+void OutQueue::grow(TLBuffer *buf) {
+  __sanitizer::atomic_fetch_add(&n_stall_, 1, __sanitizer::memory_order_relaxed);
+  u32 n = active_workers();
+  // another producer is starting a worker
+  if (n >= n_workers_ || !grow_mtx_.TryLock())
+    return;
+  n = active_workers();
+  if (n < n_workers_) {
+    if (n == n_started_) {
+      // the allocations of pthread_create are neither tsan nor ufo events of this thread
+      __tsan::ScopedIgnoreInterceptors ignore;
+      buf->in_queue_ = true;
+      workers_[n].start(this, n);
+      buf->in_queue_ = false;
+      n_started_ = n + 1;
+    }
+    // fails if the last worker just retired
+    if (__sanitizer::atomic_compare_exchange_strong(&n_active_, &n, n + 1, __sanitizer::memory_order_release)) {
+      DPrintf("UFO>>> io workers: %u\r\n", n + 1);
     }
+  }
+  grow_mtx_.Unlock();
+}
 
-    WriteTask *task = q->pop();
-    _do_write(task->fd_, task->data_, task->size_);
+// only the last active worker retires, it still drains tasks already routed to it.
+// the worker before it is woken to time out in turn
+void OutQueue::shrink(u32 id) {
+  u32 n = id + 1;
+  if (id > 0
+      && __sanitizer::atomic_compare_exchange_strong(&n_active_, &n, id, __sanitizer::memory_order_relaxed)) {
+    DPrintf("UFO>>> io workers: %u\r\n", id);
+    workers_[id - 1].park_.wake_all();
+  }
+}
 
-    task->size_ = 0;
-    q->notify_non_full();
-    q->unlock();
-  } // while
-  return nullptr;
+void OutQueue::push(TLBuffer *buf, bool last) {
+  WriteTask *task;
+  if (UNLIKELY(!free_.pop(&task))) {
+    // all buffers are in flight, wait for the writers
+    grow(buf);
+    while (!free_.pop(&task)) {
+      u32 key = free_park_.prepare();
+      if (free_.pop(&task)) {
+        free_park_.cancel();
+        break;
+      }
+      free_park_.wait(key, 0);
+    }
+  }
+  // keep the writer while older blocks of this file are in flight
+  if (__sanitizer::atomic_load(&buf->in_flight_, __sanitizer::memory_order_acquire) == 0) {
+    buf->writer_ = pick_worker();
+  }
+  __sanitizer::atomic_fetch_add(&buf->in_flight_, 1, __sanitizer::memory_order_relaxed);
+  task->load_with(buf);// non-block
+  task->last_ = last;
+  // never full, the ring can hold all tasks
+  IOWorker &w = workers_[buf->writer_];
+  w.todo_.push(task);
+  w.park_.wake_all();
 }
 
 // see comment in header
@@ -177,39 +369,28 @@ void OutQueue::release_mem() {
   if (taskq_ != nullptr)
     __tsan::internal_free(taskq_);
   taskq_ = nullptr;
+  free_.release_mem();
 
-  if (uctx->use_compression) {
-    if (g_zip_buf != nullptr) {
-      __tsan::internal_free(g_zip_buf);
-      uctx->mem_released(g_zipbuf_len);
+  if (workers_ != nullptr) {
+    for (u32 i = 0; i < n_started_; ++i) {
+      workers_[i].release_mem();
     }
-    g_zip_buf = nullptr;
-    snappy_free_env(&g_snappy_env);
+    __tsan::internal_free(workers_);
   }
-
+  workers_ = nullptr;
 }
 
 void OutQueue::stop() {
+  // each worker writes all remaining tasks before it quits
   __sanitizer::atomic_store_relaxed(&continue_, 0);
-  notify_non_empty();// send signal to pt_worker_, pt_worker_ should finish
-//  REAL(pthread_join)((void*)pt_worker_, NULL);
-  __sanitizer::real_pthread_join((void*)pt_worker_, NULL);
-  lock();
-  //finish rest of the tasks
-  while (!is_empty()) {
-    WriteTask* task = pop();
-    if (task->size_ > 0) {
-      _do_write(task->fd_, task->data_, task->size_);
-    }
+  for (u32 i = 0; i < n_started_; ++i) {
+    workers_[i].park_.wake_all();
+  }
+  for (u32 i = 0; i < n_started_; ++i) {
+    __sanitizer::real_pthread_join((void*)workers_[i].pt_, NULL);
   }
 
   release_mem();
-
-  REAL(pthread_cond_destroy)(&cond_not_empty_);
-  REAL(pthread_cond_destroy)(&cond_not_full_);
-
-  unlock();
-  REAL(pthread_mutex_destroy)(&mutex_);
 }
 
 
@@ -7,9 +7,13 @@
 
 #include <pthread.h>
 
+#include "../../../sanitizer_common/sanitizer_atomic.h"
+#include "../../../sanitizer_common/sanitizer_mutex.h"
 #include "defs.h"
 #include "tlbuffer.h"
 
+struct snappy_env;
+
 namespace bw {
 namespace ufo {
 
@@ -29,12 +33,18 @@ struct WriteTask {
   Byte *data_;
   u32 size_;
   u32 cap_;
+  TLBuffer *owner_;
+  BlockSummary sum_;
+  // last block of the trace (may be empty), the writer then writes the index and closes fd_
+  bool last_;
 
   ALWAYS_INLINE
   void load_with(TLBuffer *buf) {
 
+    this->owner_ = buf;
     this->fd_ = buf->trace_fd_;
     this->size_ = buf->size_;
+    this->sum_ = buf->sum_;
     buf->size_ = 0;
 
     u32 old_cap = buf->capacity_;
@@ -47,67 +57,144 @@ struct WriteTask {
   }
 };
 
-// FIFO Queue
+/**
+ * bounded lock-free MPMC FIFO of task pointers (D. Vyukov's array queue),
+ * capacity is a power of 2.
+ * push() returns false if full, pop() returns false if empty, neither blocks.
+ */
+struct TaskRing {
+private:
+  struct Cell {
+    __sanitizer::atomic_uint64_t seq_;
+    WriteTask *task_;
+  };
+  Cell *cells_;
+  u64 mask_;
+  char pad0_[64];
+  __sanitizer::atomic_uint64_t enq_pos_;
+  char pad1_[64];
+  __sanitizer::atomic_uint64_t deq_pos_;
+  char pad2_[64];
+public:
+
+  void init(u32 min_cap);
+
+  void release_mem();
+
+  bool push(WriteTask *task);
+
+  bool pop(WriteTask **task);
+
+  // a push in progress counts
+  bool is_empty() const;
+};
+
+/**
+ * a thread parks on a futex until another thread calls wake_all(), no syscall if nobody is parked.
+ * the waiter calls prepare() before it checks its condition a last time, then wait() or cancel().
+ */
+struct Parker {
+private:
+  __sanitizer::atomic_uint32_t seq_;
+  __sanitizer::atomic_uint32_t n_parked_;
+public:
+
+  void init();
+
+  u32 prepare();
+
+  void cancel();
+
+  // false if not woken within timeout_ms (0: no timeout)
+  bool wait(u32 key, u32 timeout_ms);
+
+  // called after the condition is set
+  void wake_all();
+};
+
+struct OutQueue;
+
+/**
+ * one compression/writer thread, owns its snappy env and output buffer.
+ * parked while it has no task.
+ */
+struct IOWorker {
+  OutQueue *q_;
+  u32 id_;
+  // tasks routed to this worker, in push order
+  TaskRing todo_;
+  Parker park_;
+  struct snappy_env *snappy_env_;
+  char *zip_buf_;
+  u64 zip_len_;
+  pthread_t pt_;
+
+  void start(OutQueue *q, u32 id);
+
+  void write(int fd, Byte *data, u64 len, const BlockSummary &sum);
+
+  void release_mem();
+
+  static void* work_loop(void* p);
+};
+
+/**
+ * FIFO Queue
+ * producers (application threads) exchange a full TLBuffer for a clean buffer in O(1),
+ * no lock and no syscall unless all buffers are in flight.
+ * workers compress and write outside of any lock, then recycle the buffer.
+ *
+ * a pool of up to n_workers_ writers, n_active_ of them take new files.
+ * a TLBuffer sticks to one worker while it has blocks in flight,
+ * so blocks of one trace file are always written in order.
+ * n_active_ grows when producers have to wait for a clean buffer (fill rate > drain rate),
+ * the thread of a worker is started the first time it is activated, by the waiting producer.
+ * n_active_ shrinks when the last active worker stays idle, a retired worker stays parked.
+ */
 struct OutQueue {
 private:
   int length_;
   WriteTask* taskq_;
-  int head_;
-  int tail_;
-  int task_count_;
+  // tasks holding clean buffers
+  TaskRing free_;
+  // producers waiting for a clean buffer
+  Parker free_park_;
   __sanitizer::atomic_uint8_t continue_;
 
-  pthread_mutex_t mutex_;
-  pthread_cond_t cond_not_full_;
-  pthread_cond_t cond_not_empty_;
-  pthread_t pt_worker_;
+  IOWorker *workers_;
+  u32 n_workers_;
+  // workers [0, n_started_) have a thread, guarded by grow_mtx_
+  u32 n_started_;
+  __sanitizer::StaticSpinMutex grow_mtx_;
+  __sanitizer::atomic_uint32_t n_active_;
+  __sanitizer::atomic_uint32_t next_worker_;
+  __sanitizer::atomic_uint64_t n_stall_;
+
+  friend struct IOWorker;
+
+  u32 pick_worker();
+  void grow(TLBuffer *buf);
+  void shrink(u32 id);
 public:
 
-  void start(int len);
+  void start(int len, u32 n_workers);
 
   // called by multiple thread
-  void push(TLBuffer *buf);
+  // last: buf is finished, see TLBuffer::finish()
+  void push(TLBuffer *buf, bool last = false);
 
   void stop();
 
-  void lock();
-
-  void unlock();
-
-  void wait_non_full();
-
-  void wait_non_empty();
-
-  void notify_non_full();
+  bool is_started() const;
 
-  void notify_non_empty();
+  u32 active_workers() const;
 
-  bool is_started() const;
+  u64 stall_count() const;
 
-  // release all memory, do nothing with the cond or mutex or the worker thread.
+  // release all memory, do nothing with the worker threads.
   // called at stop,
   // or by the child process immediately after fork
   void release_mem();
-
-  WriteTask* pop() {
-    WriteTask* task = taskq_ + head_;
-    head_ = (head_ + 1 ) % length_;
-    task_count_--;
-    return task;
-  }
-
-  bool is_empty() const {
-    return head_ == tail_;
-  }
-
-  bool is_full() const {
-    return tail_ - head_ == (length_ - 1)
-           || head_ - tail_ == 1;
-  }
-
-  int size() const {
-    return this->task_count_;
-  }
 };
 
 
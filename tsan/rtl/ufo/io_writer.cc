@@ -0,0 +1,346 @@
+//
+// Created by xkommando on 3/24/17.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+#include "../../../sanitizer_common/sanitizer_posix.h"
+
+#include "../tsan_rtl.h"
+
+#include "defs.h"
+#include "io_writer.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::internal_write;
+using __sanitizer::internal_iserror;
+using __sanitizer::uptr;
+using __sanitizer::Printf;
+
+static u8 writer_kind_;
+static u8 sync_policy_;
+static u64 sync_bytes_;
+static TraceFile *files_;
+
+void init_writer(u8 kind, u8 sync_policy, u32 sync_mb) {
+  writer_kind_ = kind;
+  sync_policy_ = sync_policy;
+  sync_bytes_ = (u64) sync_mb * 1024 * 1024;
+  if (files_ == nullptr) {
+    // pages are touched only for the fds actually used
+    files_ = (TraceFile *) __sanitizer::MmapOrDie(MAX_TRACE_FD * sizeof(TraceFile), "UFO trace files");
+  }
+}
+
+void destroy_writer() {
+  if (files_ == nullptr)
+    return;
+  for (int fd = 0; fd < MAX_TRACE_FD; ++fd) {
+    if (files_[fd].stage_ != nullptr) {
+      __sanitizer::UnmapOrDie(files_[fd].stage_, DIRECT_STAGE_SIZE);
+    }
+    if (files_[fd].index_ != nullptr) {
+      __tsan::internal_free(files_[fd].index_);
+    }
+  }
+  __sanitizer::UnmapOrDie(files_, MAX_TRACE_FD * sizeof(TraceFile));
+  files_ = nullptr;
+}
+
+static TraceFile *file_of(int fd) {
+  if (files_ == nullptr || fd < 0 || fd >= MAX_TRACE_FD)
+    return nullptr;
+  return files_ + fd;
+}
+
+static void write_all(int fd, const void *data, u64 len) {
+  const Byte *p = (const Byte *) data;
+  while (len > 0) {
+    uptr res = internal_write(fd, p, len);
+    int write_errno;
+    if (internal_iserror(res, &write_errno)) {
+      Printf(">>>!!! UFO write file error, code:[%d], %s\r\n", write_errno, strerror(write_errno));
+      return;
+    }
+    p += res;
+    len -= res;
+  }
+}
+
+// partial writes resumed. the raw syscall: writev() is intercepted
+static void writev_all(int fd, const void *head, u64 head_len, const void *data, u64 len) {
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<void *>(head);
+  iov[0].iov_len = head_len;
+  iov[1].iov_base = const_cast<void *>(data);
+  iov[1].iov_len = len;
+  struct iovec *v = iov;
+  int n = 2;
+  while (n > 0) {
+    long res = syscall(SYS_writev, fd, v, n);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      Printf(">>>!!! UFO write file error, code:[%d], %s\r\n", errno, strerror(errno));
+      return;
+    }
+    u64 done = (u64) res;
+    while (n > 0 && done >= v->iov_len) {
+      done -= v->iov_len;
+      ++v;
+      --n;
+    }
+    if (n > 0) {
+      v->iov_base = (Byte *) v->iov_base + done;
+      v->iov_len -= done;
+    }
+  }
+}
+
+/**
+ * an existing trace keeps its blocks: its index is loaded and cut off, the merged index is written at close.
+ * returns the number of blocks loaded into *index, *unindexed if the trace has blocks but no index.
+ */
+static u32 _load_index(const char *path, BlockSummary **index, bool *unindexed) {
+  *index = nullptr;
+  *unindexed = false;
+  int fd = (int) __sanitizer::internal_open(path, O_RDWR);
+  if (fd < 0)
+    return 0;
+  u64 end = __sanitizer::internal_lseek(fd, 0, SEEK_END);
+  IndexTrailer trailer(0, 0);
+  trailer.magic = 0;
+  if (end >= sizeof(UFOHeader) + sizeof(IndexTrailer)) {
+    __sanitizer::internal_lseek(fd, end - sizeof(IndexTrailer), SEEK_SET);
+    if (__sanitizer::internal_read(fd, &trailer, sizeof(IndexTrailer)) != sizeof(IndexTrailer))
+      trailer.magic = 0;
+  }
+  u64 index_len = (u64) trailer.count * sizeof(BlockSummary);
+  if (trailer.magic != IndexTrailer::MAGIC || trailer.footer_off + index_len + sizeof(IndexTrailer) != end) {
+    *unindexed = end > sizeof(UFOHeader);
+    __sanitizer::internal_close(fd);
+    return 0;
+  }
+  u32 n = trailer.count;
+  if (n > 0) {
+    *index = (BlockSummary *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, index_len);
+    __sanitizer::internal_lseek(fd, trailer.footer_off, SEEK_SET);
+    if (__sanitizer::internal_read(fd, *index, index_len) != index_len) {
+      __tsan::internal_free(*index);
+      *index = nullptr;
+      *unindexed = true;
+      __sanitizer::internal_close(fd);
+      return 0;
+    }
+  }
+  __sanitizer::internal_ftruncate(fd, trailer.footer_off);
+  __sanitizer::internal_close(fd);
+  return n;
+}
+
+/**
+ * if file already exists, append after its blocks, see _load_index.
+ * O_DIRECT is used only if the existing file ends on an aligned offset,
+ * e.g. a reopened trace is continued in buffered mode.
+ */
+int trace_open(const char *path) {
+  BlockSummary *old_index;
+  bool unindexed;
+  u32 n_old = _load_index(path, &old_index, &unindexed);
+  int fd = -1;
+  bool direct = false;
+  u64 end = 0;
+  if (writer_kind_ == WriterDirect) {
+    fd = (int) __sanitizer::internal_open(path, O_CREAT | O_WRONLY | O_DIRECT, 0666);
+    if (fd >= 0) {
+      end = __sanitizer::internal_lseek(fd, 0, SEEK_END);
+      if (end % DIRECT_ALIGN == 0 && fd < MAX_TRACE_FD) {
+        direct = true;
+      } else {
+        __sanitizer::internal_close(fd);
+        fd = -1;
+      }
+    } else {
+      DPrintf("UFO>>> O_DIRECT not supported for '%s', use buffered write\r\n", path);
+    }
+  }
+  if (fd < 0) {
+    fd = (int) __sanitizer::internal_open(path, O_CREAT | O_APPEND | O_WRONLY, 0666);
+    if (fd < 0) {
+      if (old_index != nullptr)
+        __tsan::internal_free(old_index);
+      return fd;
+    }
+    end = __sanitizer::internal_lseek(fd, 0, SEEK_END);
+  }
+
+  TraceFile *tf = file_of(fd);
+  if (tf != nullptr) {
+    tf->direct_ = direct;
+    tf->padded_ = false;
+    tf->written_ = end;
+    tf->unsynced_ = 0;
+    tf->stage_len_ = 0;
+    tf->stage_off_ = end;
+    tf->n_index_ = 0;
+    tf->unindexed_ = unindexed;
+    if (old_index != nullptr) {
+      if (tf->index_ != nullptr)
+        __tsan::internal_free(tf->index_);
+      tf->index_ = old_index;
+      tf->n_index_ = n_old;
+      tf->index_cap_ = n_old;
+      old_index = nullptr;
+    }
+    if (direct && tf->stage_ == nullptr) {
+      tf->stage_ = (Byte *) __sanitizer::MmapOrDie(DIRECT_STAGE_SIZE, "UFO direct io");
+    }
+  }
+  if (old_index != nullptr)
+    __tsan::internal_free(old_index);
+  return fd;
+}
+
+void trace_write(int fd, const void *data, u64 len) {
+  TraceFile *tf = file_of(fd);
+  if (tf == nullptr || !tf->direct_) {
+    write_all(fd, data, len);
+    if (tf != nullptr) {
+      tf->written_ += len;
+      tf->unsynced_ += len;
+    }
+    return;
+  }
+  tf->written_ += len;
+  tf->unsynced_ += len;
+  const Byte *p = (const Byte *) data;
+  while (len > 0) {
+    u64 n = DIRECT_STAGE_SIZE - tf->stage_len_;
+    if (n > len)
+      n = len;
+    __sanitizer::internal_memcpy(tf->stage_ + tf->stage_len_, p, n);
+    tf->stage_len_ += n;
+    p += n;
+    len -= n;
+    if (tf->stage_len_ == DIRECT_STAGE_SIZE) {
+      // full aligned chunk, the file offset is at stage_off_
+      write_all(fd, tf->stage_, DIRECT_STAGE_SIZE);
+      tf->stage_off_ += DIRECT_STAGE_SIZE;
+      tf->stage_len_ = 0;
+    }
+  }
+}
+
+void trace_writev(int fd, const void *head, u64 head_len, const void *data, u64 len) {
+  TraceFile *tf = file_of(fd);
+  if (tf != nullptr && tf->direct_) {
+    // staged, written in aligned chunks anyway
+    trace_write(fd, head, head_len);
+    trace_write(fd, data, len);
+    return;
+  }
+  writev_all(fd, head, head_len, data, len);
+  if (tf != nullptr) {
+    tf->written_ += head_len + len;
+    tf->unsynced_ += head_len + len;
+  }
+}
+
+// write the staged tail padded with zeros, keep it staged and rewind,
+// the next chunk overwrites the padding.
+static void write_tail(int fd, TraceFile *tf) {
+  if (tf->stage_len_ == 0)
+    return;
+  u32 padded = (u32) __sanitizer::RoundUpTo(tf->stage_len_, DIRECT_ALIGN);
+  __sanitizer::internal_memset(tf->stage_ + tf->stage_len_, 0, padded - tf->stage_len_);
+  write_all(fd, tf->stage_, padded);
+  __sanitizer::internal_lseek(fd, tf->stage_off_, SEEK_SET);
+  tf->padded_ = true;
+}
+
+static void sync_file(int fd, TraceFile *tf) {
+  if (tf != nullptr) {
+    if (tf->direct_)
+      write_tail(fd, tf);
+    tf->unsynced_ = 0;
+  }
+  fsync(fd);
+}
+
+u64 trace_offset(int fd) {
+  TraceFile *tf = file_of(fd);
+  return tf != nullptr ? tf->written_ : 0;
+}
+
+static void add_index(TraceFile *tf, const BlockSummary &sum, u64 off) {
+  if (tf->n_index_ == tf->index_cap_) {
+    u32 cap = tf->index_cap_ == 0 ? 64 : tf->index_cap_ * 2;
+    BlockSummary *idx = (BlockSummary *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, cap * sizeof(BlockSummary));
+    if (tf->index_ != nullptr) {
+      __sanitizer::internal_memcpy(idx, tf->index_, tf->n_index_ * sizeof(BlockSummary));
+      __tsan::internal_free(tf->index_);
+    }
+    tf->index_ = idx;
+    tf->index_cap_ = cap;
+  }
+  BlockSummary &s = tf->index_[tf->n_index_++];
+  s = sum;
+  s.offset = off;
+  s.length = (u32) (tf->written_ - off);
+}
+
+void trace_block_done(int fd, const BlockSummary &sum, u64 off) {
+  TraceFile *tf = file_of(fd);
+  if (tf != nullptr && !tf->unindexed_)
+    add_index(tf, sum, off);
+  if (sync_policy_ == SyncEveryFlush) {
+    sync_file(fd, tf);
+  } else if (sync_policy_ == SyncEveryMB) {
+    if (tf == nullptr || tf->unsynced_ >= sync_bytes_)
+      sync_file(fd, tf);
+  }
+}
+
+void trace_write_index(int fd) {
+  TraceFile *tf = file_of(fd);
+  if (tf == nullptr || tf->n_index_ == 0 || tf->unindexed_)
+    return;
+  IndexTrailer trailer(tf->written_, tf->n_index_);
+  trace_writev(fd, tf->index_, (u64) tf->n_index_ * sizeof(BlockSummary), &trailer, sizeof(IndexTrailer));
+  tf->n_index_ = 0;
+}
+
+void trace_close(int fd) {
+  TraceFile *tf = file_of(fd);
+  if (tf != nullptr && tf->direct_) {
+    write_tail(fd, tf);
+    if (tf->padded_) {
+      __sanitizer::internal_ftruncate(fd, tf->written_);
+    }
+    __sanitizer::UnmapOrDie(tf->stage_, DIRECT_STAGE_SIZE);
+    tf->stage_ = nullptr;
+    tf->stage_len_ = 0;
+    tf->direct_ = false;
+  }
+  if (tf != nullptr && tf->index_ != nullptr) {
+    __tsan::internal_free(tf->index_);
+    tf->index_ = nullptr;
+    tf->n_index_ = 0;
+    tf->index_cap_ = 0;
+  }
+  if (sync_policy_ != SyncNever) {
+    fsync(fd);
+  }
+  __sanitizer::internal_close(fd);
+}
+
+} // ns ufo
+} // ns bw
@@ -0,0 +1,95 @@
+//
+// Created by xkommando on 3/24/17.
+//
+
+#ifndef UFO_IO_WRITER_H
+#define UFO_IO_WRITER_H
+
+#include "../tsan_defs.h"
+#include "defs.h"
+#include "ufo_interface.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u8;
+using __sanitizer::u32;
+using __sanitizer::u64;
+
+/**
+ * backend writing the trace files
+ * WriterBuffered: write() to the page cache.
+ * WriterDirect: O_DIRECT, blocks are batched in an aligned staging buffer and written in large aligned chunks,
+ *   the padding of the last chunk is truncated at close.
+ *   falls back to WriterBuffered if the file system does not support O_DIRECT.
+ */
+enum WriterKind {
+  WriterBuffered = 0,
+  WriterDirect = 1
+};
+
+/**
+ * when to fsync a trace file
+ * SyncEveryFlush: after each flushed block (old SYNC_AT_FLUSH behavior)
+ * SyncNever: leave it to the OS
+ * SyncAtClose: when the trace of a thread is closed (thread end)
+ * SyncEveryMB: after every sync_mb MB written to a file, and at close
+ */
+enum SyncPolicy {
+  SyncEveryFlush = 0,
+  SyncNever,
+  SyncAtClose,
+  SyncEveryMB
+};
+
+const u32 DIRECT_ALIGN = 4096;
+const u32 DIRECT_STAGE_SIZE = 512 * 1024;
+const int MAX_TRACE_FD = 1 << 16;
+
+// state of one open trace file, indexed by fd
+struct TraceFile {
+  bool direct_;
+  bool padded_; // WriterDirect: zeros written after the logical end
+  u64 written_; // logical length of the file
+  u64 unsynced_;
+  // WriterDirect only: staged data goes to file offset stage_off_
+  Byte *stage_;
+  u32 stage_len_;
+  u64 stage_off_;
+  // summaries of the blocks written, see BlockSummary
+  BlockSummary *index_;
+  u32 n_index_;
+  u32 index_cap_;
+  // reopened a trace without index: no index is written, readers scan the whole file
+  bool unindexed_;
+};
+
+void init_writer(u8 kind, u8 sync_policy, u32 sync_mb);
+
+void destroy_writer();
+
+// returns fd, negative on error. an existing trace is continued, trace_offset() is not 0
+int trace_open(const char *path);
+
+// append data, one file is written by one thread at a time
+void trace_write(int fd, const void *data, u64 len);
+
+// append head then data, one writev() if buffered (e.g. block frame and block)
+void trace_writev(int fd, const void *head, u64 head_len, const void *data, u64 len);
+
+// logical length of the file, offset of the next block
+u64 trace_offset(int fd);
+
+// end of a flushed block starting at offset off, index it and apply the sync policy
+void trace_block_done(int fd, const BlockSummary &sum, u64 off);
+
+// append the index of the blocks written since trace_open, see IndexTrailer
+void trace_write_index(int fd);
+
+// write what is staged, apply the sync policy, close fd
+void trace_close(int fd);
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_IO_WRITER_H
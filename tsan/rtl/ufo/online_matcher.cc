@@ -0,0 +1,634 @@
+//
+// Created by xkommando on 3/30/17.
+//
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+
+#include "../tsan_mman.h"
+#include "../tsan_rtl.h"
+
+#include "defs.h"
+#include "ufo_interface.h"
+#include "tlbuffer.h"
+#include "thread_table.h"
+#include "ufo.h"
+#include "online_matcher.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::Printf;
+using __sanitizer::atomic_fetch_add;
+using __sanitizer::atomic_fetch_sub;
+using __sanitizer::atomic_load_relaxed;
+using __sanitizer::memory_order_relaxed;
+
+// defined in ufo_rtl.cc
+extern UFOContext *uctx;
+
+const u64 NOT_REUSED = ~0ull;
+
+void OnlineMatcher::init(u8 encoding, bool has_value) {
+  encoding_ = encoding;
+  has_value_ = has_value;
+  mtx_.Init();
+  live_ = (LiveChunk **) __sanitizer::MmapOrDie((1 << LIVE_BITS) * sizeof(LiveChunk *), "UFO online live chunks");
+  live_free_ = nullptr;
+  slabs_ = nullptr;
+  freed_ = (FreedChunk **) __sanitizer::MmapOrDie((1 << FREED_BITS) * sizeof(FreedChunk *), "UFO online freed chunks");
+  large_ = nullptr;
+  quarantine_ = (FreedChunk *) __sanitizer::MmapOrDie(Q_SIZE * sizeof(FreedChunk), "UFO online quarantine");
+  q_head_ = 0;
+  cover_ = (__sanitizer::atomic_uint32_t *) __sanitizer::MmapOrDie(
+      (1 << COVER_BITS) * sizeof(__sanitizer::atomic_uint32_t), "UFO online cover");
+  reported_ = (u64 *) __sanitizer::MmapOrDie(REPORTED_SLOTS * sizeof(u64), "UFO online reports");
+  pending_ = (PendingUaf *) __sanitizer::MmapOrDie(PENDING_SLOTS * sizeof(PendingUaf), "UFO online pending");
+  n_pending_ = 0;
+  pending_frees_ = (PendingFree **) __sanitizer::MmapOrDie(PENDING_SLOTS * sizeof(PendingFree *),
+                                                         "UFO online pending frees");
+  free_nodes_ = (PendingFree *) __sanitizer::MmapOrDie(PENDING_SLOTS * sizeof(PendingFree), "UFO online pending frees");
+  free_nodes_free_ = nullptr;
+  for (u32 i = 0; i < PENDING_SLOTS; ++i) {
+    free_nodes_[i].next = free_nodes_free_;
+    free_nodes_free_ = free_nodes_ + i;
+  }
+  n_pending_frees_ = 0;
+  n_freed_ = 0;
+  // pages touched for the uids in use only
+  analyzed_ = (u64 *) __sanitizer::MmapOrDie(ThreadTable::MAX_UID * sizeof(u64), "UFO online analyzed idx");
+  __sanitizer::atomic_store_relaxed(&n_blocks_, 0);
+  __sanitizer::atomic_store_relaxed(&n_events_, 0);
+  __sanitizer::atomic_store_relaxed(&n_candidates_, 0);
+  __sanitizer::atomic_store_relaxed(&n_reports_, 0);
+  __sanitizer::atomic_store_relaxed(&n_dropped_, 0);
+}
+
+void OnlineMatcher::destroy() {
+  while (slabs_ != nullptr) {
+    LiveChunk *next = slabs_->next;
+    __tsan::internal_free(slabs_);
+    slabs_ = next;
+  }
+  __sanitizer::UnmapOrDie(live_, (1 << LIVE_BITS) * sizeof(LiveChunk *));
+  __sanitizer::UnmapOrDie(freed_, (1 << FREED_BITS) * sizeof(FreedChunk *));
+  __sanitizer::UnmapOrDie(quarantine_, Q_SIZE * sizeof(FreedChunk));
+  __sanitizer::UnmapOrDie(cover_, (1 << COVER_BITS) * sizeof(__sanitizer::atomic_uint32_t));
+  __sanitizer::UnmapOrDie(reported_, REPORTED_SLOTS * sizeof(u64));
+  __sanitizer::UnmapOrDie(pending_, PENDING_SLOTS * sizeof(PendingUaf));
+  __sanitizer::UnmapOrDie(pending_frees_, PENDING_SLOTS * sizeof(PendingFree *));
+  __sanitizer::UnmapOrDie(free_nodes_, PENDING_SLOTS * sizeof(PendingFree));
+  __sanitizer::UnmapOrDie(analyzed_, ThreadTable::MAX_UID * sizeof(u64));
+  live_ = nullptr;
+  freed_ = nullptr;
+  quarantine_ = nullptr;
+  cover_ = nullptr;
+  reported_ = nullptr;
+  pending_ = nullptr;
+  pending_frees_ = nullptr;
+  free_nodes_ = nullptr;
+  analyzed_ = nullptr;
+}
+
+void OnlineMatcher::print_summary() {
+  Printf("UFO>>> online: %llu blocks, %llu events, %llu use-after-free accesses, %llu reported, "
+             "%llu dropped (reallocated before, or evicted before confirmed, or frees without allocation)\r\n",
+         atomic_load_relaxed(&n_blocks_), atomic_load_relaxed(&n_events_),
+         atomic_load_relaxed(&n_candidates_), atomic_load_relaxed(&n_reports_),
+         atomic_load_relaxed(&n_dropped_));
+}
+
+LiveChunk *OnlineMatcher::new_live() {
+  if (live_free_ == nullptr) {
+    LiveChunk *slab = (LiveChunk *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, SLAB_SIZE * sizeof(LiveChunk));
+    slab->next = slabs_;
+    slabs_ = slab;
+    for (u32 i = 1; i < SLAB_SIZE; ++i) {
+      slab[i].next = live_free_;
+      live_free_ = slab + i;
+    }
+  }
+  LiveChunk *c = live_free_;
+  live_free_ = c->next;
+  return c;
+}
+
+void OnlineMatcher::set_cover(const FreedChunk *c, bool add) {
+  u64 first = c->addr >> PAGE_SHIFT;
+  u64 last = (c->addr + (c->size > 0 ? c->size - 1 : 0)) >> PAGE_SHIFT;
+  // huge chunks: only the beginning is watched
+  if (last - first >= (1 << 16))
+    last = first + (1 << 16) - 1;
+  for (u64 pg = first; pg <= last; ++pg) {
+    if (add)
+      atomic_fetch_add(cover_ + cover_of(pg), 1, memory_order_relaxed);
+    else
+      atomic_fetch_sub(cover_ + cover_of(pg), 1, memory_order_relaxed);
+  }
+}
+
+static bool _is_small(const FreedChunk *c) {
+  u64 first = c->addr >> OnlineMatcher::PAGE_SHIFT;
+  u64 last = (c->addr + (c->size > 0 ? c->size - 1 : 0)) >> OnlineMatcher::PAGE_SHIFT;
+  return last - first < OnlineMatcher::SMALL_PAGES;
+}
+
+// lock held
+void OnlineMatcher::evict(FreedChunk *c) {
+  FreedChunk **pp = _is_small(c) ? freed_ + hash(c->addr >> PAGE_SHIFT, FREED_BITS) : &large_;
+  while (*pp != nullptr && *pp != c)
+    pp = &(*pp)->next;
+  if (*pp == c)
+    *pp = c->next;
+  set_cover(c, false);
+  c->in_use = false;
+}
+
+void OnlineMatcher::on_alloc(u32 tid, u64 idx, u64 addr, u64 pc, u32 size) {
+  __sanitizer::SpinMutexLock l(&mtx_);
+  LiveChunk *c = new_live();
+  c->addr = addr;
+  c->alloc_idx = idx;
+  c->alloc_pc = pc;
+  c->size = size;
+  c->alloc_tid = tid;
+  LiveChunk **head = live_ + hash(addr, LIVE_BITS);
+  c->next = *head;
+  *head = c;
+  mark_reused(addr, size, idx);
+  if (n_pending_frees_ > 0)
+    match_pending_free(addr, idx);
+}
+
+// lock held
+void OnlineMatcher::add_pending_free(u32 tid, u64 idx, u64 addr, u64 pc) {
+  PendingFree *f = free_nodes_free_;
+  if (f == nullptr) {
+    atomic_fetch_add(&n_dropped_, 1, memory_order_relaxed);
+    return;
+  }
+  free_nodes_free_ = f->next;
+  f->addr = addr;
+  f->idx = idx;
+  f->pc = pc;
+  f->tid = tid;
+  PendingFree **head = pending_frees_ + hash(addr, PENDING_BITS);
+  f->next = *head;
+  *head = f;
+  ++n_pending_frees_;
+}
+
+// lock held
+void OnlineMatcher::match_pending_free(u64 addr, u64 idx) {
+  // the first free after the allocation
+  PendingFree **match = nullptr;
+  for (PendingFree **pp = pending_frees_ + hash(addr, PENDING_BITS); *pp != nullptr; pp = &(*pp)->next) {
+    PendingFree *f = *pp;
+    if (f->addr == addr && f->idx > idx && (match == nullptr || f->idx < (*match)->idx))
+      match = pp;
+  }
+  if (match == nullptr)
+    return;
+  PendingFree *f = *match;
+  *match = f->next;
+  --n_pending_frees_;
+  quarantine(f->tid, f->idx, addr, f->pc);
+  f->next = free_nodes_free_;
+  free_nodes_free_ = f;
+}
+
+// lock held
+void OnlineMatcher::mark_reused(u64 addr, u32 size, u64 idx) {
+  u64 end = addr + (size > 0 ? size : 1);
+  u64 first = addr >> PAGE_SHIFT;
+  u64 last = (end - 1) >> PAGE_SHIFT;
+  if (last - first < 64) {
+    u64 pg = first >= SMALL_PAGES - 1 ? first - (SMALL_PAGES - 1) : 0;
+    for (; pg <= last; ++pg) {
+      for (FreedChunk *c = freed_[hash(pg, FREED_BITS)]; c != nullptr; c = c->next) {
+        if (c->addr < end && addr < c->addr + c->size && c->free_idx < idx && idx < c->reuse_idx)
+          c->reuse_idx = idx;
+      }
+    }
+  } else {
+    for (u32 i = 0; i < Q_SIZE; ++i) {
+      FreedChunk *c = quarantine_ + i;
+      if (c->in_use && _is_small(c)
+          && c->addr < end && addr < c->addr + c->size && c->free_idx < idx && idx < c->reuse_idx)
+        c->reuse_idx = idx;
+    }
+  }
+  for (FreedChunk *c = large_; c != nullptr; c = c->next) {
+    if (c->addr < end && addr < c->addr + c->size && c->free_idx < idx && idx < c->reuse_idx)
+      c->reuse_idx = idx;
+  }
+}
+
+void OnlineMatcher::on_dealloc(u32 tid, u64 idx, u64 addr, u64 pc) {
+  __sanitizer::SpinMutexLock l(&mtx_);
+  // allocated by another thread, not analyzed yet, or before tracing
+  if (!quarantine(tid, idx, addr, pc))
+    add_pending_free(tid, idx, addr, pc);
+}
+
+// lock held
+bool OnlineMatcher::quarantine(u32 tid, u64 idx, u64 addr, u64 pc) {
+  // the chunk freed is the last one allocated at addr before idx,
+  // a later allocation at addr may be analyzed before this free.
+  LiveChunk **head = live_ + hash(addr, LIVE_BITS);
+  LiveChunk **freed = nullptr;
+  u64 reuse = NOT_REUSED;
+  for (LiveChunk **pp = head; *pp != nullptr; pp = &(*pp)->next) {
+    LiveChunk *c = *pp;
+    if (c->addr != addr)
+      continue;
+    if (c->alloc_idx < idx) {
+      if (freed == nullptr || (*freed)->alloc_idx < c->alloc_idx)
+        freed = pp;
+    } else if (c->alloc_idx < reuse) {
+      reuse = c->alloc_idx;
+    }
+  }
+  if (freed == nullptr)
+    return false;
+  LiveChunk *lc = *freed;
+  *freed = lc->next;
+
+  FreedChunk *fc = quarantine_ + (q_head_++ & (Q_SIZE - 1));
+  if (fc->in_use)
+    evict(fc);
+  fc->addr = addr;
+  fc->size = lc->size;
+  fc->alloc_pc = lc->alloc_pc;
+  fc->alloc_tid = lc->alloc_tid;
+  fc->free_idx = idx;
+  fc->free_pc = pc;
+  fc->free_tid = tid;
+  fc->reuse_idx = reuse;
+  fc->in_use = true;
+  fc->gen = ++n_freed_;
+  FreedChunk **pp = _is_small(fc) ? freed_ + hash(addr >> PAGE_SHIFT, FREED_BITS) : &large_;
+  fc->next = *pp;
+  *pp = fc;
+  set_cover(fc, true);
+
+  lc->next = live_free_;
+  live_free_ = lc;
+  return true;
+}
+
+// lock held
+bool OnlineMatcher::check(FreedChunk *c, u32 tid, u64 idx, u64 addr, u64 pc, u32 size, bool is_write) {
+  if (!(c->addr < addr + size && addr < c->addr + c->size))
+    return false;
+  if (!(c->free_idx < idx && idx < c->reuse_idx))
+    return false;
+  atomic_fetch_add(&n_candidates_, 1, memory_order_relaxed);
+
+  // report each (access pc, free pc) once, the first candidate is kept until confirmed
+  u64 key = (pc * 31 + c->free_pc) | 1;
+  u32 slot = hash(key, 12);
+  for (u32 i = 0; i < REPORTED_SLOTS; ++i, slot = (slot + 1) & (REPORTED_SLOTS - 1)) {
+    if (reported_[slot] == key)
+      return true;
+    if (reported_[slot] == 0)
+      break;
+  }
+  slot = hash(key, PENDING_BITS);
+  for (u32 i = 0; i < PENDING_SLOTS; ++i, slot = (slot + 1) & (PENDING_SLOTS - 1)) {
+    PendingUaf &u = pending_[slot];
+    if (u.key == key) {
+      if (idx < u.idx && (u.chunk != c || u.gen != c->gen)) {
+        // an earlier access of another chunk: confirmed sooner
+        u.chunk = c;
+        u.gen = c->gen;
+        u.idx = idx;
+        u.addr = addr;
+        u.tid = tid;
+        u.size = size;
+        u.is_write = is_write;
+      }
+      return true;
+    }
+    if (u.key == 0) {
+      u.key = key;
+      u.chunk = c;
+      u.gen = c->gen;
+      u.idx = idx;
+      u.addr = addr;
+      u.pc = pc;
+      u.tid = tid;
+      u.size = size;
+      u.is_write = is_write;
+      ++n_pending_;
+      return true;
+    }
+  }
+  // table full, count only
+  atomic_fetch_add(&n_dropped_, 1, memory_order_relaxed);
+  return true;
+}
+
+// lock held
+bool OnlineMatcher::mark_reported(u64 key) {
+  u32 slot = hash(key, 12);
+  for (u32 i = 0; i < REPORTED_SLOTS; ++i, slot = (slot + 1) & (REPORTED_SLOTS - 1)) {
+    if (reported_[slot] == key)
+      return true;
+    if (reported_[slot] == 0) {
+      reported_[slot] = key;
+      return false;
+    }
+  }
+  return false; // table full, reported again
+}
+
+void OnlineMatcher::report(const PendingUaf &u) {
+  const FreedChunk *c = u.chunk;
+  atomic_fetch_add(&n_reports_, 1, memory_order_relaxed);
+  Printf("UFO>>> use after free: #%u %s %u bytes at %p  pc:%p idx:%llu\r\n"
+             "      freed by #%u  pc:%p idx:%llu\r\n"
+             "      allocated by #%u  pc:%p  chunk %p size %u\r\n",
+         u.tid, u.is_write ? "write" : "read", u.size, (void *) u.addr, (void *) u.pc, u.idx,
+         c->free_tid, (void *) c->free_pc, c->free_idx,
+         c->alloc_tid, (void *) c->alloc_pc, (void *) c->addr, c->size);
+}
+
+// lock held
+void OnlineMatcher::resolve(bool all) {
+  // every event before min_idx has been analyzed
+  u64 min_idx = ~0ull;
+  if (!all) {
+    const ThreadTable *threads = uctx->threads;
+    if (threads == nullptr)
+      return; // destroyed, see resolve_all()
+    u32 n = threads->n_uids();
+    for (u32 i = 0; i < n; ++i) {
+      if (analyzed_[i] < min_idx)
+        min_idx = analyzed_[i];
+    }
+  }
+  // every allocation before the free was analyzed
+  for (u32 i = 0; i < PENDING_SLOTS && n_pending_frees_ > 0; ++i) {
+    PendingFree **pp = pending_frees_ + i;
+    while (*pp != nullptr) {
+      PendingFree *f = *pp;
+      if (!all && min_idx < f->idx) {
+        pp = &f->next;
+        continue;
+      }
+      *pp = f->next;
+      --n_pending_frees_;
+      atomic_fetch_add(&n_dropped_, 1, memory_order_relaxed);
+      f->next = free_nodes_free_;
+      free_nodes_free_ = f;
+    }
+  }
+  for (u32 i = 0; i < PENDING_SLOTS && n_pending_ > 0; ++i) {
+    PendingUaf &u = pending_[i];
+    if (u.key == 0)
+      continue;
+    const FreedChunk *c = u.chunk;
+    bool evicted = !c->in_use || c->gen != u.gen;
+    if (!evicted && u.idx < c->reuse_idx && !all && min_idx <= u.idx)
+      continue;
+    if (evicted || u.idx >= c->reuse_idx) {
+      atomic_fetch_add(&n_dropped_, 1, memory_order_relaxed);
+    } else if (!mark_reported(u.key)) {
+      report(u);
+    }
+    u.key = 0;
+    --n_pending_;
+  }
+  // open addressing: re-insert the remaining entries so that lookups do not stop at the holes
+  if (n_pending_ > 0) {
+    for (u32 i = 0; i < PENDING_SLOTS; ++i) {
+      PendingUaf u = pending_[i];
+      if (u.key == 0)
+        continue;
+      pending_[i].key = 0;
+      u32 slot = hash(u.key, PENDING_BITS);
+      while (pending_[slot].key != 0)
+        slot = (slot + 1) & (PENDING_SLOTS - 1);
+      pending_[slot] = u;
+    }
+  }
+}
+
+void OnlineMatcher::resolve_all() {
+  __sanitizer::SpinMutexLock l(&mtx_);
+  resolve(true);
+}
+
+void OnlineMatcher::match(u32 tid, u64 idx, u64 addr, u64 pc, u32 size, bool is_write) {
+  __sanitizer::SpinMutexLock l(&mtx_);
+  u64 first = addr >> PAGE_SHIFT;
+  u64 last = (addr + (size > 0 ? size - 1 : 0)) >> PAGE_SHIFT;
+  if (last - first > 64)
+    last = first + 64;
+  u64 pg = first >= SMALL_PAGES - 1 ? first - (SMALL_PAGES - 1) : 0;
+  for (; pg <= last; ++pg) {
+    for (FreedChunk *c = freed_[hash(pg, FREED_BITS)]; c != nullptr; c = c->next) {
+      if (check(c, tid, idx, addr, pc, size, is_write))
+        return;
+    }
+  }
+  for (FreedChunk *c = large_; c != nullptr; c = c->next) {
+    if (check(c, tid, idx, addr, pc, size, is_write))
+      return;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// block decoding, see Encoding in ufo_interface.h
+
+ALWAYS_INLINE
+static u64 _varint(const Byte *&p) {
+  u64 v = 0;
+  u32 shift = 0;
+  Byte b;
+  do {
+    b = *p++;
+    v |= (u64) (b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return v;
+}
+
+ALWAYS_INLINE
+static u64 _unzigzag(u64 v) {
+  return (v >> 1) ^ (~(v & 1) + 1);
+}
+
+static u32 _raw_size(u8 type) {
+  switch (type) {
+    case EventType::ThreadBegin: return sizeof(ThreadBeginEvent);
+    case EventType::ThreadEnd: return sizeof(ThreadEndEvent);
+    case EventType::ThreadCreate: return sizeof(CreateThreadEvent);
+    case EventType::ThreadJoin: return sizeof(JoinThreadEvent);
+    case EventType::ThreadAcqLock: return sizeof(LockEvent);
+    case EventType::ThreadRelLock: return sizeof(UnlockEvent);
+    case EventType::MemAlloc: return sizeof(AllocEvent);
+    case EventType::MemDealloc: return sizeof(DeallocEvent);
+    case EventType::MemRead:
+    case EventType::MemWrite: return sizeof(MemAccEvent);
+    case EventType::MemRangeRead:
+    case EventType::MemRangeWrite: return sizeof(MemRangeAccEvent);
+    case EventType::PtrAssignment: return sizeof(PtrAssignEvent);
+    case EventType::EnterFunc: return sizeof(FuncEntryEvent);
+    case EventType::ExitFunc: return sizeof(FuncExitEvent);
+    case EventType::ThrCondWait: return sizeof(ThrCondWaitEvent);
+    case EventType::ThrCondSignal: return sizeof(ThrCondSignalEvent);
+    case EventType::ThrCondBC: return sizeof(ThrCondBCEvent);
+    case EventType::PtrDeRef: return sizeof(PtrDeRefEvent);
+    case EventType::PcDef: return sizeof(PcDefEvent);
+    case EventType::MemAtomic: return sizeof(AtomicEvent);
+    default: return 0;
+  }
+}
+
+void OnlineMatcher::analyze(u32 uid, const Byte *data, u64 len, bool last) {
+  const bool compact = (encoding_ & EncodingCompact) != 0;
+  const bool pc_dict = (encoding_ & EncodingPcDict) != 0;
+  // the dictionary is reset by each block
+  u64 *pcs = pc_dict && len > 0 ? (u64 *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, PC_DICT_MAX_ID * sizeof(u64))
+                                 : nullptr;
+  u64 max_idx = 0;
+  u64 pred_idx = 0;
+  u64 pred_addr = 0;
+  u64 pred_pc = 0;
+  u64 n_events = 0;
+
+  const Byte *p = data;
+  const Byte *end = data + len;
+  while (p < end) {
+    const u8 ti = *p;
+    const u8 type = ti & 0x3f;
+    ++n_events;
+    if (compact && (type == EventType::MemRead || type == EventType::MemWrite
+                    || type == EventType::MemRangeRead || type == EventType::MemRangeWrite
+                    || type == EventType::MemAlloc || type == EventType::MemDealloc
+                    || type == EventType::ThreadAcqLock || type == EventType::ThreadRelLock
+                    || type == EventType::ThrCondWait || type == EventType::ThrCondSignal
+                    || type == EventType::ThrCondBC
+                    || type == EventType::EnterFunc || type == EventType::MemAtomic)) {
+      ++p;
+      u64 idx = 0;
+      if (type != EventType::ThreadRelLock && type != EventType::EnterFunc
+          && type != EventType::ThrCondSignal && type != EventType::ThrCondBC) {
+        pred_idx += _varint(p);
+        idx = pred_idx;
+        max_idx = idx;
+      }
+      u64 addr = 0;
+      if (type != EventType::EnterFunc) {
+        pred_addr += _unzigzag(_varint(p));
+        addr = pred_addr;
+      }
+      u64 pc;
+      if (pc_dict) {
+        pc = pcs[_varint(p) & (PC_DICT_MAX_ID - 1)];
+      } else {
+        pred_pc += _unzigzag(_varint(p));
+        pc = pred_pc;
+      }
+
+      if (type == EventType::MemRead || type == EventType::MemWrite) {
+        u32 sz = 1u << (ti >> 6);
+        on_access(uid, idx, addr, pc, sz, type == EventType::MemWrite);
+        if (has_value_)
+          p += sz;
+      } else if (type == EventType::MemRangeRead || type == EventType::MemRangeWrite) {
+        u32 sz = (u32) _varint(p);
+        on_access(uid, idx, addr, pc, sz, type == EventType::MemRangeWrite);
+      } else if (type == EventType::MemAlloc) {
+        u32 sz = *((const u32 *) p);
+        p += 4;
+        on_alloc(uid, idx, addr, pc, sz);
+      } else if (type == EventType::MemDealloc) {
+        on_dealloc(uid, idx, addr, pc);
+      } else if (type == EventType::ThrCondWait) {
+        _varint(p); // mtx
+      } else if (type == EventType::MemAtomic) {
+        u8 op = *p++ & 7;
+        if (op != AtomicOpFence)
+          on_access(uid, idx, addr, pc, 1u << (ti >> 6), op != AtomicOpLoad);
+      }
+      continue;
+    }
+
+    u32 sz = _raw_size(type);
+    if (UNLIKELY(sz == 0 || p + sz > end)) {
+      Printf("UFO>>> online: #%u unknown event type %u, block dropped\r\n", uid, (u32) ti);
+      break;
+    }
+    if (type == EventType::MemRead || type == EventType::MemWrite
+        || type == EventType::MemRangeRead || type == EventType::MemRangeWrite
+        || type == EventType::MemAlloc || type == EventType::MemDealloc || type == EventType::MemAtomic
+        || type == EventType::ThreadAcqLock || type == EventType::ThrCondWait) {
+      // the idx follows the type byte
+      const u64 idx = ((const MemAccEvent *) p)->idx;
+      if (idx > max_idx)
+        max_idx = idx;
+    }
+    switch (type) {
+      case EventType::MemRead:
+      case EventType::MemWrite: {
+        const MemAccEvent *e = (const MemAccEvent *) p;
+        u32 vsz = 1u << (ti >> 6);
+        on_access(uid, e->idx, e->addr, e->pc, vsz, type == EventType::MemWrite);
+        if (has_value_)
+          sz += vsz;
+        break;
+      }
+      case EventType::MemRangeRead:
+      case EventType::MemRangeWrite: {
+        const MemRangeAccEvent *e = (const MemRangeAccEvent *) p;
+        on_access(uid, e->idx, e->addr, e->pc, e->size, type == EventType::MemRangeWrite);
+        break;
+      }
+      case EventType::MemAlloc: {
+        const AllocEvent *e = (const AllocEvent *) p;
+        on_alloc(uid, e->idx, e->addr, e->pc, e->size);
+        break;
+      }
+      case EventType::MemDealloc: {
+        const DeallocEvent *e = (const DeallocEvent *) p;
+        on_dealloc(uid, e->idx, e->addr, e->pc);
+        break;
+      }
+      case EventType::MemAtomic: {
+        const AtomicEvent *e = (const AtomicEvent *) p;
+        u8 op = e->op_mo & 7;
+        if (op != AtomicOpFence)
+          on_access(uid, e->idx, e->addr, e->pc, 1u << (ti >> 6), op != AtomicOpLoad);
+        break;
+      }
+      case EventType::PcDef: {
+        const PcDefEvent *e = (const PcDefEvent *) p;
+        pcs[e->id & (PC_DICT_MAX_ID - 1)] = e->pc;
+        --n_events;
+        break;
+      }
+      default:
+        break;
+    }
+    p += sz;
+  }
+  if (pcs != nullptr)
+    __tsan::internal_free(pcs);
+
+  __sanitizer::SpinMutexLock l(&mtx_);
+  if (last)
+    analyzed_[uid] = ~0ull;
+  else if (max_idx > analyzed_[uid])
+    analyzed_[uid] = max_idx;
+  if (n_pending_ > 0 || n_pending_frees_ > 0)
+    resolve(false);
+  if (len > 0) {
+    atomic_fetch_add(&n_blocks_, 1, memory_order_relaxed);
+    atomic_fetch_add(&n_events_, n_events, memory_order_relaxed);
+  }
+}
+
+} // ns ufo
+} // ns bw
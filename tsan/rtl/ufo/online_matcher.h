@@ -0,0 +1,202 @@
+//
+// Created by xkommando on 3/30/17.
+//
+
+#ifndef UFO_ONLINE_MATCHER_H
+#define UFO_ONLINE_MATCHER_H
+
+#include "../../../sanitizer_common/sanitizer_atomic.h"
+#include "../../../sanitizer_common/sanitizer_mutex.h"
+#include "../tsan_defs.h"
+#include "defs.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u8;
+using __sanitizer::u32;
+using __sanitizer::u64;
+
+// chunk allocated by the program, keyed by its address
+struct LiveChunk {
+  u64 addr;
+  u64 alloc_idx;
+  u64 alloc_pc;
+  u32 size;
+  u32 alloc_tid;
+  LiveChunk *next;
+};
+
+// freed chunk kept in quarantine until evicted
+struct FreedChunk {
+  u64 addr;
+  u64 alloc_pc;
+  u64 free_idx;
+  u64 free_pc;
+  // idx of the first allocation reusing this memory, ~0 if not reused
+  u64 reuse_idx;
+  u32 size;
+  u32 alloc_tid;
+  u32 free_tid;
+  bool in_use;
+  // number of the free, the slot is reused for another chunk when evicted
+  u64 gen;
+  FreedChunk *next;
+};
+
+// access to a freed chunk, reported once no allocation before it can still be analyzed
+struct PendingUaf {
+  // (access pc, free pc), 0 if the slot is empty
+  u64 key;
+  FreedChunk *chunk;
+  u64 gen;
+  u64 idx;
+  u64 addr;
+  u64 pc;
+  u32 tid;
+  u32 size;
+  bool is_write;
+};
+
+// free analyzed before the allocation of its chunk (another thread), matched when the allocation arrives
+struct PendingFree {
+  u64 addr;
+  u64 idx;
+  u64 pc;
+  u32 tid;
+  PendingFree *next;
+};
+
+/**
+ * UFO_ONLINE: blocks are analyzed by the io workers instead of written to files, then dropped.
+ *
+ * interval index of the heap built from AllocEvent/DeallocEvent:
+ * live chunks in a hash table keyed by address,
+ * the last Q_SIZE freed chunks in buckets keyed by their first page (chunks up to SMALL_PAGES pages)
+ * or in a list (larger chunks), with a page coverage filter checked without lock.
+ *
+ * an access (MemAccEvent, MemRangeAccEvent) to a freed chunk is a candidate if it comes after the free
+ * and before the memory is allocated again, by idx.
+ * threads are analyzed in the order their blocks are flushed: a free seen after the accesses that follow it
+ * in another thread is missed, and a reallocation before the access may not be analyzed yet.
+ * so a candidate is pending until every thread has been analyzed up to its idx (analyzed_, the idx of the
+ * thread only grows), then reported if the chunk was not reallocated before it. the first candidate of each
+ * (access pc, free pc) is kept, a candidate whose chunk left the quarantine is dropped (no false positive).
+ * pending candidates of threads that never flush again are reported at exit, see resolve_all().
+ * likewise a free analyzed before the allocation of its chunk (allocated by another thread) is pending until
+ * every thread has been analyzed up to its idx, then dropped as allocated before tracing.
+ * accesses analyzed before such a free is matched are missed.
+ */
+struct OnlineMatcher {
+  static const u32 PAGE_SHIFT = 12;
+  static const u32 SMALL_PAGES = 8;
+  static const u32 LIVE_BITS = 20;
+  static const u32 FREED_BITS = 16;
+  static const u32 COVER_BITS = 20;
+  static const u32 Q_SIZE = 1 << 16;
+  static const u32 REPORTED_SLOTS = 1 << 12;
+  static const u32 PENDING_SLOTS = 1 << 12;
+  static const u32 PENDING_BITS = 12;
+  static const u32 SLAB_SIZE = 4096;
+
+  u8 encoding_;
+  bool has_value_;
+
+  __sanitizer::SpinMutex mtx_;
+  LiveChunk **live_;
+  LiveChunk *live_free_;
+  // slabs of LiveChunk, linked by their first node
+  LiveChunk *slabs_;
+  FreedChunk **freed_;
+  FreedChunk *large_;
+  FreedChunk *quarantine_;
+  u32 q_head_;
+  // number of freed chunks covering a page (hashed), read without lock
+  __sanitizer::atomic_uint32_t *cover_;
+  // (access pc, free pc) already reported
+  u64 *reported_;
+  PendingUaf *pending_;
+  u32 n_pending_;
+  // frees without a live chunk yet, by address, and their nodes
+  PendingFree **pending_frees_;
+  PendingFree *free_nodes_;
+  PendingFree *free_nodes_free_;
+  u32 n_pending_frees_;
+  u64 n_freed_;
+  // per uid: the events with a larger idx are not analyzed yet, ~0 once the thread ended
+  u64 *analyzed_;
+
+  __sanitizer::atomic_uint64_t n_blocks_;
+  __sanitizer::atomic_uint64_t n_events_;
+  __sanitizer::atomic_uint64_t n_candidates_;
+  __sanitizer::atomic_uint64_t n_reports_;
+  __sanitizer::atomic_uint64_t n_dropped_;
+
+  void init(u8 encoding, bool has_value);
+
+  void destroy();
+
+  // decode and match one block of thread uid, thread safe. last: the thread ended
+  void analyze(u32 uid, const Byte *data, u64 len, bool last = false);
+
+  // all blocks were analyzed, report the pending candidates
+  void resolve_all();
+
+  void print_summary();
+
+  void on_alloc(u32 tid, u64 idx, u64 addr, u64 pc, u32 size);
+
+  void on_dealloc(u32 tid, u64 idx, u64 addr, u64 pc);
+
+  ALWAYS_INLINE
+  void on_access(u32 tid, u64 idx, u64 addr, u64 pc, u32 size, bool is_write) {
+    if (LIKELY(__sanitizer::atomic_load_relaxed(cover_ + cover_of(addr >> PAGE_SHIFT)) == 0
+               && __sanitizer::atomic_load_relaxed(cover_ + cover_of((addr + (size > 0 ? size - 1 : 0)) >> PAGE_SHIFT)) == 0))
+      return;
+    match(tid, idx, addr, pc, size, is_write);
+  }
+
+private:
+  ALWAYS_INLINE
+  static u32 hash(u64 key, u32 bits) {
+    return (u32) ((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+  }
+
+  ALWAYS_INLINE
+  static u32 cover_of(u64 page) {
+    return hash(page, COVER_BITS);
+  }
+
+  void match(u32 tid, u64 idx, u64 addr, u64 pc, u32 size, bool is_write);
+
+  bool check(FreedChunk *c, u32 tid, u64 idx, u64 addr, u64 pc, u32 size, bool is_write);
+
+  // report the pending candidates older than every thread, or all of them. lock held
+  void resolve(bool all);
+
+  // move the last chunk allocated at addr before idx to the quarantine, false if none. lock held
+  bool quarantine(u32 tid, u64 idx, u64 addr, u64 pc);
+
+  void add_pending_free(u32 tid, u64 idx, u64 addr, u64 pc);
+
+  // the pending free of the chunk allocated at addr with idx, if any
+  void match_pending_free(u64 addr, u64 idx);
+
+  void report(const PendingUaf &u);
+
+  // key already reported, or reported now
+  bool mark_reported(u64 key);
+
+  void mark_reused(u64 addr, u32 size, u64 idx);
+
+  void set_cover(const FreedChunk *c, bool add);
+
+  void evict(FreedChunk *c);
+
+  LiveChunk *new_live();
+};
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_ONLINE_MATCHER_H
@@ -0,0 +1,100 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#include <string.h>
+
+#include "snappy_decompress.h"
+
+namespace bw {
+namespace ufo {
+namespace reader {
+
+// varint32 preamble
+static const uint8_t *read_preamble(const uint8_t *p, const uint8_t *end, size_t *out) {
+  uint32_t v = 0;
+  for (uint32_t shift = 0; shift <= 28 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint32_t) (b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      *out = v;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+bool snappy_uncompressed_length(const uint8_t *src, size_t len, size_t *out_len) {
+  return read_preamble(src, src + len, out_len) != nullptr;
+}
+
+bool snappy_uncompress(const uint8_t *src, size_t len, uint8_t *out) {
+  const uint8_t *p = src;
+  const uint8_t *end = src + len;
+  size_t out_len;
+  p = read_preamble(p, end, &out_len);
+  if (p == nullptr)
+    return false;
+
+  uint8_t *op = out;
+  uint8_t *op_end = out + out_len;
+  while (p < end) {
+    const uint8_t tag = *p++;
+    size_t n;
+    size_t offset;
+    switch (tag & 3) {
+      case 0: { // literal
+        n = tag >> 2;
+        if (n >= 60) {
+          size_t bytes = n - 59;
+          if (p + bytes > end)
+            return false;
+          n = 0;
+          for (size_t i = 0; i < bytes; ++i)
+            n |= (size_t) p[i] << (8 * i);
+          p += bytes;
+        }
+        n += 1;
+        if (p + n > end || op + n > op_end)
+          return false;
+        memcpy(op, p, n);
+        op += n;
+        p += n;
+        continue;
+      }
+      case 1: // copy, 1 byte offset
+        if (p + 1 > end)
+          return false;
+        n = 4 + ((tag >> 2) & 7);
+        offset = ((size_t) (tag >> 5) << 8) | p[0];
+        p += 1;
+        break;
+      case 2: // copy, 2 byte offset
+        if (p + 2 > end)
+          return false;
+        n = (tag >> 2) + 1;
+        offset = (size_t) p[0] | ((size_t) p[1] << 8);
+        p += 2;
+        break;
+      default: // copy, 4 byte offset
+        if (p + 4 > end)
+          return false;
+        n = (tag >> 2) + 1;
+        offset = (size_t) p[0] | ((size_t) p[1] << 8) | ((size_t) p[2] << 16) | ((size_t) p[3] << 24);
+        p += 4;
+        break;
+    }
+    if (offset == 0 || offset > (size_t) (op - out) || op + n > op_end)
+      return false;
+    // may overlap, byte by byte
+    const uint8_t *from = op - offset;
+    for (size_t i = 0; i < n; ++i)
+      op[i] = from[i];
+    op += n;
+  }
+  return op == op_end;
+}
+
+} // ns reader
+} // ns ufo
+} // ns bw
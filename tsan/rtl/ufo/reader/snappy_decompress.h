@@ -0,0 +1,25 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#ifndef UFO_READER_SNAPPY_DECOMPRESS_H
+#define UFO_READER_SNAPPY_DECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace bw {
+namespace ufo {
+namespace reader {
+
+// uncompressed length stored in the preamble, false if malformed
+bool snappy_uncompressed_length(const uint8_t *src, size_t len, size_t *out_len);
+
+// out must hold snappy_uncompressed_length() bytes, false if malformed
+bool snappy_uncompress(const uint8_t *src, size_t len, uint8_t *out);
+
+} // ns reader
+} // ns ufo
+} // ns bw
+
+#endif //UFO_READER_SNAPPY_DECOMPRESS_H
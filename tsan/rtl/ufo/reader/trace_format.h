@@ -0,0 +1,145 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#ifndef UFO_READER_TRACE_FORMAT_H
+#define UFO_READER_TRACE_FORMAT_H
+
+#include <stdint.h>
+
+// on-disk format written by the runtime, see ../ufo_interface.h
+// the reader does not depend on the sanitizer headers, keep both in sync.
+
+namespace bw {
+namespace ufo {
+namespace reader {
+
+const uint64_t TRACE_VERSION = 20170425;
+
+enum EventType {
+  ThreadBegin = 0,
+  ThreadEnd,
+  ThreadCreate = 2,
+  ThreadJoin,
+  ThreadAcqLock,
+  ThreadRelLock = 5,
+  MemAlloc,
+  MemDealloc,
+  MemRead = 8,
+  MemWrite,
+  MemRangeRead = 10,
+  MemRangeWrite,
+  PtrAssignment = 12,
+  TLHeader,
+  InfoPacket,
+  EnterFunc = 15,
+  ExitFunc,
+  ThrCondWait,
+  ThrCondSignal = 18,
+  ThrCondBC,
+  PtrDeRef = 20,
+  PcDef,
+  MemAtomic,
+  N_EVENT_TYPES
+};
+
+enum Encoding {
+  EncodingRaw = 0,
+  EncodingCompact = 1,
+  EncodingPcDict = 2,
+  EncodingNoValue = 4
+};
+
+const uint32_t PC_DICT_MAX_ID = 1 << 12;
+
+#pragma pack(push, 1)
+struct Header {
+  uint8_t type_index;
+  uint64_t version;
+  uint32_t tid;
+  uint64_t timestamp;
+  uint32_t length; // not 0: blocks are snappy compressed
+  uint8_t clock_mode;
+  uint8_t encoding;
+  // not 0: memory accesses are sampled (UFO_SAMPLE), see ../sampler.h
+  uint32_t sample_burst;
+  uint32_t sample_decay;
+  uint32_t sample_max_period;
+};
+
+// index after the last block, see BlockSummary in ../ufo_interface.h
+struct BlockSummary {
+  uint64_t offset; // file offset of the block, length prefix included
+  uint32_t length; // bytes in the file, length prefix included
+  uint64_t min_idx;
+  uint64_t max_idx;
+  uint64_t min_addr;
+  uint64_t max_addr; // exclusive
+  uint32_t n_alloc;
+  uint32_t n_dealloc;
+  uint32_t n_lock;
+  uint32_t n_skipped; // memory accesses not traced by UFO_SAMPLE
+};
+
+struct IndexTrailer {
+  uint64_t footer_off;
+  uint32_t count;
+  uint32_t magic;
+};
+#pragma pack(pop)
+static_assert(sizeof(Header) == 39, "header must be packed");
+static_assert(sizeof(BlockSummary) == 60, "summary must be packed");
+static_assert(sizeof(IndexTrailer) == 16, "trailer must be packed");
+
+const uint32_t INDEX_MAGIC = 0x58444955; // "UIDX"
+
+// size of the raw event (value of MemRead/MemWrite excluded), 0 if unknown
+inline uint32_t raw_event_size(uint8_t type) {
+  switch (type) {
+    case ThreadBegin: return 35;
+    case ThreadEnd: return 9;
+    case ThreadCreate: return 15;
+    case ThreadJoin: return 15;
+    case ThreadAcqLock: return 19;
+    case ThreadRelLock: return 13;
+    case MemAlloc: return 23;
+    case MemDealloc: return 19;
+    case MemRead:
+    case MemWrite: return 19;
+    case MemRangeRead:
+    case MemRangeWrite: return 23;
+    case PtrAssignment: return 13;
+    case EnterFunc: return 7;
+    case ExitFunc: return 1;
+    case ThrCondWait: return 25;
+    case ThrCondSignal: return 13;
+    case ThrCondBC: return 13;
+    case PtrDeRef: return 7;
+    case PcDef: return 9;
+    case MemAtomic: return 20;
+    default: return 0;
+  }
+}
+
+// events written with delta/varint fields under EncodingCompact
+inline bool is_compact_type(uint8_t type) {
+  return type == MemRead || type == MemWrite || type == MemRangeRead || type == MemRangeWrite
+         || type == MemAlloc || type == MemDealloc || type == ThreadAcqLock || type == ThreadRelLock
+         || type == ThrCondWait || type == ThrCondSignal || type == ThrCondBC
+         || type == EnterFunc || type == MemAtomic;
+}
+
+// events ordered by the clock (idx)
+inline bool has_idx(uint8_t type) {
+  return type == MemRead || type == MemWrite || type == MemRangeRead || type == MemRangeWrite
+         || type == MemAlloc || type == MemDealloc || type == ThreadAcqLock || type == ThrCondWait
+         || type == MemAtomic;
+}
+
+const char *event_name(uint8_t type);
+
+} // ns reader
+} // ns ufo
+} // ns bw
+
+#endif //UFO_READER_TRACE_FORMAT_H
@@ -0,0 +1,727 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "snappy_decompress.h"
+#include "trace_reader.h"
+
+namespace bw {
+namespace ufo {
+namespace reader {
+
+const char *event_name(uint8_t type) {
+  static const char *names[N_EVENT_TYPES] = {
+      "ThreadBegin", "ThreadEnd", "ThreadCreate", "ThreadJoin", "ThreadAcqLock", "ThreadRelLock",
+      "MemAlloc", "MemDealloc", "MemRead", "MemWrite", "MemRangeRead", "MemRangeWrite",
+      "PtrAssignment", "TLHeader", "InfoPacket", "EnterFunc", "ExitFunc", "ThrCondWait",
+      "ThrCondSignal", "ThrCondBC", "PtrDeRef", "PcDef", "MemAtomic"
+  };
+  return type < N_EVENT_TYPES ? names[type] : "Unknown";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EventBatch::clear() {
+  type.clear();
+  tid.clear();
+  idx.clear();
+  addr.clear();
+  pc.clear();
+  size.clear();
+  aux.clear();
+}
+
+void EventBatch::reserve(size_t n) {
+  type.reserve(n);
+  tid.reserve(n);
+  idx.reserve(n);
+  addr.reserve(n);
+  pc.reserve(n);
+  size.reserve(n);
+  aux.reserve(n);
+}
+
+void EventBatch::push(uint8_t t, uint32_t td, uint64_t i, uint64_t a, uint64_t p, uint32_t sz, uint64_t x) {
+  type.push_back(t);
+  tid.push_back(td);
+  idx.push_back(i);
+  addr.push_back(a);
+  pc.push_back(p);
+  size.push_back(sz);
+  aux.push_back(x);
+}
+
+void EventBatch::push_from(const EventBatch &o, size_t i) {
+  push(o.type[i], o.tid[i], o.idx[i], o.addr[i], o.pc[i], o.size[i], o.aux[i]);
+}
+
+void EventBatch::append(const EventBatch &o) {
+  type.insert(type.end(), o.type.begin(), o.type.end());
+  tid.insert(tid.end(), o.tid.begin(), o.tid.end());
+  idx.insert(idx.end(), o.idx.begin(), o.idx.end());
+  addr.insert(addr.end(), o.addr.begin(), o.addr.end());
+  pc.insert(pc.end(), o.pc.begin(), o.pc.end());
+  size.insert(size.end(), o.size.begin(), o.size.end());
+  aux.insert(aux.end(), o.aux.begin(), o.aux.end());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// little endian fields of the packed events
+
+static inline uint64_t _u48(const uint8_t *p) {
+  uint64_t v = 0;
+  memcpy(&v, p, 6);
+  return v;
+}
+
+static inline uint32_t _u32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint16_t _u16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return v;
+}
+
+static inline uint64_t _value(const uint8_t *p, uint32_t sz) {
+  uint64_t v = 0;
+  memcpy(&v, p, sz);
+  return v;
+}
+
+static inline bool _varint(const uint8_t *&p, const uint8_t *end, uint64_t *out) {
+  uint64_t v = 0;
+  for (uint32_t shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t b = *p++;
+    v |= (uint64_t) (b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline uint64_t _unzigzag(uint64_t v) {
+  return (v >> 1) ^ (~(v & 1) + 1);
+}
+
+// size of the raw event at p including the value, 0 if unknown
+static inline uint32_t _raw_len(const uint8_t *p, bool has_value) {
+  const uint8_t type = p[0] & 0x3f;
+  uint32_t sz = raw_event_size(type);
+  if (has_value && (type == MemRead || type == MemWrite))
+    sz += 1u << (p[0] >> 6);
+  return sz;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TraceFile::TraceFile()
+    : fd_(-1),
+      map_(nullptr),
+      map_len_(0),
+      data_end_(0) {
+  memset(&header_, 0, sizeof(header_));
+}
+
+TraceFile::~TraceFile() {
+  close();
+}
+
+void TraceFile::close() {
+  if (map_ != nullptr) {
+    munmap((void *) map_, map_len_);
+    map_ = nullptr;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  map_len_ = 0;
+  data_end_ = 0;
+  blocks_.clear();
+  summaries_.clear();
+}
+
+bool TraceFile::open(const std::string &path, std::string *err) {
+  close();
+  path_ = path;
+  fd_ = ::open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  map_len_ = (uint64_t) st.st_size;
+  if (map_len_ < sizeof(Header)) {
+    *err = path + ": no header";
+    return false;
+  }
+  void *m = mmap(nullptr, map_len_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (m == MAP_FAILED) {
+    *err = path + ": mmap " + strerror(errno);
+    return false;
+  }
+  map_ = (const uint8_t *) m;
+  madvise(m, map_len_, MADV_SEQUENTIAL);
+
+  memcpy(&header_, map_, sizeof(Header));
+  if (header_.type_index != TLHeader || header_.version != TRACE_VERSION) {
+    *err = path + ": not a trace of version " + std::to_string(TRACE_VERSION);
+    return false;
+  }
+  data_end_ = map_len_;
+  if (read_index(err))
+    return true;
+  if (!err->empty())
+    return false;
+  if (header_.length != 0 || (header_.encoding & EncodingCompact))
+    return index_framed(err);
+  return index_raw(err);
+}
+
+// true if the file ends with a valid index, false with err empty if it has none
+bool TraceFile::read_index(std::string *err) {
+  if (map_len_ < sizeof(Header) + sizeof(IndexTrailer))
+    return false;
+  IndexTrailer t;
+  memcpy(&t, map_ + map_len_ - sizeof(IndexTrailer), sizeof(IndexTrailer));
+  if (t.magic != INDEX_MAGIC || t.footer_off < sizeof(Header)
+      || t.footer_off + (uint64_t) t.count * sizeof(BlockSummary) + sizeof(IndexTrailer) != map_len_)
+    return false;
+
+  const bool compressed = header_.length != 0;
+  const bool framed = compressed || (header_.encoding & EncodingCompact);
+  summaries_.resize(t.count);
+  memcpy(summaries_.data(), map_ + t.footer_off, (size_t) t.count * sizeof(BlockSummary));
+  for (const BlockSummary &s : summaries_) {
+    if (s.offset + s.length > t.footer_off || (framed && s.length < 4)) {
+      *err = path_ + ": bad index";
+      summaries_.clear();
+      return false;
+    }
+    BlockRef b = {s.offset, s.length, compressed};
+    if (framed) {
+      b.offset += 4;
+      b.length -= 4;
+    }
+    blocks_.push_back(b);
+  }
+  data_end_ = t.footer_off;
+  return true;
+}
+
+bool TraceFile::index_framed(std::string *err) {
+  const bool compressed = header_.length != 0;
+  uint64_t off = sizeof(Header);
+  while (off + 4 <= data_end_) {
+    uint32_t len = _u32(map_ + off);
+    off += 4;
+    if (off + len > data_end_) {
+      // block cut by a crash, keep what was written before
+      fprintf(stderr, "UFO>>> %s: truncated block at %lu dropped\n", path_.c_str(), (unsigned long) off - 4);
+      break;
+    }
+    BlockRef b = {off, len, compressed};
+    blocks_.push_back(b);
+    off += len;
+  }
+  (void) err;
+  return true;
+}
+
+bool TraceFile::index_raw(std::string *err) {
+  const bool has_value = (header_.encoding & EncodingNoValue) == 0;
+  uint64_t begin = sizeof(Header);
+  uint64_t off = begin;
+  while (off < data_end_) {
+    uint32_t sz = _raw_len(map_ + off, has_value);
+    if (sz == 0) {
+      *err = path_ + ": unknown event type " + std::to_string(map_[off]) + " at " + std::to_string(off);
+      return false;
+    }
+    if (off + sz > data_end_)
+      break;
+    off += sz;
+    if (off - begin >= CUT_SIZE) {
+      BlockRef b = {begin, off - begin, false};
+      blocks_.push_back(b);
+      begin = off;
+    }
+  }
+  if (off > begin) {
+    BlockRef b = {begin, off - begin, false};
+    blocks_.push_back(b);
+  }
+  return true;
+}
+
+bool TraceFile::decode_block(size_t i, EventBatch *out, std::string *err) const {
+  const BlockRef &b = blocks_[i];
+  const uint8_t *p = map_ + b.offset;
+  if (!b.compressed)
+    return decode_payload(p, b.length, out, err);
+
+  size_t len;
+  if (!snappy_uncompressed_length(p, b.length, &len)) {
+    *err = path_ + ": bad snappy block " + std::to_string(i);
+    return false;
+  }
+  std::vector<uint8_t> buf(len);
+  if (!snappy_uncompress(p, b.length, buf.data())) {
+    *err = path_ + ": bad snappy block " + std::to_string(i);
+    return false;
+  }
+  return decode_payload(buf.data(), len, out, err);
+}
+
+bool TraceFile::decode_payload(const uint8_t *data, uint64_t len, EventBatch *out, std::string *err) const {
+  const bool compact = (header_.encoding & EncodingCompact) != 0;
+  const bool pc_dict = (header_.encoding & EncodingPcDict) != 0;
+  const bool has_value = (header_.encoding & EncodingNoValue) == 0;
+  const uint32_t tid = header_.tid;
+  std::vector<uint64_t> pcs(pc_dict ? PC_DICT_MAX_ID : 0);
+  // predictors are reset at the beginning of each block
+  uint64_t pred_idx = 0;
+  uint64_t pred_addr = 0;
+  uint64_t pred_pc = 0;
+  uint64_t last_idx = 0;
+
+  out->reserve(out->count() + len / 8);
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  while (p < end) {
+    const uint8_t ti = *p;
+    const uint8_t type = ti & 0x3f;
+    if (compact && is_compact_type(type)) {
+      const uint8_t *q = p + 1;
+      uint64_t v = 0;
+      bool ok = true;
+      uint64_t idx = last_idx;
+      if (type != ThreadRelLock && type != EnterFunc && type != ThrCondSignal && type != ThrCondBC) {
+        ok = ok && _varint(q, end, &v);
+        pred_idx += v;
+        idx = pred_idx;
+      }
+      uint64_t addr = 0;
+      if (ok && type != EnterFunc) {
+        ok = _varint(q, end, &v);
+        pred_addr += _unzigzag(v);
+        addr = pred_addr;
+      }
+      uint64_t pc = 0;
+      if (ok) {
+        ok = _varint(q, end, &v);
+        if (pc_dict) {
+          pc = pcs[v & (PC_DICT_MAX_ID - 1)];
+        } else {
+          pred_pc += _unzigzag(v);
+          pc = pred_pc;
+        }
+      }
+      uint32_t sz = 0;
+      uint64_t value = 0;
+      if (ok && (type == MemRead || type == MemWrite)) {
+        sz = 1u << (ti >> 6);
+        if (has_value) {
+          ok = q + sz <= end;
+          if (ok)
+            value = _value(q, sz);
+          q += sz;
+        }
+      } else if (ok && (type == MemRangeRead || type == MemRangeWrite)) {
+        ok = _varint(q, end, &v);
+        sz = (uint32_t) v;
+      } else if (ok && type == MemAlloc) {
+        ok = q + 4 <= end;
+        if (ok)
+          sz = _u32(q);
+        q += 4;
+      } else if (ok && type == ThrCondWait) {
+        // aux: mutex
+        ok = _varint(q, end, &v);
+        value = addr + _unzigzag(v);
+      } else if (ok && (type == ThreadAcqLock || type == ThreadRelLock)) {
+        // aux: 1 for a reader lock
+        value = ti >> 6;
+      } else if (ok && type == MemAtomic) {
+        // aux: operation | memory order << 3
+        sz = 1u << (ti >> 6);
+        ok = q + 1 <= end;
+        if (ok)
+          value = *q;
+        q += 1;
+      }
+      if (!ok) {
+        *err = path_ + ": truncated " + event_name(type);
+        return false;
+      }
+      out->push(type, tid, idx, addr, pc, sz, value);
+      last_idx = idx;
+      p = q;
+      continue;
+    }
+
+    uint32_t sz = _raw_len(p, has_value);
+    if (sz == 0 || p + sz > end) {
+      *err = path_ + ": bad event type " + std::to_string(ti) + " at block offset " + std::to_string(p - data);
+      return false;
+    }
+    switch (type) {
+      case ThreadBegin:
+        out->push(type, tid, last_idx, _u32(p + 1), _u48(p + 5), _u32(p + 11), _u48(p + 15));
+        break;
+      case ThreadEnd:
+        out->push(type, tid, last_idx, _u32(p + 1), 0, _u32(p + 5), 0);
+        break;
+      case ThreadCreate:
+      case ThreadJoin:
+        out->push(type, tid, last_idx, _u32(p + 1), _u48(p + 9), _u32(p + 5), 0);
+        break;
+      case ThreadAcqLock:
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 13), 0, ti >> 6);
+        break;
+      case MemDealloc:
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 13), 0, 0);
+        break;
+      case MemAlloc:
+      case MemRangeRead:
+      case MemRangeWrite:
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 13), _u32(p + 19), 0);
+        break;
+      case MemRead:
+      case MemWrite: {
+        uint32_t vsz = 1u << (ti >> 6);
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 13), vsz, has_value ? _value(p + 19, vsz) : 0);
+        break;
+      }
+      case ThreadRelLock:
+        out->push(type, tid, last_idx, _u48(p + 1), _u48(p + 7), 0, ti >> 6);
+        break;
+      case ThrCondSignal:
+      case ThrCondBC:
+        out->push(type, tid, last_idx, _u48(p + 1), _u48(p + 7), 0, 0);
+        break;
+      case ThrCondWait:
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 19), 0, _u48(p + 13));
+        break;
+      case MemAtomic:
+        last_idx = _u48(p + 1);
+        out->push(type, tid, last_idx, _u48(p + 7), _u48(p + 13), 1u << (ti >> 6), p[19]);
+        break;
+      case PtrAssignment:
+        out->push(type, tid, last_idx, _u48(p + 1), 0, 0, _u48(p + 7));
+        break;
+      case PtrDeRef:
+        out->push(type, tid, last_idx, _u48(p + 1), 0, 0, 0);
+        break;
+      case EnterFunc:
+        out->push(type, tid, last_idx, 0, _u48(p + 1), 0, 0);
+        break;
+      case ExitFunc:
+        out->push(type, tid, last_idx, 0, 0, 0, 0);
+        break;
+      case PcDef:
+        if (pc_dict)
+          pcs[_u16(p + 1) & (PC_DICT_MAX_ID - 1)] = _u48(p + 3);
+        break;
+      default:
+        break;
+    }
+    p += sz;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TraceReader::TraceReader(unsigned n_workers)
+    : n_workers_(n_workers > 0 ? n_workers : 1),
+      n_decoded_(0),
+      n_skipped_(0) {}
+
+TraceReader::~TraceReader() {
+  for (TraceFile *f : files_)
+    delete f;
+}
+
+bool TraceReader::open_file(const std::string &path, std::string *err) {
+  TraceFile *f = new TraceFile;
+  if (!f->open(path, err)) {
+    delete f;
+    return false;
+  }
+  files_.push_back(f);
+  return true;
+}
+
+bool TraceReader::open_dir(const std::string &dir, std::string *err) {
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    *err = dir + ": " + strerror(errno);
+    return false;
+  }
+  std::vector<uint64_t> uids;
+  while (struct dirent *ent = readdir(d)) {
+    const char *name = ent->d_name;
+    if (*name == '\0' || strspn(name, "0123456789") != strlen(name))
+      continue;
+    uids.push_back(strtoull(name, nullptr, 10));
+  }
+  closedir(d);
+  std::sort(uids.begin(), uids.end());
+  for (uint64_t uid : uids) {
+    if (!open_file(dir + "/" + std::to_string(uid), err))
+      return false;
+  }
+  return true;
+}
+
+// max idx of the blocks of f before block b, 0 if none or if f has no index
+static uint64_t _idx_before(const TraceFile &f, size_t b) {
+  if (!f.has_index())
+    return 0;
+  while (b-- > 0) {
+    const BlockSummary &s = f.summary(b);
+    if (s.min_idx <= s.max_idx)
+      return s.max_idx;
+  }
+  return 0;
+}
+
+// leading events without idx take the idx of the previous block
+static void _fix_leading_idx(EventBatch *ev, uint64_t last_idx) {
+  for (size_t k = 0; k < ev->count() && !has_idx(ev->type[k]); ++k)
+    ev->idx[k] = last_idx;
+}
+
+bool TraceReader::scan(const BlockFn &fn, std::string *err, const BlockFilter *filter) {
+  struct Task {
+    size_t file;
+    size_t block;
+  };
+  std::vector<Task> tasks;
+  n_skipped_ = 0;
+  for (size_t f = 0; f < files_.size(); ++f) {
+    const TraceFile &tf = *files_[f];
+    for (size_t b = 0; b < tf.n_blocks(); ++b) {
+      if (filter != nullptr && tf.has_index() && !filter->match(tf.summary(b))) {
+        ++n_skipped_;
+        continue;
+      }
+      Task t = {f, b};
+      tasks.push_back(t);
+    }
+  }
+
+  n_decoded_ = tasks.size();
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::string first_err;
+  std::mutex mtx;
+  auto work = [&]() {
+    // one block per worker in memory
+    EventBatch out;
+    std::string e;
+    for (size_t i = next++; i < tasks.size() && !failed; i = next++) {
+      const Task &t = tasks[i];
+      const TraceFile &tf = *files_[t.file];
+      out.clear();
+      if (!tf.decode_block(t.block, &out, &e)) {
+        std::lock_guard<std::mutex> l(mtx);
+        if (!failed.exchange(true))
+          first_err = e;
+        continue;
+      }
+      _fix_leading_idx(&out, _idx_before(tf, t.block));
+      std::lock_guard<std::mutex> l(mtx);
+      fn(t.file, out);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < n_workers_ && i < tasks.size(); ++i)
+    workers.emplace_back(work);
+  work();
+  for (std::thread &w : workers)
+    w.join();
+  if (failed) {
+    *err = first_err;
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct MergeStream::Cursor {
+  const TraceFile *file;
+  // next block to decode ahead
+  size_t next_block;
+  // a block is being decoded into ahead_out
+  bool pending;
+  size_t ahead_block;
+  bool async;
+  EventBatch cur;
+  size_t pos;
+  // idx of the last event of the previous blocks
+  uint64_t last_idx;
+  EventBatch ahead_out;
+  std::string ahead_err;
+  // destroyed first, waits for the decoding of ahead_out
+  std::future<bool> ahead;
+};
+
+MergeStream::MergeStream(const TraceReader &reader, const BlockFilter *filter)
+    : reader_(reader),
+      use_filter_(filter != nullptr),
+      started_(false),
+      n_async_(0),
+      n_decoded_(0),
+      n_skipped_(0) {
+  if (filter != nullptr)
+    filter_ = *filter;
+  for (size_t f = 0; f < reader.n_files(); ++f) {
+    Cursor *c = new Cursor;
+    c->file = &reader.file(f);
+    c->next_block = 0;
+    c->pending = false;
+    c->ahead_block = 0;
+    c->async = false;
+    c->pos = 0;
+    c->last_idx = 0;
+    cursors_.push_back(c);
+  }
+}
+
+MergeStream::~MergeStream() {
+  for (Cursor *c : cursors_) {
+    if (c->pending && c->async)
+      c->ahead.wait();
+    delete c;
+  }
+}
+
+void MergeStream::prefetch(Cursor *c) {
+  const TraceFile &tf = *c->file;
+  size_t b = c->next_block;
+  while (b < tf.n_blocks() && use_filter_ && tf.has_index() && !filter_.match(tf.summary(b))) {
+    ++n_skipped_;
+    ++b;
+  }
+  c->pending = b < tf.n_blocks();
+  if (!c->pending)
+    return;
+  c->next_block = b + 1;
+  c->ahead_block = b;
+  ++n_decoded_;
+  // the other cursors decode in the caller's thread when they need their block
+  c->async = n_async_ < reader_.n_workers();
+  if (c->async)
+    ++n_async_;
+  c->ahead = std::async(c->async ? std::launch::async : std::launch::deferred, [c, b]() {
+    return c->file->decode_block(b, &c->ahead_out, &c->ahead_err);
+  });
+}
+
+bool MergeStream::load(Cursor *c, std::string *err) {
+  c->cur.clear();
+  c->pos = 0;
+  while (c->cur.count() == 0 && c->pending) {
+    bool ok = c->ahead.get();
+    if (c->async)
+      --n_async_;
+    if (!ok) {
+      *err = c->ahead_err;
+      c->pending = false;
+      return false;
+    }
+    std::swap(c->cur, c->ahead_out);
+    c->ahead_out.clear();
+    // blocks skipped by the filter are in the index
+    if (c->file->has_index())
+      c->last_idx = _idx_before(*c->file, c->ahead_block);
+    prefetch(c);
+    _fix_leading_idx(&c->cur, c->last_idx);
+    if (c->cur.count() > 0)
+      c->last_idx = c->cur.idx.back();
+  }
+  return true;
+}
+
+bool MergeStream::start(std::string *err) {
+  started_ = true;
+  for (Cursor *c : cursors_)
+    prefetch(c);
+  for (size_t i = 0; i < cursors_.size(); ++i) {
+    Cursor *c = cursors_[i];
+    if (!load(c, err))
+      return false;
+    if (c->cur.count() > 0) {
+      Head h = {c->cur.idx[0], c->cur.tid[0], i};
+      heap_.push(h);
+    }
+  }
+  return true;
+}
+
+bool MergeStream::next(EventBatch *out, size_t max, std::string *err) {
+  out->clear();
+  if (!started_ && !start(err))
+    return false;
+  while (out->count() < max && !heap_.empty()) {
+    Head h = heap_.top();
+    heap_.pop();
+    Cursor *c = cursors_[h.cursor];
+    // events of the thread up to the next head keep program order
+    const uint64_t bound_idx = heap_.empty() ? UINT64_MAX : heap_.top().idx;
+    const uint32_t bound_tid = heap_.empty() ? UINT32_MAX : heap_.top().tid;
+    for (;;) {
+      out->push_from(c->cur, c->pos);
+      if (++c->pos == c->cur.count() && !load(c, err))
+        return false;
+      if (c->pos == c->cur.count() || out->count() == max)
+        break;
+      const uint64_t idx = c->cur.idx[c->pos];
+      if (idx > bound_idx || (idx == bound_idx && c->cur.tid[c->pos] > bound_tid))
+        break;
+    }
+    if (c->pos < c->cur.count()) {
+      h.idx = c->cur.idx[c->pos];
+      heap_.push(h);
+    }
+  }
+  return out->count() > 0;
+}
+
+} // ns reader
+} // ns ufo
+} // ns bw
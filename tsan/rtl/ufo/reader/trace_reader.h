@@ -0,0 +1,255 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#ifndef UFO_READER_TRACE_READER_H
+#define UFO_READER_TRACE_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+
+namespace bw {
+namespace ufo {
+namespace reader {
+
+/**
+ * decoded events, one column per field.
+ * fields not carried by an event type are 0, events without idx (unlock, func entry, thread events...)
+ * take the idx of the previous event of the same thread so that the merged order keeps program order.
+ *
+ * addr:  address, mutex, cond, ptr_l, ptr_addr, tid of the kid/joiner/parent
+ * size:  access size, range size, alloc size, e_time of thread events
+ * aux:   value of MemRead/MemWrite, mutex of ThrCondWait, ptr_r, stack address of ThreadBegin,
+ *        1 for a reader ThreadAcqLock/ThreadRelLock, operation | memory order << 3 of MemAtomic
+ */
+struct EventBatch {
+  std::vector<uint8_t> type;
+  std::vector<uint32_t> tid;
+  std::vector<uint64_t> idx;
+  std::vector<uint64_t> addr;
+  std::vector<uint64_t> pc;
+  std::vector<uint32_t> size;
+  std::vector<uint64_t> aux;
+
+  size_t count() const { return type.size(); }
+
+  void clear();
+
+  void reserve(size_t n);
+
+  void push(uint8_t t, uint32_t tid, uint64_t idx, uint64_t addr, uint64_t pc, uint32_t sz, uint64_t aux);
+
+  // append row i of other
+  void push_from(const EventBatch &other, size_t i);
+
+  void append(const EventBatch &other);
+};
+
+// one block of a trace file, offset and length of its payload
+struct BlockRef {
+  uint64_t offset;
+  uint64_t length;
+  bool compressed;
+};
+
+/**
+ * blocks to decode, by their BlockSummary.
+ * a block is kept if its idx range meets [min_idx, max_idx] and its address range meets [min_addr, max_addr).
+ * blocks of files without index are always kept, events are not filtered.
+ */
+struct BlockFilter {
+  uint64_t min_idx;
+  uint64_t max_idx;
+  uint64_t min_addr;
+  uint64_t max_addr;
+
+  BlockFilter()
+      : min_idx(0),
+        max_idx(UINT64_MAX),
+        min_addr(0),
+        max_addr(UINT64_MAX) {}
+
+  bool match(const BlockSummary &s) const {
+    // no event with idx, e.g. thread events only
+    if (s.min_idx > s.max_idx)
+      return true;
+    if (s.min_idx > max_idx || s.max_idx < min_idx)
+      return false;
+    if (min_addr == 0 && max_addr == UINT64_MAX)
+      return true;
+    return s.min_addr < max_addr && s.max_addr > min_addr;
+  }
+};
+
+/**
+ * one trace file (one thread), mapped read only.
+ * blocks are taken from the index of the file if it has one (IndexTrailer),
+ * otherwise they are found at open, see Encoding in ../ufo_interface.h for the framing.
+ * raw streams without index have no framing and are cut at event boundaries every CUT_SIZE bytes.
+ */
+class TraceFile {
+public:
+  static const uint64_t CUT_SIZE = 1 << 20;
+
+  TraceFile();
+
+  ~TraceFile();
+
+  // false with err set if the file can not be read or has another version
+  bool open(const std::string &path, std::string *err);
+
+  void close();
+
+  const std::string &path() const { return path_; }
+
+  const Header &header() const { return header_; }
+
+  uint32_t tid() const { return header_.tid; }
+
+  size_t n_blocks() const { return blocks_.size(); }
+
+  const BlockRef &block(size_t i) const { return blocks_[i]; }
+
+  // trace closed at thread end, summaries are in block order
+  bool has_index() const { return !summaries_.empty(); }
+
+  const BlockSummary &summary(size_t i) const { return summaries_[i]; }
+
+  // decode block i, events are appended to out. thread safe.
+  bool decode_block(size_t i, EventBatch *out, std::string *err) const;
+
+private:
+  bool read_index(std::string *err);
+
+  bool index_framed(std::string *err);
+
+  bool index_raw(std::string *err);
+
+  bool decode_payload(const uint8_t *p, uint64_t len, EventBatch *out, std::string *err) const;
+
+  std::string path_;
+  Header header_;
+  int fd_;
+  const uint8_t *map_;
+  uint64_t map_len_;
+  // end of the blocks, start of the index if any
+  uint64_t data_end_;
+  std::vector<BlockRef> blocks_;
+  std::vector<BlockSummary> summaries_;
+
+  TraceFile(const TraceFile &);
+  TraceFile &operator=(const TraceFile &);
+};
+
+/**
+ * all trace files of a run.
+ * blocks are decoded in parallel by n_workers threads and never all kept in memory:
+ * scan() hands each decoded block to a callback, MergeStream merges the threads by (idx, tid).
+ */
+class TraceReader {
+public:
+  explicit TraceReader(unsigned n_workers);
+
+  ~TraceReader();
+
+  // every regular file in dir named by a number (the thread uid)
+  bool open_dir(const std::string &dir, std::string *err);
+
+  bool open_file(const std::string &path, std::string *err);
+
+  size_t n_files() const { return files_.size(); }
+
+  const TraceFile &file(size_t i) const { return *files_[i]; }
+
+  unsigned n_workers() const { return n_workers_; }
+
+  typedef std::function<void(size_t file, const EventBatch &events)> BlockFn;
+
+  // decode every block of every file, fn is called once per block, one call at a time, in no particular order.
+  // leading events without idx take the max idx of the previous block if the file is indexed, 0 otherwise.
+  // with a filter, indexed blocks not matching it are skipped
+  bool scan(const BlockFn &fn, std::string *err, const BlockFilter *filter = nullptr);
+
+  // blocks decoded and skipped by the last scan()
+  size_t n_decoded() const { return n_decoded_; }
+
+  size_t n_skipped() const { return n_skipped_; }
+
+private:
+  unsigned n_workers_;
+  std::vector<TraceFile *> files_;
+  size_t n_decoded_;
+  size_t n_skipped_;
+
+  TraceReader(const TraceReader &);
+  TraceReader &operator=(const TraceReader &);
+};
+
+/**
+ * events of all threads of a reader merged by (idx, tid), program order is kept within a thread.
+ * each file has a cursor holding its current block while its next block is decoded ahead,
+ * by at most n_workers threads at a time, so memory is bounded by two blocks per file.
+ */
+class MergeStream {
+public:
+  // with a filter, indexed blocks not matching it are skipped
+  explicit MergeStream(const TraceReader &reader, const BlockFilter *filter = nullptr);
+
+  ~MergeStream();
+
+  // out is cleared and filled with the next events, at most max.
+  // false at the end of the stream, or with err set if a block can not be decoded
+  bool next(EventBatch *out, size_t max, std::string *err);
+
+  size_t n_decoded() const { return n_decoded_; }
+
+  size_t n_skipped() const { return n_skipped_; }
+
+private:
+  struct Cursor;
+
+  struct Head {
+    uint64_t idx;
+    uint32_t tid;
+    size_t cursor;
+    bool operator>(const Head &o) const {
+      if (idx != o.idx)
+        return idx > o.idx;
+      return tid > o.tid;
+    }
+  };
+
+  bool start(std::string *err);
+
+  // decode the next block of c ahead
+  void prefetch(Cursor *c);
+
+  // make the block decoded ahead the current block of c, empty blocks are skipped
+  bool load(Cursor *c, std::string *err);
+
+  const TraceReader &reader_;
+  BlockFilter filter_;
+  bool use_filter_;
+  bool started_;
+  unsigned n_async_;
+  size_t n_decoded_;
+  size_t n_skipped_;
+  std::vector<Cursor *> cursors_;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heap_;
+
+  MergeStream(const MergeStream &);
+  MergeStream &operator=(const MergeStream &);
+};
+
+} // ns reader
+} // ns ufo
+} // ns bw
+
+#endif //UFO_READER_TRACE_READER_H
@@ -0,0 +1,533 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+// round trip of the trace format: traces are written the way TLBuffer writes them,
+// fields of EncodingCompact by the encoders of the runtime (../compact_codec.h),
+// and read back by TraceFile, TraceReader::scan and MergeStream.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../compact_codec.h"
+#include "trace_reader.h"
+
+using namespace bw::ufo;
+using namespace bw::ufo::reader;
+
+static int n_failed = 0;
+
+#define CHECK(c) do { \
+    if (!(c)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+      ++n_failed; \
+    } \
+  } while (0)
+
+struct Event {
+  uint8_t type;
+  uint32_t tid;
+  uint64_t idx;
+  uint64_t addr;
+  uint64_t pc;
+  uint32_t size;
+  uint64_t aux;
+};
+
+static void _put(uint8_t *p, uint64_t v, uint32_t len) {
+  memcpy(p, &v, len);
+}
+
+/**
+ * one trace file.
+ * compact events are encoded as in TLBuffer::put_event, the others are written raw.
+ * events expected from the reader are recorded along, events without idx take the last idx of the thread.
+ */
+class TraceWriter {
+public:
+  TraceWriter(uint32_t tid, uint8_t encoding)
+      : tid_(tid),
+        encoding_(encoding),
+        last_idx_(0) {
+    begin_block();
+  }
+
+  const std::vector<Event> &events() const { return events_; }
+
+  void mem(uint8_t type, uint32_t log_sz, uint64_t idx, uint64_t addr, uint64_t pc, uint64_t value) {
+    const uint8_t ti = (uint8_t) (type | log_sz << 6);
+    const uint32_t sz = 1u << log_sz;
+    uint8_t *p = begin(ti, pc, 19);
+    if (compact()) {
+      p = pred_.put_idx(p, idx);
+      p = pred_.put_addr(p, addr);
+      p = put_pc(p, pc);
+    } else {
+      p = put_raw3(p, idx, addr, pc);
+    }
+    if (has_value()) {
+      _put(p, value, sz);
+      p += sz;
+    }
+    end(p);
+    note(idx, addr, addr + sz);
+    expect(type, idx, addr, pc, sz, has_value() ? value : 0);
+  }
+
+  void range(uint8_t type, uint64_t idx, uint64_t addr, uint64_t pc, uint32_t size) {
+    uint8_t *p = begin(type, pc, 23);
+    if (compact()) {
+      p = pred_.put_idx(p, idx);
+      p = pred_.put_addr(p, addr);
+      p = put_pc(p, pc);
+      p = codec::put_varint(p, size);
+    } else {
+      p = put_raw3(p, idx, addr, pc);
+      _put(p, size, 4);
+      p += 4;
+    }
+    end(p);
+    note(idx, addr, addr + size);
+    expect(type, idx, addr, pc, size, 0);
+  }
+
+  void alloc(uint64_t idx, uint64_t addr, uint64_t pc, uint32_t size) {
+    uint8_t *p = begin(MemAlloc, pc, 23);
+    if (compact()) {
+      p = pred_.put_idx(p, idx);
+      p = pred_.put_addr(p, addr);
+      p = put_pc(p, pc);
+    } else {
+      p = put_raw3(p, idx, addr, pc);
+    }
+    // size is not compressed
+    _put(p, size, 4);
+    end(p + 4);
+    note(idx, addr, addr + size);
+    sum_.n_alloc++;
+    expect(MemAlloc, idx, addr, pc, size, 0);
+  }
+
+  void dealloc(uint64_t idx, uint64_t addr, uint64_t pc) {
+    uint8_t *p = begin(MemDealloc, pc, 19);
+    if (compact()) {
+      p = pred_.put_idx(p, idx);
+      p = pred_.put_addr(p, addr);
+      p = put_pc(p, pc);
+    } else {
+      p = put_raw3(p, idx, addr, pc);
+    }
+    end(p);
+    note(idx, addr, addr + 1);
+    sum_.n_dealloc++;
+    expect(MemDealloc, idx, addr, pc, 0, 0);
+  }
+
+  void lock(uint64_t idx, uint64_t mutex, uint64_t pc, bool reader) {
+    uint8_t *p = begin((uint8_t) (ThreadAcqLock | reader << 6), pc, 19);
+    if (compact()) {
+      p = pred_.put_idx(p, idx);
+      p = pred_.put_addr(p, mutex);
+      p = put_pc(p, pc);
+    } else {
+      p = put_raw3(p, idx, mutex, pc);
+    }
+    end(p);
+    note_idx(idx);
+    sum_.n_lock++;
+    expect(ThreadAcqLock, idx, mutex, pc, 0, reader);
+  }
+
+  void unlock(uint64_t mutex, uint64_t pc, bool reader) {
+    uint8_t *p = begin((uint8_t) (ThreadRelLock | reader << 6), pc, 13);
+    if (compact()) {
+      p = pred_.put_addr(p, mutex);
+      p = put_pc(p, pc);
+    } else {
+      _put(p, mutex, 6);
+      _put(p + 6, pc, 6);
+      p += 12;
+    }
+    end(p);
+    sum_.n_lock++;
+    expect(ThreadRelLock, last_idx_, mutex, pc, 0, reader);
+  }
+
+  // compact only from here
+
+  void cond_wait(uint64_t idx, uint64_t cond, uint64_t mtx, uint64_t pc) {
+    uint8_t *p = begin(ThrCondWait, pc, 0);
+    p = pred_.put_idx(p, idx);
+    p = pred_.put_addr(p, cond);
+    p = put_pc(p, pc);
+    p = codec::put_varint(p, codec::zigzag(mtx, cond));
+    end(p);
+    note_idx(idx);
+    sum_.n_lock++;
+    expect(ThrCondWait, idx, cond, pc, 0, mtx);
+  }
+
+  void cond_signal(uint64_t cond, uint64_t pc) {
+    uint8_t *p = begin(ThrCondSignal, pc, 0);
+    p = pred_.put_addr(p, cond);
+    p = put_pc(p, pc);
+    end(p);
+    sum_.n_lock++;
+    expect(ThrCondSignal, last_idx_, cond, pc, 0, 0);
+  }
+
+  void enter_func(uint64_t caller_pc) {
+    uint8_t *p = begin(EnterFunc, caller_pc, 0);
+    p = put_pc(p, caller_pc);
+    end(p);
+    expect(EnterFunc, last_idx_, 0, caller_pc, 0, 0);
+  }
+
+  void atomic(uint32_t log_sz, uint64_t idx, uint64_t addr, uint64_t pc, uint8_t op_mo) {
+    uint8_t *p = begin((uint8_t) (MemAtomic | log_sz << 6), pc, 0);
+    p = pred_.put_idx(p, idx);
+    p = pred_.put_addr(p, addr);
+    p = put_pc(p, pc);
+    *p = op_mo;
+    end(p + 1);
+    note(idx, addr, addr + (1u << log_sz));
+    expect(MemAtomic, idx, addr, pc, 1u << log_sz, op_mo);
+  }
+
+  // raw in every encoding
+
+  void thread_begin(uint64_t pc, uint32_t e_time, uint64_t stack) {
+    uint8_t *p = reserve(35);
+    p[0] = ThreadBegin;
+    _put(p + 1, tid_, 4);
+    _put(p + 5, pc, 6);
+    _put(p + 11, e_time, 4);
+    _put(p + 15, stack, 6);
+    end(p + 35);
+    expect(ThreadBegin, last_idx_, tid_, pc, e_time, stack);
+  }
+
+  void thread_end(uint32_t e_time) {
+    uint8_t *p = reserve(9);
+    p[0] = ThreadEnd;
+    _put(p + 1, tid_, 4);
+    _put(p + 5, e_time, 4);
+    end(p + 9);
+    expect(ThreadEnd, last_idx_, tid_, 0, e_time, 0);
+  }
+
+  // predictors and pc ids are reset at the beginning of each block
+  void end_block() {
+    if (!block_.empty()) {
+      blocks_.push_back(block_);
+      index_.push_back(sum_);
+    }
+    begin_block();
+  }
+
+  // drop the last n bytes of the current block
+  void cut(size_t n) {
+    block_.resize(block_.size() - n);
+  }
+
+  bool save(const std::string &path, bool with_index) {
+    end_block();
+    Header h;
+    memset(&h, 0, sizeof(h));
+    h.type_index = TLHeader;
+    h.version = TRACE_VERSION;
+    h.tid = tid_;
+    h.encoding = encoding_;
+    std::vector<uint8_t> out((const uint8_t *) &h, (const uint8_t *) &h + sizeof(h));
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+      const std::vector<uint8_t> &b = blocks_[i];
+      index_[i].offset = out.size();
+      if (compact()) {
+        // compact blocks are framed by their length
+        uint32_t len = (uint32_t) b.size();
+        out.insert(out.end(), (const uint8_t *) &len, (const uint8_t *) &len + 4);
+      }
+      out.insert(out.end(), b.begin(), b.end());
+      index_[i].length = (uint32_t) (out.size() - index_[i].offset);
+    }
+    if (with_index) {
+      IndexTrailer t = {out.size(), (uint32_t) index_.size(), INDEX_MAGIC};
+      out.insert(out.end(), (const uint8_t *) index_.data(),
+                 (const uint8_t *) index_.data() + index_.size() * sizeof(BlockSummary));
+      out.insert(out.end(), (const uint8_t *) &t, (const uint8_t *) &t + sizeof(t));
+    }
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == nullptr)
+      return false;
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+  }
+
+private:
+  bool compact() const { return (encoding_ & EncodingCompact) != 0; }
+
+  bool has_value() const { return (encoding_ & EncodingNoValue) == 0; }
+
+  bool pc_dict() const { return (encoding_ & EncodingPcDict) != 0; }
+
+  void begin_block() {
+    block_.clear();
+    pred_.reset();
+    pc_ids_.clear();
+    memset(&sum_, 0, sizeof(sum_));
+    sum_.min_idx = UINT64_MAX;
+    sum_.min_addr = UINT64_MAX;
+  }
+
+  uint8_t *reserve(size_t len) {
+    size_t off = block_.size();
+    block_.resize(off + len);
+    return block_.data() + off;
+  }
+
+  // definition of a new pc id first, then the type of the event
+  uint8_t *begin(uint8_t ti, uint64_t pc, uint32_t raw_len) {
+    uint8_t *p = reserve(9 + 40 + (raw_len > 0 ? raw_len : 0));
+    if (compact() && pc_dict()) {
+      std::map<uint64_t, uint32_t>::iterator it = pc_ids_.find(pc);
+      if (it == pc_ids_.end()) {
+        uint32_t id = (uint32_t) pc_ids_.size();
+        it = pc_ids_.insert(std::make_pair(pc, id)).first;
+        p[0] = PcDef;
+        _put(p + 1, id, 2);
+        _put(p + 3, pc, 6);
+        p += 9;
+      }
+      cur_pc_id_ = it->second;
+    }
+    *p = ti;
+    return p + 1;
+  }
+
+  void end(uint8_t *p) {
+    block_.resize(p - block_.data());
+  }
+
+  uint8_t *put_pc(uint8_t *p, uint64_t pc) {
+    if (pc_dict())
+      return codec::put_varint(p, cur_pc_id_);
+    return pred_.put_pc(p, pc);
+  }
+
+  static uint8_t *put_raw3(uint8_t *p, uint64_t idx, uint64_t addr, uint64_t pc) {
+    _put(p, idx, 6);
+    _put(p + 6, addr, 6);
+    _put(p + 12, pc, 6);
+    return p + 18;
+  }
+
+  void note_idx(uint64_t idx) {
+    sum_.min_idx = std::min(sum_.min_idx, idx);
+    sum_.max_idx = std::max(sum_.max_idx, idx);
+    last_idx_ = idx;
+  }
+
+  void note(uint64_t idx, uint64_t addr, uint64_t end) {
+    note_idx(idx);
+    sum_.min_addr = std::min(sum_.min_addr, addr);
+    sum_.max_addr = std::max(sum_.max_addr, end);
+  }
+
+  void expect(uint8_t type, uint64_t idx, uint64_t addr, uint64_t pc, uint32_t size, uint64_t aux) {
+    Event e = {type, tid_, idx, addr, pc, size, aux};
+    events_.push_back(e);
+  }
+
+  uint32_t tid_;
+  uint8_t encoding_;
+  uint64_t last_idx_;
+  std::vector<uint8_t> block_;
+  codec::Predictors pred_;
+  std::map<uint64_t, uint32_t> pc_ids_;
+  uint32_t cur_pc_id_;
+  BlockSummary sum_;
+  std::vector<std::vector<uint8_t> > blocks_;
+  std::vector<BlockSummary> index_;
+  std::vector<Event> events_;
+};
+
+static bool _same(const EventBatch &b, size_t i, const Event &e) {
+  return b.type[i] == e.type && b.tid[i] == e.tid && b.idx[i] == e.idx && b.addr[i] == e.addr
+         && b.pc[i] == e.pc && b.size[i] == e.size && b.aux[i] == e.aux;
+}
+
+static void _check_events(const EventBatch &b, const std::vector<Event> &expected) {
+  CHECK(b.count() == expected.size());
+  for (size_t i = 0; i < b.count() && i < expected.size(); ++i) {
+    if (!_same(b, i, expected[i])) {
+      fprintf(stderr, "event %lu: got %s #%u idx %lu addr 0x%lx, expected %s #%u idx %lu addr 0x%lx\n",
+              (unsigned long) i, event_name(b.type[i]), b.tid[i], (unsigned long) b.idx[i],
+              (unsigned long) b.addr[i], event_name(expected[i].type), expected[i].tid,
+              (unsigned long) expected[i].idx, (unsigned long) expected[i].addr);
+      ++n_failed;
+      return;
+    }
+  }
+}
+
+static bool _by_idx_tid(const Event &a, const Event &b) {
+  if (a.idx != b.idx)
+    return a.idx < b.idx;
+  return a.tid < b.tid;
+}
+
+static std::vector<Event> _merged(const std::vector<TraceWriter *> &ws) {
+  std::vector<Event> all;
+  for (const TraceWriter *w : ws)
+    all.insert(all.end(), w->events().begin(), w->events().end());
+  // idx never decreases in a thread, program order is kept
+  std::stable_sort(all.begin(), all.end(), _by_idx_tid);
+  return all;
+}
+
+static EventBatch _stream(const TraceReader &r, size_t batch, const BlockFilter *filter, size_t *n_skipped) {
+  MergeStream s(r, filter);
+  EventBatch all;
+  EventBatch b;
+  std::string err;
+  while (s.next(&b, batch, &err)) {
+    CHECK(b.count() <= batch);
+    all.append(b);
+  }
+  CHECK(err.empty());
+  if (n_skipped != nullptr)
+    *n_skipped = s.n_skipped();
+  return all;
+}
+
+int main() {
+  char tmpl[] = "/tmp/ufo_reader_test.XXXXXX";
+  const char *dir = mkdtemp(tmpl);
+  if (dir == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  const std::string d(dir);
+
+  // compact with pc ids, indexed, two blocks
+  TraceWriter t1(1, EncodingCompact | EncodingPcDict);
+  t1.thread_begin(0x401000, 7, 0x7ffd0000);
+  t1.alloc(10, 0x602000, 0x401100, 64);
+  t1.mem(MemWrite, 3, 11, 0x602008, 0x401200, 0xdeadbeefcafeull);
+  t1.mem(MemRead, 2, 11, 0x602010, 0x401200, 0x1234);
+  t1.lock(20, 0x603000, 0x401300, false);
+  t1.unlock(0x603000, 0x401310, false);
+  t1.enter_func(0x401400);
+  t1.end_block();
+  // leading events without idx take the idx of the previous block
+  t1.unlock(0x603040, 0x401310, true);
+  t1.cond_wait(30, 0x604000, 0x603000, 0x401500);
+  t1.cond_signal(0x604000, 0x401510);
+  t1.range(MemRangeWrite, 31, 0x602000, 0x401600, 4096);
+  t1.atomic(2, 40, 0x602020, 0x401700, 2 | 5 << 3);
+  t1.dealloc(50, 0x602000, 0x401800);
+  t1.thread_end(9);
+  CHECK(t1.save(d + "/1", true));
+
+  // compact, not indexed (thread still running), no value
+  TraceWriter t2(2, EncodingCompact | EncodingNoValue);
+  t2.thread_begin(0x401000, 8, 0x7ffc0000);
+  t2.mem(MemRead, 3, 11, 0x602008, 0x402000, 0);
+  t2.lock(25, 0x603000, 0x402100, true);
+  t2.end_block();
+  t2.unlock(0x603000, 0x402110, true);
+  t2.mem(MemWrite, 0, 35, 0x605000, 0x402200, 0);
+  t2.range(MemRangeRead, 45, 0x606000, 0x402300, 100);
+  CHECK(t2.save(d + "/2", false));
+
+  // raw, not framed
+  TraceWriter t3(3, EncodingRaw);
+  t3.thread_begin(0x401000, 9, 0x7ffb0000);
+  t3.mem(MemRead, 3, 10, 0x602000, 0x403000, 42);
+  t3.alloc(12, 0x607000, 0x403100, 16);
+  t3.lock(20, 0x603000, 0x403200, false);
+  t3.unlock(0x603000, 0x403210, false);
+  t3.mem(MemWrite, 1, 60, 0x607004, 0x403300, 0xbeef);
+  t3.dealloc(61, 0x607000, 0x403400);
+  t3.thread_end(11);
+  CHECK(t3.save(d + "/3", false));
+
+  std::vector<TraceWriter *> ws = {&t1, &t2, &t3};
+  const std::vector<Event> merged = _merged(ws);
+
+  TraceReader r(2);
+  std::string err;
+  CHECK(r.open_dir(d, &err));
+  CHECK(r.n_files() == 3);
+  if (r.n_files() == 3) {
+    CHECK(r.file(0).has_index() && r.file(0).n_blocks() == 2);
+    CHECK(!r.file(1).has_index() && r.file(1).n_blocks() == 2);
+    CHECK(!r.file(2).has_index() && r.file(2).n_blocks() == 1);
+    CHECK(r.file(0).summary(0).min_idx == 10 && r.file(0).summary(0).max_idx == 20);
+    CHECK(r.file(0).summary(0).n_alloc == 1 && r.file(0).summary(1).n_dealloc == 1);
+
+    // block by block, the leading unlock of the 2nd block has no idx yet
+    EventBatch b0;
+    EventBatch b1;
+    CHECK(r.file(0).decode_block(0, &b0, &err));
+    CHECK(r.file(0).decode_block(1, &b1, &err));
+    CHECK(b1.count() > 0 && b1.type[0] == ThreadRelLock && b1.idx[0] == 0);
+    b0.append(b1);
+    CHECK(b0.count() == t1.events().size());
+
+    // every batch size, batches end inside blocks and inside runs of one thread
+    for (size_t batch : {1, 3, 7, 1 << 16})
+      _check_events(_stream(r, batch, nullptr, nullptr), merged);
+
+    // per block, files decoded in parallel
+    std::vector<size_t> counts(r.n_files());
+    CHECK(r.scan([&](size_t f, const EventBatch &ev) { counts[f] += ev.count(); }, &err));
+    for (size_t f = 0; f < ws.size(); ++f)
+      CHECK(counts[f] == ws[f]->events().size());
+
+    // the 1st block of the indexed file ends before idx 25, the leading unlock
+    // of the 2nd block still takes its max idx from the index
+    BlockFilter filter;
+    filter.min_idx = 25;
+    size_t n_skipped = 0;
+    EventBatch part = _stream(r, 5, &filter, &n_skipped);
+    CHECK(n_skipped == 1);
+    // the 1st block of thread 1 has 7 events
+    std::vector<Event> rest(t1.events().begin() + 7, t1.events().end());
+    rest.insert(rest.end(), t2.events().begin(), t2.events().end());
+    rest.insert(rest.end(), t3.events().begin(), t3.events().end());
+    std::stable_sort(rest.begin(), rest.end(), _by_idx_tid);
+    _check_events(part, rest);
+  }
+
+  // a truncated lock is an error, not an event
+  TraceWriter t4(4, EncodingCompact);
+  t4.mem(MemRead, 3, 1, 0x602000, 0x404000, 1);
+  t4.lock(0x1ffff, 0x603000, 0x404100, false);
+  t4.cut(1);
+  CHECK(t4.save(d + "/4", false));
+  TraceFile f4;
+  CHECK(f4.open(d + "/4", &err));
+  EventBatch b4;
+  err.clear();
+  CHECK(f4.n_blocks() == 1 && !f4.decode_block(0, &b4, &err));
+  CHECK(err.find("truncated ThreadAcqLock") != std::string::npos);
+
+  for (const char *name : {"1", "2", "3", "4"})
+    unlink((d + "/" + name).c_str());
+  rmdir(dir);
+
+  if (n_failed != 0) {
+    fprintf(stderr, "trace_reader_test: %d checks failed\n", n_failed);
+    return 1;
+  }
+  printf("trace_reader_test: ok\n");
+  return 0;
+}
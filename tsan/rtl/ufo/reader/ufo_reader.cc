@@ -0,0 +1,188 @@
+//
+// Created by xkommando on 4/3/17.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "trace_reader.h"
+
+using namespace bw::ufo::reader;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-j workers] [-m] [-n max] [-i from:to] [-a lo:hi] <trace dir | trace file>...\n"
+          "  -j  number of decoding threads, default: hardware concurrency\n"
+          "  -m  print the merged events (ordered by idx, tid)\n"
+          "  -n  print at most max events with -m\n"
+          "  -i  only events with from <= idx <= to\n"
+          "  -a  only events with lo <= address < hi (hex), blocks are skipped using the trace index\n"
+          "without -m, print the number of events of each type per thread\n", prog);
+}
+
+static void print_event(const EventBatch &ev, size_t i) {
+  printf("%12lu  #%-5u %-14s addr 0x%012lx  pc 0x%012lx  size %-8u aux 0x%lx\n",
+         (unsigned long) ev.idx[i], ev.tid[i], event_name(ev.type[i]),
+         (unsigned long) ev.addr[i], (unsigned long) ev.pc[i], ev.size[i], (unsigned long) ev.aux[i]);
+}
+
+// "a:b", numbers in base
+static bool parse_range(const char *s, int base, uint64_t *a, uint64_t *b) {
+  char *end;
+  *a = strtoull(s, &end, base);
+  if (*end != ':')
+    return false;
+  *b = strtoull(end + 1, &end, base);
+  return *end == '\0';
+}
+
+static bool keep(const EventBatch &ev, size_t i, const BlockFilter &f, bool by_addr) {
+  if (ev.idx[i] < f.min_idx || ev.idx[i] > f.max_idx)
+    return false;
+  return !by_addr || (ev.addr[i] >= f.min_addr && ev.addr[i] < f.max_addr);
+}
+
+// merged events in batches of this size
+static const size_t MERGE_BATCH = 1 << 16;
+
+static bool print_merged(const TraceReader &r, const BlockFilter &filter, bool by_addr, uint64_t max_print,
+                         size_t *n_decoded, size_t *n_skipped, std::string *err) {
+  MergeStream stream(r, &filter);
+  EventBatch batch;
+  uint64_t n = 0;
+  while (n < max_print && stream.next(&batch, MERGE_BATCH, err)) {
+    for (size_t i = 0; i < batch.count() && n < max_print; ++i) {
+      if (keep(batch, i, filter, by_addr)) {
+        print_event(batch, i);
+        ++n;
+      }
+    }
+  }
+  *n_decoded = stream.n_decoded();
+  *n_skipped = stream.n_skipped();
+  return err->empty();
+}
+
+static bool print_stat(TraceReader &r, const BlockFilter &filter, bool by_addr, std::string *err) {
+  std::vector<std::vector<uint64_t> > counts(r.n_files(), std::vector<uint64_t>(N_EVENT_TYPES));
+  bool ok = r.scan([&](size_t f, const EventBatch &ev) {
+    std::vector<uint64_t> &cnt = counts[f];
+    for (size_t i = 0; i < ev.count(); ++i) {
+      if (ev.type[i] < N_EVENT_TYPES && keep(ev, i, filter, by_addr))
+        ++cnt[ev.type[i]];
+    }
+  }, err, &filter);
+  if (!ok)
+    return false;
+
+  uint64_t total[N_EVENT_TYPES] = {0};
+  for (size_t f = 0; f < r.n_files(); ++f) {
+    const TraceFile &tf = r.file(f);
+    const std::vector<uint64_t> &cnt = counts[f];
+    uint64_t n = 0;
+    for (uint8_t t = 0; t < N_EVENT_TYPES; ++t)
+      n += cnt[t];
+    printf("#%u  %s  blocks %lu  events %lu  compressed %d  encoding %u  indexed %d\n",
+           tf.tid(), tf.path().c_str(), (unsigned long) tf.n_blocks(), (unsigned long) n,
+           tf.header().length != 0, (unsigned) tf.header().encoding, tf.has_index());
+    const Header &h = tf.header();
+    if (h.sample_max_period != 0) {
+      // accesses skipped are counted in the index only
+      uint64_t skipped = 0;
+      for (size_t b = 0; tf.has_index() && b < tf.n_blocks(); ++b)
+        skipped += tf.summary(b).n_skipped;
+      printf("    sampled: burst %u, decay %u, min rate 1/%u, accesses skipped %lu\n",
+             h.sample_burst, h.sample_decay, h.sample_max_period, (unsigned long) skipped);
+    }
+    for (uint8_t t = 0; t < N_EVENT_TYPES; ++t) {
+      if (cnt[t] == 0)
+        continue;
+      printf("    %-14s %lu\n", event_name(t), (unsigned long) cnt[t]);
+      total[t] += cnt[t];
+    }
+  }
+  printf("total\n");
+  for (uint8_t t = 0; t < N_EVENT_TYPES; ++t) {
+    if (total[t] != 0)
+      printf("    %-14s %lu\n", event_name(t), (unsigned long) total[t]);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  unsigned n_workers = std::thread::hardware_concurrency();
+  bool merged = false;
+  uint64_t max_print = UINT64_MAX;
+  BlockFilter filter;
+  bool by_addr = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:mn:i:a:h")) != -1) {
+    switch (opt) {
+      case 'j': n_workers = (unsigned) atoi(optarg); break;
+      case 'm': merged = true; break;
+      case 'n': max_print = strtoull(optarg, nullptr, 10); break;
+      case 'i':
+        if (!parse_range(optarg, 10, &filter.min_idx, &filter.max_idx)) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'a':
+        if (!parse_range(optarg, 16, &filter.min_addr, &filter.max_addr)) {
+          usage(argv[0]);
+          return 1;
+        }
+        by_addr = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(n_workers);
+  std::string err;
+  for (int i = optind; i < argc; ++i) {
+    struct stat st;
+    bool ok = stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)
+              ? reader.open_dir(argv[i], &err)
+              : reader.open_file(argv[i], &err);
+    if (!ok) {
+      fprintf(stderr, "UFO>>> %s\n", err.c_str());
+      return 1;
+    }
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  size_t n_decoded;
+  size_t n_skipped;
+  bool ok;
+  if (merged) {
+    ok = print_merged(reader, filter, by_addr, max_print, &n_decoded, &n_skipped, &err);
+  } else {
+    ok = print_stat(reader, filter, by_addr, &err);
+    n_decoded = reader.n_decoded();
+    n_skipped = reader.n_skipped();
+  }
+  if (!ok) {
+    fprintf(stderr, "UFO>>> %s\n", err.c_str());
+    return 1;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+
+  fprintf(stderr, "UFO>>> %lu files, %lu blocks decoded (%lu skipped) in %ld ms with %u workers\n",
+          (unsigned long) reader.n_files(), (unsigned long) n_decoded, (unsigned long) n_skipped,
+          (long) std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count(), n_workers);
+  return 0;
+}
@@ -9,6 +9,7 @@
 #include "defs.h"
 #include "ufo_interface.h"
 #include "ufo.h"
+#include "heap_map.h"
 
 //#define DPrintf Printf
 
@@ -20,86 +21,168 @@ extern UFOContext* uctx;
 
 #ifdef STAT_ON
 #define MC_STAT(thr, field)\
-  uctx->stat[tid].field++;
+  if (TLStatistic *st_ = uctx->tl_stat(tid)) st_->field++;
 #else
 #define MC_STAT(thr, field)
 #endif
 
+// the event of a tid not bound to a thread is dropped, see ThreadTable::of
+#define TL_BUF_OR_RETURN(buf, tid, ...)\
+  TLBuffer *buf##_p_ = uctx->tl_buf(tid);\
+  if (UNLIKELY(buf##_p_ == nullptr)) return __VA_ARGS__;\
+  TLBuffer &buf = *buf##_p_;
+
+
+// idx of the next synced event of this thread, see tlclock.h
+ALWAYS_INLINE
+static u64 _next_idx(TLBuffer& buf) {
+  if (uctx->clock_mode == ClockThreadLocal) {
+    u64 t = (read_tsc() - uctx->tsc_started) >> TSC_SHIFT;
+    u64 c = buf.lclock_ + 1;
+    buf.lclock_ = t > c ? t : c;
+    return buf.lclock_;
+  }
+  return __sync_add_and_fetch(&__ufo_e_count, 1);
+}
+
+// happens-before edge: sync object -> this thread
+ALWAYS_INLINE
+static void _acquire_clock(TLBuffer& buf, u64 sync_id) {
+  if (uctx->clock_mode == ClockThreadLocal) {
+    u64 c = uctx->sync_clock->acquire(sync_id);
+    if (c > buf.lclock_)
+      buf.lclock_ = c;
+  }
+}
+
+// happens-before edge: this thread -> sync object
+ALWAYS_INLINE
+static void _release_clock(TLBuffer& buf, u64 sync_id) {
+  if (uctx->clock_mode == ClockThreadLocal) {
+    uctx->sync_clock->release(sync_id, buf.lclock_);
+  }
+}
+
+// the buffer size shrank since the last flush, flush this buffer early if it is too large,
+// or a flush of all threads was requested.
+// checked at lock and alloc only, not on the hot path: the other buffers are limited by UFOContext::limit_buffers
+ALWAYS_INLINE
+static void _check_limit(TLBuffer& buf) {
+  u32 e = atomic_load_relaxed(&uctx->gov_epoch);
+  if (UNLIKELY(e != buf.gov_epoch_)) {
+    buf.gov_epoch_ = e;
+    u32 sz = uctx->get_buf_size();
+    // the ring has a fixed size
+    if (sz < buf.limit_ && buf.ring_ == nullptr)
+      buf.limit_ = sz;
+  }
+  // __ufo_flush(), __ufo_rotate(): flush at the next event
+  u32 f = atomic_load_relaxed(&uctx->flush_epoch);
+  if (UNLIKELY(f != buf.flush_epoch_)) {
+    buf.flush_epoch_ = f;
+    if (buf.ring_ == nullptr)
+      buf.limit_ = 0;
+  }
+}
 
 // read one byte before lock,unlock
 ALWAYS_INLINE
 static void _reset_read(int tid, u64 mtx_id) {
-  auto& buf = uctx->tlbufs[tid];
+  TL_BUF_OR_RETURN(buf, tid)
   // read 1 byte before lock, drop this read
-  const u64 esz = sizeof(MemAccEvent) + 1;
-  if (LIKELY(buf.size_ >= esz)) {
-    if (LIKELY(buf.buf_[buf.size_ - esz] == EventType::MemRead)) { // 8 -> read 1 byte
-      u64 addr = *((u64*)(buf.buf_ + buf.size_ - esz + 7));
-      addr &= 0x0000ffffffffffff;
-      if (LIKELY(addr == mtx_id)) {
-        buf.size_ -= esz;
+  if (LIKELY(buf.last_type() == EventType::MemRead)) { // 8 -> read 1 byte
+    if (LIKELY(buf.last_addr() == mtx_id)) {
+      buf.drop_last();
 #ifdef STAT_ON
-        uctx->stat[tid].c_read[0]--;
+      uctx->tl_stat(tid)->c_read[0]--;
 #endif
-        DPrintf("read 1 byte reset\r\n");
-      }
+      DPrintf("read 1 byte reset\r\n");
     }
   }
 }
 
+// rd: reader lock of a rwlock, same event with LOCK_READ
+ALWAYS_INLINE
+static void _lock(int tid, uptr pc, u64 mutex_id, bool rd) {
+  _reset_read(tid, mutex_id);
+  TL_BUF_OR_RETURN(buf, tid)
+  _check_limit(buf);
+  _acquire_clock(buf, mutex_id);
+  buf.dedup_clear();
+  u64 _idx = _next_idx(buf);
+  buf.put_event(LockEvent(_idx, (u64)mutex_id, pc, rd));
+}
+
+ALWAYS_INLINE
+static void _unlock(int tid, uptr pc, u64 mutex_id, bool rd) {
+  TL_BUF_OR_RETURN(buf, tid)
+  _reset_read(tid, mutex_id);
+  buf.put_event(UnlockEvent((u64)mutex_id, (u64)pc, rd));
+  _release_clock(buf, mutex_id);
+  buf.dedup_clear();
+}
+
 void impl_mtx_lock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
   const int tid = thr->tid;
   MC_STAT(thr, c_lock)
   DPrintf("UFO>>> #%d lock  mutex id:%llu    pc:%p\r\n", tid, mutex_id, pc);
-  _reset_read(tid, mutex_id);
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
-  uctx->tlbufs[tid].put_event(LockEvent(_idx, (u64)mutex_id, pc));
+  _lock(tid, pc, mutex_id, false);
 }
 
 void impl_mtx_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
   const int tid = thr->tid;
   MC_STAT(thr, c_unlock)
   DPrintf("UFO>>> #%d unlock mutex %llu    pc:%p\r\n", tid, mutex_id, pc);
-  auto& buf = uctx->tlbufs[tid];
-  _reset_read(tid, mutex_id);
-  buf.put_event(UnlockEvent((u64)mutex_id, (u64)pc));
+  _unlock(tid, pc, mutex_id, false);
 }
 
 void impl_rd_lock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-  DPrintf("UFO>>> #%d rd lock :%llu    pc:%p\r\n", thr->tid, mutex_id, pc);
+  const int tid = thr->tid;
+  MC_STAT(thr, c_rd_lock)
+  DPrintf("UFO>>> #%d rd lock :%llu    pc:%p\r\n", tid, mutex_id, pc);
+  _lock(tid, pc, mutex_id, true);
 }
 
 void impl_rd_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-  DPrintf("UFO>>> #%d !!!!!!!!!!!!11 rd unlock :%llu    pc:%p\r\n", thr->tid, mutex_id, pc);
+  const int tid = thr->tid;
+  MC_STAT(thr, c_rd_unlock)
+  DPrintf("UFO>>> #%d rd unlock :%llu    pc:%p\r\n", tid, mutex_id, pc);
+  _unlock(tid, pc, mutex_id, true);
 }
 
+// reader or writer unlock, the mode is unknown
 void impl_rw_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-  DPrintf("UFO>>> #%d rw unlock :%llu    pc:%p\r\n", thr->tid, mutex_id, pc);
+  const int tid = thr->tid;
+  MC_STAT(thr, c_rw_unlock)
+  DPrintf("UFO>>> #%d rw unlock :%llu    pc:%p\r\n", tid, mutex_id, pc);
+  _unlock(tid, pc, mutex_id, false);
 }
 
 
+// called when the wait returns, before mtx is locked again
 void impl_cond_wait(__tsan::ThreadState* thr, uptr pc, u64 addr_cond, u64 addr_mtx) {
   DPrintf("UFO>>> #%d cond wait       cond: %p  mutex: %p    pc:%p\r\n", thr->tid, addr_cond, addr_mtx, pc);
   const int tid = thr->tid;
   MC_STAT(thr, c_cond_wait)
+  TL_BUF_OR_RETURN(buf, tid)
+  _check_limit(buf);
+  _acquire_clock(buf, addr_cond);
+  buf.dedup_clear();
+  u64 _idx = _next_idx(buf);
+  buf.put_event(ThrCondWaitEvent(_idx, addr_cond, addr_mtx, (u64)pc));
 }
 
 ALWAYS_INLINE
 static void _reset_range_r(int tid, u64 cond_id) {
-  auto& buf = uctx->tlbufs[tid];
+  TL_BUF_OR_RETURN(buf, tid)
   // read 8 byte cond before signal, drop this read
-  const u64 esz = sizeof(MemRangeAccEvent);
-  if (LIKELY(buf.size_ >= esz)) {
-    if (LIKELY(buf.buf_[buf.size_ - esz] == EventType::MemRangeRead)) { // type 10: range read
-      u64 addr = *((u64*)(buf.buf_ + buf.size_ - esz + 7));
-      addr &= 0x0000ffffffffffff;
-      if (LIKELY(addr == cond_id)) {
-        buf.size_ -= esz;
+  if (LIKELY(buf.last_type() == EventType::MemRangeRead)) { // type 10: range read
+    if (LIKELY(buf.last_addr() == cond_id)) {
+      buf.drop_last();
 #ifdef STAT_ON
-        uctx->stat[tid].c_range_r--;
+      uctx->tl_stat(tid)->c_range_r--;
 #endif
-        DPrintf("read range 8 bytes reset\r\n");
-      }
+      DPrintf("read range 8 bytes reset\r\n");
     }
   }
 }
@@ -108,6 +191,10 @@ void impl_cond_signal(__tsan::ThreadState* thr, uptr pc, u64 addr_cond) {
   const int tid = thr->tid;
   MC_STAT(thr, c_cond_signal)
   _reset_range_r(tid, addr_cond);
+  TL_BUF_OR_RETURN(buf, tid)
+  buf.put_event(ThrCondSignalEvent(addr_cond, (u64)pc));
+  _release_clock(buf, addr_cond);
+  buf.dedup_clear();
 }
 
 void impl_cond_broadcast(__tsan::ThreadState* thr, uptr pc, u64 addr_cond) {
@@ -115,6 +202,44 @@ void impl_cond_broadcast(__tsan::ThreadState* thr, uptr pc, u64 addr_cond) {
   const int tid = thr->tid;
   MC_STAT(thr, c_cond_bc)
   _reset_range_r(tid, addr_cond);
+  TL_BUF_OR_RETURN(buf, tid)
+  buf.put_event(ThrCondBCEvent(addr_cond, (u64)pc));
+  _release_clock(buf, addr_cond);
+  buf.dedup_clear();
+}
+
+// memory orders of __tsan_memory_order
+ALWAYS_INLINE
+static bool _is_acquire(u8 op, u8 mo) {
+  return op != AtomicOpStore && (mo == 1 || mo == 2 || mo == 4 || mo == 5);
+}
+
+ALWAYS_INLINE
+static bool _is_release(u8 op, u8 mo) {
+  return op != AtomicOpLoad && (mo == 3 || mo == 4 || mo == 5);
+}
+
+// called under the lock of the sync var of addr if mo is not relaxed, events of one address are in order
+void impl_atomic(__tsan::ThreadState *thr, uptr pc, uptr addr, int size_log, u8 op, u8 mo) {
+  DPrintf("UFO>>> #%d atomic op %d mo %d %d bytes at %p   pc:%p\r\n", thr->tid, op, mo, (1 << size_log), addr, pc);
+  const int tid = thr->tid;
+  if (mo == 0 && !uctx->atomic_relaxed) {
+    MC_STAT(thr, cs_relaxed)
+    return;
+  }
+  MC_STAT(thr, c_atomic)
+  TL_BUF_OR_RETURN(buf, tid)
+  _check_limit(buf);
+  if (_is_acquire(op, mo)) {
+    _acquire_clock(buf, addr);
+    buf.dedup_clear();
+  }
+  u64 _idx = _next_idx(buf);
+  buf.put_event(AtomicEvent((u8) size_log, _idx, (u64) addr, (u64) pc, op, mo));
+  if (_is_release(op, mo)) {
+    _release_clock(buf, addr);
+    buf.dedup_clear();
+  }
 }
 
 
@@ -128,9 +253,17 @@ void *impl_alloc(ThreadState *thr, uptr pc, void *addr_left, uptr size) {
   DPrintf("UFO>>> #%d allocate %llu bytes from %llu    pc:%p\r\n", thr->tid, size, addr_left, pc);
   const int tid = thr->tid;
   MC_STAT(thr, c_alloc)
-  auto& buf = uctx->tlbufs[tid];
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
+  TL_BUF_OR_RETURN(buf, tid, addr_left)
+  if (UNLIKELY(buf.in_queue_))
+    return addr_left;
+  _check_limit(buf);
+  // chunk may be freed by another thread right before
+  _acquire_clock(buf, (u64)addr_left);
+  buf.dedup_clear();
+  u64 _idx = _next_idx(buf);
   buf.put_event(AllocEvent(_idx, (u64)addr_left, (u64)pc, (u32)size));
+  if (uctx->live_heap != nullptr)
+    uctx->live_heap->on_alloc(buf.uid_, _idx, (u64)addr_left, (u64)pc, (u32)size);
   return addr_left;
 }
 
@@ -138,25 +271,25 @@ void impl_dealloc(ThreadState *thr, uptr pc, void *addr) {
   DPrintf("UFO>>> #%d deallocate at %llu     pc:%p  \r\n", thr->tid, addr, pc);
   const int tid = thr->tid;
   MC_STAT(thr, c_dealloc)
-  TLBuffer& buf = uctx->tlbufs[tid];
-  const u64 esz = sizeof(AllocEvent);
-  if (LIKELY(buf.size_ >= esz)) {
-    if (UNLIKELY(buf.buf_[buf.size_ - esz] == AllocEvent::TYPE_INDEX)) {
-      u64 alloc_addr = *((u64*)(buf.buf_ + buf.size_ - esz + 5));
-      alloc_addr &= 0x0000ffffffffffff;
-      u64 dealloc_addr = (u64)addr;
-      if (LIKELY(alloc_addr == dealloc_addr)) {
-        buf.size_ -= esz;
+  TL_BUF_OR_RETURN(buf, tid)
+  if (UNLIKELY(buf.in_queue_))
+    return;
+  if (uctx->live_heap != nullptr)
+    uctx->live_heap->on_dealloc((u64)addr);
+  if (UNLIKELY(buf.last_type() == AllocEvent::TYPE_INDEX)) {
+    if (LIKELY(buf.last_addr() == (u64)addr)) {
+      buf.drop_last();
 #ifdef STAT_ON
-        uctx->stat[tid].c_alloc--;
+      uctx->tl_stat(tid)->c_alloc--;
 #endif
-        DPrintf("Continous alloc dealloc reset.\r\n");
-        return;
-      }
+      DPrintf("Continous alloc dealloc reset.\r\n");
+      return;
     }
   }
-  u64 _idx = __sync_add_and_fetch(&uctx->e_count, 1);
+  u64 _idx = _next_idx(buf);
   buf.put_event(DeallocEvent(_idx, (u64)addr, (u64)pc));
+  _release_clock(buf, (u64)addr);
+  buf.dedup_clear();
 }
 
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -173,37 +306,37 @@ default: return (u64)-1;
 
 void impl_thread_created(int tid_parent, int tid_kid, uptr pc) {
   DPrintf("UFO>>> (this tid %d) #%d -> #%d   pc:%p\r\n", cur_thread()->tid, tid_parent, tid_kid, pc);
+  u32 et = (u32)(uctx->get_time_ms() - uctx->time_started);
+  // the kid always gets a new uid, even if TSan reuses tid_kid
+  auto &buf_kid = uctx->threads->bind(tid_kid)->buf;
+  buf_kid.open_buf();
+  buf_kid.open_file(buf_kid.uid_);
+
+  // the kid is traced even if the parent is not bound
+  TLBuffer *buf_pa = uctx->tl_buf(tid_parent);
+  if (LIKELY(buf_pa != nullptr)) {
 #ifdef STAT_ON
-  uctx->stat[tid_parent].c_start++;
+    uctx->tl_stat(tid_parent)->c_start++;
 #endif
-
-  u32 et = (u32)(uctx->get_time_ms() - uctx->time_started);
-  auto& buf_pa = uctx->tlbufs[tid_parent];
-  // alloc 288 bytes on first pthread creation, drop this event
-  if (LIKELY(buf_pa.size_ >= sizeof(AllocEvent))) {
-    if (LIKELY(buf_pa.buf_[buf_pa.size_ - sizeof(AllocEvent)] == EventType::MemAlloc)) {
-      u32 size = *((u32*)(buf_pa.buf_ + buf_pa.size_ - 4));
+    // alloc 288 bytes on first pthread creation, drop this event
+    if (LIKELY(buf_pa->last_type() == EventType::MemAlloc)) {
+      // size is the last 4 bytes in both encodings
+      u32 size = *((u32*)(buf_pa->buf_ + buf_pa->size_ - 4));
       if (LIKELY(size == 288)) {// just observed this number 288
-        buf_pa.size_ -= sizeof(AllocEvent);
+        buf_pa->drop_last();
 #ifdef STAT_ON
-        uctx->stat[tid_parent].c_alloc--;
+        uctx->tl_stat(tid_parent)->c_alloc--;
 #endif
         DPrintf("alloc 288 reset\r\n");
       }
     }
-  }
-  buf_pa.put_event(CreateThreadEvent((TidType) tid_kid, et, (u64)pc));
-
-  auto &buf_kid = uctx->tlbufs[tid_kid];
-  if (UNLIKELY(buf_kid.buf_ != nullptr && buf_kid.size_ > 0)) {
-    buf_kid.flush();
-  } else buf_kid.open_buf();
+    buf_pa->put_event(CreateThreadEvent(buf_kid.uid_, et, (u64)pc));
+    buf_pa->dedup_clear();
 
-  if (LIKELY(!buf_kid.is_file_open())) {
-    buf_kid.open_file(tid_kid);
+    if (buf_pa->lclock_ > buf_kid.lclock_)
+      buf_kid.lclock_ = buf_pa->lclock_;
   }
-
-  buf_kid.put_event(ThreadBeginEvent((TidType) tid_parent, (u64)pc, et));
+  buf_kid.put_event(ThreadBeginEvent(uctx->uid_of(tid_parent), (u64)pc, et));
 }
 
 // rewrite begin event
@@ -212,37 +345,45 @@ void impl_thread_started(__tsan::ThreadState* thr, uptr stk_addr, uptr stk_size,
          cur_thread()->tid, thr->tid, stk_addr, stk_size, tls_addr, tls_size);
 
   const int tid = thr->tid;
-  auto& buf = uctx->tlbufs[tid];
-  if (LIKELY(buf.size_ >= sizeof(ThreadBeginEvent))) {
-    if (LIKELY(buf.buf_[buf.size_ - sizeof(ThreadBeginEvent)] == EventType::ThreadBegin)) {
-      ThreadBeginEvent* e = (ThreadBeginEvent*)(buf.buf_ + buf.size_ - sizeof(ThreadBeginEvent));
-      e->stk_addr = (u64)stk_addr;
-      e->stk_size = (u32)stk_size;
-      e->tls_addr = (u64)tls_addr;
-      e->tls_size = (u32)tls_size;
-    }
+  TL_BUF_OR_RETURN(buf, tid)
+  buf.bind_inline();
+  if (LIKELY(buf.last_type() == EventType::ThreadBegin)) {
+    ThreadBeginEvent* e = (ThreadBeginEvent*)(buf.buf_ + buf.last_off_);
+    e->stk_addr = (u64)stk_addr;
+    e->stk_size = (u32)stk_size;
+    e->tls_addr = (u64)tls_addr;
+    e->tls_size = (u32)tls_size;
   }
 }
 
 void impl_thread_join(int tid_main, int tid_joiner, uptr pc) {
   DPrintf("UFO>>> (this tid %d) #%d <- #%d   pc:%p\r\n", cur_thread()->tid, tid_main, tid_joiner, pc);
+  TL_BUF_OR_RETURN(buf_kid, tid_joiner)
+  u32 et = (u32)(uctx->get_time_ms() - uctx->time_started);
+  TLBuffer *buf_main = uctx->tl_buf(tid_main);
+  if (LIKELY(buf_main != nullptr)) {
 #ifdef STAT_ON
-  uctx->stat[tid_main].c_join++;
+    uctx->tl_stat(tid_main)->c_join++;
 #endif
+    if (buf_kid.lclock_ > buf_main->lclock_)
+      buf_main->lclock_ = buf_kid.lclock_;
+    buf_main->put_event(JoinThreadEvent(buf_kid.uid_, et, (u64)pc));
+    buf_main->dedup_clear();
+  }
 
-  u32 et = (u32)(uctx->get_time_ms() - uctx->time_started);
-  uctx->tlbufs[tid_main].put_event(JoinThreadEvent((TidType) tid_joiner, et, (u64)pc));
-
-  auto &buf_kid = uctx->tlbufs[tid_joiner];
-  buf_kid.put_event(ThreadEndEvent((TidType) tid_main, et));
-  buf_kid.finish();
+  buf_kid.put_event(ThreadEndEvent(uctx->uid_of(tid_main), et));
+  // the slot of the kid may be reclaimed from now on
+  uctx->threads->end(tid_joiner);
 }
 
 void impl_enter_func(ThreadState *thr, uptr pc) {
   DPrintf("UFO>>> #%d call  pc:%p  \r\n", thr->tid, pc);
   int tid = thr->tid;
   MC_STAT(thr, c_func_call)
-  auto& buf = uctx->tlbufs[tid];
+  TL_BUF_OR_RETURN(buf, tid)
+  // __ufo_disable_thread(), the calls across it are not paired
+  if (UNLIKELY(buf.acc_off_))
+    return;
   buf.put_event(FuncEntryEvent((u64)pc));
   buf.last_fe = buf.e_counter_;
 }
@@ -250,15 +391,14 @@ void impl_enter_func(ThreadState *thr, uptr pc) {
 void impl_exit_func(ThreadState *thr) {
   DPrintf("UFO>>> #%d exit call  pc:%p  \r\n", thr->tid);
   int tid = thr->tid;
-  TLBuffer& buf = uctx->tlbufs[tid];
-
-  u64 esz = sizeof(FuncEntryEvent);
-  if (LIKELY(buf.size_ >= esz)) {
-    if (UNLIKELY((buf.e_counter_ == buf.last_fe)
-                 && (buf.buf_[buf.size_ - esz] == FuncEntryEvent::TYPE_INDEX))) {
-      buf.size_ -= esz;
-      return;
-    }
+  TL_BUF_OR_RETURN(buf, tid)
+  if (UNLIKELY(buf.acc_off_))
+    return;
+
+  if (UNLIKELY((buf.e_counter_ == buf.last_fe)
+               && (buf.last_type() == FuncEntryEvent::TYPE_INDEX))) {
+    buf.drop_last();
+    return;
   }
   buf.put_event(FuncExitEvent());
 }
@@ -268,7 +408,8 @@ void impl_ptr_prop(__tsan::ThreadState *thr, uptr pc, uptr addr_src, uptr addr_d
   DPrintf("UFO>>>#%d  ptr prop  pc:%p  %p ==> %p \r\n", thr->tid, pc, addr_src, addr_dest);
   int tid = thr->tid;
   MC_STAT(thr, c_ptr_prop)
-  uctx->tlbufs[tid].put_event(PtrAssignEvent((u64)addr_src, (u64)addr_dest));
+  TL_BUF_OR_RETURN(buf, tid)
+  buf.put_event(PtrAssignEvent((u64)addr_src, (u64)addr_dest));
 }
 
 
@@ -276,7 +417,8 @@ void impl_ptr_deref(__tsan::ThreadState *thr, uptr pc, uptr addr_ptr) {
   DPrintf("UFO>>>#%d  ptr de-ref  pc:%p  %p \r\n", thr->tid, pc, addr_ptr);
   int tid = thr->tid;
 //  MC_STAT(thr, c_ptr_prop)
-  uctx->tlbufs[tid].put_event(PtrDeRefEvent((u64)addr_ptr));
+  TL_BUF_OR_RETURN(buf, tid)
+  buf.put_event(PtrDeRefEvent((u64)addr_ptr));
 }
 
 #include "impl_mem_acc.h"
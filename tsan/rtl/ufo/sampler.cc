@@ -0,0 +1,47 @@
+//
+// Created by xkommando on 4/10/17.
+//
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+
+#include "../tsan_mman.h"
+
+#include "sampler.h"
+
+namespace bw {
+namespace ufo {
+
+void PcSampler::alloc() {
+  table_ = (Entry *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, SAMPLER_SLOTS * sizeof(Entry));
+  __sanitizer::internal_memset(table_, 0, SAMPLER_SLOTS * sizeof(Entry));
+}
+
+void PcSampler::release() {
+  if (table_ != nullptr) {
+    __tsan::internal_free(table_);
+    table_ = nullptr;
+  }
+}
+
+void PcSampler::next_phase(Entry &e) {
+  if (!e.tracing) {
+    e.tracing = 1;
+    e.left = burst_;
+    return;
+  }
+  // end of a burst, the pc is hotter: skip longer
+  u64 period = (u64) e.period * decay_;
+  if (period > max_period_)
+    period = max_period_;
+  e.period = (u32) period;
+  u64 skip = (u64) burst_ * (period - 1);
+  if (skip == 0) {
+    e.left = burst_;
+    return;
+  }
+  e.tracing = 0;
+  e.left = skip > 0xffffffffull ? 0xffffffffu : (u32) skip;
+}
+
+} // ns ufo
+} // ns bw
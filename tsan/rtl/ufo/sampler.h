@@ -0,0 +1,83 @@
+//
+// Created by xkommando on 4/10/17.
+//
+
+#ifndef UFO_SAMPLER_H
+#define UFO_SAMPLER_H
+
+#include "../../../sanitizer_common/sanitizer_internal_defs.h"
+#include "defs.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u32;
+using __sanitizer::u64;
+
+const u32 SAMPLER_BITS = 12;
+const u32 SAMPLER_SLOTS = 1 << SAMPLER_BITS;
+
+/**
+ * UFO_SAMPLE: adaptive burst sampling of memory accesses, per pc (LiteRace).
+ * a pc is traced for a burst of `burst` executions, then skipped for burst * (period - 1) executions.
+ * period starts at 1 and is multiplied by `decay` after each burst, up to `max_period`:
+ * cold code is always traced, hot code is traced for 1 / max_period of its executions.
+ *
+ * the table is direct mapped, a pc evicted by another one starts over as a cold pc.
+ * thread local, allocated at the first sampled access.
+ */
+struct PcSampler {
+  struct Entry {
+    u64 pc;
+    u32 left; // executions left in the current phase
+    u32 period : 31;
+    u32 tracing : 1; // burst or skip phase
+  };
+
+  Entry *table_;
+  u32 burst_;
+  u32 decay_;
+  u32 max_period_;
+
+  void init(u32 burst, u32 decay, u32 max_period) {
+    table_ = nullptr;
+    burst_ = burst;
+    decay_ = decay;
+    max_period_ = max_period;
+  }
+
+  void release();
+
+  // true if this execution of pc is traced
+  ALWAYS_INLINE
+  bool sample(u64 pc) {
+    if (UNLIKELY(table_ == nullptr))
+      alloc();
+    Entry &e = table_[slot(pc)];
+    if (UNLIKELY(e.pc != pc)) {
+      e.pc = pc;
+      e.left = burst_;
+      e.period = 1;
+      e.tracing = 1;
+    }
+    if (UNLIKELY(e.left == 0))
+      next_phase(e);
+    e.left--;
+    return e.tracing != 0;
+  }
+
+private:
+  void alloc();
+
+  void next_phase(Entry &e);
+
+  ALWAYS_INLINE
+  static u32 slot(u64 pc) {
+    return (u32) ((pc * 0x9E3779B97F4A7C15ull) >> (64 - SAMPLER_BITS));
+  }
+};
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_SAMPLER_H
@@ -0,0 +1,126 @@
+//
+// Created by xkommando on 3/27/17.
+//
+
+#include "../../../sanitizer_common/sanitizer_common.h"
+
+#include "../tsan_mman.h"
+#include "../tsan_rtl.h"
+
+#include "defs.h"
+#include "thread_table.h"
+#include "ufo.h"
+
+namespace bw {
+namespace ufo {
+
+// defined in ufo_rtl.cc
+extern UFOContext *uctx;
+
+void ThreadTable::init() {
+  __sanitizer::internal_memset(live_, 0, sizeof(live_));
+  chunks_ = (ThreadSlot **) __sanitizer::MmapOrDie(MAX_CHUNKS * sizeof(ThreadSlot *), "UFO thread table");
+  n_ended_ = (u32 *) __sanitizer::MmapOrDie(MAX_CHUNKS * sizeof(u32), "UFO thread table");
+  dead_ = (u32 *) __sanitizer::MmapOrDie(MAX_CHUNKS * sizeof(u32), "UFO thread table");
+  n_dead_ = 0;
+  __sanitizer::atomic_store_relaxed(&n_uids_, 0);
+  mtx_.Init();
+}
+
+void ThreadTable::destroy() {
+  const u32 n_chunks = (n_uids() + CHUNK_SIZE - 1) >> CHUNK_BITS;
+  for (u32 i = 0; i < n_chunks; ++i) {
+    if (chunks_[i] != nullptr)
+      __tsan::internal_free(chunks_[i]);
+  }
+  __sanitizer::UnmapOrDie(chunks_, MAX_CHUNKS * sizeof(ThreadSlot *));
+  __sanitizer::UnmapOrDie(n_ended_, MAX_CHUNKS * sizeof(u32));
+  __sanitizer::UnmapOrDie(dead_, MAX_CHUNKS * sizeof(u32));
+  chunks_ = nullptr;
+  n_ended_ = nullptr;
+  dead_ = nullptr;
+}
+
+ThreadSlot *ThreadTable::alloc_slot(u32 uid) {
+  if (UNLIKELY(uid >= MAX_UID)) {
+    Printf("UFO>>> too many threads: %u\r\n", uid);
+    __sanitizer::Die();
+  }
+  ThreadSlot *chunk;
+  {
+    __sanitizer::SpinMutexLock l(&mtx_);
+    chunk = chunks_[uid >> CHUNK_BITS];
+    if (chunk == nullptr) {
+      chunk = (ThreadSlot *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, CHUNK_SIZE * sizeof(ThreadSlot));
+      // ready_ is 0
+      __sanitizer::internal_memset(chunk, 0, CHUNK_SIZE * sizeof(ThreadSlot));
+      n_ended_[uid >> CHUNK_BITS] = 0;
+      __atomic_store_n(&chunks_[uid >> CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+    }
+  }
+  // uid is ours, the chunk is not reclaimed before this thread ends
+  ThreadSlot *slot = chunk + (uid & (CHUNK_SIZE - 1));
+  slot->buf.init();
+  slot->buf.uid_ = uid;
+  slot->stat.init();
+  __sanitizer::atomic_store(&slot->ready_, 1, __sanitizer::memory_order_release);
+  return slot;
+}
+
+ThreadSlot *ThreadTable::bind(int tid) {
+  // tid reused, the previous thread ended without join (e.g. detached)
+  end(tid);
+  u32 uid = __sanitizer::atomic_fetch_add(&n_uids_, 1, __sanitizer::memory_order_acq_rel);
+  ThreadSlot *slot = alloc_slot(uid);
+  __atomic_store_n(&live_[tid], slot, __ATOMIC_RELEASE);
+  return slot;
+}
+
+void ThreadTable::end(int tid) {
+  ThreadSlot *slot = of(tid);
+  if (slot == nullptr)
+    return;
+  slot->buf.finish();
+  __atomic_store_n(&live_[tid], (ThreadSlot *) nullptr, __ATOMIC_RELEASE);
+  // the statistics of the slot are printed at exit
+  if (uctx->print_stat())
+    return;
+  const u32 c = slot->buf.uid_ >> CHUNK_BITS;
+  __sanitizer::SpinMutexLock l(&mtx_);
+  if (++n_ended_[c] == CHUNK_SIZE)
+    dead_[n_dead_++] = c;
+  if (n_dead_ > 0)
+    reclaim();
+}
+
+// the last block of an ended thread may still be in the io queue, which refers to its buffer
+void ThreadTable::reclaim() {
+  for (u32 i = 0; i < n_dead_;) {
+    ThreadSlot *chunk = chunks_[dead_[i]];
+    bool written = true;
+    for (u32 j = 0; j < CHUNK_SIZE && written; ++j) {
+      written = __sanitizer::atomic_load(&chunk[j].buf.in_flight_, __sanitizer::memory_order_acquire) == 0;
+    }
+    if (!written) {
+      ++i;
+      continue;
+    }
+    __atomic_store_n(&chunks_[dead_[i]], (ThreadSlot *) nullptr, __ATOMIC_RELEASE);
+    __tsan::internal_free(chunk);
+    dead_[i] = dead_[--n_dead_];
+  }
+}
+
+void ThreadTable::reset() {
+  const u32 n = n_uids();
+  for (u32 uid = 0; uid < n; ++uid) {
+    ThreadSlot *slot = get(uid);
+    if (slot == nullptr)
+      continue;
+    slot->buf.reset();
+    slot->stat.init();
+  }
+}
+
+} // ns ufo
+} // ns bw
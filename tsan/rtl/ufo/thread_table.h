@@ -0,0 +1,106 @@
+//
+// Created by xkommando on 3/27/17.
+//
+
+#ifndef UFO_THREAD_TABLE_H
+#define UFO_THREAD_TABLE_H
+
+#include "../../../sanitizer_common/sanitizer_atomic.h"
+#include "../../../sanitizer_common/sanitizer_mutex.h"
+#include "../tsan_defs.h"
+#include "defs.h"
+#include "tlbuffer.h"
+#include "ufo_stat.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u32;
+using __sanitizer::uptr;
+
+// state of one UFO thread
+struct ThreadSlot {
+  TLBuffer buf;
+  TLStatistic stat;
+  // set once buf and stat are initialized, see ThreadTable::get
+  __sanitizer::atomic_uint32_t ready_;
+};
+
+/**
+ * per-thread state, indexed by UFO thread id (uid).
+ * uids are unique and monotonically increasing, never reused in one process:
+ * a TSan tid reused by a new thread gets a new uid, hence a new trace file.
+ *
+ * two levels: directory -> chunk of CHUNK_SIZE slots, chunks are allocated on first use.
+ * the running thread finds its slot from the TSan tid (live_), one load on the hot path.
+ * init, fork and destroy only visit the uids in use.
+ *
+ * a slot is published (ready_) after it is initialized, get() returns nullptr before.
+ * a chunk is freed once all its threads ended and their last blocks were written, see end().
+ * not with UFO_STAT: the statistics of every thread are printed at exit.
+ * the threads that visit the slots while others run (governor, ring dumps) hold mtx_.
+ */
+struct ThreadTable {
+  static const u32 CHUNK_BITS = 8;
+  static const u32 CHUNK_SIZE = 1 << CHUNK_BITS;
+  static const u32 MAX_CHUNKS = 1 << 16;
+  static const u32 MAX_UID = CHUNK_SIZE * MAX_CHUNKS;
+
+  // TSan tid -> slot of the thread currently using the tid
+  ThreadSlot *live_[__tsan::kMaxTid];
+  // mmaped, only touched for the chunks in use
+  ThreadSlot **chunks_;
+  __sanitizer::atomic_uint32_t n_uids_;
+  // guards chunks_ allocation and reclamation
+  __sanitizer::SpinMutex mtx_;
+  // per chunk: number of ended threads, mmaped
+  u32 *n_ended_;
+  // chunks whose threads all ended, freed when their blocks are written
+  u32 *dead_;
+  u32 n_dead_;
+
+  void init();
+
+  void destroy();
+
+  // new uid for TSan tid, the previous thread of this tid is finished
+  ThreadSlot *bind(int tid);
+
+  // the thread of tid ended (joined): finish its trace, unbind tid, its slot may be reclaimed
+  void end(int tid);
+
+  // nullptr if no thread is bound to tid
+  ALWAYS_INLINE
+  ThreadSlot *of(int tid) const {
+    return __atomic_load_n(&live_[tid], __ATOMIC_RELAXED);
+  }
+
+  ALWAYS_INLINE
+  u32 n_uids() const {
+    return __sanitizer::atomic_load(&n_uids_, __sanitizer::memory_order_acquire);
+  }
+
+  // uid < n_uids(), nullptr if not initialized yet or reclaimed
+  ALWAYS_INLINE
+  ThreadSlot *get(u32 uid) const {
+    ThreadSlot *chunk = __atomic_load_n(&chunks_[uid >> CHUNK_BITS], __ATOMIC_ACQUIRE);
+    if (chunk == nullptr)
+      return nullptr;
+    ThreadSlot *slot = chunk + (uid & (CHUNK_SIZE - 1));
+    return __sanitizer::atomic_load(&slot->ready_, __sanitizer::memory_order_acquire) ? slot : nullptr;
+  }
+
+  // after fork, executed by child process
+  void reset();
+
+private:
+  ThreadSlot *alloc_slot(u32 uid);
+
+  // lock held
+  void reclaim();
+};
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_THREAD_TABLE_H
@@ -17,6 +17,7 @@
 #include "defs.h"
 #include "ufo.h"
 #include "tlbuffer.h"
+#include "io_writer.h"
 
 #include "snappy/snappy.h"
 
@@ -30,13 +31,20 @@ using __tsan::internal_alloc;
 using __tsan::internal_free;
 using __sanitizer::Die;
 
-TLBuffer *G_BUF_BASE;
-
 // defined in ufo_rtl.cc
 extern UFOContext *uctx;
 
+// limit_ is 0, the inlined accesses of threads without buffer take the slow path
+static InlineBuf no_inline_buf = {nullptr, 0, 0, NO_EVENT, 0};
+
+extern "C" {
+volatile u64 __ufo_e_count = 0;
+THREADLOCAL InlineBuf *__ufo_tl_buf = &no_inline_buf;
+}
+
 // thread safe, COMPRESS_ON
-void write_file(int fd, Byte* data, u64 len) {
+void write_file(int fd, Byte* data, u64 len, const BlockSummary &sum) {
+  u64 off = trace_offset(fd);
   if (uctx->use_compression) {
 
     struct snappy_env env;
@@ -53,21 +61,19 @@ void write_file(int fd, Byte* data, u64 len) {
       Die();
     }
     u32 block_len = outlen;
-    internal_write(fd, &block_len, 4);
-    internal_write(fd, out, outlen);
+    trace_writev(fd, &block_len, 4, out, outlen);
     internal_free(out);
+  } else if (uctx->encoding & EncodingCompact) {
+    u32 block_len = len;
+    trace_writev(fd, &block_len, 4, data, len);
   } else {
-    uptr bytes_written = internal_write(fd, data, len);
-    int write_errno;
-    bool result;
-    if (__sanitizer::internal_iserror(bytes_written, &write_errno)) {
-      Printf(">>>!!! UFO write file error, code:[%d], %s\r\n", write_errno, strerror(write_errno));
-    }
+    trace_write(fd, data, len);
   }
+  trace_block_done(fd, sum, off);
+}
 
-#ifdef SYNC_AT_FLUSH
-  fsync(fd);
-#endif
+void TLBuffer::bind_inline() {
+  __ufo_tl_buf = inline_acc_ && !acc_off_ && uctx->trace_enabled ? this : &no_inline_buf;
 }
 
 bool TLBuffer::is_file_open() const {
@@ -78,8 +84,30 @@ void TLBuffer::init() {
   buf_ = nullptr;
   size_ = 0;
   capacity_ = 0,
+  limit_ = 0;
+  gov_epoch_ = 0;
+  flush_epoch_ = atomic_load_relaxed(&uctx->flush_epoch);
+  dir_epoch_ = 0;
   trace_fd_ = -1,
   e_counter_ = 0;
+  lclock_ = 0;
+  writer_ = 0;
+  __sanitizer::atomic_store_relaxed(&in_flight_, 0);
+  in_queue_ = false;
+  compact_ = (uctx->encoding & EncodingCompact) != 0;
+  pc_keys_ = nullptr;
+  pc_ids_ = nullptr;
+  n_pc_ids_ = 0;
+  cur_pc_id_ = 0;
+  sampler_.init(uctx->sample_burst, uctx->sample_decay, uctx->sample_max_period);
+  dedup_ = nullptr;
+  dedup_epoch_ = 0;
+  inline_acc_ = uctx->inline_acc;
+  acc_off_ = false;
+  ring_ = nullptr;
+  seg_len_ = 0;
+  __sanitizer::atomic_store_relaxed(&n_wraps_, 0);
+  begin_block();
 
   tls_height = -1;
   tls_bottom = -1;// lower address
@@ -100,31 +128,92 @@ bool TLBuffer::is_thrlocal(u64 addr) const {
   return false;
 }
 
+void TLBuffer::clear_pc_dict() {
+  __sanitizer::internal_memset(pc_keys_, 0, PC_DICT_SLOTS * sizeof(u64));
+  n_pc_ids_ = 0;
+}
+
+void TLBuffer::open_dedup() {
+  dedup_ = (u64 *) internal_alloc(__tsan::MBlockScopedBuf, DEDUP_SLOTS * sizeof(u64));
+  reset_dedup();
+}
+
+void TLBuffer::reset_dedup() {
+  __sanitizer::internal_memset(dedup_, 0, DEDUP_SLOTS * sizeof(u64));
+  // empty slots (0) are in no epoch
+  dedup_epoch_ = DEDUP_EPOCH_ONE;
+}
+
+// slow path of pc_id(), space is reserved by begin_compact()
+u32 TLBuffer::pc_define(u32 slot, u64 pc) {
+  if (UNLIKELY(n_pc_ids_ >= PC_DICT_MAX_ID)) {
+    // ids are bound again by the following PcDefEvents
+    clear_pc_dict();
+    slot = pc_slot(pc);
+  }
+  u32 id = n_pc_ids_++;
+  pc_keys_[slot] = pc | PC_KEY_USED;
+  pc_ids_[slot] = (u16) id;
+
+  PcDefEvent def((u16) id, pc);
+  __sanitizer::internal_memcpy(buf_ + size_, &def, sizeof(PcDefEvent));
+  size_ += sizeof(PcDefEvent);
+  return id;
+}
+
 void TLBuffer::open_buf() {
+  if (compact_ && (uctx->encoding & EncodingPcDict) && pc_keys_ == nullptr) {
+    pc_keys_ = (u64 *) internal_alloc(__tsan::MBlockScopedBuf, PC_DICT_SLOTS * sizeof(u64));
+    pc_ids_ = (u16 *) internal_alloc(__tsan::MBlockScopedBuf, PC_DICT_SLOTS * sizeof(u16));
+    uctx->mem_acquired(PC_DICT_SLOTS * (sizeof(u64) + sizeof(u16)));
+  }
+  gov_epoch_ = atomic_load_relaxed(&uctx->gov_epoch);
+  if (uctx->ring_size != 0) {
+    // fixed size, not resized by the memory governor
+    ring_ = (Byte *) internal_alloc(__tsan::MBlockScopedBuf, uctx->ring_size);
+    seg_len_ = uctx->ring_size / RING_SEGMENTS;
+    __sanitizer::internal_memset(seg_size_, 0, sizeof(seg_size_));
+    __sanitizer::atomic_store_relaxed(&n_wraps_, 0);
+    buf_ = ring_;
+    capacity_ = seg_len_;
+    limit_ = seg_len_;
+    size_ = 0;
+    begin_block();
+    uctx->mem_acquired(uctx->ring_size);
+    return;
+  }
   u32 sz = uctx->get_buf_size();
   buf_ = (Byte *) internal_alloc(__tsan::MBlockScopedBuf, sz);
   capacity_ = sz;
+  limit_ = sz;
   size_ = 0;
+  begin_block();
   uctx->mem_acquired(sz);
 }
 
 /**
- * if file already exists, append. this is because the tid will be reused.
- *
+ * if file already exists, append. uids are not reused, but a forked child keeps the uid of the forking thread.
+ * the blocks and the index of the existing trace are kept, see trace_open.
  */
-void TLBuffer::open_file(int tid) {
+void TLBuffer::open_file(u32 uid) {
 
   if (uctx->no_stack) {
     uptr stk_size;
     uptr tls_size;
-    __sanitizer::GetThreadStackAndTls(tid == 0, (uptr *) &this->stack_bottom, &stk_size, (uptr *) &this->tls_bottom,
+    __sanitizer::GetThreadStackAndTls(uid == 0, (uptr *) &this->stack_bottom, &stk_size, (uptr *) &this->tls_bottom,
                                       &tls_size);
     this->stack_height = (u32) stk_size;
     this->tls_height = (u32) stk_size;
     DPrintf("UFO>>> #%d  stack:%llu %u   tls:%llu %u\r\n",
            __tsan::cur_thread()->tid, this->stack_bottom, this->stack_height, tls_bottom, this->tls_height);
   }
+  // blocks are analyzed, not written, or kept in the ring until dumped
+  if (uctx->online || uctx->ring_size != 0)
+    return;
 
+  // trace_dir is replaced by __ufo_rotate()
+  uctx->dir_mtx.Lock();
+  dir_epoch_ = atomic_load_relaxed(&uctx->dir_epoch);
   uptr pre_len = __sanitizer::internal_strlen(uctx->trace_dir);
   const uptr name_len = pre_len + 50;
   char *file_name = (char *) internal_alloc(__tsan::MBlockScopedBuf, name_len);
@@ -132,67 +221,232 @@ void TLBuffer::open_file(int tid) {
   __sanitizer::internal_strncat(file_name, uctx->trace_dir, pre_len + 2);
   file_name[pre_len] = '/';
   pre_len++;
-  pre_len += __sanitizer::internal_snprintf(file_name + pre_len, name_len, "%d", tid);
+  pre_len += __sanitizer::internal_snprintf(file_name + pre_len, name_len, "%u", uid);
   file_name[pre_len] = '\0';
+  uctx->dir_mtx.Unlock();
 
-  this->trace_fd_ = __sanitizer::internal_open(file_name, O_CREAT | O_APPEND | O_WRONLY, 0666);
+  this->trace_fd_ = trace_open(file_name);
   if (trace_fd_ < 0) {
-    fprintf(stderr, "UFO>>>#%d could not open file '%s' fd:[%d] code:[%d] error %s\r\n",
-            tid, file_name, trace_fd_, errno, strerror(errno));
+    fprintf(stderr, "UFO>>>#%u could not open file '%s' fd:[%d] code:[%d] error %s\r\n",
+            uid, file_name, trace_fd_, errno, strerror(errno));
     perror("");
     Die();
   }
   internal_free(file_name);
-  u32 data = uctx->use_compression;
-  UFOHeader header(tid, uctx->time_started, data);
-  internal_write(trace_fd_, &header, sizeof(UFOHeader));
+  // a reopened trace continues after its blocks, see trace_open
+  if (trace_offset(trace_fd_) == 0) {
+    u32 data = uctx->use_compression;
+    UFOHeader header(uid, uctx->time_started, data, uctx->clock_mode, uctx->encoding,
+                     uctx->sample_burst, uctx->sample_decay, uctx->sample_max_period);
+    trace_write(trace_fd_, &header, sizeof(UFOHeader));
+  }
 
-  DPrintf("UFO>>>#%d this %p fname:[%s] fd:%d    %s %d \r\n",
-          tid, this, file_name, trace_fd_, __PRETTY_FUNCTION__, __LINE__);
+  DPrintf("UFO>>>#%u this %p fname:[%s] fd:%d    %s %d \r\n",
+          uid, this, file_name, trace_fd_, __PRETTY_FUNCTION__, __LINE__);
 
 }
 
 void TLBuffer::flush() {
-  if (UNLIKELY( ! is_file_open())) {
-    int tid = this - G_BUF_BASE;
-    open_file(tid);
+  if (ring_ != nullptr) {
+    wrap();
+    return;
   }
+  if (UNLIKELY(!uctx->online && !is_file_open())) {
+    open_file(uid_);
+  }
+  // __ufo_rotate(): the trace in the previous dir ends with this block, the next one opens a trace in the new dir
+  const bool last = !uctx->online && dir_epoch_ != atomic_load_relaxed(&uctx->dir_epoch);
 
+  // empty if flushed on request, see UFOContext::flush_threads
   if (uctx->use_io_q) {
-    uctx->out_queue->push(this);
+    if (size_ > 0 || last)
+      uctx->out_queue->push(this, last);
   } else {
-    write_file(trace_fd_, buf_, size_);
+    if (size_ > 0)
+      write_file(trace_fd_, buf_, size_, sum_);
+    if (last) {
+      trace_write_index(trace_fd_);
+      trace_close(trace_fd_);
+    }
   }
+  if (last)
+    trace_fd_ = -1;
+  size_ = 0;
+  fit_buf();
+  begin_block();
+  // __ufo_enable(), __ufo_disable() of another thread
+  if (inline_acc_)
+    bind_inline();
+}
+
+void TLBuffer::wrap() {
+  u64 w = __sanitizer::atomic_load_relaxed(&n_wraps_);
+  u32 seg = (u32) (w % RING_SEGMENTS);
+  seg_size_[seg] = size_;
+  seg_sum_[seg] = sum_;
+  // the segment and its summary are complete before the next one is overwritten, see copy_ring()
+  __sanitizer::atomic_store(&n_wraps_, w + 1, __sanitizer::memory_order_release);
+  seg = (u32) ((w + 1) % RING_SEGMENTS);
+  seg_size_[seg] = 0;
+  buf_ = ring_ + (u64) seg * seg_len_;
   size_ = 0;
+  limit_ = seg_len_;
+  begin_block();
+}
+
+/**
+ * like a seqlock: the segments overwritten during the copy are found with n_wraps_ and dropped.
+ * the current segment is copied up to the start of its last event (last_off_, released by publish_last()),
+ * which may still be written, dropped or rewritten (see drop_last). nothing of it right after a drop.
+ */
+void TLBuffer::copy_ring(Byte *dst, RingSnapshot *snap) const {
+  snap->n_segs = 0;
+  if (ring_ == nullptr)
+    return;
+  u64 w0 = __sanitizer::atomic_load(&n_wraps_, __sanitizer::memory_order_acquire);
+  u32 cur = (u32) (w0 % RING_SEGMENTS);
+  u32 len = __atomic_load_n(&last_off_, __ATOMIC_ACQUIRE);
+  if (len == NO_EVENT)
+    len = 0;
+  BlockSummary cur_sum = sum_;
+
+  u32 sizes[RING_SEGMENTS];
+  u64 off = 0;
+  // oldest first, the current segment last
+  for (u32 k = 1; k <= RING_SEGMENTS; ++k) {
+    u32 seg = (cur + k) % RING_SEGMENTS;
+    // 0 if not used yet
+    u32 n = k < RING_SEGMENTS ? seg_size_[seg] : len;
+    __sanitizer::internal_memcpy(dst + off, ring_ + (u64) seg * seg_len_, n);
+    sizes[k - 1] = n;
+    snap->sum[k - 1] = k < RING_SEGMENTS ? seg_sum_[seg] : cur_sum;
+    off += n;
+  }
+  __sanitizer::atomic_thread_fence(__sanitizer::memory_order_seq_cst);
+  u64 w1 = __sanitizer::atomic_load(&n_wraps_, __sanitizer::memory_order_acquire);
+  u64 lost = w1 - w0;
+  if (lost >= RING_SEGMENTS)
+    return;
+  if (lost > 0) {
+    // the summary of the current segment was reset, take the one saved at wrap
+    snap->sum[RING_SEGMENTS - 1] = seg_sum_[cur];
+  }
+
+  // compact the segments kept at the beginning of dst
+  u64 from = 0;
+  u64 to = 0;
+  for (u32 k = 0; k < RING_SEGMENTS; ++k) {
+    if (k >= lost && sizes[k] > 0) {
+      if (from != to)
+        __sanitizer::internal_memmove(dst + to, dst + from, sizes[k]);
+      snap->size[snap->n_segs] = sizes[k];
+      snap->sum[snap->n_segs] = snap->sum[k];
+      snap->n_segs++;
+      to += sizes[k];
+    }
+    from += sizes[k];
+  }
+}
+
+void TLBuffer::fit_buf() {
+  gov_epoch_ = atomic_load_relaxed(&uctx->gov_epoch);
+  u32 sz = uctx->get_buf_size();
+  // shrink at once, grow when the size doubles
+  if (capacity_ > sz || (u64) capacity_ * 2 <= sz) {
+    internal_free(buf_);
+    uctx->mem_released(capacity_);
+    buf_ = (Byte *) internal_alloc(__tsan::MBlockScopedBuf, sz);
+    capacity_ = sz;
+    uctx->mem_acquired(sz);
+    uctx->buf_resized();
+  }
+  limit_ = capacity_;
 }
 
 void TLBuffer::finish() {
+  if (ring_ != nullptr) {
+    // the events of an ended thread are dropped, the allocations of its live chunks are retained
+    __sanitizer::SpinMutexLock l(&uctx->ring_mtx);
+    internal_free(ring_);
+    uctx->mem_released(uctx->ring_size);
+    ring_ = nullptr;
+    buf_ = nullptr;
+    size_ = 0;
+    begin_block();
+  }
   if (buf_ != nullptr) {
-    if (size_ > 0) {
-      if (UNLIKELY( ! is_file_open())) {
-        int tid = this - G_BUF_BASE;
-        open_file(tid);
+    if (uctx->use_io_q && uctx->out_queue != nullptr) {
+      // do not wait for the writer: the last block follows the blocks in flight to the same writer,
+      // which writes the index and closes the file after it
+      if (UNLIKELY(!uctx->online && !is_file_open())) {
+        open_file(uid_);
+      }
+      uctx->out_queue->push(this, true);
+      begin_block();
+      trace_fd_ = -1;
+    } else if (size_ > 0 || uctx->online) {
+      // blocks of this trace still in the async io queue (stopped at exit)
+      while (__sanitizer::atomic_load(&in_flight_, __sanitizer::memory_order_acquire) != 0) {
+        __sanitizer::internal_sched_yield();
+      }
+      if (uctx->online) {
+        // even if empty: the matcher waits for the threads not analyzed to the end
+        uctx->matcher->analyze(uid_, buf_, size_, true);
+      } else {
+        if (UNLIKELY( ! is_file_open())) {
+          open_file(uid_);
+        }
+        write_file(trace_fd_, buf_, size_, sum_);
       }
-      write_file(trace_fd_, buf_, size_);
       size_ = 0;
+      begin_block();
     }
     internal_free(buf_);
     uctx->mem_released(capacity_);
     buf_ = nullptr;
+  } else if (uctx->online && uctx->matcher != nullptr) {
+    uctx->matcher->analyze(uid_, nullptr, 0, true);
+  }
+  if (pc_keys_ != nullptr) {
+    internal_free(pc_keys_);
+    internal_free(pc_ids_);
+    uctx->mem_released(PC_DICT_SLOTS * (sizeof(u64) + sizeof(u16)));
+    pc_keys_ = nullptr;
+    pc_ids_ = nullptr;
+  }
+  sampler_.release();
+  if (dedup_ != nullptr) {
+    internal_free(dedup_);
+    dedup_ = nullptr;
   }
   capacity_ = 0;
+  limit_ = 0;
 
   if (is_file_open()) {
 //      trace_fd_ valid
-    fsync(trace_fd_);
-    __sanitizer::internal_close(trace_fd_);
+    trace_write_index(trace_fd_);
+    trace_close(trace_fd_);
   }
+  trace_fd_ = -1;
 }
 
 void TLBuffer::reset() {
   size_ = 0;
   trace_fd_ = -1;
   e_counter_ = 0;
+  lclock_ = 0;
+  writer_ = 0;
+  __sanitizer::atomic_store_relaxed(&in_flight_, 0);
+  in_queue_ = false;
+  compact_ = (uctx->encoding & EncodingCompact) != 0;
+  if (ring_ != nullptr) {
+    __sanitizer::internal_memset(seg_size_, 0, sizeof(seg_size_));
+    __sanitizer::atomic_store_relaxed(&n_wraps_, 0);
+    buf_ = ring_;
+    limit_ = seg_len_;
+  }
+  dedup_clear();
+  begin_block();
 }
 
 
@@ -11,27 +11,90 @@
 #include "../../../sanitizer_common/sanitizer_posix.h"
 #endif
 
+#include "../../../sanitizer_common/sanitizer_atomic.h"
 #include "../tsan_defs.h"
 #include "defs.h"
+#include "ufo_interface.h"
+#include "sampler.h"
+#include "compact_codec.h"
 
 
 namespace bw {
 namespace ufo {
 
-struct TLBuffer;
-extern TLBuffer *G_BUF_BASE;
+// room after each event for the value of mem acc
+const u32 MAX_VALUE_LEN = 8;
+// type + 3 varint (7 bytes for 48 bit) + size
+const u32 MAX_COMPACT_LEN = 32;
+const u32 NO_EVENT = 0xffffffff;
 
+// pc dictionary, ids fit in 2 varint bytes
+const u32 PC_DICT_BITS = 13;
+const u32 PC_DICT_SLOTS = 1 << PC_DICT_BITS;
+const u32 PC_DICT_MAX_ID = 1 << 12;
+const u64 PC_KEY_USED = 1ull << 63;
+const u32 MAX_PC_DEF_LEN = sizeof(PcDefEvent);
 
-// thread safe, COMPRESS_ON
-void write_file(int fd, Byte* data, u64 len);
+// UFO_DEDUP cache, key: address, read/write and size in the low 51 bits, epoch in the high 13 bits
+const u32 DEDUP_BITS = 10;
+const u32 DEDUP_SLOTS = 1 << DEDUP_BITS;
+const u64 DEDUP_EPOCH_ONE = 1ull << 51;
+const u64 DEDUP_KEY_MASK = DEDUP_EPOCH_ONE - 1;
 
-struct TLBuffer {
+// UFO_RING, see flight_recorder.h
+const u32 RING_SEGMENTS = 4;
+
+// segments of a ring copied by the dumping thread, oldest first
+struct RingSnapshot {
+  u32 n_segs;
+  u32 size[RING_SEGMENTS];
+  BlockSummary sum[RING_SEGMENTS];
+};
 
-  bool stopped;
 
+// thread safe, COMPRESS_ON, sum is added to the index of the file
+void write_file(int fd, Byte* data, u64 len, const BlockSummary &sum);
+
+/**
+ * ABI of the inlined memory access (UFO_INLINE_ACC, clang -mllvm -ufo-inline-acc),
+ * see instrumentUfoInlineAcc() in tsan/instrument/ThreadSanitizer.cpp, the layout must match.
+ *
+ * if size_ + INLINE_ACC_ROOM < limit_, the instrumented code takes idx = ++lclock_ (ClockThreadLocal),
+ * writes a raw MemAccEvent (pc is the address of the function) and the value at buf_ + size_,
+ * sets last_off_ and bumps size_. otherwise it calls __tsan_read/__tsan_write, which flushes.
+ */
+struct InlineBuf {
   Byte *buf_;
   u32 size_;
+  // flush when size_ reaches limit_ (<= capacity_), lowered by the memory governor
+  u32 limit_;
+  // start of the last event in buf_, used to drop the last event
+  u32 last_off_;
+  // last idx of this thread, ClockThreadLocal only, see tlclock.h
+  u64 lclock_;
+};
+static_assert(sizeof(InlineBuf) == 32, "InlineBuf is used by the instrumented code");
+
+const u32 INLINE_ACC_ROOM = sizeof(MemAccEvent) + MAX_VALUE_LEN;
+
+extern "C" {
+// ClockGlobal: idx of the last synced event (mem acc, lock, alloc/dealloc), see tlclock.h
+extern volatile u64 __ufo_e_count;
+// TLBuffer of this thread if UFOContext::inline_acc, otherwise an empty buffer (the slow path is taken)
+extern THREADLOCAL InlineBuf *__ufo_tl_buf;
+}
+
+struct TLBuffer : InlineBuf {
+
+  bool stopped;
+
+  // UFO thread id, name of the trace file, see thread_table.h
+  u32 uid_;
   u32 capacity_;
+  u32 gov_epoch_;
+  // UFOContext::flush_epoch, UFOContext::dir_epoch when trace_fd_ was opened
+  u32 flush_epoch_;
+  u32 dir_epoch_;
   int trace_fd_;
   u64 last_fe; // last e_count_ value at function entry, used to eliminate empty calls
 
@@ -43,28 +106,135 @@ struct TLBuffer {
 
   u64 e_counter_;
 
+  // async io: worker writing this trace, and number of blocks not written yet
+  u32 writer_;
+  __sanitizer::atomic_uint32_t in_flight_;
+  // async io: this thread starts a worker, the allocations of pthread_create are not traced
+  bool in_queue_;
+
+  // EncodingCompact: fields are delta encoded against the previous event of this block
+  bool compact_;
+  codec::Predictors pred_;
+  // predictors before the last event (InlineBuf::last_off_), used to drop the last event
+  codec::Predictors last_pred_;
+
+  // EncodingPcDict: pc -> id of this block, open addressing, null if not used
+  u64 *pc_keys_;
+  u16 *pc_ids_;
+  u32 n_pc_ids_;
+  u32 cur_pc_id_;
+
+  // summary of the block in buf_, added to the index of the trace file at flush
+  BlockSummary sum_;
+
+  // UFO_SAMPLE, memory accesses of hot pcs
+  PcSampler sampler_;
+
+  // UFO_DEDUP: accesses traced since the last sync event of this thread, direct mapped, null if not used.
+  // slots of older epochs never match, the cache is cleared by bumping the epoch
+  u64 *dedup_;
+  u64 dedup_epoch_;
+
+  // UFO_INLINE_ACC, accesses written by the instrumented code are not in the summary
+  bool inline_acc_;
+
+  // __ufo_disable_thread(): memory accesses and calls of this thread are not traced
+  bool acc_off_;
+
+  // UFO_RING: buf_ is segment (n_wraps_ % RING_SEGMENTS) of ring_, null if not used.
+  // a full segment is kept with its size and summary, the oldest one is overwritten
+  Byte *ring_;
+  u32 seg_len_;
+  u32 seg_size_[RING_SEGMENTS];
+  BlockSummary seg_sum_[RING_SEGMENTS];
+  __sanitizer::atomic_uint64_t n_wraps_;
+
   void init();
 
   void open_buf();
 
-  void open_file(int tid);
+  void open_file(u32 uid);
 
   void flush();
 
+  // resize the empty buffer to the current buffer size
+  void fit_buf();
+
+  // write the last block and the index, close the trace and free the buffers.
+  // with the async io queue, the writer of this trace does the io and finish() returns at once
   void finish();
 
   void reset();
 
+  // UFO_RING: copy the segments to dst (ring size), called by the dumping thread while this thread keeps tracing
+  void copy_ring(Byte *dst, RingSnapshot *snap) const;
+
+  // called by the thread of this buffer, the instrumented code of this thread writes to this buffer
+  void bind_inline();
+
   bool is_file_open() const;
 
   /// tls or stack
   bool is_thrlocal(u64 addr) const;
 
+  // drop the last event, restore predictors, only one event can be dropped
+  void drop_last() {
+    if ((buf_[last_off_] & 0x3f) == EventType::MemAlloc)
+      sum_.n_alloc--;
+    size_ = last_off_;
+    publish_last(NO_EVENT);
+    pred_ = last_pred_;
+  }
+
+  // false if the same access was traced since the last sync event
+  ALWAYS_INLINE
+  bool dedup_first(u64 addr, int size_log, bool is_write) {
+    if (UNLIKELY(dedup_ == nullptr))
+      open_dedup();
+    u64 k = ((addr << 3) | ((u64) is_write << 2) | (u64) size_log) & DEDUP_KEY_MASK;
+    u64 &slot = dedup_[(u32) ((k * 0x9E3779B97F4A7C15ull) >> (64 - DEDUP_BITS))];
+    k |= dedup_epoch_;
+    if (slot == k)
+      return false;
+    slot = k;
+    return true;
+  }
+
+  // sync event: lock, unlock, alloc, dealloc, thread and cond events
+  ALWAYS_INLINE
+  void dedup_clear() {
+    if (dedup_ == nullptr)
+      return;
+    dedup_epoch_ += DEDUP_EPOCH_ONE;
+    if (UNLIKELY(dedup_epoch_ == 0))
+      reset_dedup();
+  }
+
+  ALWAYS_INLINE
+  u8 last_type() const {
+    return last_off_ < size_ ? buf_[last_off_] : (u8) NO_EVENT;
+  }
+
+  // addr of the last event, which must start with idx and addr (mem acc, range acc, alloc, dealloc, lock)
+  ALWAYS_INLINE
+  u64 last_addr() const {
+    if (compact_)
+      return pred_.addr;
+    return *((u64 *) (buf_ + last_off_ + 7)) & 0x0000ffffffffffff;
+  }
+
 #pragma GCC diagnostic ignored "-Wcast-qual"
   template<typename E, u32 SZ = sizeof(E)>
   __HOT_CODE
   ALWAYS_INLINE
   void put_event(const E &event) {
+    put_raw<E, SZ>(event);
+  }
+
+  template<typename E, u32 SZ = sizeof(E)>
+  __HOT_CODE
+  ALWAYS_INLINE
+  void put_raw(const E &event) {
 
 #ifndef BUF_EVENT_ON
     if (internal_write(trace_fd_, &event, SZ) < 0) {
@@ -72,29 +242,329 @@ struct TLBuffer {
   }
   return;
 #else
-    if (UNLIKELY(buf_ == nullptr)) {
-      open_buf();
-      int tid = this - G_BUF_BASE;
-      open_file(tid);
-    } else if (UNLIKELY(size_ + SZ >= capacity_)) {
-      flush();
-    }
     Byte *pdata = (Byte *) (&event);
-    Byte *pbuf = buf_ + size_;
+    Byte *pbuf = reserve(SZ + MAX_VALUE_LEN);
+    save_pred();
 
     // write index (8 byte)
     *pbuf = *pdata;
     u32 offset = 1;
 
-    while (offset < SZ) {
+    while (offset + 1 < SZ) {
       *((u16 *) (pbuf + offset)) = *((u16 *) (pdata + offset));
       offset += 2;
     }
+    if (offset < SZ) {
+      pbuf[offset] = pdata[offset];
+      offset++;
+    }
     size_ += offset;
 #endif
 
     this->e_counter_++;
   }
+
+  // compact encoding (EncodingCompact) of the frequent events, raw otherwise.
+  // non-template overloads are preferred to put_event<E>.
+  __HOT_CODE
+  ALWAYS_INLINE
+  void put_event(const MemAccEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.addr);
+      p = put_pc(p, e.pc);
+      end_compact(p);
+    }
+    note_acc(e.idx, e.addr, e.addr + (1u << (e.type_index >> 6)));
+  }
+
+  __HOT_CODE
+  ALWAYS_INLINE
+  void put_event(const MemRangeAccEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.addr);
+      p = put_pc(p, e.pc);
+      p = put_varint(p, e.size);
+      end_compact(p);
+    }
+    note_acc(e.idx, e.addr, e.addr + e.size);
+  }
+
+  ALWAYS_INLINE
+  void put_event(const AllocEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.addr);
+      p = put_pc(p, e.pc);
+      // size is not compressed, always the last 4 bytes, as in AllocEvent
+      *((u32 *) p) = e.size;
+      end_compact(p + 4);
+    }
+    note_acc(e.idx, e.addr, e.addr + e.size);
+    sum_.n_alloc++;
+  }
+
+  ALWAYS_INLINE
+  void put_event(const DeallocEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.addr);
+      p = put_pc(p, e.pc);
+      end_compact(p);
+    }
+    note_acc(e.idx, e.addr, e.addr + 1);
+    sum_.n_dealloc++;
+  }
+
+  ALWAYS_INLINE
+  void put_event(const LockEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.mutexId);
+      p = put_pc(p, e.pc);
+      end_compact(p);
+    }
+    note_idx(e.idx);
+    sum_.n_lock++;
+  }
+
+  ALWAYS_INLINE
+  void put_event(const UnlockEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_addr(p, e.mutexId);
+      p = put_pc(p, e.pc);
+      end_compact(p);
+    }
+    sum_.n_lock++;
+  }
+
+  ALWAYS_INLINE
+  void put_event(const ThrCondWaitEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.cond);
+      p = put_pc(p, e.pc);
+      p = put_varint(p, zigzag(e.mtx, e.cond));
+      end_compact(p);
+    }
+    note_idx(e.idx);
+    sum_.n_lock++;
+  }
+
+  // signal and broadcast
+  template<typename E>
+  ALWAYS_INLINE
+  void put_cond_release(const E &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_addr(p, e.cond);
+      p = put_pc(p, e.pc);
+      end_compact(p);
+    }
+    sum_.n_lock++;
+  }
+
+  ALWAYS_INLINE
+  void put_event(const ThrCondSignalEvent &e) {
+    put_cond_release(e);
+  }
+
+  ALWAYS_INLINE
+  void put_event(const ThrCondBCEvent &e) {
+    put_cond_release(e);
+  }
+
+  __HOT_CODE
+  ALWAYS_INLINE
+  void put_event(const AtomicEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+    } else {
+      Byte *p = begin_compact(e.type_index, e.pc);
+      p = put_idx(p, e.idx);
+      p = put_addr(p, e.addr);
+      p = put_pc(p, e.pc);
+      *p = e.op_mo;
+      end_compact(p + 1);
+    }
+    // a fence has no address
+    if ((e.op_mo & 7) == AtomicOpFence)
+      note_idx(e.idx);
+    else
+      note_acc(e.idx, e.addr, e.addr + (1u << (e.type_index >> 6)));
+  }
+
+  ALWAYS_INLINE
+  void put_event(const FuncEntryEvent &e) {
+    if (!compact_) {
+      put_raw(e);
+      return;
+    }
+    Byte *p = begin_compact(e.type_index, e.caller_pc);
+    p = put_pc(p, e.caller_pc);
+    end_compact(p);
+  }
+
+private:
+  // make room for an event of at most len bytes, value included
+  ALWAYS_INLINE
+  Byte *reserve(u32 len) {
+    if (UNLIKELY(buf_ == nullptr)) {
+      open_buf();
+      open_file(uid_);
+    } else if (UNLIKELY(size_ + len >= limit_)) {
+      flush();
+    }
+    publish_last(size_);
+    return buf_ + size_;
+  }
+
+  // UFO_RING: the events before off are complete, see copy_ring(). a plain store on x86
+  ALWAYS_INLINE
+  void publish_last(u32 off) {
+    __atomic_store_n(&last_off_, off, __ATOMIC_RELEASE);
+  }
+
+  ALWAYS_INLINE
+  void save_pred() {
+    last_pred_ = pred_;
+  }
+
+  ALWAYS_INLINE
+  void note_idx(u64 idx) {
+    if (UNLIKELY(idx < sum_.min_idx))
+      sum_.min_idx = idx;
+    if (idx > sum_.max_idx)
+      sum_.max_idx = idx;
+  }
+
+  // [addr, end) touched by the event
+  ALWAYS_INLINE
+  void note_acc(u64 idx, u64 addr, u64 end) {
+    note_idx(idx);
+    if (addr < sum_.min_addr)
+      sum_.min_addr = addr;
+    if (end > sum_.max_addr)
+      sum_.max_addr = end;
+  }
+
+  // predictors, pc ids, the last event and the summary are reset at the beginning of each block
+  ALWAYS_INLINE
+  void begin_block() {
+    sum_.reset();
+    if (inline_acc_)
+      sum_.cover_all();
+    pred_.reset();
+    publish_last(NO_EVENT);
+    if (pc_keys_ != nullptr)
+      clear_pc_dict();
+  }
+
+  void clear_pc_dict();
+
+  // UFO_RING: the next segment becomes buf_, nothing is written
+  void wrap();
+
+  void open_dedup();
+
+  // epoch wrapped around, forget all slots
+  void reset_dedup();
+
+  // pc is looked up in the dictionary first, its definition is written before the event
+  ALWAYS_INLINE
+  Byte *begin_compact(u8 type_index, u64 pc) {
+    Byte *p = reserve(MAX_PC_DEF_LEN + MAX_COMPACT_LEN + MAX_VALUE_LEN);
+    if (pc_keys_ != nullptr) {
+      cur_pc_id_ = pc_id(pc);
+      p = buf_ + size_;
+      publish_last(size_);
+    }
+    save_pred();
+    *p = type_index;
+    return p + 1;
+  }
+
+  // id of pc in this block, emit PcDefEvent on first occurrence
+  ALWAYS_INLINE
+  u32 pc_id(u64 pc) {
+    u64 key = pc | PC_KEY_USED;
+    u32 slot = pc_slot(pc);
+    for (;;) {
+      u64 k = pc_keys_[slot];
+      if (LIKELY(k == key))
+        return pc_ids_[slot];
+      if (k == 0)
+        break;
+      slot = (slot + 1) & (PC_DICT_SLOTS - 1);
+    }
+    return pc_define(slot, pc);
+  }
+
+  ALWAYS_INLINE
+  static u32 pc_slot(u64 pc) {
+    return (u32) ((pc * 0x9E3779B97F4A7C15ull) >> (64 - PC_DICT_BITS));
+  }
+
+  u32 pc_define(u32 slot, u64 pc);
+
+  ALWAYS_INLINE
+  void end_compact(Byte *p) {
+    size_ = (u32) (p - buf_);
+    this->e_counter_++;
+  }
+
+  // field encoders in compact_codec.h, shared with the tests of the offline reader
+  ALWAYS_INLINE
+  static Byte *put_varint(Byte *p, u64 v) {
+    return codec::put_varint(p, v);
+  }
+
+  ALWAYS_INLINE
+  static u64 zigzag(u64 cur, u64 pred) {
+    return codec::zigzag(cur, pred);
+  }
+
+  ALWAYS_INLINE
+  Byte *put_idx(Byte *p, u64 idx) {
+    return pred_.put_idx(p, idx);
+  }
+
+  ALWAYS_INLINE
+  Byte *put_addr(Byte *p, u64 addr) {
+    return pred_.put_addr(p, addr);
+  }
+
+  ALWAYS_INLINE
+  Byte *put_pc(Byte *p, u64 pc) {
+    if (pc_keys_ != nullptr)
+      return put_varint(p, cur_pc_id_);
+    return pred_.put_pc(p, pc);
+  }
+public:
 #pragma GCC diagnostic warning "-Wcast-qual"
 };
 
@@ -0,0 +1,96 @@
+//
+// Created by xkommando on 3/1/17.
+//
+
+#ifndef UFO_TLCLOCK_H
+#define UFO_TLCLOCK_H
+
+#include <time.h>
+
+#include "../../../sanitizer_common/sanitizer_atomic.h"
+#include "../tsan_defs.h"
+#include "defs.h"
+
+namespace bw {
+namespace ufo {
+
+using __sanitizer::u32;
+using __sanitizer::u64;
+using __sanitizer::atomic_uint64_t;
+
+/**
+ * how the idx of synced events (mem acc, lock, alloc/dealloc) is generated.
+ *
+ * ClockGlobal: one shared counter (__ufo_e_count, see tlbuffer.h),
+ *   idx is unique and totally ordered across all threads.
+ *
+ * ClockThreadLocal: hybrid logical clock kept in each TLBuffer,
+ *   idx = max(last idx + 1, (tsc - tsc_started) >> TSC_SHIFT),
+ *   merged with the clock released on the sync object at lock/unlock,
+ *   thread create/join and alloc/dealloc of the same address.
+ *   idx is strictly increasing within a thread and consistent with happens-before,
+ *   but two threads may produce the same idx:
+ *   the global order is rebuilt by sorting on (idx, tid).
+ *   events without idx are placed right after the previous event of the same thread.
+ *   accesses inlined by the instrumentation (UFO_INLINE_ACC) take last idx + 1, without tsc.
+ */
+enum ClockMode {
+  ClockGlobal = 0,
+  ClockThreadLocal = 1
+};
+
+// 48 bit idx at 3GHz lasts ~100 hours
+const u32 TSC_SHIFT = 2;
+
+ALWAYS_INLINE
+u64 read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  // invariant tsc, synchronized among cores
+  return __builtin_ia32_rdtsc();
+#else
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
+#endif
+}
+
+/**
+ * clock released on sync objects (mutex, thread, heap address).
+ * the sync id is hashed into a fixed table, collision only adds extra (safe) ordering.
+ */
+struct SyncClock {
+  static const u32 N_SLOTS = 1 << 14;
+
+  atomic_uint64_t slots_[N_SLOTS];
+
+  void init() {
+    for (u32 i = 0; i < N_SLOTS; ++i) {
+      __sanitizer::atomic_store_relaxed(slots_ + i, 0);
+    }
+  }
+
+  ALWAYS_INLINE
+  static u32 slot_of(u64 sync_id) {
+    return (u32)(((sync_id >> 3) * 0x9E3779B97F4A7C15ull) >> 50);
+  }
+
+  ALWAYS_INLINE
+  u64 acquire(u64 sync_id) const {
+    return __sanitizer::atomic_load(slots_ + slot_of(sync_id), __sanitizer::memory_order_acquire);
+  }
+
+  ALWAYS_INLINE
+  void release(u64 sync_id, u64 clk) {
+    atomic_uint64_t *s = slots_ + slot_of(sync_id);
+    u64 cur = __sanitizer::atomic_load_relaxed(s);
+    while (cur < clk
+           && !__sanitizer::atomic_compare_exchange_weak(s, &cur, clk, __sanitizer::memory_order_release)) {
+    }
+  }
+};
+static_assert((1 << (64 - 50)) == SyncClock::N_SLOTS, "hash shift must match table size");
+
+} // ns ufo
+} // ns bw
+
+#endif //UFO_TLCLOCK_H
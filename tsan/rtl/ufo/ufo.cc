@@ -52,32 +52,55 @@ u64 UFOContext::get_time_ms() {
 //void (*fn_enter_func)(__tsan::ThreadState *thr, uptr pc);
 //void (*fn_exit_func)(__tsan::ThreadState *thr);
 
-FPAlloc UFOContext::fn_alloc = &nop_alloc;
-
-FPDealloc UFOContext::fn_dealloc = &nop_dealloc;
-FPThr UFOContext::fn_thread_created = &nop_thread_created;
-FPThrStart UFOContext::fn_thread_started = &nop_thread_start;
-FPThr UFOContext::fn_thread_join = &nop_thread_join;
-
-FPMtxLock UFOContext::fn_mtx_lock = &nop_mtx_lock;
-FPMtxLock UFOContext::fn_mtx_unlock = &nop_mtx_unlock;
-
-FPMtxLock UFOContext::fn_rd_lock = &nop_rd_lock;
-FPMtxLock UFOContext::fn_rd_unlock = &nop_rd_unlock;
-FPMtxLock UFOContext::fn_rw_unlock = &nop_rw_unlock;
-
-
-FPCondWait UFOContext::fn_cond_wait = &nop_cond_wait;
-FPCondSignal UFOContext::fn_cond_signal = &nop_cond_signal;
-FPCondSignal UFOContext::fn_cond_bc = &nop_cond_broadcast;
-
-FPMemAcc UFOContext::fn_mem_acc = &nop_mem_acc;
-FPMemRangeAcc UFOContext::fn_mem_range_acc = &nop_mem_range_acc;
-
-FPFuncEnter UFOContext::fn_enter_func = &nop_enter_func;
-FPFuncExit UFOContext::fn_exit_func = &nop_exit_func;
-FPPtrProp UFOContext::fn_ptr_prop = &nop_ptr_prop;
-FPPtrDeRef UFOContext::fn_ptr_deref = &nop_ptr_deref;
+// nothing traced, before init_start and after destroy
+static const Hooks nop_hooks = {
+    &nop_alloc, &nop_dealloc,
+    &nop_thread_created, &nop_thread_start, &nop_thread_join,
+    &nop_mtx_lock, &nop_mtx_unlock, &nop_rd_lock, &nop_rd_unlock, &nop_rw_unlock,
+    &nop_cond_wait, &nop_cond_signal, &nop_cond_broadcast,
+    &nop_atomic,
+    &nop_ptr_prop, &nop_ptr_deref
+};
+
+// tracing disabled, threads are still bound
+static const Hooks thread_hooks = {
+    &nop_alloc, &nop_dealloc,
+    &impl_thread_created, &impl_thread_started, &impl_thread_join,
+    &nop_mtx_lock, &nop_mtx_unlock, &nop_rd_lock, &nop_rd_unlock, &nop_rw_unlock,
+    &nop_cond_wait, &nop_cond_signal, &nop_cond_broadcast,
+    &nop_atomic,
+    &nop_ptr_prop, &nop_ptr_deref
+};
+
+static const Hooks trace_hooks = {
+    &impl_alloc, &impl_dealloc,
+    &impl_thread_created, &impl_thread_started, &impl_thread_join,
+    &impl_mtx_lock, &impl_mtx_unlock, &impl_rd_lock, &impl_rd_unlock, &impl_rw_unlock,
+    &impl_cond_wait, &impl_cond_signal, &impl_cond_broadcast,
+    &impl_atomic,
+    &nop_ptr_prop, &nop_ptr_deref
+};
+
+// UFO_PTR_PROP
+static const Hooks trace_ptr_hooks = {
+    &impl_alloc, &impl_dealloc,
+    &impl_thread_created, &impl_thread_started, &impl_thread_join,
+    &impl_mtx_lock, &impl_mtx_unlock, &impl_rd_lock, &impl_rd_unlock, &impl_rw_unlock,
+    &impl_cond_wait, &impl_cond_signal, &impl_cond_broadcast,
+    &impl_atomic,
+    &impl_ptr_prop, &impl_ptr_deref
+};
+
+const Hooks *UFOContext::hooks_ = &nop_hooks;
+
+// hot path hooks, see ufo_interface.h
+FPMemAcc fn_mem_acc = &nop_mem_acc;
+FPMemRangeAcc fn_mem_range_acc = &nop_mem_range_acc;
+
+FPFuncEnter fn_enter_func = &nop_enter_func;
+FPFuncExit fn_exit_func = &nop_exit_func;
+
+bool lite_mode = false;
 
 // static
 s64 UFOContext::get_int_opt(const char *name, s64 default_val) {
@@ -95,81 +118,90 @@ void UFOContext::start_trace() {
   if ( !is_on) {
     return;
   }
-  fn_alloc = &impl_alloc;
-  fn_dealloc = &impl_dealloc;
-  fn_thread_created = &impl_thread_created;
-  fn_thread_started = &impl_thread_started;
-  fn_thread_join = &impl_thread_join;
-
-  fn_mtx_lock = &impl_mtx_lock;
-  fn_mtx_unlock = &impl_mtx_unlock;
-  fn_rd_lock = &impl_rd_lock;
-  fn_rd_unlock = &impl_rd_unlock;
-  fn_rw_unlock = &impl_rw_unlock;
-
-  fn_cond_wait = &impl_cond_wait;
-  fn_cond_signal = &impl_cond_signal;
-  fn_cond_bc = &impl_cond_broadcast;
-
   s64 set_no_stack = get_int_opt(ENV_NO_STACK_ACC, NO_STACK_ACC);
   s64 set_no_value = get_int_opt(ENV_NO_VALUE, 0);
+  this->no_data_value = set_no_value != 0;
+  this->no_stack = set_no_stack != 0;
 
+  // threads are bound even if tracing is disabled
+  if (!trace_enabled) {
+    stop_events();
+    return;
+  }
+
+  set_hooks(trace_ptr_prop ? &trace_ptr_hooks : &trace_hooks);
   if (this->trace_func_call) {
     fn_enter_func = &impl_enter_func;
     fn_exit_func = &impl_exit_func;
   }
-  if (this->trace_ptr_prop) {
-    fn_ptr_prop = &impl_ptr_prop;
-    fn_ptr_deref = &impl_ptr_deref;
-  }
-
-  this->no_data_value = set_no_value != 0;
-  if (set_no_stack == 0) {
-    this->no_stack = false;
-    fn_mem_range_acc = &impl_mem_range_acc;
-    if (no_data_value) {
-      fn_mem_acc = &impl_mem_acc_nv;
-    } else {
-      fn_mem_acc = &impl_mem_acc;
-    }
-  } else {
-    this->no_stack = true;
-    fn_mem_range_acc = &ns_mem_range_acc;
-    if (no_data_value) {
-      fn_mem_acc = &ns_mem_acc_nv;
-    } else {
-      fn_mem_acc = &ns_mem_acc;
-    }
-  }
 
-  fn_mem_range_acc = &ns_mem_range_acc;
+  u32 acc_flags = 0;
+  if (!no_data_value)
+    acc_flags |= AccValue;
+  // no stack access on the heap either
+  if (heap_only)
+    acc_flags |= AccHeapOnly;
+  else if (no_stack)
+    acc_flags |= AccNoStack;
+  if (dedup)
+    acc_flags |= AccDedup;
+  if (sample_max_period != 0)
+    acc_flags |= AccSample;
+  if (do_print_stat_)
+    acc_flags |= AccStat;
+  if (atomic_load_relaxed(&thread_off))
+    acc_flags |= AccThreadOff;
+  // range accesses on the stack or tls are never traced
+  u32 range_flags = heap_only ? acc_flags : (acc_flags | AccNoStack);
+  fn_mem_acc = select_mem_acc(acc_flags);
+  fn_mem_range_acc = select_mem_range_acc(range_flags);
 
   DPrintf("UFO>>>start tracing\r\n");
 }
 
 void UFOContext::stop_trace() {
-  fn_alloc = &nop_alloc;
-  fn_dealloc = &nop_dealloc;
-  fn_thread_created = &nop_thread_created;
-  fn_thread_started = &nop_thread_start;
-  fn_thread_join = &nop_thread_join;
-
-  fn_mtx_lock = &nop_mtx_lock;
-  fn_mtx_unlock = &nop_mtx_unlock;
-  fn_rd_lock = &nop_rd_lock;
-  fn_rd_unlock = &nop_rd_unlock;
-  fn_rw_unlock = &nop_rw_unlock;
-
-  fn_cond_wait = &nop_cond_wait;
-  fn_cond_signal = &nop_cond_signal;
-  fn_cond_bc = &nop_cond_broadcast;
+  fn_mem_acc = &nop_mem_acc;
+  fn_mem_range_acc = &nop_mem_range_acc;
+  fn_enter_func = &nop_enter_func;
+  fn_exit_func = &nop_exit_func;
+  set_hooks(&nop_hooks);
+}
 
+void UFOContext::stop_events() {
   fn_mem_acc = &nop_mem_acc;
   fn_mem_range_acc = &nop_mem_range_acc;
   fn_enter_func = &nop_enter_func;
   fn_exit_func = &nop_exit_func;
-  fn_ptr_prop = &nop_ptr_prop;
-  fn_ptr_deref = &nop_ptr_deref;
+  set_hooks(&thread_hooks);
+}
+
+// <base>_<pid> to out (DIR_MAX_LEN), base is UFO_TDIR or the dir of __ufo_rotate()
+static void _make_trace_dir(char *out, const char *base, u32 pid) {
+  __sanitizer::internal_memset(out, '\0', DIR_MAX_LEN);
+  u64 dir_len;
+  if (base == nullptr
+      || (dir_len = internal_strnlen(base, DIR_MAX_LEN)) < 1) {
+    internal_strncpy(out, DEFAULT_TRACE_DIR, 100);
+  } else {
+    internal_strncpy(out, base, DIR_MAX_LEN - 45);
+  }
+  // append '_' to dir name
+  dir_len = internal_strnlen(out, DIR_MAX_LEN - 1);
+  if (0 < dir_len && dir_len < DIR_MAX_LEN - 45) {
+    if (out[dir_len - 1] == '/') {
+      out[dir_len - 1] = '_';
+    } else {
+      out[dir_len] = '_';
+      out[dir_len + 1] = '\0';
+      dir_len++;
+    }
+  }
+  // append process id to the dir name
+//  pre_len += __sanitizer::internal_snprintf(file_name + pre_len, name_len, "%d", tid);
+  char str_pid[50];
+  __sanitizer::internal_memset(str_pid, '\0', 50);
+  __sanitizer::internal_snprintf(str_pid, 45, "%u", pid);
+  __sanitizer::internal_strncat(out, str_pid, 45);
 }
 
 void UFOContext::read_config() {
@@ -178,6 +210,7 @@ void UFOContext::read_config() {
   this->use_compression = 0;
   this->use_io_q = 0;
   this->out_queue_legth = -1;
+  this->io_workers = 0;
 
   this->do_print_stat_ = get_int_opt(ENV_PRINT_STAT, 0);
 
@@ -187,6 +220,7 @@ void UFOContext::read_config() {
 //    this->tl_buf_size = (u64) bufsz * 1024 * 1024; // to MB
     u32 sz = bufsz * 1024 * 1024;
     atomic_store_relaxed(&this->tl_buf_size_, sz);
+    this->max_buf_size_ = sz;
   } else {
     Printf("!!! Could not read thread local buffer size or size illegal:  %ld\r\n", bufsz);
     Die();
@@ -209,16 +243,30 @@ void UFOContext::read_config() {
         , bufsz, mem_t2_ / 1024 / 1024);
   }
 
-  ratio_mem_x2 = 0;
-  ratio_mem_x4 = 0;
+
+  // online: blocks are analyzed by the io workers, never compressed nor written
+  s64 set_online = get_int_opt(ENV_ONLINE, 0);
+  this->online = set_online != 0;
+
+  // flight recorder: the blocks stay in the rings until dumped
+  this->ring_size = 0;
+  s64 ring_mb = get_int_opt(ENV_RING, 0);
+  if (ring_mb != 0 && online) {
+    Printf("!!! UFO_RING ignored, blocks are analyzed with UFO_ONLINE.\r\n");
+  } else if (0 < ring_mb && ring_mb < 4096) {
+    this->ring_size = (u32) ring_mb * 1024 * 1024;
+  } else if (ring_mb != 0) {
+    Printf("!!! Invalid ring size: %dMB, UFO_RING ignored.\r\n", ring_mb);
+  }
+  this->ring_signal = (int) get_int_opt(ENV_RING_SIGNAL, DEFAULT_RING_SIGNAL);
 
   // use snappy compression
   s64 use_comp = get_int_opt(ENV_USE_COMPRESS, 0);
-  this->use_compression = use_comp;
+  this->use_compression = use_comp && !online;
 
   // use async io queue
   s64 do_use_q = get_int_opt(ENV_USE_IO_Q, 0);
-  this->use_io_q = do_use_q;
+  this->use_io_q = (do_use_q || online) && ring_size == 0;
   if (use_io_q) {
     // queue size
     s64 io_q_sz = get_int_opt(ENV_IO_Q_SIZE, DEFAULT_IO_Q_SIZE);
@@ -228,6 +276,14 @@ void UFOContext::read_config() {
       Printf("!!! Could not read out queue length or length is illegal:  %d\r\n", io_q_sz);
       Die();
     }
+    // more writers than buffers would never be busy
+    s64 n_workers = get_int_opt(ENV_IO_WORKERS, DEFAULT_IO_WORKERS);
+    if (0 < n_workers && n_workers < 256) {
+      this->io_workers = n_workers < out_queue_legth ? n_workers : out_queue_legth;
+    } else {
+      Printf("!!! Could not read number of io workers or number is illegal:  %d\r\n", n_workers);
+      Die();
+    }
   }
 
   s64 do_trace_call = get_int_opt(ENV_TRACE_FUNC, 1);
@@ -236,59 +292,154 @@ void UFOContext::read_config() {
   s64 do_trace_ptr_prop = get_int_opt(ENV_PTR_PROP, 0);
   this->trace_ptr_prop = do_trace_ptr_prop;
 
-  // trace dir
-  __sanitizer::internal_memset(trace_dir, '\0', DIR_MAX_LEN);
-  const char *env_dir = __sanitizer::GetEnv(ENV_TRACE_DIR);
-  u64 dir_len;
-  if (env_dir == nullptr
-      || (dir_len = internal_strnlen(env_dir, DIR_MAX_LEN)) < 1) {
-    internal_strncpy(trace_dir, DEFAULT_TRACE_DIR, 100);
-  } else {
-    internal_strncpy(trace_dir, env_dir, DIR_MAX_LEN - 45);
+  s64 use_tl_clock = get_int_opt(ENV_TL_CLOCK, 0);
+  this->clock_mode = use_tl_clock ? ClockThreadLocal : ClockGlobal;
+
+  // also set by start_trace, needed here for the encoding and the inline access
+  this->no_data_value = get_int_opt(ENV_NO_VALUE, 0) != 0;
+  this->no_stack = get_int_opt(ENV_NO_STACK_ACC, NO_STACK_ACC) != 0;
+  s64 use_compact = get_int_opt(ENV_COMPACT, 0);
+  this->encoding = use_compact ? EncodingCompact : EncodingRaw;
+  if (use_compact && get_int_opt(ENV_PC_DICT, 1)) {
+    this->encoding |= EncodingPcDict;
   }
-  // append '_' to dir name
-  dir_len = internal_strnlen(trace_dir, DIR_MAX_LEN - 1);
-  if (0 < dir_len && dir_len < DIR_MAX_LEN - 45) {
-    if (trace_dir[dir_len - 1] == '/') {
-      trace_dir[dir_len - 1] = '_';
-    } else {
-      trace_dir[dir_len] = '_';
-      trace_dir[dir_len + 1] = '\0';
-      dir_len++;
+  if (no_data_value) {
+    this->encoding |= EncodingNoValue;
+  }
+
+  this->heap_only = get_int_opt(ENV_HEAP_ONLY, 0) != 0;
+  this->atomic_relaxed = get_int_opt(ENV_ATOMIC_RELAXED, 1) != 0;
+  this->dedup = get_int_opt(ENV_DEDUP, 0) != 0;
+
+  // burst sampling of memory accesses, other events are always traced
+  this->sample_burst = 0;
+  this->sample_decay = 0;
+  this->sample_max_period = 0;
+  if (get_int_opt(ENV_SAMPLE, 0)) {
+    s64 burst = get_int_opt(ENV_SAMPLE_BURST, DEFAULT_SAMPLE_BURST);
+    if (burst < 1 || burst > 65535) {
+      Printf("!!! Invalid sampling burst: %d, reset to default: %d.\r\n", burst, DEFAULT_SAMPLE_BURST);
+      burst = DEFAULT_SAMPLE_BURST;
+    }
+    s64 decay = get_int_opt(ENV_SAMPLE_DECAY, DEFAULT_SAMPLE_DECAY);
+    if (decay < 2 || decay > 65535) {
+      Printf("!!! Invalid sampling decay: %d, reset to default: %d.\r\n", decay, DEFAULT_SAMPLE_DECAY);
+      decay = DEFAULT_SAMPLE_DECAY;
+    }
+    s64 period = get_int_opt(ENV_SAMPLE_MIN, DEFAULT_SAMPLE_MIN);
+    if (period < 2 || period > (1 << 30)) {
+      Printf("!!! Invalid minimum sampling rate: 1/%d, reset to default: 1/%d.\r\n", period, DEFAULT_SAMPLE_MIN);
+      period = DEFAULT_SAMPLE_MIN;
     }
+    this->sample_burst = (u32) burst;
+    this->sample_decay = (u32) decay;
+    this->sample_max_period = (u32) period;
   }
-  // append process id to the dir name
-//  pre_len += __sanitizer::internal_snprintf(file_name + pre_len, name_len, "%d", tid);
-  char str_pid[50];
-  __sanitizer::internal_memset(str_pid, '\0', 50);
-  __sanitizer::internal_snprintf(str_pid, 45, "%u", this->cur_pid_);
-  __sanitizer::internal_strncat(trace_dir, str_pid, 45);
 
+  // the inlined accesses are raw, with value and the idx of the thread clock, and never filtered.
+  // their blocks have no idx range, a dump could not tell the live chunks already in the ring
+  this->inline_acc = get_int_opt(ENV_INLINE_ACC, 0) != 0;
+  if (inline_acc && (encoding != EncodingRaw || clock_mode != ClockThreadLocal
+                     || no_stack || heap_only || dedup || sample_max_period != 0 || ring_size != 0)) {
+    Printf("!!! UFO_INLINE_ACC ignored, requires raw encoding, UFO_TL_CLOCK, values, no access filter and no ring.\r\n");
+    this->inline_acc = false;
+  }
+
+  s64 use_direct = get_int_opt(ENV_WRITER, 0);
+  this->writer_kind = use_direct ? WriterDirect : WriterBuffered;
+  s64 sync = get_int_opt(ENV_SYNC, DEFAULT_SYNC);
+  this->sync_mb = 0;
+  if (sync < 0) {
+    this->sync_policy = SyncEveryFlush;
+  } else if (sync == 0) {
+    this->sync_policy = SyncNever;
+  } else if (sync == 1) {
+    this->sync_policy = SyncAtClose;
+  } else {
+    this->sync_policy = SyncEveryMB;
+    this->sync_mb = (u32) sync;
+  }
+
+  // trace dir
+  _make_trace_dir(trace_dir, __sanitizer::GetEnv(ENV_TRACE_DIR), this->cur_pid_);
 }
 
-void UFOContext::open_trace_dir() {
+// create the directory, or remove the files in it
+static bool _prepare_dir(const char *dir) {
   // open or create
   struct stat _st = {0};
-  __sanitizer::internal_stat(trace_dir, &_st);
+  __sanitizer::internal_stat(dir, &_st);
   if (!S_ISDIR(_st.st_mode)) {
-    if (0 != mkdir(trace_dir, 0700)) {
-      fprintf(stderr, "UFO>>> Could not create directory for trace files '%s': ", trace_dir);
+    if (0 != mkdir(dir, 0700)) {
+      fprintf(stderr, "UFO>>> Could not create directory for trace files '%s': ", dir);
       perror("");
-      Die();
+      return false;
     }
   } else {
     // These are data types defined in the "dirent" header
-    DIR *folder = opendir(trace_dir);
+    DIR *folder = opendir(dir);
     struct dirent *next_file;
     char filepath[320];
 
     while ((next_file = readdir(folder)) != nullptr) {
       // build the path for each file in the folder
-      sprintf(filepath, "%s/%s", trace_dir, next_file->d_name);
+      sprintf(filepath, "%s/%s", dir, next_file->d_name);
       remove(filepath);
     }
     closedir(folder);
   }
+  return true;
+}
+
+// create dir, or take an existing empty one. false if it has files
+static bool _new_dir(const char *dir) {
+  struct stat _st = {0};
+  __sanitizer::internal_stat(dir, &_st);
+  if (!S_ISDIR(_st.st_mode))
+    return _prepare_dir(dir);
+  DIR *folder = opendir(dir);
+  if (folder == nullptr)
+    return false;
+  bool empty = true;
+  struct dirent *next_file;
+  while (empty && (next_file = readdir(folder)) != nullptr) {
+    const char *name = next_file->d_name;
+    empty = internal_strcmp(name, ".") == 0 || internal_strcmp(name, "..") == 0;
+  }
+  closedir(folder);
+  if (!empty)
+    fprintf(stderr, "UFO>>> '%s' is not empty, trace dir not changed\r\n", dir);
+  return empty;
+}
+
+static void _write_module_info(const char *dir, const __sanitizer::ListOfModules &modules) {
+  char path[DIR_MAX_LEN];
+  internal_strncpy(path, dir, 200);
+  internal_strncat(path, NAME_MODULE_INFO, 50);
+
+  FILE *cfp = fopen(path, "w+");
+  if (cfp == nullptr)
+    return;
+  for (const auto &module : modules) {
+    fprintf(cfp, "%s|", module.full_name());
+    DPrintf("module: %s ",  module.full_name());
+    uptr base = module.base_address();
+    fprintf(cfp, "%llx|", base);
+    for (const auto &range : module.ranges()) {
+      uptr start = range.beg;
+      uptr end = range.end;
+      fprintf(cfp, "%d|%llx|%llx|", range.executable, start, end);
+      DPrintf("%d|%llx|%llx|", range.executable, start, end);
+    }
+    fprintf(cfp, "\r\n");
+    DPrintf("\r\n");
+  }
+  fclose(cfp);
+}
+
+void UFOContext::open_trace_dir() {
+  if (!_prepare_dir(trace_dir))
+    Die();
 }
 
 void UFOContext::print_config() {
@@ -312,13 +463,61 @@ void UFOContext::print_config() {
     Printf("trace ptr prop; ");
   } else Printf("do not trace ptr prop; ");
 
+  if (this->clock_mode == ClockThreadLocal) {
+    Printf("thread local clock; ");
+  } else Printf("global clock; ");
+
+  if (this->encoding & EncodingPcDict) {
+    Printf("compact encoding with pc dictionary; ");
+  } else if (this->encoding & EncodingCompact) {
+    Printf("compact encoding; ");
+  } else Printf("raw encoding; ");
+
+  if (this->online) {
+    Printf("online use-after-free matching, no trace file; ");
+  } else if (this->writer_kind == WriterDirect) {
+    Printf("O_DIRECT writer; ");
+  } else Printf("buffered writer; ");
+
+  if (this->sync_policy == SyncEveryFlush) {
+    Printf("fsync every flush; ");
+  } else if (this->sync_policy == SyncNever) {
+    Printf("never fsync; ");
+  } else if (this->sync_policy == SyncAtClose) {
+    Printf("fsync at thread end; ");
+  } else Printf("fsync every %u MB; ", sync_mb);
+
+  if (this->heap_only) {
+    Printf("heap access only; ");
+  }
+  if (this->dedup) {
+    Printf("drop repeated accesses between sync events; ");
+  }
+  if (!this->atomic_relaxed) {
+    Printf("no relaxed atomics; ");
+  }
+  if (this->inline_acc) {
+    Printf("inline accesses; ");
+  }
+  if (lite_mode) {
+    Printf("lite tsan runtime; ");
+  }
+  if (this->ring_size != 0) {
+    Printf("flight recorder: %u MB ring per thread, dump signal %d; ", ring_size / 1024 / 1024, ring_signal);
+  }
+  if (!this->trace_enabled) {
+    Printf("disabled until __ufo_enable(); ");
+  }
+  if (this->sample_max_period != 0) {
+    Printf("sample accesses: burst %u, decay %u, min rate 1/%u; ", sample_burst, sample_decay, sample_max_period);
+  } else Printf("trace every access; ");
 
 #ifdef STAT_ON
   Printf("statistic set on; ");
 #endif
   u32 sz = get_buf_size();
   Printf("initial per thread buffer size:%u (%u MB), ", sz, (sz / 1024 / 1024));
-//  Printf("level 1 memory threshold:%uMB, level 2: %uMB; ", mem_t1_ / 1024 / 1024, mem_t2_ / 1024 / 1024);
+  Printf("level 1 memory threshold:%lluMB, level 2: %lluMB; ", mem_t1_ / 1024 / 1024, mem_t2_ / 1024 / 1024);
 
   if (this->use_compression) {
     Printf("compress buffer; ");
@@ -326,7 +525,7 @@ void UFOContext::print_config() {
     Printf("do not compress; ");
   }
   if (this->use_io_q) {
-    Printf("async IO queue enabled, length: %d; ", out_queue_legth);
+    Printf("async IO queue enabled, length: %d, max writers: %d; ", out_queue_legth, io_workers);
   } else {
     Printf("async IO queue disabled; ");
   }
@@ -345,18 +544,34 @@ void UFOContext::init_start() {
   this->p_pid_ = (u32)__sanitizer::internal_getppid();
   this->is_subproc = false;
   this->mudule_length_ = 0;
-  this->e_count = 0;
+  __ufo_e_count = 0;
+  this->sync_clock = nullptr;
+  this->threads = nullptr;
+  this->matcher = nullptr;
+  this->out_queue = nullptr;
+  this->live_heap = nullptr;
+  this->n_dumps_ = 0;
+  atomic_store_relaxed(&total_mem_, 0);
+  atomic_store_relaxed(&peak_mem_, 0);
+  atomic_store_relaxed(&n_shrink_, 0);
+  atomic_store_relaxed(&n_grow_, 0);
+  atomic_store_relaxed(&n_resize_, 0);
+  atomic_store_relaxed(&shrink_pending_, 0);
+  atomic_store_relaxed(&n_gov_log_, 0);
+  atomic_store_relaxed(&gov_epoch, 0);
+  atomic_store_relaxed(&thread_off, 0);
+  atomic_store_relaxed(&flush_epoch, 0);
+  atomic_store_relaxed(&dir_epoch, 0);
+  ctl_mtx.Init();
+  dir_mtx.Init();
+  // kept by forked children, see set_enabled()
+  this->trace_enabled = get_int_opt(ENV_ROI, 0) == 0;
 
   s64 set_on = get_int_opt(ENV_UFO_ON, 0);
   this->is_on = (set_on != 0);
 
-  // step 0: prepare statistic
-#ifdef STAT_ON
-  this->stat = (TLStatistic *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, MAX_THREAD * sizeof(TLStatistic));
-  for (u32 i = 0; i < MAX_THREAD; ++i) {
-    stat[i].init();
-  }
-#endif
+  // once per process, the meta map of tsan is inherited by forked children
+  lite_mode = get_int_opt(ENV_LITE, 0) != 0;
 
   // read before return (if not on), stat config
   read_config(); // before openbuf
@@ -367,31 +582,51 @@ void UFOContext::init_start() {
   }
 
   time_started = get_time_ms();
+  tsc_started = read_tsc();
   print_config();
 
-  // step1: prepare tl buffer
-  tlbufs = (TLBuffer *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, MAX_THREAD * sizeof(TLBuffer));
-  for (u32 i = 0; i < MAX_THREAD; ++i) {
-    tlbufs[i].init();
+  // step1: prepare thread table, tl buffer and statistic are allocated on thread creation
+  threads = (ThreadTable *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(ThreadTable));
+  threads->init();
+
+  // step 2: clock of sync objects
+  if (clock_mode == ClockThreadLocal) {
+    this->sync_clock = (SyncClock *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(SyncClock));
+    sync_clock->init();
   }
-  G_BUF_BASE = tlbufs;
 
-  // step 3: prepare async io queue
+  // step 3: prepare writer backend and async io queue
+  init_writer(writer_kind, sync_policy, sync_mb);
+  if (online) {
+    this->matcher = (OnlineMatcher *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(OnlineMatcher));
+    matcher->init(encoding, !no_data_value);
+  }
   if (use_io_q) {
     this->out_queue = (OutQueue *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(OutQueue));
-    out_queue->start(this->out_queue_legth);
+    out_queue->start(this->out_queue_legth, this->io_workers);
+  }
+  if (ring_size != 0) {
+    this->live_heap = (LiveHeap *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(LiveHeap));
+    live_heap->init();
+    ring_mtx.Init();
+    start_recorder(ring_signal);
   }
 
   // step 4: create trace dir
   open_trace_dir();
+  if (ring_size != 0) {
+    prepare_fatal_dump(trace_dir);
+  }
   // step 5: save loaded module info
   save_module_info();
 
   // step create buffer for main thread
+  TLBuffer &main_buf = threads->bind(0)->buf;
+  main_buf.bind_inline();
 #ifdef BUF_EVENT_ON
-  tlbufs[0].open_buf();
+  main_buf.open_buf();
 #endif
-  tlbufs[0].open_file(0);
+  main_buf.open_file(main_buf.uid_);
 
   { // put ThreadStarted event to main thread trace
     uptr stk_addr;
@@ -408,7 +643,7 @@ void UFOContext::init_start() {
     be.tls_addr = (u64) tls_addr;
     be.tls_size = (u32) tls_size;
 
-    tlbufs[0].put_event(be);
+    main_buf.put_event(be);
   }
   this->start_trace();
 }
@@ -416,35 +651,227 @@ void UFOContext::init_start() {
 void UFOContext::destroy() {
   stop_trace();
 
+  if (!this->is_on)
+    return;
+
+  // no dump from now on, the rings are dropped
+  if (live_heap != nullptr) {
+    stop_recorder();
+  }
+
 #ifdef STAT_ON
-  if (this->do_print_stat_ && this->is_on) {
+  if (this->do_print_stat_) {
     output_stat();
   }
-  __tsan::internal_free(stat);
 #endif
-  stat = nullptr;
 
-  if (!this->is_on)
-    return;
+  if (do_print_stat_) {
+    print_mem_stat();
+  }
 
   // first flush io queue
   if (use_io_q) {
+    if (do_print_stat_) {
+      Printf("UFO>>> async IO queue: %llu stalls, %u active writers\r\n",
+             out_queue->stall_count(), out_queue->active_workers());
+    }
     out_queue->stop();
     __tsan::internal_free(out_queue);
+    out_queue = nullptr;
   }
-  // then flush remaining buffer & close file
-  for (u32 i = 0; i < MAX_THREAD; ++i) {
-    tlbufs[i].finish();
+  // then flush remaining buffer & close file, synchronously
+  const u32 n_uids = threads->n_uids();
+  for (u32 uid = 0; uid < n_uids; ++uid) {
+    ThreadSlot *slot = threads->get(uid);
+    if (slot != nullptr)
+      slot->buf.finish();
   }
 
-  __tsan::internal_free(tlbufs);
-  tlbufs = nullptr;
+  // threads still running may take the inlined access path, their buffers (limit_ is 0) are never freed
+  if (!inline_acc) {
+    threads->destroy();
+    __tsan::internal_free(threads);
+  }
+  threads = nullptr;
+
+  if (live_heap != nullptr) {
+    if (do_print_stat_) {
+      Printf("UFO>>> flight recorder: %u dumps, %llu live chunks\r\n", n_dumps_, live_heap->n_live());
+    }
+    live_heap->destroy();
+    __tsan::internal_free(live_heap);
+    live_heap = nullptr;
+  }
+
+  if (matcher != nullptr) {
+    matcher->resolve_all();
+    matcher->print_summary();
+    matcher->destroy();
+    __tsan::internal_free(matcher);
+    matcher = nullptr;
+  }
+  destroy_writer();
+
+  if (sync_clock != nullptr) {
+    __tsan::internal_free(sync_clock);
+    sync_clock = nullptr;
+  }
 
   // save module info if new modules have been loaded
   save_module_info();
 }
 
 
+/**
+ * one directory per dump: trace_dir/dump_<n>, the trace files of all threads in it.
+ * threads keep tracing, see TLBuffer::copy_ring. live chunks allocated during the dump may be missed.
+ */
+bool UFOContext::dump_ring() {
+  if (ring_size == 0 || threads == nullptr)
+    return false;
+  // a trigger during a dump, or a fault in it, is dropped
+  if (!ring_mtx.TryLock())
+    return false;
+  // the watcher thread is not a TSan thread
+  __tsan::ScopedGlobalProcessor sgp;
+
+  char dir[DIR_MAX_LEN + 16];
+  dir_mtx.Lock();
+  __sanitizer::internal_snprintf(dir, sizeof(dir), "%s%s%u", trace_dir, NAME_DUMP_DIR, ++n_dumps_);
+  dir_mtx.Unlock();
+  if (!_prepare_dir(dir)) {
+    ring_mtx.Unlock();
+    return false;
+  }
+
+  const u64 max_live = live_heap->n_live();
+  u64 n_live = 0;
+  LiveChunk *live = nullptr;
+  if (max_live > 0) {
+    live = (LiveChunk *) __sanitizer::MmapOrDie(max_live * sizeof(LiveChunk), "UFO ring dump");
+    n_live = live_heap->collect(live, max_live);
+  }
+  Byte *ring_copy = (Byte *) __sanitizer::MmapOrDie(ring_size, "UFO ring dump");
+  Byte *alloc_buf = (Byte *) __sanitizer::MmapOrDie(DUMP_ALLOC_BUF, "UFO ring dump");
+
+  // live chunks are ordered by uid. the chunks of ended threads are not reclaimed meanwhile
+  __sanitizer::SpinMutexLock l(&threads->mtx_);
+  const u32 n_uids = threads->n_uids();
+  u64 i = 0;
+  for (u32 uid = 0; uid < n_uids; ++uid) {
+    u64 end = i;
+    while (end < n_live && live[end].alloc_tid == uid)
+      end++;
+    ThreadSlot *slot = threads->get(uid);
+    dump_thread(dir, uid, slot != nullptr ? &slot->buf : nullptr, live + i, end - i, ring_copy, alloc_buf);
+    i = end;
+  }
+
+  __sanitizer::UnmapOrDie(alloc_buf, DUMP_ALLOC_BUF);
+  __sanitizer::UnmapOrDie(ring_copy, ring_size);
+  if (live != nullptr)
+    __sanitizer::UnmapOrDie(live, max_live * sizeof(LiveChunk));
+  Printf("UFO>>> flight recorder: %u threads dumped to '%s'\r\n", n_uids, dir);
+  ring_mtx.Unlock();
+  return true;
+}
+
+void UFOContext::set_enabled(int tid, bool on) {
+  if (!is_on)
+    return;
+  __sanitizer::SpinMutexLock l(&ctl_mtx);
+  if (trace_enabled == on)
+    return;
+  trace_enabled = on;
+  start_trace();
+  if (inline_acc) {
+    unbind_inline();
+    TLBuffer *buf = tl_buf(tid);
+    if (buf != nullptr)
+      buf->bind_inline();
+  }
+  DPrintf("UFO>>> tracing %s\r\n", on ? "enabled" : "disabled");
+}
+
+/**
+ * the handlers only test TLBuffer::acc_off_ once a thread disabled itself, see AccThreadOff.
+ * the flag is written by its own thread, which takes the new handlers before it returns.
+ * sync events of the thread are still traced, they order the other threads.
+ */
+void UFOContext::set_thread_enabled(int tid, bool on) {
+  if (!is_on)
+    return;
+  TLBuffer *buf = tl_buf(tid);
+  if (buf == nullptr)
+    return;
+  buf->acc_off_ = !on;
+  buf->bind_inline();
+  if (!on && atomic_load_relaxed(&thread_off) == 0) {
+    __sanitizer::SpinMutexLock l(&ctl_mtx);
+    atomic_store_relaxed(&thread_off, 1);
+    start_trace();
+  }
+}
+
+/**
+ * the buffer of another thread is only written by that thread,
+ * it is flushed at its next lock, alloc, atomic or cond wait (limit_ is 0).
+ * with the async io queue, waits for the blocks of this thread to be written.
+ */
+bool UFOContext::flush_threads(int tid) {
+  if (!is_on || ring_size != 0)
+    return false;
+  u32 f = __sanitizer::atomic_fetch_add(&flush_epoch, 1, __sanitizer::memory_order_relaxed) + 1;
+  TLBuffer *buf = tl_buf(tid);
+  if (buf == nullptr)
+    return true;
+  buf->flush_epoch_ = f;
+  if (buf->buf_ != nullptr)
+    buf->flush();
+  while (__sanitizer::atomic_load(&buf->in_flight_, __sanitizer::memory_order_acquire) != 0) {
+    __sanitizer::internal_sched_yield();
+  }
+  return true;
+}
+
+/**
+ * each thread closes its trace in the previous dir at its next flush, which is requested at once,
+ * and opens a new trace (header, no ThreadBegin event) in the new dir.
+ * an existing dir must be empty, its files are never removed.
+ * the dir of a forked child is still built from UFO_TDIR.
+ */
+bool UFOContext::rotate(int tid, const char *dir) {
+  if (!is_on || online || dir == nullptr)
+    return false;
+  char next[DIR_MAX_LEN];
+  _make_trace_dir(next, dir, cur_pid_);
+  dir_mtx.Lock();
+  bool same = internal_strncmp(next, trace_dir, DIR_MAX_LEN) == 0;
+  dir_mtx.Unlock();
+  if (same || !_new_dir(next))
+    return false;
+  // no file io under the spin lock
+  __sanitizer::ListOfModules modules;
+  modules.init();
+  _write_module_info(next, modules);
+  {
+    __sanitizer::SpinMutexLock l(&ctl_mtx);
+    // rotated to the same dir concurrently
+    if (internal_strncmp(next, trace_dir, DIR_MAX_LEN) == 0)
+      return false;
+    dir_mtx.Lock();
+    internal_strncpy(trace_dir, next, DIR_MAX_LEN);
+    dir_mtx.Unlock();
+    __sanitizer::atomic_fetch_add(&dir_epoch, 1, __sanitizer::memory_order_relaxed);
+    this->mudule_length_ = (u32) modules.size();
+  }
+  if (ring_size != 0)
+    prepare_fatal_dump(next);
+  Printf("UFO>>> trace dir is now '%s'\r\n", next);
+  flush_threads(tid);
+  return true;
+}
+
 void UFOContext::save_module_info() {
 
   __sanitizer::ListOfModules modules;
@@ -458,29 +885,7 @@ void UFOContext::save_module_info() {
 
   Printf("UFO>>>Proc %d: Saving info of %d modules\r\n", this->cur_pid_, cur_len);
 
-  char path[DIR_MAX_LEN];
-  internal_strncpy(path, trace_dir, 200);
-  internal_strncat(path, NAME_MODULE_INFO, 50);
-
-  FILE *cfp = fopen(path, "w+");
-  for (const auto &module : modules) {
-//      fprintf(fp, "%s %s %s %d", "We", "are", "in", 2012);
-    fprintf(cfp, "%s|", module.full_name());
-    DPrintf("module: %s ",  module.full_name());
-    uptr base = module.base_address();
-    fprintf(cfp, "%llx|", base);
-    for (const auto &range : module.ranges()) {
-//      if (range.executable) {
-      uptr start = range.beg;
-      uptr end = range.end;
-      fprintf(cfp, "%d|%llx|%llx|", range.executable, start, end);
-      DPrintf("%d|%llx|%llx|", range.executable, start, end);
-//      }
-    }
-    fprintf(cfp, "\r\n");
-    DPrintf("\r\n");
-  }
-  fclose(cfp);
+  _write_module_info(trace_dir, modules);
   this->mudule_length_ = cur_len;
 }
 
@@ -491,7 +896,7 @@ void UFOContext::output_stat() {
   internal_strncpy(path, this->trace_dir, 200);
   internal_strncat(path, NAME_STAT_FILE, 50);
   FILE *f_pp = fopen(path, "w+");
-  summary_stat(f_pp, this->stat, MAX_THREAD, cur_pid_, p_pid_);
+  summary_stat(f_pp, *threads, cur_pid_, p_pid_);
   fclose(f_pp);
 
   internal_memset(path, '\0', DIR_MAX_LEN);
@@ -499,7 +904,7 @@ void UFOContext::output_stat() {
   internal_strncpy(path, trace_dir, 200);
   internal_strncat(path, NAME_STAT_CSV, 50);
   FILE* f_csv = fopen(path, "w+");
-  print_csv(f_csv, this->stat, MAX_THREAD, cur_pid_, p_pid_);
+  print_csv(f_csv, *threads, cur_pid_, p_pid_);
   fclose(f_csv);
 }
 
@@ -532,79 +937,146 @@ void UFOContext::child_after_fork() {
 
   read_config();
   time_started = get_time_ms();
+  tsc_started = read_tsc();
   print_config();
   open_trace_dir();
+
+  if (clock_mode == ClockThreadLocal) {
+    if (sync_clock == nullptr) {
+      this->sync_clock = (SyncClock *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(SyncClock));
+    }
+    sync_clock->init();
+  }
+  init_writer(writer_kind, sync_policy, sync_mb);
   save_module_info();
 
   if (use_io_q) {
     this->out_queue->release_mem();
     __tsan::internal_free(out_queue);
     this->out_queue = (OutQueue *) __tsan::internal_alloc(__tsan::MBlockScopedBuf, sizeof(OutQueue));
-    out_queue->start(this->out_queue_legth);
+    out_queue->start(this->out_queue_legth, this->io_workers);
   }
 
-  for (u32 i = 0; i < MAX_THREAD; ++i) {
-    this->tlbufs[i].reset();
+  // only the threads used by the parent
+  this->threads->reset();
 
-#ifdef STAT_ON
-    this->stat[i].init();
-#endif
+  // the live chunks of the parent are still live in the child
+  this->n_dumps_ = 0;
+  if (live_heap != nullptr) {
+    prepare_fatal_dump(trace_dir);
+    recorder_after_fork();
   }
 
   this->start_trace();
 }
 
-void UFOContext::mem_acquired(u32 n_bytes) {
-//  this->lock.Lock();
-//  this->total_mem_ += n_bytes;
-//  if (total_mem_ >= this->mem_t2_) {
-//    mem_t2_ = mem_t2_ * 4 / 3;
-//
-//    u32 buf_sz = get_buf_size();
-//    buf_sz /= 4;
-//    if (buf_sz <= MIN_BUF_SZ)
-//      buf_sz = MIN_BUF_SZ;
-//    atomic_store_relaxed(&this->tl_buf_size_, buf_sz);
-//    Printf(">>>>>>>>>> tl buf  / 4\r\n");
-//
-//    ratio_mem_x4 += 1;
-//  } else if (total_mem_ > this->mem_t1_) {
-//    mem_t1_ = mem_t1_ * 3 / 2;
-//
-//    u32 buf_sz = get_buf_size();
-//    buf_sz /= 2;
-//    if (buf_sz <= MIN_BUF_SZ)
-//      buf_sz = MIN_BUF_SZ;
-//    atomic_store_relaxed(&this->tl_buf_size_, buf_sz);
-//    Printf(">>>>>>>>>> tl buf  / 2\r\n");
-//
-//    ratio_mem_x2 += 1;
-//  }
-//  lock.Unlock();
+bool UFOContext::set_buf_size(u32 cur, u32 sz) {
+  if (!__sanitizer::atomic_compare_exchange_strong(&tl_buf_size_, &cur, sz, __sanitizer::memory_order_relaxed))
+    return false;
+  u32 n = __sanitizer::atomic_fetch_add(&n_gov_log_, 1, __sanitizer::memory_order_relaxed);
+  if (n < GOV_LOG_SIZE) {
+    GovDecision &d = gov_log_[n];
+    d.time_ms = get_time_ms() - time_started;
+    d.total_mem = atomic_load_relaxed(&total_mem_);
+    d.from = cur;
+    d.to = sz;
+  }
+  return true;
 }
 
-void UFOContext::mem_released(u32 n_bytes) {
-//  lock.Lock();
-//  this->total_mem_ += n_bytes;
-//
-//  if (ratio_mem_x4 > 1 && total_mem_ < mem_t2_) {
-//    ratio_mem_x4 -= 1;
-//
-//    u32 buf_sz = get_buf_size();
-//    buf_sz *= 4;
-//    atomic_store_relaxed(&this->tl_buf_size_, buf_sz);
-//    Printf(">>>>>>>>>> tl buf X4\r\n");
-//
-//  } else if (ratio_mem_x2 > 1 && total_mem_ < mem_t1_) {
-//
-//    ratio_mem_x2 -= 1;
-//
-//    u32 buf_sz = get_buf_size();
-//    buf_sz *= 2;
-//    atomic_store_relaxed(&this->tl_buf_size_, buf_sz);
-//    Printf(">>>>>>>>>> tl buf X2\r\n");
-//  }
-//  lock.Unlock();
+// a thread that only accesses memory never reaches _check_limit(): its limit is lowered here,
+// the buffer is flushed and resized at its next event. the owner may restore a larger limit in fit_buf()
+// before it sees the new size, then the next shrink or sync event lowers it again
+void UFOContext::limit_buffers(u32 sz) {
+  if (threads == nullptr)
+    return;
+  __sanitizer::SpinMutexLock l(&threads->mtx_);
+  const u32 n_uids = threads->n_uids();
+  for (u32 uid = 0; uid < n_uids; ++uid) {
+    ThreadSlot *slot = threads->get(uid);
+    if (slot == nullptr || slot->buf.ring_ != nullptr)
+      continue;
+    // 0: finished or flushing, never raised
+    u32 lim = __atomic_load_n(&slot->buf.limit_, __ATOMIC_RELAXED);
+    while (lim > sz
+           && !__atomic_compare_exchange_n(&slot->buf.limit_, &lim, sz, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+
+// a limit of 0 is restored by the flush of the owner thread, see TLBuffer::flush()
+void UFOContext::unbind_inline() {
+  __sanitizer::SpinMutexLock l(&threads->mtx_);
+  const u32 n_uids = threads->n_uids();
+  for (u32 uid = 0; uid < n_uids; ++uid) {
+    ThreadSlot *slot = threads->get(uid);
+    if (slot != nullptr)
+      __atomic_store_n(&slot->buf.limit_, 0, __ATOMIC_RELAXED);
+  }
+}
+
+// shrink new buffers under pressure, the shrinking thread decides for all.
+// once per shrink: total_mem_ drops only when the buffers are resized at their flush
+void UFOContext::mem_acquired(u64 n_bytes) {
+  u64 total = __sanitizer::atomic_fetch_add(&total_mem_, n_bytes, __sanitizer::memory_order_relaxed) + n_bytes;
+  u64 peak = atomic_load_relaxed(&peak_mem_);
+  while (total > peak
+         && !__sanitizer::atomic_compare_exchange_weak(&peak_mem_, &peak, total, __sanitizer::memory_order_relaxed)) {
+  }
+
+  if (total < mem_t1_ || atomic_load_relaxed(&shrink_pending_) != 0)
+    return;
+  u32 cur = get_buf_size();
+  u32 sz = total >= mem_t2_ ? cur / 4 : cur / 2;
+  if (sz < MIN_BUF_SZ)
+    sz = MIN_BUF_SZ;
+  if (sz < cur && set_buf_size(cur, sz)) {
+    atomic_store_relaxed(&shrink_pending_, 1);
+    __sanitizer::atomic_fetch_add(&n_shrink_, 1, __sanitizer::memory_order_relaxed);
+    // buffers larger than sz are flushed early
+    __sanitizer::atomic_fetch_add(&gov_epoch, 1, __sanitizer::memory_order_relaxed);
+    limit_buffers(sz);
+  }
+}
+
+// grow again under low pressure
+void UFOContext::mem_released(u64 n_bytes) {
+  u64 total = __sanitizer::atomic_fetch_sub(&total_mem_, n_bytes, __sanitizer::memory_order_relaxed) - n_bytes;
+  if (total >= mem_t1_ / 2)
+    return;
+  u32 cur = get_buf_size();
+  if (cur >= max_buf_size_)
+    return;
+  u64 sz = (u64) cur * 2;
+  if (sz > max_buf_size_)
+    sz = max_buf_size_;
+  if (set_buf_size(cur, (u32) sz)) {
+    atomic_store_relaxed(&shrink_pending_, 0);
+    __sanitizer::atomic_fetch_add(&n_grow_, 1, __sanitizer::memory_order_relaxed);
+  }
+}
+
+void UFOContext::print_mem_stat() {
+  char path[DIR_MAX_LEN];
+  internal_strncpy(path, this->trace_dir, 200);
+  internal_strncat(path, NAME_MEM_STAT, 50);
+  FILE *fp = fopen(path, "w+");
+  if (fp == nullptr) {
+    Printf("UFO>>> could not write %s\r\n", path);
+    return;
+  }
+  fprintf(fp, "peak memory (MB), %llu\r\n", atomic_load_relaxed(&peak_mem_) / 1024 / 1024);
+  fprintf(fp, "threshold (MB), %llu, %llu\r\n", mem_t1_ / 1024 / 1024, mem_t2_ / 1024 / 1024);
+  fprintf(fp, "buffer size (KB), %u, max %u\r\n", get_buf_size() / 1024, max_buf_size_ / 1024);
+  fprintf(fp, "shrinks, %llu\r\ngrows, %llu\r\nbuffers resized, %llu\r\n",
+          atomic_load_relaxed(&n_shrink_), atomic_load_relaxed(&n_grow_), atomic_load_relaxed(&n_resize_));
+  u32 n = atomic_load_relaxed(&n_gov_log_);
+  fprintf(fp, "\r\ndecisions, %u\r\ntime (ms), memory (KB), from (KB), to (KB)\r\n", n);
+  for (u32 i = 0; i < n && i < GOV_LOG_SIZE; ++i) {
+    const GovDecision &d = gov_log_[i];
+    fprintf(fp, "%llu, %llu, %u, %u\r\n", d.time_ms, d.total_mem / 1024, d.from / 1024, d.to / 1024);
+  }
+  fclose(fp);
 }
 
 }
@@ -11,8 +11,13 @@
 #include "defs.h"
 #include "ufo_interface.h"
 #include "tlbuffer.h"
+#include "thread_table.h"
+#include "tlclock.h"
 #include "ufo_stat.h"
 #include "io_queue.h"
+#include "io_writer.h"
+#include "online_matcher.h"
+#include "flight_recorder.h"
 
 namespace bw {
 namespace ufo {
@@ -43,14 +48,34 @@ typedef void (*FPThrStart)(__tsan::ThreadState *thr, uptr, uptr, uptr, uptr);
 typedef void (*FPMtxLock)(__tsan::ThreadState *thr, uptr pc, u64 mutex_id);
 typedef void (*FPCondWait)(__tsan::ThreadState* thr, uptr pc, u64 addr_cond, u64 addr_mtx);
 typedef void (*FPCondSignal)(__tsan::ThreadState* thr, uptr pc, u64 addr_cond);
+typedef void (*FPAtomic)(__tsan::ThreadState *thr, uptr pc, uptr addr, int size_log, u8 op, u8 mo);
 
-typedef void (*FPMemAcc)(__tsan::ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write);
-typedef void (*FPMemRangeAcc)(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write);
-typedef void (*FPFuncEnter)(__tsan::ThreadState *thr, uptr pc);
-typedef void (*FPFuncExit)(__tsan::ThreadState *thr);
 typedef void (*FPPtrProp)(__tsan::ThreadState *thr, uptr pc, uptr addr_src, uptr addr_dest);
 typedef void (*FPPtrDeRef)(__tsan::ThreadState *thr, uptr pc, uptr addr_src);
 
+// the hooks of one tracing state, switched as a whole, see UFOContext::hooks()
+struct Hooks {
+  FPAlloc          alloc;
+  FPDealloc        dealloc;
+  FPThr            thread_created;
+  FPThrStart       thread_started;
+  FPThr            thread_join;
+
+  FPMtxLock        mtx_lock;
+  FPMtxLock        mtx_unlock;
+  FPMtxLock        rd_lock;
+  FPMtxLock        rd_unlock;
+  FPMtxLock        rw_unlock;
+
+  FPCondWait       cond_wait;
+  FPCondSignal     cond_signal;
+  FPCondSignal     cond_bc;
+
+  FPAtomic         atomic;
+
+  FPPtrProp        ptr_prop;
+  FPPtrDeRef       ptr_deref;
+};
 
 class UFOContext {
   static s64 get_int_opt(const char *name, s64 default_val);
@@ -68,28 +93,87 @@ class UFOContext {
 
   // track all buffer allocation
   // resize tl buffer size dynamically
-  __tsan::Mutex lock;
+  u32 max_buf_size_;
   u64 mem_t1_;
   u64 mem_t2_;
-  u16 ratio_mem_x2;
-  u16 ratio_mem_x4;
-  u64 total_mem_;
+  atomic_uint64_t total_mem_;
+  atomic_uint64_t peak_mem_;
+  atomic_uint64_t n_shrink_;
+  atomic_uint64_t n_grow_;
+  atomic_uint64_t n_resize_;
+  // a shrink not applied by any buffer yet, no further shrink until then, see buf_resized()
+  atomic_uint32_t shrink_pending_;
+  // buffer size decisions of the governor, the first GOV_LOG_SIZE are kept for the memory statistics
+  struct GovDecision {
+    u64 time_ms;
+    u64 total_mem;
+    u32 from;
+    u32 to;
+  };
+  static const u32 GOV_LOG_SIZE = 64;
+  GovDecision gov_log_[GOV_LOG_SIZE];
+  atomic_uint32_t n_gov_log_;
+
+  // lower the limit of the buffers larger than sz
+  void limit_buffers(u32 sz);
+  // UFO_INLINE_ACC: the instrumented code of every thread takes the slow path, which binds its buffer again
+  void unbind_inline();
+
+  // UFO_RING, dumps of this process
+  u32 n_dumps_;
+
+  bool set_buf_size(u32 cur, u32 sz);
 public:
   // config
   bool is_on;
   atomic_uint32_t stack_size;
   bool no_stack;
+  bool heap_only; // UFO_HEAP_ONLY, see heap_map.h
+  bool dedup; // UFO_DEDUP, see TLBuffer::dedup_first
+  bool atomic_relaxed; // UFO_ATOMIC_RELAXED, trace relaxed atomic operations
+  bool inline_acc; // UFO_INLINE_ACC, accesses are written by the instrumented code, see InlineBuf
   bool no_data_value;// do not record the value of the read/write
   bool trace_func_call;
   bool trace_ptr_prop;
 
+  // UFO_STAT: the statistics of every thread are printed at exit
+  bool print_stat() const {
+    return do_print_stat_;
+  }
+
   char trace_dir[DIR_MAX_LEN];
   u64 time_started;
 
-  TLBuffer *tlbufs;
-  // logical time for mem_acc(r/w, range r/w), lock, alloc/dealloc
-  // these 5 type of events are synced,
-  volatile u64 e_count;
+  ThreadTable *threads;
+
+  // state of the thread running as TSan tid, nullptr if the tid is not bound (before its start, after its join)
+  ALWAYS_INLINE
+  TLBuffer *tl_buf(int tid) const {
+    ThreadSlot *slot = threads->of(tid);
+    return LIKELY(slot != nullptr) ? &slot->buf : nullptr;
+  }
+
+  ALWAYS_INLINE
+  TLStatistic *tl_stat(int tid) const {
+    ThreadSlot *slot = threads->of(tid);
+    return LIKELY(slot != nullptr) ? &slot->stat : nullptr;
+  }
+
+  // uid of the thread running as TSan tid, or the tid if it is not bound
+  ALWAYS_INLINE
+  TidType uid_of(int tid) const {
+    ThreadSlot *slot = threads->of(tid);
+    return LIKELY(slot != nullptr) ? slot->buf.uid_ : (TidType) tid;
+  }
+  // ClockGlobal: idx from __ufo_e_count; ClockThreadLocal: idx from InlineBuf::lclock_
+  u8 clock_mode;
+  u8 encoding;
+  // UFO_SAMPLE, see sampler.h. sample_max_period is 0 if every access is traced
+  u32 sample_burst;
+  u32 sample_decay;
+  u32 sample_max_period;
+  u64 tsc_started;
+  SyncClock *sync_clock;
 
   ALWAYS_INLINE
   u32 get_buf_size() const {
@@ -98,12 +182,59 @@ public:
 
   bool use_io_q;
   bool use_compression;
+  // UFO_ONLINE, see online_matcher.h
+  bool online;
+  OnlineMatcher *matcher;
   int out_queue_legth;
+  int io_workers;
 
-  TLStatistic *stat;
+  // see io_writer.h
+  u8 writer_kind;
+  u8 sync_policy;
+  u32 sync_mb;
 
   OutQueue *out_queue;
 
+  // UFO_RING, see flight_recorder.h. ring_size is 0 if not used
+  u32 ring_size;
+  int ring_signal;
+  LiveHeap *live_heap;
+  // held by a dump, and to free a ring
+  __sanitizer::StaticSpinMutex ring_mtx;
+
+  // write the rings and the live chunks to a new dump dir, false if not in ring mode or a dump is in progress.
+  // not called on fatal errors, see dump_fatal()
+  bool dump_ring();
+
+  /**
+   * region of interest (__ufo_enable, __ufo_disable): another hook table is published, the thread hooks
+   * are the same in both, so that a thread created while tracing is disabled still has its slot.
+   * nothing is freed on disable, a thread still running a hook of the previous state writes to its own buffer.
+   * guarded by ctl_mtx, which serializes the switches.
+   */
+  bool trace_enabled;
+  // set when a thread first disables its accesses, the handlers then test TLBuffer::acc_off_
+  atomic_uint32_t thread_off;
+  // bumped to flush every buffer at its next sync event, see _check_limit()
+  atomic_uint32_t flush_epoch;
+  // bumped when trace_dir is rotated, a trace opened before is closed at its next flush
+  atomic_uint32_t dir_epoch;
+  __sanitizer::StaticSpinMutex ctl_mtx;
+  // held to read trace_dir while it may be rotated
+  __sanitizer::StaticSpinMutex dir_mtx;
+
+  // called by thread tid, its inlined accesses are switched at once, the others at their next slow access
+  void set_enabled(int tid, bool on);
+
+  // memory accesses and calls of thread tid, called by the thread itself
+  void set_thread_enabled(int tid, bool on);
+
+  // flush the buffer of thread tid now, and the others at their next sync event. false in ring mode
+  bool flush_threads(int tid);
+
+  // write the next traces to <dir>_<pid>, false if online or dir is the current trace dir
+  bool rotate(int tid, const char *dir);
+
   void save_module_info();
   void output_stat();
 public:
@@ -117,9 +248,16 @@ public:
   // after fork, executed by child process
   void child_after_fork();
 
-  // race condition on tl_buf_size_, but it does not matter.
-  void mem_acquired(u32 n_bytes);
-  void mem_released(u32 n_bytes);
+  void mem_acquired(u64 n_bytes);
+  void mem_released(u64 n_bytes);
+  // a tl buffer is resized to the current buffer size
+  void buf_resized() {
+    __sanitizer::atomic_fetch_add(&n_resize_, 1, __sanitizer::memory_order_relaxed);
+    atomic_store_relaxed(&shrink_pending_, 0);
+  }
+  // bumped whenever the buffer size shrinks, see TLBuffer::check_limit
+  atomic_uint32_t gov_epoch;
+  void print_mem_stat();
 
   static u64 get_time_ms();
 
@@ -128,29 +266,24 @@ public:
 
   static void stop_trace();
 
-  static FPAlloc          fn_alloc;
-  static FPDealloc        fn_dealloc;
-  static FPThr            fn_thread_created;
-  static FPThrStart       fn_thread_started;
-  static FPThr            fn_thread_join;
-
-  static FPMtxLock        fn_mtx_lock;
-  static FPMtxLock        fn_mtx_unlock;
-
-  static FPCondWait       fn_cond_wait;
-  static FPCondSignal     fn_cond_signal;
-  static FPCondSignal     fn_cond_bc;
-
-  static FPMtxLock        fn_rd_lock;
-  static FPMtxLock        fn_rd_unlock;
-  static FPMtxLock        fn_rw_unlock;
-
-  static FPMemAcc         fn_mem_acc;
-  static FPMemRangeAcc    fn_mem_range_acc;
-  static FPFuncEnter      fn_enter_func;
-  static FPFuncExit       fn_exit_func;
-  static FPPtrProp        fn_ptr_prop;
-  static FPPtrDeRef       fn_ptr_deref;
+  // all hooks but the thread hooks
+  static void stop_events();
+
+  /**
+   * the table is published with one release store, each wrapper in ufo_interface.cc loads it once,
+   * so a thread never mixes the hooks of two states (e.g. a traced lock with a nop unlock of the same state).
+   * the hot path hooks (fn_mem_acc, ...) are separate globals, see ufo_interface.h
+   */
+  ALWAYS_INLINE
+  static const Hooks *hooks() {
+    return __atomic_load_n(&hooks_, __ATOMIC_ACQUIRE);
+  }
+
+private:
+  static const Hooks *hooks_;
+  static void set_hooks(const Hooks *h) {
+    __atomic_store_n(&hooks_, h, __ATOMIC_RELEASE);
+  }
 };
 
 //void (*fn_dealloc)(__tsan::ThreadState *thr, uptr pc, void *addr);
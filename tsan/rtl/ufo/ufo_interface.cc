@@ -9,6 +9,7 @@
 #include "defs.h"
 #include "ufo_interface.h"
 #include "ufo.h"
+#include "heap_map.h"
 
 
 namespace bw {
@@ -52,6 +53,35 @@ bool finish_ufo() {
   return false;
 }
 
+bool dump_ufo() {
+  if (!g_started)
+    return false;
+  return uctx->dump_ring();
+}
+
+void enable_ufo(__tsan::ThreadState *thr, bool on) {
+  if (!g_started)
+    return;
+  uctx->set_enabled(thr->tid, on);
+}
+
+void enable_ufo_thread(__tsan::ThreadState *thr, bool on) {
+  if (!g_started)
+    return;
+  uctx->set_thread_enabled(thr->tid, on);
+}
+
+bool flush_ufo(__tsan::ThreadState *thr) {
+  if (!g_started)
+    return false;
+  return uctx->flush_threads(thr->tid);
+}
+
+bool rotate_ufo(__tsan::ThreadState *thr, const char *dir) {
+  if (!g_started)
+    return false;
+  return uctx->rotate(thr->tid, dir);
+}
 
 // might loss some events
 void before_fork() {
@@ -72,85 +102,71 @@ void child_after_fork() {
 ///////////////////////////////////////////////////////////////////////////////////////////////
 
 void on_mtx_lock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-  (*UFOContext::fn_mtx_lock)(thr, pc, mutex_id);
+  UFOContext::hooks()->mtx_lock(thr, pc, mutex_id);
 }
 
 void on_mtx_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-  (*UFOContext::fn_mtx_unlock)(thr, pc, mutex_id);
+  UFOContext::hooks()->mtx_unlock(thr, pc, mutex_id);
 }
 
 void on_cond_wait(__tsan::ThreadState* thr, uptr pc, u64 addr_cond, u64 addr_mtx) {
-  (*UFOContext::fn_cond_wait)(thr, pc, addr_cond, addr_mtx);
+  UFOContext::hooks()->cond_wait(thr, pc, addr_cond, addr_mtx);
 }
 
 void on_cond_signal(__tsan::ThreadState* thr, uptr pc, u64 addr_cond) {
-  (*UFOContext::fn_cond_signal)(thr, pc, addr_cond);
+  UFOContext::hooks()->cond_signal(thr, pc, addr_cond);
 }
 
 void on_cond_broadcast(__tsan::ThreadState* thr, uptr pc, u64 addr_cond) {
-  (*UFOContext::fn_cond_bc)(thr, pc, addr_cond);
+  UFOContext::hooks()->cond_bc(thr, pc, addr_cond);
 }
 
-//void on_rd_lock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-//  MC_STAT(thr, c_rd_lock)
-//  (*UFOContext::fn_rd_lock)(thr, pc, mutex_id);
-//}
-//
-//void on_rd_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-//  MC_STAT(thr, c_rd_unlock)
-//  (*UFOContext::fn_rd_unlock)(thr, pc, mutex_id);
-//}
-//
-//void on_rw_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
-//  MC_STAT(thr, c_rw_unlock)
-//  (*UFOContext::fn_rw_unlock)(thr, pc, mutex_id);
-//}
+void on_atomic(__tsan::ThreadState *thr, uptr pc, uptr addr, int size_log, u8 op, u8 mo) {
+  UFOContext::hooks()->atomic(thr, pc, addr, size_log, op, mo);
+}
 
+void on_rd_lock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
+  UFOContext::hooks()->rd_lock(thr, pc, mutex_id);
+}
 
-void *on_alloc(ThreadState *thr, uptr pc, void *addr_left, uptr size) {
-  return (*UFOContext::fn_alloc)(thr, pc, addr_left, size);
+void on_rd_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
+  UFOContext::hooks()->rd_unlock(thr, pc, mutex_id);
 }
 
-void on_dealloc(ThreadState *thr, uptr pc, void *addr) {
-  (*UFOContext::fn_dealloc)(thr, pc, addr);
+void on_rw_unlock(__tsan::ThreadState *thr, uptr pc, u64 mutex_id) {
+  UFOContext::hooks()->rw_unlock(thr, pc, mutex_id);
 }
 
 
-__HOT_CODE
-void on_mem_acc(ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, volatile bool is_write) {
-  (*UFOContext::fn_mem_acc)(thr, pc, addr, kAccessSizeLog, is_write);
+void *on_alloc(ThreadState *thr, uptr pc, void *addr_left, uptr size) {
+  return UFOContext::hooks()->alloc(thr, pc, addr_left, size);
 }
 
-__HOT_CODE
-void on_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, volatile bool is_write) {
-  (*UFOContext::fn_mem_range_acc)(thr, pc, addr, size, is_write);
+void on_dealloc(ThreadState *thr, uptr pc, void *addr) {
+  UFOContext::hooks()->dealloc(thr, pc, addr);
+}
+
+void on_heap_map(uptr p, uptr size) {
+  heap_map_add(p, size);
 }
 
 
 void on_thread_created(int tid_parent, int tid_kid, uptr pc) {
-  (*UFOContext::fn_thread_created)(tid_parent, tid_kid, pc);
+  UFOContext::hooks()->thread_created(tid_parent, tid_kid, pc);
 }
 void on_thread_start(__tsan::ThreadState* thr, uptr stk_addr, uptr stk_size, uptr tls_addr, uptr tls_size) {
-  (*UFOContext::fn_thread_started)(thr, stk_addr, stk_size, tls_addr, tls_size);
+  UFOContext::hooks()->thread_started(thr, stk_addr, stk_size, tls_addr, tls_size);
 }
 
 void on_thread_join(int tid_main, int tid_joiner, uptr pc) {
-  (*UFOContext::fn_thread_join)(tid_main, tid_joiner, pc);
-}
-
-void enter_func(__tsan::ThreadState *thr, uptr pc) {
-  (*UFOContext::fn_enter_func)(thr, pc);
-}
-
-void exit_func(__tsan::ThreadState *thr) {
-  (*UFOContext::fn_exit_func)(thr);
+  UFOContext::hooks()->thread_join(tid_main, tid_joiner, pc);
 }
 
 void on_ptr_prop(__tsan::ThreadState *thr, uptr pc, uptr addr_src, uptr addr_dest) {
-  (*UFOContext::fn_ptr_prop)(thr, pc, addr_src, addr_dest);
+  UFOContext::hooks()->ptr_prop(thr, pc, addr_src, addr_dest);
 }
 void on_ptr_deref(__tsan::ThreadState *thr, uptr pc, uptr addr_ptr) {
-  (*UFOContext::fn_ptr_deref)(thr, pc, addr_ptr);
+  UFOContext::hooks()->ptr_deref(thr, pc, addr_ptr);
 }
 
 } // ns ufo_bench
@@ -49,7 +49,61 @@ enum EventType {
   ThrCondWait,
   ThrCondSignal = 18,
   ThrCondBC,
-  PtrDeRef = 20
+  PtrDeRef = 20,
+  PcDef,
+  MemAtomic
+};
+
+// LockEvent, UnlockEvent of a reader lock (pthread_rwlock_rdlock, std::shared_mutex::lock_shared):
+// the type byte is ThreadAcqLock/ThreadRelLock | RD_LOCK_FLAG, the fields are the same.
+// the release of a rwlock by a thread that could not tell the mode (UFO_LITE) is a plain UnlockEvent.
+const u8 RD_LOCK_FLAG = 1 << 6;
+
+// AtomicEvent::op_mo: operation in the low 3 bits, memory order (__tsan_memory_order, 0: relaxed .. 5: seq_cst) above
+enum AtomicOp {
+  AtomicOpLoad = 0, // a failed compare-exchange is a load
+  AtomicOpStore,
+  AtomicOpRMW,
+  AtomicOpCAS,
+  AtomicOpFence // addr is 0
+};
+
+/**
+ * layout of events in a block, saved in UFOHeader::encoding.
+ * the high 2 bits of the type byte are the size log of MemAccEvent and AtomicEvent, RD_LOCK_FLAG for lock events.
+ *
+ * EncodingRaw: the packed structs below, little endian.
+ *
+ * EncodingCompact: MemAccEvent, MemRangeAccEvent, AllocEvent, DeallocEvent, LockEvent,
+ * UnlockEvent, ThrCondWaitEvent, ThrCondSignalEvent, ThrCondBCEvent, FuncEntryEvent and AtomicEvent
+ * are written as the type byte followed by their fields in declaration order:
+ *   idx:  varint of (idx - idx of the previous event with idx)
+ *   addr, mutexId, cond:  varint of zigzag(addr - previous addr)
+ *   pc, caller_pc:  varint of zigzag(pc - previous pc)
+ *   size: varint for MemRangeAccEvent, 4 bytes for AllocEvent
+ *   op_mo: 1 byte for AtomicEvent
+ *   mtx: after the pc of ThrCondWaitEvent, varint of zigzag(mtx - cond)
+ * the value of a MemAccEvent follows as in EncodingRaw, other events are raw.
+ * varint is LEB128 (7 bits per byte, low bits first), zigzag(d) = (d << 1) ^ (d >> 63).
+ * all previous values are 0 at the beginning of each block, so every block decodes on its own.
+ *
+ * EncodingPcDict (with EncodingCompact): pc and caller_pc are written as varint ids.
+ * the first event with a pc in a block is preceded by a PcDefEvent binding its id,
+ * a later PcDefEvent may bind an id again. ids are forgotten at the beginning of each block.
+ *
+ * EncodingNoValue: MemAccEvent is not followed by the value (UFO_NO_VALUE).
+ *
+ * a trace file is a UFOHeader followed by blocks.
+ * if UFOHeader::length (compression) is not 0, each block is a u32 length and the snappy compressed block;
+ * otherwise with EncodingCompact each block is a u32 length and the block,
+ * and raw blocks are written one after another without length.
+ * a trace closed at thread end is followed by its index: one BlockSummary per block, then an IndexTrailer.
+ */
+enum Encoding {
+  EncodingRaw = 0,
+  EncodingCompact = 1,
+  EncodingPcDict = 2,
+  EncodingNoValue = 4
 };
 
 /*
@@ -101,8 +155,9 @@ PACKED_STRUCT(LockEvent) {
   u64 pc : 48;
 
   ALWAYS_INLINE
-  explicit LockEvent(u64 _idx, u64 h, u64 p)
-      : idx(_idx),
+  explicit LockEvent(u64 _idx, u64 h, u64 p, bool rd = false)
+      : type_index(rd ? TYPE_INDEX | RD_LOCK_FLAG : TYPE_INDEX),
+        idx(_idx),
         mutexId(h),
         pc(p)    {}
 };
@@ -116,32 +171,41 @@ PACKED_STRUCT(UnlockEvent) {
   u64 pc : 48;
 
   ALWAYS_INLINE
-  explicit UnlockEvent(u64 h, u64 ip)
-      : mutexId(h),
+  explicit UnlockEvent(u64 h, u64 ip, bool rd = false)
+      : type_index(rd ? TYPE_INDEX | RD_LOCK_FLAG : TYPE_INDEX),
+        mutexId(h),
         pc(ip)  { }
 };
 static_assert(sizeof(UnlockEvent) == 13, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 
-//u64 idx: 48;
+// written when the wait returns, between the UnlockEvent and the LockEvent of mtx around the wait.
+// the wake up acquires cond, signal and broadcast release it
+// 8 + 48 + 48 + 48 + 48 -> 200
 PACKED_STRUCT(ThrCondWaitEvent) {
   static const u8 TYPE_INDEX = EventType::ThrCondWait;
   const u8 type_index = TYPE_INDEX;
+  u64 idx: 48;
   u64 cond: 48;
   u64 mtx: 48;
   u64 pc: 48;
-  explicit ThrCondWaitEvent(u64 c, u64 m, u64 p)
-      : cond(c),
+
+  ALWAYS_INLINE
+  explicit ThrCondWaitEvent(u64 _idx, u64 c, u64 m, u64 p)
+      : idx(_idx),
+        cond(c),
         mtx(m),
         pc(p)   {}
 };
-static_assert(sizeof(ThrCondWaitEvent) == 19, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(ThrCondWaitEvent) == 25, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 PACKED_STRUCT(ThrCondSignalEvent) {
   static const u8 TYPE_INDEX = EventType::ThrCondSignal;
   const u8 type_index = TYPE_INDEX;
   u64 cond: 48;
   u64 pc: 48;
+
+  ALWAYS_INLINE
   explicit ThrCondSignalEvent(u64 c, u64 p)
       : cond(c),
         pc(p)   {}
@@ -149,16 +213,37 @@ PACKED_STRUCT(ThrCondSignalEvent) {
 static_assert(sizeof(ThrCondSignalEvent) == 13, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 PACKED_STRUCT(ThrCondBCEvent) {
-  static const u8 TYPE_INDEX = EventType::ThrCondSignal;
+  static const u8 TYPE_INDEX = EventType::ThrCondBC;
   const u8 type_index = TYPE_INDEX;
   u64 cond: 48;
   u64 pc: 48;
+
+  ALWAYS_INLINE
   explicit ThrCondBCEvent(u64 c, u64 p)
       : cond(c),
         pc(p)   {}
 };
 static_assert(sizeof(ThrCondBCEvent) == 13, "compact struct (align 8) not supported, please use clang 3.8.1");
 
+// atomic load, store, rmw, compare-exchange or fence, size log of the access in the upper 2 bits of type_index
+// 8 + 48 + 48 + 48 + 8 -> 160
+PACKED_STRUCT(AtomicEvent) {
+  const u8 type_index;
+  u64 idx : 48;
+  u64 addr : 48;
+  u64 pc : 48;
+  u8 op_mo; // AtomicOp | memory order << 3
+
+  ALWAYS_INLINE
+  explicit AtomicEvent(u8 size_log, u64 _idx, u64 a, u64 p, u8 op, u8 mo)
+      : type_index((u8) (EventType::MemAtomic | (size_log << 6))),
+        idx(_idx),
+        addr(a),
+        pc(p),
+        op_mo((u8) (op | (mo << 3))) {}
+};
+static_assert(sizeof(AtomicEvent) == 20, "compact struct (align 8) not supported, please use clang 3.8.1");
+
 
 // 8 + 48 + 48 + 48 + 32 = 176
 PACKED_STRUCT(MemRangeAccEvent) {
@@ -195,7 +280,7 @@ PACKED_STRUCT(MemAccEvent) {
 };
 static_assert(sizeof(MemAccEvent) == 19, "compact struct (align 8) not supported, please use clang 3.8.1");
 
-//8 + 16 + 48 + 32 -> 104
+//8 + 32 + 32 + 48 -> 120
 PACKED_STRUCT(CreateThreadEvent) {
   static const u8 TYPE_INDEX = EventType::ThreadCreate;
   const u8 type_index = TYPE_INDEX;
@@ -209,9 +294,9 @@ PACKED_STRUCT(CreateThreadEvent) {
         e_time(t),
         pc(ip)    { }
 };
-static_assert(sizeof(CreateThreadEvent) == 13, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(CreateThreadEvent) == 15, "compact struct (align 8) not supported, please use clang 3.8.1");
 
-//8 + 16 + 48 + 32 + (48+32+48+32)-> 33
+//8 + 32 + 48 + 32 + (48+32+48+32)-> 35
 PACKED_STRUCT(ThreadBeginEvent) {
   static const u8 TYPE_INDEX = EventType::ThreadBegin;
   const u8 type_index = TYPE_INDEX;
@@ -233,10 +318,10 @@ PACKED_STRUCT(ThreadBeginEvent) {
         tls_addr(0),
         tls_size(0) { }
 };
-static_assert(sizeof(ThreadBeginEvent) == 33, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(ThreadBeginEvent) == 35, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 
-//8 +  16 + 32 + 48 -> 104
+//8 +  32 + 32 + 48 -> 120
 PACKED_STRUCT(JoinThreadEvent) {
   static const u8 TYPE_INDEX = EventType::ThreadJoin;
   const u8 type_index = TYPE_INDEX;
@@ -250,10 +335,10 @@ PACKED_STRUCT(JoinThreadEvent) {
         e_time(time),
         pc(ip)      { }
 };
-static_assert(sizeof(JoinThreadEvent) == 13, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(JoinThreadEvent) == 15, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 
-//(8 +  16 + 32 -> 56
+//(8 +  32 + 32 -> 72
 PACKED_STRUCT(ThreadEndEvent) {
   static const u8 TYPE_INDEX = EventType::ThreadEnd;
   const u8 type_index = TYPE_INDEX;
@@ -265,7 +350,7 @@ PACKED_STRUCT(ThreadEndEvent) {
       : tid_parent(tp),
         e_time(t)     { }
 };
-static_assert(sizeof(ThreadEndEvent) == 7, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(ThreadEndEvent) == 9, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 
 PACKED_STRUCT(PtrAssignEvent) {
@@ -299,14 +384,39 @@ PACKED_STRUCT(UFOHeader) {
   const TidType tid;
   const u64 timestamp;
   const u32 length;
+  const u8 clock_mode; // ClockMode, how to order events among threads
+  const u8 encoding; // Encoding, layout of events
+  // UFO_SAMPLE, see sampler.h. sample_max_period is 0 if every memory access is traced
+  const u32 sample_burst;
+  const u32 sample_decay;
+  const u32 sample_max_period;
 // data with specified length can follow
   ALWAYS_INLINE
-  explicit UFOHeader(TidType curT, u64 time, u32 len)
+  explicit UFOHeader(TidType curT, u64 time, u32 len, u8 clk, u8 enc, u32 burst, u32 decay, u32 period)
       :  tid(curT),
          timestamp(time),
-         length(len)  {}
+         length(len),
+         clock_mode(clk),
+         encoding(enc),
+         sample_burst(burst),
+         sample_decay(decay),
+         sample_max_period(period)  {}
+};
+static_assert(sizeof(UFOHeader) == 39, "compact struct (align 8) not supported, please use clang 3.8.1");
+
+// EncodingPcDict only, binds id to pc for the rest of the block
+PACKED_STRUCT(PcDefEvent) {
+  static const u8 TYPE_INDEX = EventType::PcDef;
+  const u8 type_index = TYPE_INDEX;
+  u16 id;
+  u64 pc : 48;
+
+  ALWAYS_INLINE
+  explicit PcDefEvent(u16 i, u64 p)
+      : id(i),
+        pc(p) {}
 };
-static_assert(sizeof(UFOHeader) == 23, "compact struct (align 8) not supported, please use clang 3.8.1");
+static_assert(sizeof(PcDefEvent) == 9, "compact struct (align 8) not supported, please use clang 3.8.1");
 
 PACKED_STRUCT(FuncEntryEvent) {
   static const u8 TYPE_INDEX = EventType::EnterFunc;
@@ -338,6 +448,60 @@ PACKED_STRUCT(UFOPkt) {
 };
 static_assert(sizeof(UFOPkt) == 17, "compact struct (align 8) not supported, please use clang 3.8.1");
 
+// index of a trace file, one per flushed block, written after the last block.
+// addresses are those of memory accesses and heap chunks; ranges and counts may be larger than the exact ones
+PACKED_STRUCT(BlockSummary) {
+  u64 offset; // file offset of the block, length prefix included
+  u32 length; // bytes in the file, length prefix included
+  u64 min_idx;
+  u64 max_idx;
+  u64 min_addr;
+  u64 max_addr; // exclusive
+  u32 n_alloc;
+  u32 n_dealloc;
+  u32 n_lock; // lock and unlock
+  u32 n_skipped; // memory accesses not traced by UFO_SAMPLE
+
+  ALWAYS_INLINE
+  void reset() {
+    offset = 0;
+    length = 0;
+    min_idx = ~0ull;
+    max_idx = 0;
+    min_addr = ~0ull;
+    max_addr = 0;
+    n_alloc = 0;
+    n_dealloc = 0;
+    n_lock = 0;
+    n_skipped = 0;
+  }
+
+  // the block has events not summarized (inlined accesses), never skipped by the reader
+  ALWAYS_INLINE
+  void cover_all() {
+    min_idx = 0;
+    max_idx = ~0ull;
+    min_addr = 0;
+    max_addr = ~0ull;
+  }
+};
+static_assert(sizeof(BlockSummary) == 60, "compact struct (align 8) not supported, please use clang 3.8.1");
+
+// last bytes of an indexed trace file, summaries are at [footer_off, footer_off + count * sizeof(BlockSummary))
+PACKED_STRUCT(IndexTrailer) {
+  static const u32 MAGIC = 0x58444955; // "UIDX"
+  u64 footer_off;
+  u32 count;
+  u32 magic;
+
+  ALWAYS_INLINE
+  explicit IndexTrailer(u64 off, u32 n)
+      : footer_off(off),
+        count(n),
+        magic(MAGIC) {}
+};
+static_assert(sizeof(IndexTrailer) == 16, "compact struct (align 8) not supported, please use clang 3.8.1");
+
 
 #pragma pack(pop)
 
@@ -346,9 +510,21 @@ extern "C" {
 bool init_ufo();
 //rtl/tsan_rtl.cc:383:  bw::ufo_bench::finish_ufo();
 bool finish_ufo();
+// UFO_RING: __ufo_dump(), see flight_recorder.h
+bool dump_ufo();
+// region of interest: __ufo_enable(), __ufo_disable(), see UFOContext::set_enabled
+void enable_ufo(__tsan::ThreadState *thr, bool on);
+// __ufo_enable_thread(), __ufo_disable_thread()
+void enable_ufo_thread(__tsan::ThreadState *thr, bool on);
+// __ufo_flush()
+bool flush_ufo(__tsan::ThreadState *thr);
+// __ufo_rotate()
+bool rotate_ufo(__tsan::ThreadState *thr, const char *dir);
 
 void *on_alloc(__tsan::ThreadState *thr, uptr pc, void *addr, uptr size);
 void on_dealloc(__tsan::ThreadState *thr, uptr pc, void *addr);
+// user memory mapped by the tsan allocator, see heap_map.h
+void on_heap_map(uptr p, uptr size);
 
 // called by parent thread
 void on_thread_created(int tid_parent, int tid_kid, uptr pc);
@@ -368,13 +544,8 @@ void on_cond_wait(__tsan::ThreadState* thr, uptr pc, u64 addr_cond, u64 addr_mtx
 void on_cond_signal(__tsan::ThreadState* thr, uptr pc, u64 addr_cond);
 void on_cond_broadcast(__tsan::ThreadState* thr, uptr pc, u64 addr_cond);
 
-//void MemoryAccess(ThreadState *thr, uptr pc, uptr addr,
-//                  int kAccessSizeLog, bool kAccessIsWrite, bool kIsAtomic) {
-void on_mem_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write);
-void on_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write);
-
-void enter_func(__tsan::ThreadState *thr, uptr pc);
-void exit_func(__tsan::ThreadState *thr);
+// tsan_interface_atomic.cc, op: AtomicOp, mo: __tsan_memory_order
+void on_atomic(__tsan::ThreadState *thr, uptr pc, uptr addr, int size_log, u8 op, u8 mo);
 
 
 void on_ptr_deref(__tsan::ThreadState *thr, uptr pc, uptr addr_ptr);
@@ -386,6 +557,51 @@ void child_after_fork();
 
 } //extern "C"
 
+typedef void (*FPMemAcc)(__tsan::ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write);
+typedef void (*FPMemRangeAcc)(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write);
+typedef void (*FPFuncEnter)(__tsan::ThreadState *thr, uptr pc);
+typedef void (*FPFuncExit)(__tsan::ThreadState *thr);
+
+// hot path, inlined in tsan: one indirect call to the handler of the current configuration.
+// set by UFOContext::start_trace() stop_trace(), not part of the hook table (UFOContext::hooks()):
+// accesses are not paired, they are switched after the table on enable and before it on disable
+extern FPMemAcc fn_mem_acc;
+extern FPMemRangeAcc fn_mem_range_acc;
+extern FPFuncEnter fn_enter_func;
+extern FPFuncExit fn_exit_func;
+
+// UFO_LITE: tsan skips its own sync bookkeeping (sync vars, vector clocks, mutex sets,
+// meta map of heap blocks), the interceptors only call the UFO hooks.
+// set once by UFOContext::init_start()
+extern bool lite_mode;
+
+ALWAYS_INLINE
+bool is_lite() {
+  return lite_mode;
+}
+
+//void MemoryAccess(ThreadState *thr, uptr pc, uptr addr,
+//                  int kAccessSizeLog, bool kAccessIsWrite, bool kIsAtomic) {
+ALWAYS_INLINE
+void on_mem_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, int kAccessSizeLog, bool is_write) {
+  (*fn_mem_acc)(thr, pc, addr, kAccessSizeLog, is_write);
+}
+
+ALWAYS_INLINE
+void on_mem_range_acc(__tsan::ThreadState *thr, uptr pc, uptr addr, uptr size, bool is_write) {
+  (*fn_mem_range_acc)(thr, pc, addr, size, is_write);
+}
+
+ALWAYS_INLINE
+void enter_func(__tsan::ThreadState *thr, uptr pc) {
+  (*fn_enter_func)(thr, pc);
+}
+
+ALWAYS_INLINE
+void exit_func(__tsan::ThreadState *thr) {
+  (*fn_exit_func)(thr);
+}
+
 
 } // ns ufo_bench
 } // ns bw
@@ -28,6 +28,9 @@ struct TLStatistic {
   u64 c_cond_signal;
   u64 c_cond_bc;
 
+  u64 c_atomic;
+  u64 cs_relaxed; // UFO_ATOMIC_RELAXED=0
+
   u64 c_read[4];
   u64 c_write[4];
   u64 c_range_w;
@@ -35,6 +38,10 @@ struct TLStatistic {
   // stack acc
   u64 cs_acc;
   u64 cs_range_acc;
+  u64 cs_sampled; // UFO_SAMPLE
+  u64 cs_non_heap; // UFO_HEAP_ONLY
+  u64 c_dedup_hit; // UFO_DEDUP, dropped
+  u64 c_dedup_miss;
   u64 c_func_call;
 
   u64 c_ptr_prop;
@@ -53,6 +60,8 @@ struct TLStatistic {
     c_cond_wait = 0;
     c_cond_signal = 0;
     c_cond_bc = 0;
+    c_atomic = 0;
+    cs_relaxed = 0;
 
     c_read[0] = 0;
     c_read[1] = 0;
@@ -66,6 +75,10 @@ struct TLStatistic {
     c_range_w = 0;
     cs_acc = 0;
     cs_range_acc = 0;
+    cs_sampled = 0;
+    cs_non_heap = 0;
+    c_dedup_hit = 0;
+    c_dedup_miss = 0;
     c_func_call = 0;
 
     c_ptr_prop = 0;
@@ -86,6 +99,7 @@ struct TLStatistic {
     c += c_cond_wait;
     c += c_cond_signal;
     c += c_cond_bc;
+    c += c_atomic;
 
     c += c_range_w;
     c += c_range_r;
@@ -110,13 +124,14 @@ struct TLStatistic {
 
     c += c_lock * sizeof(LockEvent);
 
-//    c += c_rd_lock * sizeof(LockEvent);
+    c += c_rd_lock * sizeof(LockEvent);
     c += c_unlock * sizeof(UnlockEvent);
-//    u64 c_rd_unlock;
-//    u64 c_rw_unlock;
+    c += c_rd_unlock * sizeof(UnlockEvent);
+    c += c_rw_unlock * sizeof(UnlockEvent);
     c += c_cond_wait * sizeof(ThrCondWaitEvent);
     c += c_cond_signal * sizeof(ThrCondSignalEvent);
     c += c_cond_bc * sizeof(ThrCondBCEvent);
+    c += c_atomic * sizeof(AtomicEvent);
 
     c += c_range_w * sizeof(MemRangeWrite);
     c += c_range_r * sizeof(MemRangeRead);
@@ -140,9 +155,11 @@ struct TLStatistic {
 };
 
 
-void summary_stat(FILE* f, TLStatistic* arr_stat, int len, u32 this_pid, u32 p_pid);
+struct ThreadTable;
+
+void summary_stat(FILE* f, const ThreadTable& threads, u32 this_pid, u32 p_pid);
 
-void print_csv(FILE* f, TLStatistic* arr_stat, int len, u32 this_pid, u32 p_pid);
+void print_csv(FILE* f, const ThreadTable& threads, u32 this_pid, u32 p_pid);
 
 }
 }